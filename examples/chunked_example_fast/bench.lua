@@ -0,0 +1,258 @@
+#!/usr/bin/env tarantool
+
+-- A benchmark of merger.map_merge() on a local cluster: a router
+-- (this instance) and two storages started by `make bench`.
+--
+-- The dataset is loaded first, then each case runs concurrent
+-- clients for a while. A client reads pages of `limit` tuples
+-- starting from a random key of the first `range` part of the
+-- key space (1 is the whole space, 0.01 is a hot one percent).
+-- A case reports throughput, latency percentiles and CPU usage
+-- of the router and the storages.
+--
+-- Parameters are environment variables (lists are comma
+-- separated):
+--
+-- BENCH_TUPLES       a number of tuples to load (100000);
+-- BENCH_PAYLOAD      a size of a string field in bytes (100);
+-- BENCH_CLIENTS      numbers of concurrent clients (1,8,32);
+-- BENCH_LIMITS       page sizes (10,100,1000);
+-- BENCH_RANGES       parts of the key space to start from (0.01,1);
+-- BENCH_CHUNK_SIZES  first chunk sizes of storages (16,128,1024);
+-- BENCH_DURATION     seconds per case (5);
+-- BENCH_FUNC         a storage function
+--                    (tuple.merger.select_chunked);
+-- BENCH_FORMAT       a chunk format: msgpack, compact or keyed
+--                    (msgpack).
+
+local ffi = require('ffi')
+local fio = require('fio')
+local clock = require('clock')
+local fiber = require('fiber')
+local buffer = require('buffer')
+local msgpack = require('msgpack')
+local vshard = require('vshard')
+local merger = require('tuple.merger')
+local key_def_lib = require('tuple.keydef')
+local vshard_cfg = require('vshard_cfg')
+
+local function env_number(name, default)
+    local value = os.getenv(name)
+    return value ~= nil and tonumber(value) or default
+end
+
+local function env_list(name, default)
+    local value = os.getenv(name) or default
+    local res = {}
+    for item in value:gmatch('[^,%s]+') do
+        table.insert(res, tonumber(item))
+    end
+    return res
+end
+
+local cfg = {
+    tuples = env_number('BENCH_TUPLES', 100000),
+    payload = env_number('BENCH_PAYLOAD', 100),
+    clients = env_list('BENCH_CLIENTS', '1,8,32'),
+    limits = env_list('BENCH_LIMITS', '10,100,1000'),
+    ranges = env_list('BENCH_RANGES', '0.01,1'),
+    chunk_sizes = env_list('BENCH_CHUNK_SIZES', '16,128,1024'),
+    duration = env_number('BENCH_DURATION', 5),
+    func = os.getenv('BENCH_FUNC') or 'tuple.merger.select_chunked',
+    format = os.getenv('BENCH_FORMAT') or 'msgpack',
+}
+
+-- {{{ CPU usage
+
+ffi.cdef([[
+    long sysconf(int name);
+]])
+
+-- _SC_CLK_TCK on Linux.
+local CLK_TCK = tonumber(ffi.C.sysconf(2))
+
+-- CPU time (user + system) of a process in seconds or nil when
+-- it is not available (say, not on Linux).
+local function cpu_time(pid)
+    local fh = fio.open(('/proc/%s/stat'):format(pid), {'O_RDONLY'})
+    if fh == nil then
+        return nil
+    end
+    local stat = fh:read(4096)
+    fh:close()
+    -- Skip the pid and the command, which may contain spaces.
+    local fields = {}
+    for field in stat:match('%) (.*)'):gmatch('%S+') do
+        table.insert(fields, field)
+    end
+    -- utime and stime are 14th and 15th fields of the stat.
+    return (tonumber(fields[12]) + tonumber(fields[13])) / CLK_TCK
+end
+
+local function read_pid(filename)
+    local fh = fio.open(filename, {'O_RDONLY'})
+    if fh == nil then
+        return nil
+    end
+    local pid = fh:read(64)
+    fh:close()
+    return tonumber(pid)
+end
+
+local processes = {
+    {name = 'router', pid = 'self'},
+    {name = 'storage_1', pid = read_pid('storage_1.pid')},
+    {name = 'storage_2', pid = read_pid('storage_2.pid')},
+}
+
+local function cpu_snapshot()
+    local res = {}
+    for i, process in ipairs(processes) do
+        res[i] = process.pid ~= nil and cpu_time(process.pid) or nil
+    end
+    return res
+end
+
+-- CPU usage in percents of one core.
+local function cpu_usage(before, after, wall_time)
+    local res = {}
+    for i = 1, #processes do
+        if before[i] ~= nil and after[i] ~= nil then
+            res[i] = ('%.0f%%'):format(
+                (after[i] - before[i]) / wall_time * 100)
+        else
+            res[i] = 'n/a'
+        end
+    end
+    return res
+end
+
+-- }}} CPU usage
+
+-- {{{ Dataset
+
+local BATCH_SIZE = 1000
+
+local function load_dataset()
+    local payload = string.rep('x', cfg.payload)
+    local batches = {}
+    local function flush(replicaset)
+        local batch = batches[replicaset]
+        local res, err = replicaset:callrw('box_insert_batch', {'s', batch})
+        if res == nil then
+            error(err)
+        end
+        batches[replicaset] = {}
+    end
+    for id = 1, cfg.tuples do
+        local bucket_id = vshard.router.bucket_id_mpcrc32(id)
+        local replicaset = assert(vshard.router.route(bucket_id))
+        batches[replicaset] = batches[replicaset] or {}
+        table.insert(batches[replicaset], {id, payload})
+        if #batches[replicaset] == BATCH_SIZE then
+            flush(replicaset)
+        end
+    end
+    for replicaset, batch in pairs(batches) do
+        if #batch > 0 then
+            flush(replicaset)
+        end
+    end
+end
+
+-- }}} Dataset
+
+-- {{{ Cases
+
+local key_def = key_def_lib.new({{fieldno = 1, type = 'unsigned'}})
+
+-- Read a page of tuples into a buffer like a proxy does and
+-- return a number of the read tuples.
+local function read_page(buf, start, limit, chunk_size)
+    local m = merger.map_merge(vshard.router, cfg.func,
+        {'s', 'pk', {start}, {
+            iterator = 'GE',
+            limit = limit,
+            chunk_size = chunk_size,
+            format = cfg.format,
+        }}, key_def, {format = cfg.format})
+    buf:recycle()
+    m:select({buffer = buf, limit = limit})
+    -- The page is an array of tuples.
+    local count = msgpack.decode_array_header(buf.rpos, buf:size())
+    return count
+end
+
+local function percentile(latencies, q)
+    local idx = math.max(1, math.ceil(#latencies * q))
+    return latencies[idx] * 1000
+end
+
+local function run_case(clients, limit, range, chunk_size)
+    local latencies = {}
+    local tuple_count = 0
+    local max_start = math.max(1, math.floor(cfg.tuples * range))
+    local deadline
+
+    local function client()
+        local buf = buffer.ibuf()
+        while clock.monotonic() < deadline do
+            local start = math.random(max_start)
+            local started_at = clock.monotonic()
+            tuple_count = tuple_count + read_page(buf, start, limit,
+                chunk_size)
+            table.insert(latencies, clock.monotonic() - started_at)
+        end
+    end
+
+    local cpu_before = cpu_snapshot()
+    local started_at = clock.monotonic()
+    deadline = started_at + cfg.duration
+    local fibers = {}
+    for i = 1, clients do
+        fibers[i] = fiber.new(client)
+        fibers[i]:set_joinable(true)
+    end
+    for _, f in ipairs(fibers) do
+        local ok, err = f:join()
+        if not ok then
+            error(err)
+        end
+    end
+    local wall_time = clock.monotonic() - started_at
+    local cpu = cpu_usage(cpu_before, cpu_snapshot(), wall_time)
+
+    table.sort(latencies)
+    print(('%7d %6d %6s %6d %9.0f %10.0f %8.2f %8.2f %8.2f %7s %9s %9s')
+        :format(clients, limit, range, chunk_size,
+                #latencies / wall_time, tuple_count / wall_time,
+                percentile(latencies, 0.5), percentile(latencies, 0.99),
+                percentile(latencies, 0.999), cpu[1], cpu[2], cpu[3]))
+end
+
+-- }}} Cases
+
+vshard.router.cfg(vshard_cfg.wait_cfg())
+vshard.router.bootstrap()
+
+print(('Loading %d tuples with %d byte payloads...'):format(cfg.tuples,
+    cfg.payload))
+load_dataset()
+
+print(('func = %s, format = %s, %d s per case'):format(cfg.func,
+    cfg.format, cfg.duration))
+print(('%7s %6s %6s %6s %9s %10s %8s %8s %8s %7s %9s %9s'):format(
+    'clients', 'limit', 'range', 'chunk', 'pages/s', 'tuples/s',
+    'p50 ms', 'p99 ms', 'p999 ms', 'router', 'storage_1', 'storage_2'))
+math.randomseed(0)
+for _, chunk_size in ipairs(cfg.chunk_sizes) do
+    for _, range in ipairs(cfg.ranges) do
+        for _, limit in ipairs(cfg.limits) do
+            for _, clients in ipairs(cfg.clients) do
+                run_case(clients, limit, range, chunk_size)
+            end
+        end
+    end
+end
+
+os.exit()
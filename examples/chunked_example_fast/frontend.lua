@@ -1,7 +1,5 @@
 #!/usr/bin/env tarantool
 
-local buffer = require('buffer')
-local msgpack = require('msgpack')
 local vshard = require('vshard')
 local merger = require('tuple.merger')
 local key_def_lib = require('tuple.keydef')
@@ -44,86 +42,46 @@ local function get_key_def(space_name, index_name)
     return key_def
 end
 
-local function decode_metainfo(buf)
-    -- Skip an array around a call return values.
-    local len
-    len, buf.rpos = msgpack.decode_array_header(buf.rpos, buf:size())
-    assert(len == 2)
-
-    -- Decode a first return value (metainfo).
-    local res
-    res, buf.rpos = msgpack.decode(buf.rpos, buf:size())
-    return res
-end
-
---- Wait for a data chunk and request for the next data chunk.
-local function fetch_chunk(context, state)
-    local net_box_opts = context.net_box_opts
-    local buf = context.buffer
-    local call_args = context.call_args
-    local replicaset = context.replicaset
-    local future = state.future
-
-    -- The source was entirely drained.
-    if future == nil then
-        return nil
-    end
-
-    -- Wait for requested data.
-    local res, err = future:wait_result()
-    if res == nil then
-        error(err)
+-- Create a key_def to compare keys extracted by a key_def (see
+-- {format = 'keyed'} in box_select_chunked()).
+local function get_keys_key_def(key_def)
+    local parts = key_def:totable()
+    for i, part in ipairs(parts) do
+        part.fieldno = i
+        part.path = nil
     end
-
-    -- Decode metainfo, leave data to be processed by the merger.
-    local cursor = decode_metainfo(buf)
-
-    -- Check whether we need the next call.
-    if cursor.is_end then
-        local next_state = {}
-        return next_state, buf
-    end
-
-    -- Request the next data while we processing the current ones.
-    -- Note: We reuse the same buffer for all request to a replicaset.
-    local next_call_args = call_args
-    next_call_args[4].cursor = cursor -- change context.call_args too,
-                                      -- but it does not matter
-    local next_future = replicaset:callro('box_select_chunked', next_call_args,
-        net_box_opts)
-
-    local next_state = {future = next_future}
-    return next_state, buf
+    return key_def_lib.new(parts)
 end
 
-local function mr_call(space_name, index_name, key, opts)
-    local opts = opts or {}
+-- func is a storage function: box_select_chunked() written in
+-- Lua or tuple.merger.select_chunked() written in C.
+--
+-- opts.page_size and opts.page_cursor read one page: the results
+-- and a cursor of a next page (nil after the last one) are
+-- returned.
+local function mr_call(space_name, index_name, key, opts, func)
+    local opts = table.copy(opts or {})
+    local page_size = opts.page_size
+    local page_cursor = opts.page_cursor
+    opts.page_size = nil
+    opts.page_cursor = nil
+    local func = func or 'box_select_chunked'
     local key_def = get_key_def(space_name, index_name)
-    local call_args = {space_name, index_name, key, opts}
-
-    -- Request a first data chunk and create merger sources.
-    local merger_sources = {}
-    for _, replicaset in pairs(vshard.router.routeall()) do
-        -- Perform a request.
-        local buf = buffer.ibuf()
-        local net_box_opts = {is_async = true, buffer = buf, skip_header = true}
-        local future = replicaset:callro('box_select_chunked', call_args,
-            net_box_opts)
-
-        -- Create a source.
-        local context = {
-            net_box_opts = net_box_opts,
-            buffer = buf,
-            call_args = call_args,
-            replicaset = replicaset,
-        }
-        local state = {future = future}
-        local source = merger.new_buffer_source(fetch_chunk,
-            context, state)
-        table.insert(merger_sources, source)
+    if opts.format == 'keyed' then
+        key_def = get_keys_key_def(key_def)
     end
 
-    local merger_inst = merger.new(key_def, merger_sources)
+    -- Request chunks from all replicasets and merge them. Each
+    -- replicaset has up to pipeline_depth chunks fetched ahead.
+    local merger_inst = merger.map_merge(vshard.router, func,
+        {space_name, index_name, key, opts}, key_def, {
+            pipeline_depth = 2,
+            format = opts.format,
+            cursor = page_cursor,
+        })
+    if page_size ~= nil then
+        return merger_inst:select({limit = page_size, cursor = true})
+    end
     return merger_inst:select()
 end
 
@@ -182,4 +140,34 @@ print('mr_call')
 print('=======')
 local res = mr_call('s', 'pk', {})
 print(yaml.encode(res))
+
+-- The same using compact chunks.
+local res_compact = mr_call('s', 'pk', {}, {format = 'compact'})
+assert(yaml.encode(res_compact) == yaml.encode(res))
+
+-- The same using [key, tuple] entries.
+local res_keyed = mr_call('s', 'pk', {}, {format = 'keyed'})
+assert(yaml.encode(res_keyed) == yaml.encode(res))
+
+-- The same using the storage function written in C.
+for _, format in ipairs({'msgpack', 'compact', 'keyed'}) do
+    local res_c = mr_call('s', 'pk', {}, {format = format},
+        'tuple.merger.select_chunked')
+    assert(yaml.encode(res_c) == yaml.encode(res))
+end
+
+-- The same by pages. A router does not keep anything between
+-- pages, but a cursor.
+for _, func in ipairs({'box_select_chunked', 'tuple.merger.select_chunked'}) do
+    local res_pages = {}
+    local page, cursor
+    repeat
+        page, cursor = mr_call('s', 'pk', {}, {page_size = 3,
+            page_cursor = cursor}, func)
+        for _, tuple in ipairs(page) do
+            table.insert(res_pages, tuple)
+        end
+    until cursor == nil
+    assert(yaml.encode(res_pages) == yaml.encode(res))
+end
 os.exit()
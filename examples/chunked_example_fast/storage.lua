@@ -1,7 +1,9 @@
 #!/usr/bin/env tarantool
 
 local fio = require('fio')
+local fiber = require('fiber')
 local key_def = require('tuple.keydef')
+local merger = require('tuple.merger')
 local vshard = require('vshard')
 local vshard_cfg = require('vshard_cfg')
 
@@ -42,11 +44,16 @@ box.once('init_storage', function()
 
     box.schema.func.create('box_select')
     box.schema.func.create('box_insert')
+    box.schema.func.create('box_insert_batch')
     box.schema.func.create('box_select_chunked')
+    box.schema.func.create('tuple.merger.select_chunked', {language = 'C'})
 
     box.schema.user.grant('guest', 'execute', 'function', 'box_select')
     box.schema.user.grant('guest', 'execute', 'function', 'box_insert')
+    box.schema.user.grant('guest', 'execute', 'function', 'box_insert_batch')
     box.schema.user.grant('guest', 'execute', 'function', 'box_select_chunked')
+    box.schema.user.grant('guest', 'execute', 'function',
+        'tuple.merger.select_chunked')
 end)
 
 fio_write(instance_name .. '.instance.uuid', box.info.uuid)
@@ -61,9 +68,26 @@ _G.vshard = vshard
 local vshard_cfg_inst = merge_tables(vshard_cfg.wait_cfg(), box_cfg)
 vshard.storage.cfg(vshard_cfg_inst, box.info.uuid)
 
--- Set to small value just to show everything work. Real block
--- size should be bigger.
-local BLOCK_SIZE = 2
+-- Chunk size is adaptive and is passed within a cursor. The
+-- first chunk is small to give a fast response for limited
+-- queries. The size is doubled for each next chunk while a router
+-- asks for it quickly, but a chunk never exceeds the remaining
+-- limit and the byte budget.
+--
+-- Set to small values just to show everything work. Real sizes
+-- should be bigger: the tuple.merger.select_chunked C function
+-- follows the same rules, but starts from 64 tuples and grows up
+-- to 4096.
+local MIN_CHUNK_SIZE = 2
+local MAX_CHUNK_SIZE = 16
+local CHUNK_BYTE_BUDGET = 1024 * 1024
+
+-- A router, which asks for a next chunk later than this delay (in
+-- seconds) after a previous one was sent, consumes slowly. Keep
+-- the chunk size for it. A next chunk may be asked from another
+-- replica, so a delay is measured only when the cursor was sent
+-- by this instance: clocks of replicas are not the same.
+local SLOW_CONSUMER_DELAY = 0.1
 
 local iterator_types = {
     [box.index.EQ] = true,
@@ -92,9 +116,27 @@ local function check_iterator_type(opts, key)
     return iterator_type
 end
 
+-- Choose a size of a next chunk.
+--
+-- Grow geometrically while a chunk is full and a router is fast.
+-- When the byte budget is exceeded, use the count of tuples that
+-- fit into it.
+local function next_chunk_size(cursor, chunk_size, count, is_budget_hit)
+    if is_budget_hit then
+        return math.max(count, MIN_CHUNK_SIZE)
+    end
+    local is_fast = cursor == nil or cursor.sent_at == nil or
+        cursor.sent_by ~= box.info.uuid or
+        fiber.time() - cursor.sent_at < SLOW_CONSUMER_DELAY
+    if count == chunk_size and is_fast then
+        return math.min(chunk_size * 2, MAX_CHUNK_SIZE)
+    end
+    return chunk_size
+end
+
 -- Example for unique indexes. Non-unique now requires much
 -- more code. See also #3898.
-local function make_cursor(index, opts, data)
+local function make_cursor(index, opts, data, chunk_size)
     assert(index.unique)
 
     local last_tuple = data[#data]
@@ -109,7 +151,7 @@ local function make_cursor(index, opts, data)
 
     local next_limit
     if opts.limit ~= nil then
-        next_limit = opts.limit - BLOCK_SIZE
+        next_limit = opts.limit - #data
     end
 
     return {
@@ -117,35 +159,94 @@ local function make_cursor(index, opts, data)
         key = next_key,
         iterator = next_iterator,
         limit = next_limit,
+        chunk_size = chunk_size,
+        sent_at = fiber.time(),
+        sent_by = box.info.uuid,
     }
 end
 
 -- Helper to use box's :select() via call in vshard.
 local function box_select_chunked(space_name, index_name, key, opts)
     local opts = opts or {}
-    if opts.cursor ~= nil then
-        assert(not opts.cursor.is_end)
-        key = opts.cursor.key
-        opts.iterator = opts.cursor.iterator
-        opts.limit = opts.cursor.limit
+    local cursor = opts.cursor
+    local chunk_size = opts.chunk_size or MIN_CHUNK_SIZE
+    if cursor ~= nil then
+        assert(not cursor.is_end)
+        key = cursor.key
+        opts.iterator = cursor.iterator
+        opts.limit = cursor.limit
         opts.offset = 0
+        chunk_size = cursor.chunk_size or chunk_size
     end
 
     local index = box.space[space_name].index[index_name]
     opts.iterator = check_iterator_type(opts, key)
-    local real_limit = math.min(opts.limit or BLOCK_SIZE + 1, BLOCK_SIZE + 1)
-    local data = index:select(key, {
-        iterator = opts.iterator,
-        limit = real_limit,
-        offset = opts.offset,
-    })
+
+    -- Resume a merge from a key given by merger.map_merge(). The
+    -- key itself is included: the router skips tuples up to it.
+    -- EQ and REQ with a key are not ranges, so keep the key.
+    local is_range = (key == nil or (type(key) == 'table' and #key == 0) or
+        (opts.iterator ~= box.index.EQ and opts.iterator ~= box.index.REQ))
+    if cursor == nil and opts.after ~= nil and #opts.after > 0 and
+            is_range then
+        key = opts.after
+        if asc_iterator_types[opts.iterator] then
+            opts.iterator = box.index.GE
+        else
+            opts.iterator = box.index.LE
+        end
+        opts.offset = 0
+    end
+
+    -- Don't read more than the query needs.
+    local real_chunk_size = chunk_size
+    if opts.limit ~= nil then
+        real_chunk_size = math.min(real_chunk_size, opts.limit)
+    end
+
+    local data = {}
+    local bsize = 0
+    local skip = opts.offset or 0
+    local is_end = true
+    local is_budget_hit = false
+    for _, tuple in index:pairs(key, {iterator = opts.iterator}) do
+        if skip > 0 then
+            skip = skip - 1
+        elseif #data >= real_chunk_size then
+            is_end = opts.limit ~= nil and #data >= opts.limit
+            break
+        elseif #data > 0 and bsize + tuple:bsize() > CHUNK_BYTE_BUDGET then
+            is_end = false
+            is_budget_hit = true
+            break
+        else
+            table.insert(data, tuple)
+            bsize = bsize + tuple:bsize()
+        end
+    end
 
     local cursor
-    if #data < real_limit then
+    if is_end then
         cursor = {is_end = true}
     else
-        data[BLOCK_SIZE + 1] = nil
-        cursor = make_cursor(index, opts, data)
+        chunk_size = next_chunk_size(opts.cursor, chunk_size, #data,
+            is_budget_hit)
+        cursor = make_cursor(index, opts, data, chunk_size)
+    end
+
+    -- Send tuples as one compact block (see
+    -- merger.encode_compact()) when requested.
+    if opts.format == 'compact' then
+        return cursor, merger.encode_compact(data, {compress = true})
+    end
+
+    -- Send [key, tuple] entries, so a router compares keys and
+    -- does not parse tuples.
+    if opts.format == 'keyed' then
+        local index_key_def = key_def.new(index.parts)
+        for i, tuple in ipairs(data) do
+            data[i] = {index_key_def:extract_key(tuple), tuple}
+        end
     end
 
     return cursor, data
@@ -159,7 +260,19 @@ local function box_insert(space_name, tuple)
     return box.space[space_name]:insert(tuple)
 end
 
+-- Load many tuples at once (see bench.lua).
+local function box_insert_batch(space_name, tuples)
+    local space = box.space[space_name]
+    box.begin()
+    for _, tuple in ipairs(tuples) do
+        space:replace(tuple)
+    end
+    box.commit()
+    return #tuples
+end
+
 -- Expose functions to call it using net.box / vshard.
 _G.box_select_chunked = box_select_chunked
 _G.box_select = box_select
 _G.box_insert = box_insert
+_G.box_insert_batch = box_insert_batch
@@ -55,6 +55,9 @@ extern "C" {
 	box_error_raise(ER_MEMORY_ISSUE, "Failed to allocate %u bytes in %s for %s", \
 			amount, allocator, object)
 
+#define diag_set_system(...) \
+	box_error_raise(ER_SYSTEM, ##__VA_ARGS__)
+
 #if defined(__cplusplus)
 } /* extern "C" */
 #endif /* defined(__cplusplus) */
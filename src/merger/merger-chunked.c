@@ -0,0 +1,785 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A storage side of the chunked select protocol (see
+ * examples/chunked_example_fast and merger.map_merge()) as a C
+ * stored function.
+ *
+ * box.schema.func.create('tuple.merger.select_chunked',
+ *                        {language = 'C'})
+ *
+ * select_chunked(space_name, index_name, key, opts) -> {cursor, tuples}
+ *
+ * The function walks an index iterator and encodes tuples right
+ * into a reply, so a storage does not create a Lua table per
+ * chunk and does not create a key_def to extract a cursor key:
+ * the key is extracted using the index's own key_def.
+ *
+ * The function returns one tuple: [cursor, tuples], because a C
+ * function is only able to return tuples in 1.10.
+ * merger.map_merge() accepts both this and the two values form.
+ *
+ * Options and a cursor are the same as ones of
+ * box_select_chunked() from the example: iterator, limit, offset,
+ * chunk_size, format ('compact', 'keyed' or nil), cursor and
+ * after. Only unique indexes are supported.
+ *
+ * A chunk size is chosen by the same rules as in the example,
+ * but the first and the maximal sizes are bigger: the example
+ * keeps them small to show chunking on a few tuples.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <module.h>
+#include <msgpuck/msgpuck.h> /* mp_*() */
+
+#include "compat/diag.h"
+
+#include "merger-compact.h"
+
+/* A size of a first chunk, when it is not set in options. */
+#define CHUNK_SIZE_DEFAULT 64
+/* A chunk size does not go below this value. */
+#define CHUNK_SIZE_MIN 2
+/* A chunk size is doubled up to this value. */
+#define CHUNK_SIZE_MAX 4096
+/* Stop a chunk, when tuples occupy more bytes. */
+#define CHUNK_BYTE_BUDGET (1024 * 1024)
+/*
+ * A router, which asks for a next chunk later than this delay (in
+ * seconds) after a previous one was sent, consumes slowly and
+ * the chunk size is not increased for it.
+ */
+#define CHUNK_SLOW_CONSUMER_DELAY 0.1
+
+enum chunk_format {
+	CHUNK_FORMAT_MSGPACK,
+	CHUNK_FORMAT_COMPACT,
+	CHUNK_FORMAT_KEYED,
+};
+
+/* Indexed by enum iterator_type. */
+static const char *iterator_names[] = {
+	"EQ", "REQ", "ALL", "LT", "LE", "GE", "GT",
+};
+
+struct select_chunked_args {
+	uint32_t space_id;
+	uint32_t index_id;
+	int iterator;
+	/* A key as a MsgPack array. */
+	const char *key;
+	const char *key_end;
+	/* A buffer for a scalar key wrapped into an array. */
+	char *key_buf;
+	bool has_limit;
+	uint64_t limit;
+	uint64_t offset;
+	uint64_t chunk_size;
+	enum chunk_format format;
+	/* When a previous chunk was sent, zero if it was not. */
+	double sent_at;
+	/* An instance, which sent a previous chunk (see sent_by()). */
+	uint64_t sent_by;
+};
+
+/**
+ * A token of this instance to mark cursors it sends. A next
+ * chunk may be asked from another replica, whose clock is not
+ * the same, so only a cursor sent by this instance is timed.
+ */
+static uint64_t
+sent_by(void)
+{
+	static uint64_t token = 0;
+	if (token == 0) {
+		uint64_t usec = clock_realtime() * 1e6;
+		/* Exact as a Lua number. */
+		token = ((usec ^ ((uint64_t)getpid() << 32)) &
+			 ((1ULL << 53) - 1)) | 1;
+	}
+	return token;
+}
+
+/* {{{ Arguments */
+
+static bool
+mp_str_eq(const char *str, uint32_t len, const char *expected)
+{
+	return strlen(expected) == len && memcmp(str, expected, len) == 0;
+}
+
+/**
+ * Decode a non-negative integer option.
+ */
+static int
+decode_uint_opt(const char **data, const char *name, uint64_t *value)
+{
+	if (mp_typeof(**data) != MP_UINT) {
+		diag_set_illegal("select_chunked: %s should be a non-negative "
+				 "integer", name);
+		return -1;
+	}
+	*value = mp_decode_uint(data);
+	return 0;
+}
+
+/**
+ * Decode an iterator type given as a number or a name.
+ */
+static int
+decode_iterator(const char **data, int *iterator)
+{
+	int count = (int) (sizeof(iterator_names) / sizeof(iterator_names[0]));
+	if (mp_typeof(**data) == MP_UINT) {
+		uint64_t value = mp_decode_uint(data);
+		if (value < (uint64_t) count) {
+			*iterator = (int) value;
+			return 0;
+		}
+	} else if (mp_typeof(**data) == MP_STR) {
+		uint32_t len;
+		const char *str = mp_decode_str(data, &len);
+		for (int i = 0; i < count; ++i) {
+			if (mp_str_eq(str, len, iterator_names[i])) {
+				*iterator = i;
+				return 0;
+			}
+		}
+	} else {
+		mp_next(data);
+	}
+	diag_set_illegal("select_chunked: wrong iterator type");
+	return -1;
+}
+
+/**
+ * Decode a space or an index name (or a numeric id).
+ */
+static int
+decode_name(const char **data, uint32_t space_id, uint32_t *id)
+{
+	const char *what = space_id == BOX_ID_NIL ? "space" : "index";
+	if (mp_typeof(**data) == MP_UINT) {
+		*id = (uint32_t) mp_decode_uint(data);
+		return 0;
+	}
+	if (mp_typeof(**data) != MP_STR) {
+		diag_set_illegal("select_chunked: %s name should be a string",
+				 what);
+		return -1;
+	}
+	uint32_t len;
+	const char *name = mp_decode_str(data, &len);
+	*id = space_id == BOX_ID_NIL ? box_space_id_by_name(name, len) :
+		box_index_id_by_name(space_id, name, len);
+	if (*id == BOX_ID_NIL) {
+		diag_set_illegal("select_chunked: no such %s '%.*s'", what,
+				 (int) len, name);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Decode a key: an array, a scalar or nil.
+ */
+static int
+decode_key(const char **data, struct select_chunked_args *args)
+{
+	const char *key = *data;
+	mp_next(data);
+	if (mp_typeof(*key) == MP_ARRAY) {
+		args->key = key;
+		args->key_end = *data;
+		return 0;
+	}
+	if (mp_typeof(*key) == MP_NIL) {
+		key = *data;
+	}
+	size_t size = mp_sizeof_array(1) + (*data - key);
+	args->key_buf = malloc(size);
+	if (args->key_buf == NULL) {
+		diag_set_oom(size, "malloc", "key");
+		return -1;
+	}
+	char *pos = mp_encode_array(args->key_buf, key == *data ? 0 : 1);
+	memcpy(pos, key, *data - key);
+	args->key = args->key_buf;
+	args->key_end = pos + (*data - key);
+	return 0;
+}
+
+static int
+decode_cursor(const char **data, struct select_chunked_args *args)
+{
+	if (mp_typeof(**data) == MP_NIL) {
+		mp_next(data);
+		return 0;
+	}
+	if (mp_typeof(**data) != MP_MAP) {
+		diag_set_illegal("select_chunked: cursor should be a table");
+		return -1;
+	}
+	/* A cursor overrides a key and options. */
+	args->has_limit = false;
+	args->offset = 0;
+	uint32_t size = mp_decode_map(data);
+	for (uint32_t i = 0; i < size; ++i) {
+		if (mp_typeof(**data) != MP_STR) {
+			mp_next(data);
+			mp_next(data);
+			continue;
+		}
+		uint32_t len;
+		const char *name = mp_decode_str(data, &len);
+		int rc = 0;
+		if (mp_str_eq(name, len, "is_end")) {
+			if (mp_typeof(**data) == MP_BOOL &&
+			    mp_decode_bool(data)) {
+				diag_set_illegal("select_chunked: the cursor "
+						 "is at the end");
+				return -1;
+			}
+			mp_next(data);
+		} else if (mp_str_eq(name, len, "key")) {
+			free(args->key_buf);
+			args->key_buf = NULL;
+			rc = decode_key(data, args);
+		} else if (mp_str_eq(name, len, "iterator")) {
+			rc = decode_iterator(data, &args->iterator);
+		} else if (mp_str_eq(name, len, "limit") &&
+			   mp_typeof(**data) != MP_NIL) {
+			rc = decode_uint_opt(data, "cursor.limit",
+					     &args->limit);
+			args->has_limit = true;
+		} else if (mp_str_eq(name, len, "chunk_size") &&
+			   mp_typeof(**data) != MP_NIL) {
+			rc = decode_uint_opt(data, "cursor.chunk_size",
+					     &args->chunk_size);
+		} else if (mp_str_eq(name, len, "sent_at") &&
+			   mp_typeof(**data) == MP_DOUBLE) {
+			args->sent_at = mp_decode_double(data);
+		} else if (mp_str_eq(name, len, "sent_by") &&
+			   mp_typeof(**data) == MP_UINT) {
+			args->sent_by = mp_decode_uint(data);
+		} else {
+			mp_next(data);
+		}
+		if (rc != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Start from a key given by merger.map_merge() to resume a merge
+ * instead of the requested key. The key itself is included: the
+ * router skips tuples up to it.
+ *
+ * EQ and REQ with a non-empty key are not ranges, so they keep
+ * the requested key.
+ */
+static int
+decode_after(const char **data, struct select_chunked_args *args)
+{
+	if (mp_typeof(**data) != MP_ARRAY) {
+		diag_set_illegal("select_chunked: after should be a key");
+		return -1;
+	}
+	const char *key = args->key;
+	bool is_range = mp_decode_array(&key) == 0 ||
+		(args->iterator != ITER_EQ && args->iterator != ITER_REQ);
+	const char *after = *data;
+	if (!is_range || mp_decode_array(&after) == 0) {
+		mp_next(data);
+		return 0;
+	}
+	bool is_asc = args->iterator == ITER_EQ ||
+		args->iterator == ITER_ALL || args->iterator == ITER_GE ||
+		args->iterator == ITER_GT;
+	free(args->key_buf);
+	args->key_buf = NULL;
+	args->iterator = is_asc ? ITER_GE : ITER_LE;
+	args->offset = 0;
+	return decode_key(data, args);
+}
+
+static int
+decode_opts(const char **data, struct select_chunked_args *args)
+{
+	if (mp_typeof(**data) == MP_NIL) {
+		mp_next(data);
+		return 0;
+	}
+	if (mp_typeof(**data) != MP_MAP) {
+		diag_set_illegal("select_chunked: opts should be a table");
+		return -1;
+	}
+	/* A cursor and a resume key are applied after other options. */
+	const char *cursor = NULL;
+	const char *after = NULL;
+	uint32_t size = mp_decode_map(data);
+	for (uint32_t i = 0; i < size; ++i) {
+		if (mp_typeof(**data) != MP_STR) {
+			mp_next(data);
+			mp_next(data);
+			continue;
+		}
+		uint32_t len;
+		const char *name = mp_decode_str(data, &len);
+		int rc = 0;
+		if (mp_typeof(**data) == MP_NIL) {
+			mp_next(data);
+		} else if (mp_str_eq(name, len, "iterator")) {
+			rc = decode_iterator(data, &args->iterator);
+		} else if (mp_str_eq(name, len, "limit")) {
+			rc = decode_uint_opt(data, "limit", &args->limit);
+			args->has_limit = true;
+		} else if (mp_str_eq(name, len, "offset")) {
+			rc = decode_uint_opt(data, "offset", &args->offset);
+		} else if (mp_str_eq(name, len, "chunk_size")) {
+			rc = decode_uint_opt(data, "chunk_size",
+					     &args->chunk_size);
+		} else if (mp_str_eq(name, len, "format")) {
+			const char *format = NULL;
+			if (mp_typeof(**data) == MP_STR)
+				format = mp_decode_str(data, &len);
+			else
+				mp_next(data);
+			if (format != NULL &&
+			    mp_str_eq(format, len, "compact")) {
+				args->format = CHUNK_FORMAT_COMPACT;
+			} else if (format != NULL &&
+				   mp_str_eq(format, len, "keyed")) {
+				args->format = CHUNK_FORMAT_KEYED;
+			} else if (format == NULL ||
+				   !mp_str_eq(format, len, "msgpack")) {
+				diag_set_illegal("select_chunked: unknown "
+						 "format");
+				return -1;
+			}
+		} else if (mp_str_eq(name, len, "cursor")) {
+			cursor = *data;
+			mp_next(data);
+		} else if (mp_str_eq(name, len, "after")) {
+			after = *data;
+			mp_next(data);
+		} else {
+			mp_next(data);
+		}
+		if (rc != 0)
+			return -1;
+	}
+	if (cursor != NULL && decode_cursor(&cursor, args) != 0)
+		return -1;
+	if (cursor == NULL && after != NULL && decode_after(&after, args) != 0)
+		return -1;
+	if (args->chunk_size == 0)
+		args->chunk_size = 1;
+	return 0;
+}
+
+static int
+decode_args(const char *data, const char *data_end,
+	    struct select_chunked_args *args)
+{
+	(void) data_end;
+	memset(args, 0, sizeof(*args));
+	args->iterator = ITER_EQ;
+	args->chunk_size = CHUNK_SIZE_DEFAULT;
+	args->format = CHUNK_FORMAT_MSGPACK;
+
+	uint32_t count = mp_decode_array(&data);
+	if (count < 2 || count > 4) {
+		diag_set_illegal("Usage: select_chunked(space_name, "
+				 "index_name[, key[, opts]])");
+		return -1;
+	}
+	if (decode_name(&data, BOX_ID_NIL, &args->space_id) != 0 ||
+	    decode_name(&data, args->space_id, &args->index_id) != 0)
+		return -1;
+	if (count > 2 && decode_key(&data, args) != 0)
+		return -1;
+	if (count == 2) {
+		static const char empty_key[] = {'\x90'};
+		args->key = empty_key;
+		args->key_end = empty_key + sizeof(empty_key);
+	}
+	if (count > 3 && decode_opts(&data, args) != 0)
+		return -1;
+	return 0;
+}
+
+/* }}} */
+
+/* {{{ Reply */
+
+/**
+ * Tuples of a chunk and a next cursor.
+ */
+struct select_chunked_reply {
+	/* Referenced tuples. */
+	box_tuple_t **tuples;
+	uint32_t count;
+	uint32_t capacity;
+	/* MsgPack size of tuples. */
+	size_t bsize;
+	/* Whether there are more tuples after the chunk. */
+	bool is_end;
+	/* A size of a next chunk. */
+	uint64_t next_chunk_size;
+};
+
+static int
+reply_add(struct select_chunked_reply *reply, box_tuple_t *tuple)
+{
+	if (reply->count == reply->capacity) {
+		uint32_t capacity = reply->capacity == 0 ? 16 :
+			reply->capacity * 2;
+		size_t size = capacity * sizeof(box_tuple_t *);
+		box_tuple_t **tuples = realloc(reply->tuples, size);
+		if (tuples == NULL) {
+			diag_set_oom(size, "realloc", "tuples");
+			return -1;
+		}
+		reply->tuples = tuples;
+		reply->capacity = capacity;
+	}
+	box_tuple_ref(tuple);
+	reply->tuples[reply->count++] = tuple;
+	reply->bsize += box_tuple_bsize(tuple);
+	return 0;
+}
+
+static void
+reply_destroy(struct select_chunked_reply *reply)
+{
+	for (uint32_t i = 0; i < reply->count; ++i)
+		box_tuple_unref(reply->tuples[i]);
+	free(reply->tuples);
+}
+
+/**
+ * Read tuples of a chunk.
+ *
+ * The chunk is stopped by the chunk size, the remaining limit or
+ * the byte budget. The size of a next chunk grows geometrically
+ * while the chunk is full and a router asks for it quickly. When
+ * the byte budget is exceeded, the next chunk has the count of
+ * tuples that fit into it, but not less than CHUNK_SIZE_MIN.
+ */
+static int
+read_chunk(const struct select_chunked_args *args,
+	   struct select_chunked_reply *reply)
+{
+	uint64_t chunk_size = args->chunk_size;
+	if (args->has_limit && args->limit < chunk_size)
+		chunk_size = args->limit;
+
+	box_iterator_t *it = box_index_iterator(args->space_id,
+		args->index_id, args->iterator, args->key, args->key_end);
+	if (it == NULL)
+		return -1;
+
+	int rc = -1;
+	bool is_budget_hit = false;
+	uint64_t skip = args->offset;
+	reply->is_end = true;
+	box_tuple_t *tuple;
+	while (true) {
+		if (box_iterator_next(it, &tuple) != 0)
+			goto out;
+		if (tuple == NULL)
+			break;
+		if (skip > 0) {
+			--skip;
+			continue;
+		}
+		if (reply->count >= chunk_size) {
+			reply->is_end = args->has_limit &&
+				reply->count >= args->limit;
+			break;
+		}
+		if (reply->count > 0 &&
+		    reply->bsize + box_tuple_bsize(tuple) > CHUNK_BYTE_BUDGET) {
+			reply->is_end = false;
+			is_budget_hit = true;
+			break;
+		}
+		if (reply_add(reply, tuple) != 0)
+			goto out;
+	}
+
+	reply->next_chunk_size = args->chunk_size;
+	/* A delay is measured by this instance's clock only. */
+	bool is_fast = args->sent_at == 0 || args->sent_by != sent_by() ||
+		fiber_time() - args->sent_at < CHUNK_SLOW_CONSUMER_DELAY;
+	if (is_budget_hit) {
+		reply->next_chunk_size = reply->count > CHUNK_SIZE_MIN ?
+			reply->count : CHUNK_SIZE_MIN;
+	} else if (reply->count == args->chunk_size && is_fast) {
+		reply->next_chunk_size = args->chunk_size * 2;
+		if (reply->next_chunk_size > CHUNK_SIZE_MAX)
+			reply->next_chunk_size = CHUNK_SIZE_MAX;
+		if (reply->next_chunk_size < args->chunk_size)
+			reply->next_chunk_size = args->chunk_size;
+	}
+	rc = 0;
+out:
+	box_iterator_free(it);
+	return rc;
+}
+
+/**
+ * Encode a cursor into @a buf or return its size if @a buf is
+ * NULL.
+ */
+static size_t
+encode_cursor(char *buf, const struct select_chunked_args *args,
+	      const struct select_chunked_reply *reply,
+	      const char *key, uint32_t key_size)
+{
+	size_t size;
+	if (reply->is_end) {
+		size = mp_sizeof_map(1) + mp_sizeof_str(strlen("is_end")) +
+			mp_sizeof_bool(true);
+		if (buf != NULL) {
+			buf = mp_encode_map(buf, 1);
+			buf = mp_encode_str(buf, "is_end", strlen("is_end"));
+			buf = mp_encode_bool(buf, true);
+		}
+		return size;
+	}
+
+	bool is_asc = args->iterator == ITER_EQ ||
+		args->iterator == ITER_ALL || args->iterator == ITER_GE ||
+		args->iterator == ITER_GT;
+	int next_iterator = is_asc ? ITER_GT : ITER_LT;
+	uint64_t next_limit = args->has_limit ?
+		args->limit - reply->count : 0;
+	double sent_at = fiber_time();
+	uint32_t field_count = args->has_limit ? 7 : 6;
+
+	size = mp_sizeof_map(field_count) +
+		mp_sizeof_str(strlen("is_end")) + mp_sizeof_bool(false) +
+		mp_sizeof_str(strlen("key")) + key_size +
+		mp_sizeof_str(strlen("iterator")) +
+		mp_sizeof_uint(next_iterator) +
+		mp_sizeof_str(strlen("chunk_size")) +
+		mp_sizeof_uint(reply->next_chunk_size) +
+		mp_sizeof_str(strlen("sent_at")) + mp_sizeof_double(sent_at) +
+		mp_sizeof_str(strlen("sent_by")) + mp_sizeof_uint(sent_by());
+	if (args->has_limit)
+		size += mp_sizeof_str(strlen("limit")) +
+			mp_sizeof_uint(next_limit);
+	if (buf == NULL)
+		return size;
+
+	buf = mp_encode_map(buf, field_count);
+	buf = mp_encode_str(buf, "is_end", strlen("is_end"));
+	buf = mp_encode_bool(buf, false);
+	buf = mp_encode_str(buf, "key", strlen("key"));
+	memcpy(buf, key, key_size);
+	buf += key_size;
+	buf = mp_encode_str(buf, "iterator", strlen("iterator"));
+	buf = mp_encode_uint(buf, next_iterator);
+	buf = mp_encode_str(buf, "chunk_size", strlen("chunk_size"));
+	buf = mp_encode_uint(buf, reply->next_chunk_size);
+	buf = mp_encode_str(buf, "sent_at", strlen("sent_at"));
+	buf = mp_encode_double(buf, sent_at);
+	buf = mp_encode_str(buf, "sent_by", strlen("sent_by"));
+	buf = mp_encode_uint(buf, sent_by());
+	if (args->has_limit) {
+		buf = mp_encode_str(buf, "limit", strlen("limit"));
+		buf = mp_encode_uint(buf, next_limit);
+	}
+	return size;
+}
+
+/**
+ * Encode tuples according to the format: a MsgPack array of
+ * tuples, an array of [key, tuple] entries or a compact block.
+ *
+ * Return a malloc'ed buffer and set @a size_ptr.
+ */
+static char *
+encode_tuples(const struct select_chunked_args *args,
+	      const struct select_chunked_reply *reply, size_t *size_ptr)
+{
+	if (args->format == CHUNK_FORMAT_COMPACT) {
+		struct merge_compact_encoder encoder;
+		merge_compact_encoder_create(&encoder);
+		char *block = NULL;
+		size_t block_size;
+		for (uint32_t i = 0; i < reply->count; ++i) {
+			if (merge_compact_encoder_add(&encoder,
+						      reply->tuples[i]) != 0)
+				goto compact_out;
+		}
+		block = merge_compact_encoder_finish(&encoder,
+			MERGE_COMPACT_LZ, &block_size);
+		if (block == NULL)
+			goto compact_out;
+		size_t size = mp_sizeof_str(block_size);
+		char *buf = malloc(size);
+		if (buf == NULL) {
+			diag_set_oom(size, "malloc", "compact block");
+			free(block);
+			block = NULL;
+			goto compact_out;
+		}
+		mp_encode_str(buf, block, block_size);
+		free(block);
+		block = buf;
+		*size_ptr = size;
+compact_out:
+		merge_compact_encoder_destroy(&encoder);
+		return block;
+	}
+
+	/* Keys are allocated on the fiber's region. */
+	const char **keys = NULL;
+	uint32_t *key_sizes = NULL;
+	size_t size = mp_sizeof_array(reply->count) + reply->bsize;
+	if (args->format == CHUNK_FORMAT_KEYED && reply->count > 0) {
+		keys = malloc(reply->count * sizeof(*keys));
+		key_sizes = malloc(reply->count * sizeof(*key_sizes));
+		if (keys == NULL || key_sizes == NULL) {
+			diag_set_oom(reply->count * sizeof(*keys), "malloc",
+				     "keys");
+			goto error;
+		}
+		for (uint32_t i = 0; i < reply->count; ++i) {
+			keys[i] = box_tuple_extract_key(reply->tuples[i],
+				args->space_id, args->index_id, &key_sizes[i]);
+			if (keys[i] == NULL)
+				goto error;
+			size += mp_sizeof_array(2) + key_sizes[i];
+		}
+	}
+
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		diag_set_oom(size, "malloc", "tuples");
+		goto error;
+	}
+	char *pos = mp_encode_array(buf, reply->count);
+	for (uint32_t i = 0; i < reply->count; ++i) {
+		if (keys != NULL) {
+			pos = mp_encode_array(pos, 2);
+			memcpy(pos, keys[i], key_sizes[i]);
+			pos += key_sizes[i];
+		}
+		size_t bsize = box_tuple_bsize(reply->tuples[i]);
+		box_tuple_to_buf(reply->tuples[i], pos, bsize);
+		pos += bsize;
+	}
+	free(keys);
+	free(key_sizes);
+	*size_ptr = size;
+	return buf;
+
+error:
+	free(keys);
+	free(key_sizes);
+	return NULL;
+}
+
+/* }}} */
+
+/* {{{ Stored function */
+
+int
+select_chunked(box_function_ctx_t *ctx, const char *args_data,
+	       const char *args_end)
+{
+	struct select_chunked_args args;
+	struct select_chunked_reply reply;
+	memset(&reply, 0, sizeof(reply));
+	char *tuples = NULL;
+	char *buf = NULL;
+	int rc = -1;
+
+	if (decode_args(args_data, args_end, &args) != 0 ||
+	    read_chunk(&args, &reply) != 0)
+		goto out;
+
+	/* Extract a key to continue from using the index key_def. */
+	const char *key = NULL;
+	uint32_t key_size = 0;
+	if (!reply.is_end) {
+		box_tuple_t *last = reply.tuples[reply.count - 1];
+		key = box_tuple_extract_key(last, args.space_id,
+					    args.index_id, &key_size);
+		if (key == NULL)
+			goto out;
+	}
+
+	size_t tuples_size;
+	tuples = encode_tuples(&args, &reply, &tuples_size);
+	if (tuples == NULL)
+		goto out;
+
+	size_t cursor_size = encode_cursor(NULL, &args, &reply, key,
+					   key_size);
+	size_t size = mp_sizeof_array(2) + cursor_size + tuples_size;
+	buf = malloc(size);
+	if (buf == NULL) {
+		diag_set_oom(size, "malloc", "reply");
+		goto out;
+	}
+	char *pos = mp_encode_array(buf, 2);
+	pos += encode_cursor(pos, &args, &reply, key, key_size);
+	memcpy(pos, tuples, tuples_size);
+
+	box_tuple_t *result = box_tuple_new(box_tuple_format_default(), buf,
+					    buf + size);
+	if (result == NULL)
+		goto out;
+	rc = box_return_tuple(ctx, result);
+
+out:
+	free(buf);
+	free(tuples);
+	free(args.key_buf);
+	reply_destroy(&reply);
+	return rc;
+}
+
+/* }}} */
@@ -0,0 +1,324 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <module.h>
+#include <msgpuck/msgpuck.h> /* mp_*() */
+
+#include "merger-collation.h"
+
+/* {{{ ICU */
+
+/* Declarations from ICU headers. */
+typedef uint16_t UChar;
+typedef int UErrorCode;
+typedef struct UCollator UCollator;
+
+enum {
+	UCOL_PRIMARY = 0,
+	UCOL_SECONDARY = 1,
+	UCOL_TERTIARY = 2,
+	UCOL_QUATERNARY = 3,
+	UCOL_DEFAULT = -1,
+};
+
+#define U_FAILURE(status) ((status) > 0)
+
+/**
+ * ICU functions found in the tarantool executable.
+ */
+static struct {
+	/* Whether the lookup was performed. */
+	bool is_resolved;
+	/* Whether all functions are found. */
+	bool is_available;
+	UCollator *(*ucol_open)(const char *loc, UErrorCode *status);
+	void (*ucol_close)(UCollator *coll);
+	void (*ucol_setStrength)(UCollator *coll, int strength);
+	int32_t (*ucol_getSortKey)(const UCollator *coll, const UChar *source,
+				   int32_t source_length, uint8_t *result,
+				   int32_t result_length);
+	UChar *(*u_strFromUTF8)(UChar *dest, int32_t dest_capacity,
+				int32_t *dest_length, const char *src,
+				int32_t src_length, UErrorCode *status);
+} icu;
+
+/**
+ * Find an ICU function. ICU is usually built with a version
+ * suffix in symbol names (say, ucol_open_67), so try them too.
+ */
+static void *
+icu_lookup(const char *name)
+{
+	void *sym = dlsym(RTLD_DEFAULT, name);
+	if (sym != NULL)
+		return sym;
+	char versioned[64];
+	for (int version = 99; version >= 44 && sym == NULL; --version) {
+		snprintf(versioned, sizeof(versioned), "%s_%d", name, version);
+		sym = dlsym(RTLD_DEFAULT, versioned);
+	}
+	return sym;
+}
+
+static bool
+icu_resolve(void)
+{
+	if (icu.is_resolved)
+		return icu.is_available;
+	icu.is_resolved = true;
+	icu.ucol_open = icu_lookup("ucol_open");
+	icu.ucol_close = icu_lookup("ucol_close");
+	icu.ucol_setStrength = icu_lookup("ucol_setStrength");
+	icu.ucol_getSortKey = icu_lookup("ucol_getSortKey");
+	icu.u_strFromUTF8 = icu_lookup("u_strFromUTF8");
+	icu.is_available = icu.ucol_open != NULL && icu.ucol_close != NULL &&
+		icu.ucol_setStrength != NULL && icu.ucol_getSortKey != NULL &&
+		icu.u_strFromUTF8 != NULL;
+	return icu.is_available;
+}
+
+/**
+ * Open an ICU collator for a tarantool built-in collation name:
+ * 'unicode', 'unicode_ci' or 'unicode_<locale>_s<strength>'.
+ *
+ * Return NULL for other collations.
+ */
+static UCollator *
+icu_open_collation(const char *name)
+{
+	static const char *prefix = "unicode";
+	size_t prefix_len = strlen(prefix);
+	size_t len = strlen(name);
+	if (len < prefix_len || strncmp(name, prefix, prefix_len) != 0)
+		return NULL;
+	const char *locale = name + prefix_len;
+	size_t locale_len = len - prefix_len;
+
+	/* Strength suffix. */
+	int strength = UCOL_DEFAULT;
+	if (locale_len >= 3 && strcmp(locale + locale_len - 3, "_ci") == 0) {
+		strength = UCOL_PRIMARY;
+		locale_len -= 3;
+	} else if (locale_len >= 3 && locale[locale_len - 3] == '_' &&
+		   locale[locale_len - 2] == 's' &&
+		   locale[locale_len - 1] >= '1' &&
+		   locale[locale_len - 1] <= '4') {
+		strength = UCOL_PRIMARY + locale[locale_len - 1] - '1';
+		locale_len -= 3;
+	} else if (locale_len != 0) {
+		return NULL;
+	}
+
+	/* Locale: 'unicode_uk_s1' -> 'uk'. */
+	char locale_buf[64];
+	if (locale_len > 0) {
+		if (locale[0] != '_' || locale_len >= sizeof(locale_buf))
+			return NULL;
+		++locale;
+		--locale_len;
+	}
+	memcpy(locale_buf, locale, locale_len);
+	locale_buf[locale_len] = '\0';
+
+	UErrorCode status = 0;
+	UCollator *coll = icu.ucol_open(locale_buf, &status);
+	if (U_FAILURE(status) || coll == NULL)
+		return NULL;
+	if (strength != UCOL_DEFAULT)
+		icu.ucol_setStrength(coll, strength);
+	return coll;
+}
+
+/* }}} */
+
+/* {{{ Sort keys */
+
+struct merge_sort_key_def {
+	uint32_t part_count;
+	/* Zero based field numbers. */
+	uint32_t *fieldnos;
+	/* Collators or NULLs for binary comparison. */
+	UCollator **collators;
+	/* A buffer to convert strings to UTF-16. */
+	UChar *ubuf;
+	size_t ubuf_capacity;
+};
+
+struct merge_sort_key_def *
+merge_sort_key_def_new(const struct merge_sort_key_part *parts,
+		       uint32_t part_count)
+{
+	if (part_count == 0 || !icu_resolve())
+		return NULL;
+	struct merge_sort_key_def *def = calloc(1, sizeof(*def));
+	if (def == NULL)
+		return NULL;
+	def->fieldnos = calloc(part_count, sizeof(*def->fieldnos));
+	def->collators = calloc(part_count, sizeof(*def->collators));
+	if (def->fieldnos == NULL || def->collators == NULL)
+		goto error;
+	def->part_count = part_count;
+	for (uint32_t i = 0; i < part_count; ++i) {
+		def->fieldnos[i] = parts[i].fieldno;
+		if (parts[i].collation == NULL)
+			continue;
+		def->collators[i] = icu_open_collation(parts[i].collation);
+		if (def->collators[i] == NULL)
+			goto error;
+	}
+	return def;
+
+error:
+	merge_sort_key_def_delete(def);
+	return NULL;
+}
+
+void
+merge_sort_key_def_delete(struct merge_sort_key_def *def)
+{
+	for (uint32_t i = 0; i < def->part_count; ++i) {
+		if (def->collators[i] != NULL)
+			icu.ucol_close(def->collators[i]);
+	}
+	free(def->fieldnos);
+	free(def->collators);
+	free(def->ubuf);
+	free(def);
+}
+
+static int
+sort_key_reserve(char **buf, size_t *capacity, size_t size)
+{
+	if (size <= *capacity)
+		return 0;
+	size_t new_capacity = *capacity > 0 ? *capacity : 64;
+	while (new_capacity < size)
+		new_capacity *= 2;
+	char *new_buf = realloc(*buf, new_capacity);
+	if (new_buf == NULL)
+		return -1;
+	*buf = new_buf;
+	*capacity = new_capacity;
+	return 0;
+}
+
+ssize_t
+merge_sort_key_build(struct merge_sort_key_def *def, box_tuple_t *tuple,
+		     bool is_key, char **buf, size_t *capacity)
+{
+	size_t size = 0;
+	for (uint32_t i = 0; i < def->part_count; ++i) {
+		const char *field = box_tuple_field(tuple,
+			is_key ? i : def->fieldnos[i]);
+
+		/* NULLs go first. */
+		if (sort_key_reserve(buf, capacity, size + 1) != 0)
+			return -1;
+		if (field == NULL || mp_typeof(*field) == MP_NIL) {
+			(*buf)[size++] = 0x00;
+			continue;
+		}
+		(*buf)[size++] = 0x01;
+		if (mp_typeof(*field) != MP_STR)
+			return -1;
+		uint32_t len;
+		const char *str = mp_decode_str(&field, &len);
+
+		if (def->collators[i] == NULL) {
+			/*
+			 * Escape zero bytes and terminate with
+			 * two zeros, so a prefix goes first.
+			 */
+			if (sort_key_reserve(buf, capacity,
+					     size + 2 * (size_t)len + 2) != 0)
+				return -1;
+			for (uint32_t j = 0; j < len; ++j) {
+				(*buf)[size++] = str[j];
+				if (str[j] == '\0')
+					(*buf)[size++] = (char)0xff;
+			}
+			(*buf)[size++] = 0x00;
+			(*buf)[size++] = 0x00;
+			continue;
+		}
+
+		/* UTF-16 is not longer than UTF-8 in code units. */
+		if (len > INT32_MAX / 2)
+			return -1;
+		if (def->ubuf_capacity < len) {
+			UChar *ubuf = realloc(def->ubuf, sizeof(UChar) * len);
+			if (ubuf == NULL)
+				return -1;
+			def->ubuf = ubuf;
+			def->ubuf_capacity = len;
+		}
+		UErrorCode status = 0;
+		int32_t ulen;
+		icu.u_strFromUTF8(def->ubuf, def->ubuf_capacity, &ulen, str,
+				  len, &status);
+		if (U_FAILURE(status))
+			return -1;
+
+		/*
+		 * An ICU sort key is terminated by a zero byte and
+		 * has no other zeros, so keys can be concatenated.
+		 */
+		while (true) {
+			size_t avail = *capacity - size;
+			if (avail > INT32_MAX)
+				avail = INT32_MAX;
+			int32_t key_len = icu.ucol_getSortKey(
+				def->collators[i], def->ubuf, ulen,
+				(uint8_t *)*buf + size, avail);
+			if (key_len <= 0)
+				return -1;
+			if ((size_t)key_len <= avail) {
+				size += key_len;
+				break;
+			}
+			if (sort_key_reserve(buf, capacity,
+					     size + key_len) != 0)
+				return -1;
+		}
+	}
+	return size;
+}
+
+/* }}} */
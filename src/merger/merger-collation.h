@@ -0,0 +1,97 @@
+#ifndef MERGER_COLLATION_H_INCLUDED
+#define MERGER_COLLATION_H_INCLUDED
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <module.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/*
+ * A sort key is a byte string built from key parts of a tuple,
+ * such that memcmp() of two sort keys gives the same order as
+ * box_tuple_compare() of the tuples. Collation aware parts are
+ * converted using ICU sort keys.
+ *
+ * The module API does not expose collations, so ICU functions
+ * are looked up in the tarantool executable. When ICU or a
+ * collation is not available, sort keys are not used.
+ */
+
+/**
+ * A key part to build sort keys.
+ */
+struct merge_sort_key_part {
+	/* A zero based field number. */
+	uint32_t fieldno;
+	/* A collation name or NULL for binary comparison. */
+	const char *collation;
+};
+
+struct merge_sort_key_def;
+
+/**
+ * Create a sort key definition for string key parts.
+ *
+ * Return NULL when sort keys can't be built: say, ICU is not
+ * found or a collation is unknown. A diag is not set.
+ */
+struct merge_sort_key_def *
+merge_sort_key_def_new(const struct merge_sort_key_part *parts,
+		       uint32_t part_count);
+
+void
+merge_sort_key_def_delete(struct merge_sort_key_def *def);
+
+/**
+ * Build a sort key of a tuple (or of a key when @a is_key is
+ * set: key parts are its fields in order) into @a buf of
+ * @a capacity bytes (both are updated when the buffer grows).
+ *
+ * Return a size of the sort key or -1 if it can't be built (a
+ * field is not a string, an ICU error or OOM). A diag is not
+ * set.
+ */
+ssize_t
+merge_sort_key_build(struct merge_sort_key_def *def, box_tuple_t *tuple,
+		     bool is_key, char **buf, size_t *capacity);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /* MERGER_COLLATION_H_INCLUDED */
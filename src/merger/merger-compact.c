@@ -0,0 +1,510 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <module.h>
+#include <msgpuck/msgpuck.h> /* mp_*() */
+
+#include "compat/diag.h"
+
+#include "merger-compact.h"
+
+/* {{{ Helpers */
+
+enum {
+	/* A maximum size of a 64 bit LEB128 varint. */
+	COMPACT_VARINT_MAX = 10,
+	/* A minimal length of an LZ match. */
+	COMPACT_LZ_MIN_MATCH = 4,
+	/* log2 of an LZ hash table size. */
+	COMPACT_LZ_HASH_BITS = 12,
+};
+
+static int
+compact_buf_reserve(struct merge_compact_buf *buf, size_t size)
+{
+	if (size <= buf->capacity)
+		return 0;
+	size_t capacity = buf->capacity > 0 ? buf->capacity : 256;
+	while (capacity < size && capacity <= SIZE_MAX / 2)
+		capacity *= 2;
+	char *data = capacity >= size ? realloc(buf->data, capacity) : NULL;
+	if (data == NULL) {
+		diag_set_oom(size, "realloc", "compact block");
+		return -1;
+	}
+	buf->data = data;
+	buf->capacity = capacity;
+	return 0;
+}
+
+static void
+compact_buf_destroy(struct merge_compact_buf *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+	buf->capacity = 0;
+}
+
+static int
+compact_buf_append(struct merge_compact_buf *buf, const char *data,
+		   size_t size)
+{
+	if (size == 0)
+		return 0;
+	if (compact_buf_reserve(buf, buf->size + size) != 0)
+		return -1;
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+	return 0;
+}
+
+static int
+compact_buf_append_varint(struct merge_compact_buf *buf, uint64_t value)
+{
+	if (compact_buf_reserve(buf, buf->size + COMPACT_VARINT_MAX) != 0)
+		return -1;
+	char *pos = buf->data + buf->size;
+	while (value >= 0x80) {
+		*pos++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*pos++ = (char)value;
+	buf->size = pos - buf->data;
+	return 0;
+}
+
+/**
+ * Decode a varint.
+ *
+ * Return -1 if it is truncated or too long.
+ */
+static int
+compact_decode_varint(const char **pos, const char *end, uint64_t *value)
+{
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*pos == end)
+			return -1;
+		uint8_t byte = (uint8_t)*(*pos)++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static inline uint64_t
+compact_zigzag_encode(uint64_t value)
+{
+	return (value << 1) ^ (uint64_t)((int64_t)value >> 63);
+}
+
+static inline uint64_t
+compact_zigzag_decode(uint64_t value)
+{
+	return (value >> 1) ^ -(value & 1);
+}
+
+/**
+ * Whether a tuple starts with an unsigned integer field.
+ */
+static bool
+compact_has_unsigned_key(const char *tuple)
+{
+	if (mp_decode_array(&tuple) == 0)
+		return false;
+	return mp_typeof(*tuple) == MP_UINT;
+}
+
+/* }}} */
+
+/* {{{ LZ codec */
+
+/*
+ * The compressed stream is a sequence of
+ *
+ * | literal size | literal | match size - 4 | match offset |
+ *
+ * items, where the last item consists of a literal only. A match
+ * copies bytes starting at a given offset back from the current
+ * position (it may overlap with itself).
+ */
+
+static inline uint32_t
+compact_lz_hash(const char *pos)
+{
+	uint32_t value;
+	memcpy(&value, pos, sizeof(value));
+	return (value * 2654435761U) >> (32 - COMPACT_LZ_HASH_BITS);
+}
+
+static int
+compact_lz_compress(const char *src, size_t size, struct merge_compact_buf *dst)
+{
+	/* Positions plus one, zero means no position. */
+	uint32_t table[1 << COMPACT_LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const char *end = src + size;
+	const char *literal = src;
+	const char *pos = src;
+	while (pos + COMPACT_LZ_MIN_MATCH <= end) {
+		uint32_t hash = compact_lz_hash(pos);
+		uint32_t candidate = table[hash];
+		table[hash] = (uint32_t)(pos - src) + 1;
+		if (candidate == 0 ||
+		    memcmp(src + candidate - 1, pos, COMPACT_LZ_MIN_MATCH) != 0) {
+			++pos;
+			continue;
+		}
+		const char *match = src + candidate - 1;
+		size_t len = COMPACT_LZ_MIN_MATCH;
+		while (pos + len < end && match[len] == pos[len])
+			++len;
+		if (compact_buf_append_varint(dst, pos - literal) != 0 ||
+		    compact_buf_append(dst, literal, pos - literal) != 0 ||
+		    compact_buf_append_varint(dst,
+				len - COMPACT_LZ_MIN_MATCH) != 0 ||
+		    compact_buf_append_varint(dst, pos - match) != 0)
+			return -1;
+		pos += len;
+		literal = pos;
+	}
+	if (compact_buf_append_varint(dst, end - literal) != 0 ||
+	    compact_buf_append(dst, literal, end - literal) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Decompress exactly @a size bytes into @a dst.
+ *
+ * Return -1 if the stream is malformed.
+ */
+static int
+compact_lz_decompress(const char *src, const char *src_end, char *dst,
+		      size_t size)
+{
+	size_t pos = 0;
+	while (true) {
+		uint64_t literal_size;
+		if (compact_decode_varint(&src, src_end, &literal_size) != 0 ||
+		    literal_size > size - pos ||
+		    literal_size > (uint64_t)(src_end - src))
+			return -1;
+		memcpy(dst + pos, src, literal_size);
+		src += literal_size;
+		pos += literal_size;
+		if (pos == size)
+			return src == src_end ? 0 : -1;
+
+		uint64_t len;
+		uint64_t offset;
+		if (compact_decode_varint(&src, src_end, &len) != 0 ||
+		    compact_decode_varint(&src, src_end, &offset) != 0 ||
+		    size - pos < COMPACT_LZ_MIN_MATCH ||
+		    len > size - pos - COMPACT_LZ_MIN_MATCH ||
+		    offset == 0 || offset > pos)
+			return -1;
+		len += COMPACT_LZ_MIN_MATCH;
+		/* Byte by byte: a match may overlap with itself. */
+		for (size_t i = 0; i < len; ++i, ++pos)
+			dst[pos] = dst[pos - offset];
+	}
+}
+
+/* }}} */
+
+/* {{{ Encoder */
+
+void
+merge_compact_encoder_create(struct merge_compact_encoder *encoder)
+{
+	memset(encoder, 0, sizeof(*encoder));
+	encoder->is_delta_applicable = true;
+}
+
+void
+merge_compact_encoder_destroy(struct merge_compact_encoder *encoder)
+{
+	compact_buf_destroy(&encoder->tuples);
+}
+
+int
+merge_compact_encoder_add(struct merge_compact_encoder *encoder,
+			  box_tuple_t *tuple)
+{
+	struct merge_compact_buf *tuples = &encoder->tuples;
+	size_t bsize = box_tuple_bsize(tuple);
+	if (compact_buf_reserve(tuples, tuples->size + bsize) != 0)
+		return -1;
+	char *data = tuples->data + tuples->size;
+	box_tuple_to_buf(tuple, data, bsize);
+	tuples->size += bsize;
+	++encoder->tuple_count;
+	if (encoder->is_delta_applicable && !compact_has_unsigned_key(data))
+		encoder->is_delta_applicable = false;
+	return 0;
+}
+
+/**
+ * Encode the body of a block: front coded entries.
+ */
+static int
+compact_encode_body(struct merge_compact_encoder *encoder, bool is_delta,
+		    struct merge_compact_buf *body)
+{
+	/* Entries with a cut key, used when is_delta is set. */
+	struct merge_compact_buf entries[2] = {{NULL, 0, 0}, {NULL, 0, 0}};
+	const char *prev = NULL;
+	size_t prev_size = 0;
+	uint64_t prev_key = 0;
+	int rc = -1;
+
+	const char *pos = encoder->tuples.data;
+	for (uint32_t i = 0; i < encoder->tuple_count; ++i) {
+		const char *tuple = pos;
+		mp_next(&pos);
+		const char *entry = tuple;
+		size_t entry_size = pos - tuple;
+		if (is_delta) {
+			const char *key = tuple;
+			mp_decode_array(&key);
+			const char *rest = key;
+			uint64_t key_value = mp_decode_uint(&rest);
+			struct merge_compact_buf *cur = &entries[i % 2];
+			cur->size = 0;
+			if (compact_buf_append(cur, tuple, key - tuple) != 0 ||
+			    compact_buf_append(cur, rest, pos - rest) != 0)
+				goto out;
+			entry = cur->data;
+			entry_size = cur->size;
+			if (compact_buf_append_varint(body,
+				compact_zigzag_encode(key_value - prev_key)) != 0)
+				goto out;
+			prev_key = key_value;
+		}
+		size_t shared = 0;
+		while (shared < prev_size && shared < entry_size &&
+		       prev[shared] == entry[shared])
+			++shared;
+		if (compact_buf_append_varint(body, shared) != 0 ||
+		    compact_buf_append_varint(body, entry_size - shared) != 0 ||
+		    compact_buf_append(body, entry + shared,
+				       entry_size - shared) != 0)
+			goto out;
+		prev = entry;
+		prev_size = entry_size;
+	}
+	rc = 0;
+out:
+	compact_buf_destroy(&entries[0]);
+	compact_buf_destroy(&entries[1]);
+	return rc;
+}
+
+char *
+merge_compact_encoder_finish(struct merge_compact_encoder *encoder,
+			     unsigned flags, size_t *size_ptr)
+{
+	assert((flags & ~(MERGE_COMPACT_DELTA | MERGE_COMPACT_LZ)) == 0);
+	if ((flags & MERGE_COMPACT_DELTA) != 0 &&
+	    !encoder->is_delta_applicable) {
+		diag_set_illegal("Delta encoding requires an unsigned "
+				 "integer first field in each tuple");
+		return NULL;
+	}
+
+	struct merge_compact_buf body = {NULL, 0, 0};
+	struct merge_compact_buf compressed = {NULL, 0, 0};
+	struct merge_compact_buf block = {NULL, 0, 0};
+	if (compact_encode_body(encoder, (flags & MERGE_COMPACT_DELTA) != 0,
+				&body) != 0)
+		goto error;
+
+	const struct merge_compact_buf *payload = &body;
+	if ((flags & MERGE_COMPACT_LZ) != 0) {
+		if (body.size < UINT32_MAX &&
+		    compact_lz_compress(body.data, body.size, &compressed) != 0)
+			goto error;
+		if (body.size < UINT32_MAX && compressed.size < body.size)
+			payload = &compressed;
+		else
+			flags &= ~MERGE_COMPACT_LZ;
+	}
+
+	char flags_byte = (char)flags;
+	if (compact_buf_append(&block, &flags_byte, 1) != 0 ||
+	    compact_buf_append_varint(&block, encoder->tuple_count) != 0 ||
+	    compact_buf_append_varint(&block, body.size) != 0 ||
+	    compact_buf_append(&block, payload->data, payload->size) != 0)
+		goto error;
+
+	compact_buf_destroy(&body);
+	compact_buf_destroy(&compressed);
+	*size_ptr = block.size;
+	return block.data;
+
+error:
+	compact_buf_destroy(&body);
+	compact_buf_destroy(&compressed);
+	compact_buf_destroy(&block);
+	return NULL;
+}
+
+/* }}} */
+
+/* {{{ Decoder */
+
+void
+merge_compact_decoder_create(struct merge_compact_decoder *decoder)
+{
+	memset(decoder, 0, sizeof(*decoder));
+}
+
+void
+merge_compact_decoder_destroy(struct merge_compact_decoder *decoder)
+{
+	compact_buf_destroy(&decoder->out);
+	compact_buf_destroy(&decoder->prev);
+	compact_buf_destroy(&decoder->body);
+}
+
+int
+merge_compact_decode(struct merge_compact_decoder *decoder,
+		     const char *data, const char *data_end,
+		     const char **out_beg, const char **out_end,
+		     uint32_t *count_ptr)
+{
+	struct merge_compact_buf *out = &decoder->out;
+	struct merge_compact_buf *prev = &decoder->prev;
+	const char *pos = data;
+
+	/* Header. */
+	if (pos == data_end)
+		goto error;
+	uint8_t flags = (uint8_t)*pos++;
+	uint64_t count;
+	uint64_t body_size;
+	if ((flags & ~(MERGE_COMPACT_DELTA | MERGE_COMPACT_LZ)) != 0 ||
+	    compact_decode_varint(&pos, data_end, &count) != 0 ||
+	    count > UINT32_MAX ||
+	    compact_decode_varint(&pos, data_end, &body_size) != 0 ||
+	    body_size > SIZE_MAX)
+		goto error;
+
+	/* Body. */
+	const char *body = pos;
+	const char *body_end = data_end;
+	if ((flags & MERGE_COMPACT_LZ) != 0) {
+		if (compact_buf_reserve(&decoder->body, body_size) != 0)
+			return -1;
+		if (compact_lz_decompress(pos, data_end, decoder->body.data,
+					  body_size) != 0)
+			goto error;
+		body = decoder->body.data;
+		body_end = body + body_size;
+	} else if (body_size != (uint64_t)(data_end - pos)) {
+		goto error;
+	}
+
+	/* Entries. */
+	out->size = 0;
+	prev->size = 0;
+	uint64_t key = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t delta = 0;
+		uint64_t shared;
+		uint64_t suffix_size;
+		if (((flags & MERGE_COMPACT_DELTA) != 0 &&
+		     compact_decode_varint(&body, body_end, &delta) != 0) ||
+		    compact_decode_varint(&body, body_end, &shared) != 0 ||
+		    compact_decode_varint(&body, body_end, &suffix_size) != 0 ||
+		    shared > prev->size ||
+		    suffix_size > (uint64_t)(body_end - body))
+			goto error;
+		/* The shared prefix is already in place. */
+		if (compact_buf_reserve(prev, shared + suffix_size) != 0)
+			return -1;
+		memcpy(prev->data + shared, body, suffix_size);
+		body += suffix_size;
+		prev->size = shared + suffix_size;
+
+		if ((flags & MERGE_COMPACT_DELTA) == 0) {
+			if (compact_buf_append(out, prev->data,
+					       prev->size) != 0)
+				return -1;
+			continue;
+		}
+
+		/* Put the key back after the array header. */
+		key += compact_zigzag_decode(delta);
+		const char *header_end = prev->data;
+		const char *prev_end = prev->data + prev->size;
+		if (header_end == prev_end ||
+		    mp_typeof(*header_end) != MP_ARRAY ||
+		    mp_check_array(header_end, prev_end) > 0 ||
+		    mp_decode_array(&header_end) == 0)
+			goto error;
+		size_t header_size = header_end - prev->data;
+		if (compact_buf_reserve(out, out->size + prev->size +
+					mp_sizeof_uint(key)) != 0)
+			return -1;
+		char *wpos = out->data + out->size;
+		memcpy(wpos, prev->data, header_size);
+		wpos = mp_encode_uint(wpos + header_size, key);
+		memcpy(wpos, header_end, prev_end - header_end);
+		wpos += prev_end - header_end;
+		out->size = wpos - out->data;
+	}
+	if (body != body_end)
+		goto error;
+
+	*out_beg = out->data;
+	*out_end = out->data + out->size;
+	*count_ptr = count;
+	return 0;
+
+error:
+	diag_set_illegal("Invalid compact block");
+	return -1;
+}
+
+/* }}} */
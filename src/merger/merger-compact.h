@@ -0,0 +1,169 @@
+#ifndef MERGER_COMPACT_H_INCLUDED
+#define MERGER_COMPACT_H_INCLUDED
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <module.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/*
+ * A compact chunk (a block) is a sorted sequence of tuples
+ * encoded to occupy less bytes than a MsgPack array of them:
+ *
+ * | flags (1 byte) | tuple count | body size | body |
+ *
+ * Numbers are unsigned LEB128 varints. When MERGE_COMPACT_LZ is
+ * set, the body is compressed with a simple LZ77 codec (see
+ * merger-compact.c) and the body size is the size of the
+ * decompressed body.
+ *
+ * The body is a sequence of entries, one per tuple:
+ *
+ * | [key delta] | shared | suffix size | suffix |
+ *
+ * An entry stores a tuple (its MsgPack representation) as a
+ * number of bytes shared with the previous one and the rest
+ * bytes (front coding).
+ *
+ * When MERGE_COMPACT_DELTA is set, the first field of each tuple
+ * is an unsigned integer. It is stored as a zigzag encoded
+ * difference with the previous tuple's one (the key delta) and
+ * is cut from the tuple before the front coding.
+ */
+
+/**
+ * Flags of a compact block.
+ */
+enum {
+	/* The first field of tuples is delta encoded. */
+	MERGE_COMPACT_DELTA = 0x01,
+	/* The body is LZ compressed. */
+	MERGE_COMPACT_LZ = 0x02,
+};
+
+/**
+ * A growing buffer.
+ */
+struct merge_compact_buf {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+/* {{{ Encoder */
+
+struct merge_compact_encoder {
+	/* MsgPack tuples to encode. */
+	struct merge_compact_buf tuples;
+	/* A number of tuples. */
+	uint32_t tuple_count;
+	/*
+	 * Whether all tuples have an unsigned integer first
+	 * field, so MERGE_COMPACT_DELTA may be used.
+	 */
+	bool is_delta_applicable;
+};
+
+void
+merge_compact_encoder_create(struct merge_compact_encoder *encoder);
+
+void
+merge_compact_encoder_destroy(struct merge_compact_encoder *encoder);
+
+/**
+ * Add a tuple to a block being encoded.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merge_compact_encoder_add(struct merge_compact_encoder *encoder,
+			  box_tuple_t *tuple);
+
+/**
+ * Encode all added tuples into a block.
+ *
+ * MERGE_COMPACT_LZ in @a flags is dropped if the compression
+ * does not make the block smaller.
+ *
+ * Return a buffer that should be freed by a caller and set
+ * @a size_ptr. In case of an error return NULL and set a diag.
+ */
+char *
+merge_compact_encoder_finish(struct merge_compact_encoder *encoder,
+			     unsigned flags, size_t *size_ptr);
+
+/* }}} */
+
+/* {{{ Decoder */
+
+struct merge_compact_decoder {
+	/* Decoded tuples. */
+	struct merge_compact_buf out;
+	/* The previous entry (after the key delta removal). */
+	struct merge_compact_buf prev;
+	/* A decompressed body. */
+	struct merge_compact_buf body;
+};
+
+void
+merge_compact_decoder_create(struct merge_compact_decoder *decoder);
+
+void
+merge_compact_decoder_destroy(struct merge_compact_decoder *decoder);
+
+/**
+ * Decode a block into a sequence of MsgPack tuples.
+ *
+ * Set @a out_beg, @a out_end to the decoded tuples, which are
+ * valid until a next call, and @a count_ptr to their number.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merge_compact_decode(struct merge_compact_decoder *decoder,
+		     const char *data, const char *data_end,
+		     const char **out_beg, const char **out_end,
+		     uint32_t *count_ptr);
+
+/* }}} */
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /* MERGER_COMPACT_H_INCLUDED */
@@ -0,0 +1,847 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <module.h>
+#include <msgpuck/msgpuck.h> /* mp_*() */
+
+#include "compat/diag.h"
+
+#include "merger-source.h"
+
+/* {{{ File source */
+
+enum {
+	/*
+	 * A version of the sparse index file format. An index of
+	 * an older version is not used.
+	 */
+	MERGE_FILE_INDEX_VERSION = 3,
+	/*
+	 * How many bytes ahead of the current position are
+	 * requested from the kernel with MADV_WILLNEED.
+	 */
+	MERGE_SOURCE_FILE_READAHEAD = 1024 * 1024,
+};
+
+struct merge_source_file {
+	struct merge_source base;
+	/* A file mapping or NULL for an empty file. */
+	char *data;
+	/* A size of the mapping. */
+	size_t size;
+	/* A position of a next tuple. */
+	const char *pos;
+	/* An end of the data. */
+	const char *end;
+	/* The mapping is advised to be read ahead up to here. */
+	const char *readahead_pos;
+	/* Pages before this position are released. */
+	char *released_pos;
+};
+
+/* Helpers */
+
+/**
+ * Round a pointer into the file mapping down to a page boundary.
+ */
+static char *
+merge_source_file_page_start(struct merge_source_file *source,
+			     const char *pos)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t offset = pos - source->data;
+	return source->data + offset - offset % page_size;
+}
+
+/**
+ * Ask the kernel to read ahead a window after the current
+ * position and to drop pages that are already consumed.
+ */
+static void
+merge_source_file_readahead(struct merge_source_file *source)
+{
+	if (source->pos < source->readahead_pos)
+		return;
+
+	char *start = merge_source_file_page_start(source, source->pos);
+	size_t len = MERGE_SOURCE_FILE_READAHEAD;
+	if (len > (size_t)(source->end - start))
+		len = source->end - start;
+	/* The advice is a hint: ignore errors. */
+	(void)madvise(start, len, MADV_WILLNEED);
+	if (start > source->released_pos) {
+		(void)madvise(source->released_pos,
+			      start - source->released_pos, MADV_DONTNEED);
+		source->released_pos = start;
+	}
+	source->readahead_pos = start + len;
+}
+
+/**
+ * A modification time of a file in nanoseconds. A file that is
+ * rewritten within a second keeps its mtime in seconds.
+ */
+static uint64_t
+merge_file_mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+	const struct timespec *mtime = &st->st_mtimespec;
+#else
+	const struct timespec *mtime = &st->st_mtim;
+#endif
+	return (uint64_t)mtime->tv_sec * 1000000000 + mtime->tv_nsec;
+}
+
+/**
+ * Find an end of a tuple that starts at @a pos.
+ *
+ * Return 0 at success. Return -1 and set a diag when the file
+ * contains something that is not a tuple at this position.
+ */
+static int
+merge_source_file_check_tuple(struct merge_source_file *source,
+			      const char *pos, const char **tuple_end)
+{
+	const char *end = pos;
+	if (mp_typeof(*pos) != MP_ARRAY || mp_check(&end, source->end) != 0) {
+		diag_set_illegal("Invalid tuple at offset %zu of a file "
+				 "source", (size_t)(pos - source->data));
+		return -1;
+	}
+	*tuple_end = end;
+	return 0;
+}
+
+/**
+ * Whether a tuple that is compared with a key as @a cmp
+ * precedes the position defined by @a iterator.
+ */
+static bool
+merge_source_file_is_before(int cmp, int iterator)
+{
+	switch (iterator) {
+	case ITER_GT:
+		return cmp <= 0;
+	case ITER_LE:
+		return cmp > 0;
+	case ITER_LT:
+		return cmp >= 0;
+	default:
+		assert(iterator == ITER_GE);
+		return cmp < 0;
+	}
+}
+
+/**
+ * Compare a tuple at @a pos with a key.
+ *
+ * Return 0 at success and set @a is_before and @a tuple_end.
+ * Return -1 at an error and set a diag.
+ */
+static int
+merge_source_file_cmp_at(struct merge_source_file *source,
+			 box_tuple_format_t *format, struct key_def *key_def,
+			 const struct merge_source_file_opts *opts,
+			 const char *pos, bool *is_before,
+			 const char **tuple_end)
+{
+	if (merge_source_file_check_tuple(source, pos, tuple_end) != 0)
+		return -1;
+	box_tuple_t *tuple = box_tuple_new(format, pos, *tuple_end);
+	if (tuple == NULL)
+		return -1;
+	box_tuple_ref(tuple);
+	int cmp = box_tuple_compare_with_key(tuple, opts->key, key_def);
+	box_tuple_unref(tuple);
+	*is_before = merge_source_file_is_before(cmp, opts->iterator);
+	return 0;
+}
+
+/**
+ * Read a sparse index: an array of offsets of each N-th tuple.
+ *
+ * The index holds a size and a modification time (in
+ * nanoseconds) of the data file it is written for. When they don't match the data file
+ * (say, the file is rewritten without the index) or the index
+ * has an older format, the index is stale: it is ignored and
+ * @a count_ptr is set to zero, so tuples are scanned from the
+ * beginning.
+ *
+ * Return 0 at success and set @a offsets_ptr (should be freed
+ * by a caller) and @a count_ptr. Return -1 at an error and set a
+ * diag.
+ */
+static int
+merge_source_file_read_index(const char *index_path, size_t data_size,
+			     uint64_t data_mtime, uint64_t **offsets_ptr,
+			     uint32_t *count_ptr)
+{
+	*offsets_ptr = NULL;
+	*count_ptr = 0;
+	FILE *f = fopen(index_path, "rb");
+	if (f == NULL) {
+		diag_set_system("Can't open a file source index '%s': %s",
+				index_path, strerror(errno));
+		return -1;
+	}
+	char *buf = NULL;
+	uint64_t *offsets = NULL;
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0) {
+		diag_set_system("Can't stat a file source index '%s': %s",
+				index_path, strerror(errno));
+		goto error;
+	}
+	size_t size = st.st_size;
+	buf = malloc(size > 0 ? size : 1);
+	if (buf == NULL) {
+		diag_set_oom(size, "malloc", "file source index");
+		goto error;
+	}
+	if (fread(buf, 1, size, f) != size) {
+		diag_set_system("Can't read a file source index '%s'",
+				index_path);
+		goto error;
+	}
+
+	/*
+	 * [version, step, tuple count, data size, data mtime in
+	 *  nanoseconds, [offset, offset, ...]]
+	 */
+	const char *pos = buf;
+	const char *end = pos;
+	bool ok = size > 0 && mp_typeof(*pos) == MP_ARRAY &&
+		mp_check(&end, buf + size) == 0 && mp_decode_array(&pos) > 0 &&
+		mp_typeof(*pos) == MP_UINT;
+	if (!ok) {
+		diag_set_illegal("Invalid file source index '%s'", index_path);
+		goto error;
+	}
+	if (mp_decode_uint(&pos) != MERGE_FILE_INDEX_VERSION)
+		goto stale;
+	pos = buf;
+	ok = mp_decode_array(&pos) == 6;
+	uint64_t header[5] = {0};
+	for (uint32_t i = 0; ok && i < 5; ++i) {
+		ok = mp_typeof(*pos) == MP_UINT;
+		if (ok)
+			header[i] = mp_decode_uint(&pos);
+	}
+	uint64_t step = ok ? header[1] : 0;
+	uint64_t tuple_count = ok ? header[2] : 0;
+	ok = ok && step > 0 && mp_typeof(*pos) == MP_ARRAY;
+	if (!ok) {
+		diag_set_illegal("Invalid file source index '%s'", index_path);
+		goto error;
+	}
+	if (header[3] != data_size || header[4] != data_mtime)
+		goto stale;
+	uint32_t count = mp_decode_array(&pos);
+	if (count != (tuple_count + step - 1) / step) {
+		diag_set_illegal("Invalid file source index '%s'", index_path);
+		goto error;
+	}
+	offsets = malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+	if (offsets == NULL) {
+		diag_set_oom(sizeof(uint64_t) * count, "malloc",
+			     "file source index offsets");
+		goto error;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		if (mp_typeof(*pos) != MP_UINT ||
+		    (offsets[i] = mp_decode_uint(&pos)) >= data_size ||
+		    (i > 0 && offsets[i] <= offsets[i - 1])) {
+			diag_set_illegal("Invalid file source index '%s'",
+					 index_path);
+			goto error;
+		}
+	}
+
+	free(buf);
+	fclose(f);
+	*offsets_ptr = offsets;
+	*count_ptr = count;
+	return 0;
+
+stale:
+	free(buf);
+	fclose(f);
+	return 0;
+
+error:
+	free(offsets);
+	free(buf);
+	fclose(f);
+	return -1;
+}
+
+/**
+ * Whether a sampled offset of an index starts a tuple, which
+ * ends before the next sample.
+ *
+ * An index that matches a data file by its size and mtime may
+ * still be stale, say, when the file is replaced by a file with
+ * the same attributes. Such an index gives offsets in the middle
+ * of tuples.
+ */
+static bool
+merge_source_file_sample_is_valid(struct merge_source_file *source,
+				  const uint64_t *offsets, uint32_t count,
+				  uint32_t i)
+{
+	const char *pos = source->data + offsets[i];
+	const char *end = pos;
+	if (mp_typeof(*pos) != MP_ARRAY || mp_check(&end, source->end) != 0)
+		return false;
+	return i + 1 == count || end <= source->data + offsets[i + 1];
+}
+
+/**
+ * Move the source to the first tuple that does not precede
+ * opts->key according to opts->iterator.
+ *
+ * Use a sparse index (if given) to find a tuple to start a
+ * linear scan from: compare tuples at sampled offsets with the
+ * key using binary search. When a sample does not start a tuple,
+ * the index is stale: tuples are scanned from the beginning.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_source_file_seek(struct merge_source_file *source,
+		       struct key_def *key_def,
+		       const struct merge_source_file_opts *opts,
+		       uint64_t mtime)
+{
+	uint64_t *offsets = NULL;
+	uint32_t offset_count = 0;
+	if (opts->index_path != NULL &&
+	    merge_source_file_read_index(opts->index_path, source->size,
+					 mtime, &offsets,
+					 &offset_count) != 0)
+		return -1;
+
+	box_tuple_format_t *format = box_tuple_format_new(&key_def, 1);
+	if (format == NULL) {
+		free(offsets);
+		return -1;
+	}
+
+	/*
+	 * Find the last sampled tuple that precedes the key.
+	 * Sampled tuples are sorted, so the predicate is true
+	 * for a prefix of them.
+	 */
+	const char *tuple_end;
+	bool is_before;
+	uint32_t lo = 0;
+	uint32_t hi = offset_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (!merge_source_file_sample_is_valid(source, offsets,
+						       offset_count, mid)) {
+			lo = 0;
+			break;
+		}
+		const char *pos = source->data + offsets[mid];
+		if (merge_source_file_cmp_at(source, format, key_def, opts,
+					     pos, &is_before,
+					     &tuple_end) != 0)
+			goto error;
+		if (is_before)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		source->pos = source->data + offsets[lo - 1];
+
+	/* Scan tuples after the found sample. */
+	while (source->pos < source->end) {
+		if (merge_source_file_cmp_at(source, format, key_def, opts,
+					     source->pos, &is_before,
+					     &tuple_end) != 0)
+			goto error;
+		if (!is_before)
+			break;
+		source->pos = tuple_end;
+	}
+
+	box_tuple_format_unref(format);
+	free(offsets);
+	return 0;
+
+error:
+	box_tuple_format_unref(format);
+	free(offsets);
+	return -1;
+}
+
+/* Virtual methods declarations */
+
+static void
+merge_source_file_destroy(struct merge_source *base);
+static int
+merge_source_file_next(struct merge_source *base, box_tuple_format_t *format,
+		       box_tuple_t **out);
+
+/* Non-virtual methods */
+
+struct merge_source *
+merge_source_file_new(const char *path, struct key_def *key_def,
+		      const struct merge_source_file_opts *opts)
+{
+	static struct merge_source_vtab merge_source_file_vtab = {
+		.destroy = merge_source_file_destroy,
+		.next = merge_source_file_next,
+	};
+
+	struct merge_source_file *source = malloc(
+		sizeof(struct merge_source_file));
+	if (source == NULL) {
+		diag_set_oom(sizeof(struct merge_source_file), "malloc",
+			     "merge_source_file");
+		return NULL;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		diag_set_system("Can't open a file source '%s': %s", path,
+				strerror(errno));
+		free(source);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		diag_set_system("Can't stat a file source '%s': %s", path,
+				strerror(errno));
+		close(fd);
+		free(source);
+		return NULL;
+	}
+
+	/* mmap() does not accept zero length. */
+	char *data = NULL;
+	size_t size = st.st_size;
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			diag_set_system("Can't map a file source '%s': %s",
+					path, strerror(errno));
+			close(fd);
+			free(source);
+			return NULL;
+		}
+		(void)madvise(data, size, MADV_SEQUENTIAL);
+	}
+	/* The mapping holds the file. */
+	close(fd);
+
+	merge_source_create(&source->base, &merge_source_file_vtab);
+	source->data = data;
+	source->size = size;
+	source->pos = data;
+	source->end = data + size;
+	source->readahead_pos = data;
+	source->released_pos = data;
+
+	if (opts->key != NULL && size > 0 &&
+	    merge_source_file_seek(source, key_def, opts,
+				   merge_file_mtime_ns(&st)) != 0) {
+		merge_source_unref(&source->base);
+		return NULL;
+	}
+	if (size > 0)
+		merge_source_file_readahead(source);
+
+	return &source->base;
+}
+
+/* Virtual methods */
+
+static void
+merge_source_file_destroy(struct merge_source *base)
+{
+	struct merge_source_file *source = container_of(base,
+		struct merge_source_file, base);
+
+	if (source->data != NULL)
+		munmap(source->data, source->size);
+	free(source);
+}
+
+static int
+merge_source_file_next(struct merge_source *base, box_tuple_format_t *format,
+		       box_tuple_t **out)
+{
+	struct merge_source_file *source = container_of(base,
+		struct merge_source_file, base);
+
+	if (source->pos == source->end) {
+		*out = NULL;
+		return 0;
+	}
+
+	const char *tuple_beg = source->pos;
+	const char *tuple_end;
+	if (merge_source_file_check_tuple(source, tuple_beg, &tuple_end) != 0)
+		return -1;
+	source->pos = tuple_end;
+	merge_source_file_readahead(source);
+
+	if (format == NULL)
+		format = box_tuple_format_default();
+	box_tuple_t *tuple = box_tuple_new(format, tuple_beg, tuple_end);
+	if (tuple == NULL)
+		return -1;
+
+	box_tuple_ref(tuple);
+	*out = tuple;
+	return 0;
+}
+
+/* }}} */
+
+/* {{{ File writer */
+
+/* How many bytes are collected before they are written. */
+enum { MERGE_FILE_WRITE_BUF_SIZE = 1024 * 1024 };
+
+/**
+ * A file, which is written from a coio thread, so the tx thread
+ * is not blocked on disk and other fibers work meanwhile.
+ */
+struct merge_file_writer {
+	const char *path;
+	int fd;
+	/* Data collected to write. */
+	char *buf;
+	size_t size;
+	size_t capacity;
+	/* The file stat taken on close. */
+	struct stat st;
+	/* errno of a failed call or zero. */
+	int saved_errno;
+};
+
+static ssize_t
+merge_file_writer_open_f(va_list ap)
+{
+	struct merge_file_writer *writer = va_arg(ap,
+		struct merge_file_writer *);
+	writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	writer->saved_errno = writer->fd < 0 ? errno : 0;
+	return 0;
+}
+
+static ssize_t
+merge_file_writer_write_f(va_list ap)
+{
+	struct merge_file_writer *writer = va_arg(ap,
+		struct merge_file_writer *);
+	const char *pos = writer->buf;
+	const char *end = writer->buf + writer->size;
+	writer->saved_errno = 0;
+	while (pos < end) {
+		ssize_t n = write(writer->fd, pos, end - pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			writer->saved_errno = errno;
+			break;
+		}
+		pos += n;
+	}
+	return 0;
+}
+
+static ssize_t
+merge_file_writer_close_f(va_list ap)
+{
+	struct merge_file_writer *writer = va_arg(ap,
+		struct merge_file_writer *);
+	writer->saved_errno = 0;
+	if (fstat(writer->fd, &writer->st) != 0)
+		writer->saved_errno = errno;
+	if (close(writer->fd) != 0 && writer->saved_errno == 0)
+		writer->saved_errno = errno;
+	writer->fd = -1;
+	return 0;
+}
+
+/**
+ * Call a writer function in a coio thread.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_file_writer_call(struct merge_file_writer *writer,
+		       ssize_t (*func)(va_list ap))
+{
+	if (coio_call(func, writer) == -1) {
+		diag_set_system("Failed to write a file '%s' in a coio thread",
+				writer->path);
+		return -1;
+	}
+	if (writer->saved_errno != 0) {
+		diag_set_system("Can't write a file '%s': %s", writer->path,
+				strerror(writer->saved_errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Create or truncate a file to write.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_file_writer_open(struct merge_file_writer *writer, const char *path)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->path = path;
+	writer->fd = -1;
+	return merge_file_writer_call(writer, merge_file_writer_open_f);
+}
+
+/**
+ * Write the collected data.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_file_writer_flush(struct merge_file_writer *writer)
+{
+	if (writer->size == 0)
+		return 0;
+	if (merge_file_writer_call(writer, merge_file_writer_write_f) != 0)
+		return -1;
+	writer->size = 0;
+	return 0;
+}
+
+/**
+ * Reserve @a size bytes to collect. The collected data is
+ * written first when it does not leave room for them.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+static char *
+merge_file_writer_reserve(struct merge_file_writer *writer, size_t size)
+{
+	if (writer->size + size > writer->capacity &&
+	    merge_file_writer_flush(writer) != 0)
+		return NULL;
+	if (size > writer->capacity) {
+		size_t capacity = size > MERGE_FILE_WRITE_BUF_SIZE ?
+			size : MERGE_FILE_WRITE_BUF_SIZE;
+		char *buf = realloc(writer->buf, capacity);
+		if (buf == NULL) {
+			diag_set_oom(capacity, "realloc", "file buffer");
+			return NULL;
+		}
+		writer->buf = buf;
+		writer->capacity = capacity;
+	}
+	char *pos = writer->buf + writer->size;
+	writer->size += size;
+	return pos;
+}
+
+/**
+ * Write the rest of data, close the file and fill writer->st.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_file_writer_close(struct merge_file_writer *writer)
+{
+	int rc = merge_file_writer_flush(writer);
+	if (merge_file_writer_call(writer, merge_file_writer_close_f) != 0)
+		rc = -1;
+	free(writer->buf);
+	writer->buf = NULL;
+	return rc;
+}
+
+/**
+ * Close the file after an error. Keep the diag.
+ */
+static void
+merge_file_writer_abort(struct merge_file_writer *writer)
+{
+	if (writer->fd >= 0)
+		coio_call(merge_file_writer_close_f, writer);
+	free(writer->buf);
+	writer->buf = NULL;
+}
+
+/**
+ * Write a sparse index built by merge_source_write_file().
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_source_write_file_index(const char *path, uint32_t index_step,
+			      uint64_t tuple_count, const struct stat *data_st,
+			      const uint64_t *offsets, uint32_t offset_count)
+{
+	uint64_t data_size = data_st->st_size;
+	uint64_t data_mtime = merge_file_mtime_ns(data_st);
+	size_t size = mp_sizeof_array(6) +
+		mp_sizeof_uint(MERGE_FILE_INDEX_VERSION) +
+		mp_sizeof_uint(index_step) + mp_sizeof_uint(tuple_count) +
+		mp_sizeof_uint(data_size) + mp_sizeof_uint(data_mtime) +
+		mp_sizeof_array(offset_count);
+	for (uint32_t i = 0; i < offset_count; ++i)
+		size += mp_sizeof_uint(offsets[i]);
+
+	struct merge_file_writer writer;
+	if (merge_file_writer_open(&writer, path) != 0)
+		return -1;
+	char *buf = merge_file_writer_reserve(&writer, size);
+	if (buf == NULL) {
+		merge_file_writer_abort(&writer);
+		return -1;
+	}
+	char *pos = buf;
+	pos = mp_encode_array(pos, 6);
+	pos = mp_encode_uint(pos, MERGE_FILE_INDEX_VERSION);
+	pos = mp_encode_uint(pos, index_step);
+	pos = mp_encode_uint(pos, tuple_count);
+	pos = mp_encode_uint(pos, data_size);
+	pos = mp_encode_uint(pos, data_mtime);
+	pos = mp_encode_array(pos, offset_count);
+	for (uint32_t i = 0; i < offset_count; ++i)
+		pos = mp_encode_uint(pos, offsets[i]);
+	assert(pos == buf + size);
+	return merge_file_writer_close(&writer);
+}
+
+int
+merge_source_write_file(struct merge_source *source, const char *path,
+			uint32_t index_step, uint64_t *count_ptr)
+{
+	struct merge_file_writer writer;
+	if (merge_file_writer_open(&writer, path) != 0)
+		return -1;
+
+	uint64_t *offsets = NULL;
+	uint32_t offset_count = 0;
+	uint32_t offset_capacity = 0;
+	uint64_t offset = 0;
+	uint64_t count = 0;
+
+	box_tuple_t *tuple;
+	int rc;
+	while ((rc = merge_source_next(source, NULL, &tuple)) == 0 &&
+	       tuple != NULL) {
+		/* Sample an offset of each index_step-th tuple. */
+		if (index_step > 0 && count % index_step == 0) {
+			if (offset_count == offset_capacity) {
+				uint32_t capacity = offset_capacity > 0 ?
+					offset_capacity * 2 : 64;
+				size_t size = sizeof(uint64_t) * capacity;
+				uint64_t *p = realloc(offsets, size);
+				if (p == NULL) {
+					box_tuple_unref(tuple);
+					diag_set_oom(size, "realloc",
+						     "file source index");
+					goto error;
+				}
+				offsets = p;
+				offset_capacity = capacity;
+			}
+			offsets[offset_count++] = offset;
+		}
+
+		/* A full buffer is written in a coio thread. */
+		size_t bsize = box_tuple_bsize(tuple);
+		char *buf = merge_file_writer_reserve(&writer, bsize);
+		if (buf == NULL) {
+			box_tuple_unref(tuple);
+			goto error;
+		}
+		box_tuple_to_buf(tuple, buf, bsize);
+		box_tuple_unref(tuple);
+		offset += bsize;
+		++count;
+	}
+	if (rc != 0)
+		goto error;
+	if (merge_file_writer_close(&writer) != 0)
+		goto error;
+
+	if (index_step > 0) {
+		/* Bind the index to the written data file. */
+		size_t len = strlen(path);
+		char *index_path = malloc(len + sizeof(".idx"));
+		if (index_path == NULL) {
+			diag_set_oom(len + sizeof(".idx"), "malloc",
+				     "index path");
+			goto error;
+		}
+		memcpy(index_path, path, len);
+		memcpy(index_path + len, ".idx", sizeof(".idx"));
+		rc = merge_source_write_file_index(index_path, index_step,
+						   count, &writer.st, offsets,
+						   offset_count);
+		free(index_path);
+		if (rc != 0)
+			goto error;
+	}
+
+	free(offsets);
+	if (count_ptr != NULL)
+		*count_ptr = count;
+	return 0;
+
+error:
+	merge_file_writer_abort(&writer);
+	free(offsets);
+	return -1;
+}
+
+/* }}} */
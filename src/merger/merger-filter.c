@@ -0,0 +1,408 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <module.h>
+#include <msgpuck/msgpuck.h> /* mp_*() */
+
+#include "compat/diag.h"
+
+#include "merger-filter.h"
+
+struct merge_filter_node {
+	enum merge_filter_op op;
+	/* A number of nodes in the subtree, the node including. */
+	uint32_t size;
+	/* A zero based field number for a predicate. */
+	uint32_t fieldno;
+	/* Values of a predicate: values[value_idx, +value_count). */
+	uint32_t value_idx;
+	uint32_t value_count;
+};
+
+struct merge_filter {
+	struct merge_filter_node *nodes;
+	uint32_t node_count;
+	uint32_t node_capacity;
+	struct merge_filter_value *values;
+	uint32_t value_count;
+	uint32_t value_capacity;
+	/* Fields used by predicates, each one once. */
+	uint32_t *used_fields;
+	uint32_t used_field_count;
+	/*
+	 * Fields of a current tuple by their numbers up to
+	 * max_fieldno (NULL for a missing or unused field).
+	 */
+	const char **fields;
+	uint32_t max_fieldno;
+};
+
+/* {{{ Building */
+
+struct merge_filter *
+merge_filter_new(void)
+{
+	struct merge_filter *filter = calloc(1, sizeof(*filter));
+	if (filter == NULL) {
+		diag_set_oom(sizeof(*filter), "calloc", "filter");
+		return NULL;
+	}
+	return filter;
+}
+
+void
+merge_filter_delete(struct merge_filter *filter)
+{
+	for (uint32_t i = 0; i < filter->value_count; ++i)
+		free((char *)filter->values[i].str);
+	free(filter->nodes);
+	free(filter->values);
+	free(filter->used_fields);
+	free(filter->fields);
+	free(filter);
+}
+
+/**
+ * Grow an array to hold @a count items at least.
+ */
+static int
+merge_filter_reserve(void **items, uint32_t *capacity, uint32_t count,
+		     size_t item_size)
+{
+	if (count <= *capacity)
+		return 0;
+	uint32_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+	while (new_capacity < count)
+		new_capacity *= 2;
+	void *new_items = realloc(*items, item_size * new_capacity);
+	if (new_items == NULL) {
+		diag_set_oom(item_size * new_capacity, "realloc", "filter");
+		return -1;
+	}
+	*items = new_items;
+	*capacity = new_capacity;
+	return 0;
+}
+
+/**
+ * Remember a field used by a predicate.
+ */
+static int
+merge_filter_use_field(struct merge_filter *filter, uint32_t fieldno)
+{
+	for (uint32_t i = 0; i < filter->used_field_count; ++i) {
+		if (filter->used_fields[i] == fieldno)
+			return 0;
+	}
+	uint32_t count = filter->used_field_count + 1;
+	uint32_t *used_fields = realloc(filter->used_fields,
+					sizeof(uint32_t) * count);
+	if (used_fields == NULL) {
+		diag_set_oom(sizeof(uint32_t) * count, "realloc", "filter");
+		return -1;
+	}
+	filter->used_fields = used_fields;
+	if (fieldno >= filter->max_fieldno || filter->fields == NULL) {
+		size_t size = sizeof(const char *) * ((size_t)fieldno + 1);
+		const char **fields = realloc(filter->fields, size);
+		if (fields == NULL) {
+			diag_set_oom(size, "realloc", "filter");
+			return -1;
+		}
+		filter->fields = fields;
+		filter->max_fieldno = fieldno;
+	}
+	filter->used_fields[filter->used_field_count++] = fieldno;
+	return 0;
+}
+
+int
+merge_filter_add(struct merge_filter *filter, enum merge_filter_op op,
+		 uint32_t fieldno, const struct merge_filter_value *values,
+		 uint32_t value_count)
+{
+	bool is_logical = op == MERGE_FILTER_AND || op == MERGE_FILTER_OR;
+	if (is_logical || op == MERGE_FILTER_IS_NULL ||
+	    op == MERGE_FILTER_NOT_NULL)
+		value_count = 0;
+	else if (op != MERGE_FILTER_IN)
+		value_count = 1;
+
+	if (merge_filter_reserve((void **)&filter->nodes,
+				 &filter->node_capacity,
+				 filter->node_count + 1,
+				 sizeof(struct merge_filter_node)) != 0 ||
+	    merge_filter_reserve((void **)&filter->values,
+				 &filter->value_capacity,
+				 filter->value_count + value_count,
+				 sizeof(struct merge_filter_value)) != 0)
+		return -1;
+	if (!is_logical && merge_filter_use_field(filter, fieldno) != 0)
+		return -1;
+
+	uint32_t value_idx = filter->value_count;
+	for (uint32_t i = 0; i < value_count; ++i) {
+		struct merge_filter_value *value =
+			&filter->values[filter->value_count];
+		*value = values[i];
+		if (value->type == MERGE_FILTER_VALUE_STRING) {
+			char *str = malloc(value->len + 1);
+			if (str == NULL) {
+				diag_set_oom(value->len + 1, "malloc",
+					     "filter");
+				return -1;
+			}
+			memcpy(str, values[i].str, value->len);
+			value->str = str;
+		} else {
+			value->str = NULL;
+		}
+		++filter->value_count;
+	}
+
+	struct merge_filter_node *node = &filter->nodes[filter->node_count];
+	node->op = op;
+	node->size = 1;
+	node->fieldno = fieldno;
+	node->value_idx = value_idx;
+	node->value_count = value_count;
+	return filter->node_count++;
+}
+
+void
+merge_filter_close(struct merge_filter *filter, int node_idx)
+{
+	assert(node_idx >= 0 && (uint32_t)node_idx < filter->node_count);
+	filter->nodes[node_idx].size = filter->node_count - node_idx;
+}
+
+/* }}} */
+
+/* {{{ Evaluation */
+
+/**
+ * A type class of a field.
+ */
+static enum merge_filter_value_type
+merge_filter_field_type(const char *field, bool *is_comparable)
+{
+	*is_comparable = true;
+	if (field == NULL)
+		return MERGE_FILTER_VALUE_NIL;
+	switch (mp_typeof(*field)) {
+	case MP_NIL:
+		return MERGE_FILTER_VALUE_NIL;
+	case MP_BOOL:
+		return MERGE_FILTER_VALUE_BOOL;
+	case MP_UINT:
+	case MP_INT:
+	case MP_FLOAT:
+	case MP_DOUBLE:
+		return MERGE_FILTER_VALUE_NUMBER;
+	case MP_STR:
+		return MERGE_FILTER_VALUE_STRING;
+	default:
+		*is_comparable = false;
+		return MERGE_FILTER_VALUE_NIL;
+	}
+}
+
+#define MERGE_FILTER_CMP(a, b) ((a) < (b) ? -1 : (a) > (b))
+
+/**
+ * Compare a number field with a value.
+ */
+static int
+merge_filter_compare_number(const char *field,
+			    const struct merge_filter_value *value)
+{
+	switch (mp_typeof(*field)) {
+	case MP_UINT: {
+		uint64_t u = mp_decode_uint(&field);
+		if (!value->is_int)
+			return MERGE_FILTER_CMP((double)u, value->number);
+		if (value->integer < 0)
+			return 1;
+		return MERGE_FILTER_CMP(u, (uint64_t)value->integer);
+	}
+	case MP_INT: {
+		int64_t i = mp_decode_int(&field);
+		if (!value->is_int)
+			return MERGE_FILTER_CMP((double)i, value->number);
+		return MERGE_FILTER_CMP(i, value->integer);
+	}
+	case MP_FLOAT:
+		return MERGE_FILTER_CMP((double)mp_decode_float(&field),
+					value->number);
+	default:
+		return MERGE_FILTER_CMP(mp_decode_double(&field),
+					value->number);
+	}
+}
+
+/**
+ * Compare a field with a value.
+ *
+ * Set @a is_comparable to false when they are of different type
+ * classes.
+ */
+static int
+merge_filter_compare(const char *field, const struct merge_filter_value *value,
+		     bool *is_comparable)
+{
+	enum merge_filter_value_type type = merge_filter_field_type(field,
+		is_comparable);
+	if (!*is_comparable || type != value->type) {
+		*is_comparable = false;
+		return 0;
+	}
+	switch (type) {
+	case MERGE_FILTER_VALUE_NIL:
+		return 0;
+	case MERGE_FILTER_VALUE_BOOL:
+		return MERGE_FILTER_CMP(mp_decode_bool(&field),
+					value->boolean);
+	case MERGE_FILTER_VALUE_NUMBER:
+		return merge_filter_compare_number(field, value);
+	case MERGE_FILTER_VALUE_STRING: {
+		uint32_t len;
+		const char *str = mp_decode_str(&field, &len);
+		int rc = memcmp(str, value->str,
+				len < value->len ? len : value->len);
+		return rc != 0 ? rc : MERGE_FILTER_CMP(len, value->len);
+	}
+	}
+	assert(false);
+	return 0;
+}
+
+#undef MERGE_FILTER_CMP
+
+/**
+ * Evaluate a subtree at @a node_idx.
+ */
+static bool
+merge_filter_eval(const struct merge_filter *filter, uint32_t node_idx)
+{
+	const struct merge_filter_node *node = &filter->nodes[node_idx];
+	const struct merge_filter_value *values =
+		&filter->values[node->value_idx];
+	const char *field = node->op == MERGE_FILTER_AND ||
+		node->op == MERGE_FILTER_OR ? NULL :
+		filter->fields[node->fieldno];
+	bool is_comparable;
+	int cmp;
+	switch (node->op) {
+	case MERGE_FILTER_AND:
+	case MERGE_FILTER_OR: {
+		bool is_and = node->op == MERGE_FILTER_AND;
+		uint32_t end = node_idx + node->size;
+		for (uint32_t i = node_idx + 1; i < end;
+		     i += filter->nodes[i].size) {
+			if (merge_filter_eval(filter, i) != is_and)
+				return !is_and;
+		}
+		return is_and;
+	}
+	case MERGE_FILTER_IS_NULL:
+		return field == NULL || mp_typeof(*field) == MP_NIL;
+	case MERGE_FILTER_NOT_NULL:
+		return field != NULL && mp_typeof(*field) != MP_NIL;
+	case MERGE_FILTER_IN:
+		for (uint32_t i = 0; i < node->value_count; ++i) {
+			cmp = merge_filter_compare(field, &values[i],
+						   &is_comparable);
+			if (is_comparable && cmp == 0)
+				return true;
+		}
+		return false;
+	case MERGE_FILTER_NE:
+		cmp = merge_filter_compare(field, values, &is_comparable);
+		return !is_comparable || cmp != 0;
+	default:
+		break;
+	}
+	cmp = merge_filter_compare(field, values, &is_comparable);
+	if (!is_comparable)
+		return false;
+	switch (node->op) {
+	case MERGE_FILTER_EQ:
+		return cmp == 0;
+	case MERGE_FILTER_LT:
+		return cmp < 0;
+	case MERGE_FILTER_LE:
+		return cmp <= 0;
+	case MERGE_FILTER_GT:
+		return cmp > 0;
+	case MERGE_FILTER_GE:
+		return cmp >= 0;
+	default:
+		assert(false);
+		return false;
+	}
+}
+
+bool
+merge_filter_match_raw(struct merge_filter *filter, const char *data)
+{
+	if (filter->used_field_count == 0)
+		return filter->node_count == 0 || merge_filter_eval(filter, 0);
+	assert(mp_typeof(*data) == MP_ARRAY);
+	uint32_t field_count = mp_decode_array(&data);
+	uint32_t i = 0;
+	for (; i < field_count && i <= filter->max_fieldno; ++i) {
+		filter->fields[i] = data;
+		mp_next(&data);
+	}
+	for (; i <= filter->max_fieldno; ++i)
+		filter->fields[i] = NULL;
+	return merge_filter_eval(filter, 0);
+}
+
+bool
+merge_filter_match(struct merge_filter *filter, box_tuple_t *tuple)
+{
+	if (filter->node_count == 0)
+		return true;
+	for (uint32_t i = 0; i < filter->used_field_count; ++i) {
+		uint32_t fieldno = filter->used_fields[i];
+		filter->fields[fieldno] = box_tuple_field(tuple, fieldno);
+	}
+	return merge_filter_eval(filter, 0);
+}
+
+/* }}} */
@@ -0,0 +1,144 @@
+#ifndef MERGER_FILTER_H_INCLUDED
+#define MERGER_FILTER_H_INCLUDED
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <module.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/*
+ * A filter is a tree of predicates over tuple fields, which is
+ * stored as an array of nodes in prefix order. It is evaluated
+ * on raw MsgPack of a tuple, so a source may drop a tuple before
+ * it is created.
+ *
+ * Comparisons are done within a type class: numbers (integers
+ * and floating point ones), strings (binary), booleans and nil.
+ * A field of other class does not satisfy a comparison except
+ * MERGE_FILTER_NE. A missing field is nil.
+ */
+
+enum merge_filter_op {
+	/* Logical nodes: children follow the node. */
+	MERGE_FILTER_AND,
+	MERGE_FILTER_OR,
+	/* Comparisons of a field with a value. */
+	MERGE_FILTER_EQ,
+	MERGE_FILTER_NE,
+	MERGE_FILTER_LT,
+	MERGE_FILTER_LE,
+	MERGE_FILTER_GT,
+	MERGE_FILTER_GE,
+	/* A field is equal to one of values. */
+	MERGE_FILTER_IN,
+	/* A field is nil or missing. */
+	MERGE_FILTER_IS_NULL,
+	MERGE_FILTER_NOT_NULL,
+};
+
+enum merge_filter_value_type {
+	MERGE_FILTER_VALUE_NIL,
+	MERGE_FILTER_VALUE_BOOL,
+	MERGE_FILTER_VALUE_NUMBER,
+	MERGE_FILTER_VALUE_STRING,
+};
+
+/**
+ * A value to compare a field with.
+ */
+struct merge_filter_value {
+	enum merge_filter_value_type type;
+	bool boolean;
+	/*
+	 * A number. When is_int is set, the integer is exact
+	 * and the double is its approximation.
+	 */
+	bool is_int;
+	int64_t integer;
+	double number;
+	/* A string, which is copied into the filter. */
+	const char *str;
+	uint32_t len;
+};
+
+struct merge_filter;
+
+struct merge_filter *
+merge_filter_new(void);
+
+void
+merge_filter_delete(struct merge_filter *filter);
+
+/**
+ * Append a node. Children of a logical node should be appended
+ * right after it and followed by merge_filter_close().
+ *
+ * @a fieldno (zero based) and @a values are ignored for logical
+ * nodes. Comparisons take one value, MERGE_FILTER_IN takes
+ * @a value_count ones, null checks take none.
+ *
+ * Return an index of the node. Return -1 at OOM and set a diag.
+ */
+int
+merge_filter_add(struct merge_filter *filter, enum merge_filter_op op,
+		 uint32_t fieldno, const struct merge_filter_value *values,
+		 uint32_t value_count);
+
+/**
+ * Finish a logical node at @a node_idx: all nodes added after
+ * it are its children (and their descendants).
+ */
+void
+merge_filter_close(struct merge_filter *filter, int node_idx);
+
+/**
+ * Whether a tuple given as a MsgPack array satisfies a filter.
+ */
+bool
+merge_filter_match_raw(struct merge_filter *filter, const char *data);
+
+/**
+ * Whether a tuple satisfies a filter.
+ */
+bool
+merge_filter_match(struct merge_filter *filter, box_tuple_t *tuple);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /* MERGER_FILTER_H_INCLUDED */
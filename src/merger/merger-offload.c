@@ -0,0 +1,445 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <module.h>
+#include <msgpuck/msgpuck.h> /* mp_*() */
+
+#include "compat/diag.h"
+#define HEAP_FORWARD_DECLARATION
+#include "compat/heap.h"
+
+#include "merger-offload.h"
+
+/**
+ * Entries of a run and a key of the next one.
+ */
+struct merge_offload_run {
+	/* Next entries of the run and their sizes. */
+	const char *pos;
+	const uint32_t *sizes;
+	uint32_t count;
+	/* How many entries are merged since the last take. */
+	uint32_t taken;
+	/* Key fields of the next entry (NULL for a missing one). */
+	const char *key[MERGE_OFFLOAD_PART_MAX];
+	/* An anchor to make the structure a heap node. */
+	struct heap_node in_heap;
+};
+
+static bool
+merge_offload_run_less(const heap_t *heap,
+		       const struct merge_offload_run *left,
+		       const struct merge_offload_run *right);
+#define HEAP_NAME merge_offload_heap
+#define HEAP_LESS merge_offload_run_less
+#define heap_value_t struct merge_offload_run
+#define heap_value_attr in_heap
+#include "compat/heap.h"
+#undef HEAP_NAME
+#undef HEAP_LESS
+#undef heap_value_t
+#undef heap_value_attr
+
+struct merge_offload {
+	struct merge_offload_part parts[MERGE_OFFLOAD_PART_MAX];
+	uint32_t part_count;
+	/* A maximum field number of key parts. */
+	uint32_t max_fieldno;
+	bool reverse;
+	/* A heap of non-empty runs, it is built by each merge. */
+	heap_t heap;
+	struct merge_offload_run *runs;
+	uint32_t run_count;
+	/* A size of entries, which are not merged yet. */
+	size_t bsize;
+	/* Arguments and results of a merge in a coio thread. */
+	char *out;
+	uint32_t limit;
+	uint32_t count;
+	size_t size;
+	bool is_mismatch;
+};
+
+/* {{{ Compare keys */
+
+#define MERGE_OFFLOAD_CMP(a, b) ((a) < (b) ? -1 : (a) > (b))
+
+/**
+ * Whether a field may be a value of a key part.
+ */
+static bool
+merge_offload_field_is_valid(const struct merge_offload_part *part,
+			     const char *field)
+{
+	if (field == NULL)
+		return part->is_nullable;
+	switch (mp_typeof(*field)) {
+	case MP_NIL:
+		return part->is_nullable;
+	case MP_UINT:
+		return part->type == MERGE_OFFLOAD_UNSIGNED ||
+		       part->type == MERGE_OFFLOAD_INTEGER ||
+		       part->type == MERGE_OFFLOAD_NUMBER;
+	case MP_INT:
+		return part->type == MERGE_OFFLOAD_INTEGER ||
+		       part->type == MERGE_OFFLOAD_NUMBER;
+	case MP_FLOAT:
+	case MP_DOUBLE:
+		return part->type == MERGE_OFFLOAD_NUMBER;
+	case MP_STR:
+		return part->type == MERGE_OFFLOAD_STRING;
+	case MP_BOOL:
+		return part->type == MERGE_OFFLOAD_BOOLEAN;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Decode a number as a double.
+ */
+static double
+merge_offload_decode_double(const char *field)
+{
+	switch (mp_typeof(*field)) {
+	case MP_UINT:
+		return mp_decode_uint(&field);
+	case MP_INT:
+		return mp_decode_int(&field);
+	case MP_FLOAT:
+		return mp_decode_float(&field);
+	default:
+		return mp_decode_double(&field);
+	}
+}
+
+/**
+ * Compare numbers: integers exactly, others as doubles.
+ */
+static int
+merge_offload_compare_number(const char *a, const char *b)
+{
+	enum mp_type a_type = mp_typeof(*a);
+	enum mp_type b_type = mp_typeof(*b);
+	if (a_type == MP_UINT && b_type == MP_UINT)
+		return MERGE_OFFLOAD_CMP(mp_decode_uint(&a),
+					 mp_decode_uint(&b));
+	if (a_type == MP_INT && b_type == MP_INT)
+		return MERGE_OFFLOAD_CMP(mp_decode_int(&a),
+					 mp_decode_int(&b));
+	if (a_type == MP_INT && b_type == MP_UINT) {
+		int64_t value = mp_decode_int(&a);
+		return value < 0 ? -1 :
+		       MERGE_OFFLOAD_CMP((uint64_t)value, mp_decode_uint(&b));
+	}
+	if (a_type == MP_UINT && b_type == MP_INT)
+		return -merge_offload_compare_number(b, a);
+	return MERGE_OFFLOAD_CMP(merge_offload_decode_double(a),
+				 merge_offload_decode_double(b));
+}
+
+/**
+ * Compare valid fields of a key part.
+ */
+static int
+merge_offload_compare_field(const char *a, const char *b)
+{
+	bool a_is_nil = a == NULL || mp_typeof(*a) == MP_NIL;
+	bool b_is_nil = b == NULL || mp_typeof(*b) == MP_NIL;
+	if (a_is_nil || b_is_nil)
+		return (int)b_is_nil - (int)a_is_nil;
+	switch (mp_typeof(*a)) {
+	case MP_STR: {
+		uint32_t a_len, b_len;
+		const char *a_str = mp_decode_str(&a, &a_len);
+		const char *b_str = mp_decode_str(&b, &b_len);
+		int cmp = memcmp(a_str, b_str, a_len < b_len ? a_len : b_len);
+		return cmp != 0 ? cmp : MERGE_OFFLOAD_CMP(a_len, b_len);
+	}
+	case MP_BOOL:
+		return MERGE_OFFLOAD_CMP(mp_decode_bool(&a),
+					 mp_decode_bool(&b));
+	default:
+		return merge_offload_compare_number(a, b);
+	}
+}
+
+#undef MERGE_OFFLOAD_CMP
+
+static bool
+merge_offload_run_less(const heap_t *heap,
+		       const struct merge_offload_run *left,
+		       const struct merge_offload_run *right)
+{
+	struct merge_offload *offload = container_of(heap,
+		struct merge_offload, heap);
+	int cmp = 0;
+	for (uint32_t i = 0; i < offload->part_count && cmp == 0; ++i)
+		cmp = merge_offload_compare_field(left->key[i],
+						  right->key[i]);
+	return offload->reverse ? cmp >= 0 : cmp < 0;
+}
+
+/**
+ * Find key fields of a next entry of a run.
+ *
+ * Return false when they don't match types of key parts.
+ */
+static bool
+merge_offload_run_read_key(struct merge_offload *offload,
+			   struct merge_offload_run *run)
+{
+	for (uint32_t i = 0; i < offload->part_count; ++i)
+		run->key[i] = NULL;
+	const char *pos = run->pos;
+	uint32_t field_count = mp_decode_array(&pos);
+	for (uint32_t fieldno = 0; fieldno < field_count &&
+	     fieldno <= offload->max_fieldno; ++fieldno) {
+		for (uint32_t i = 0; i < offload->part_count; ++i) {
+			if (offload->parts[i].fieldno == fieldno)
+				run->key[i] = pos;
+		}
+		mp_next(&pos);
+	}
+	for (uint32_t i = 0; i < offload->part_count; ++i) {
+		if (!merge_offload_field_is_valid(&offload->parts[i],
+						  run->key[i]))
+			return false;
+	}
+	return true;
+}
+
+/* }}} */
+
+/* {{{ Merge */
+
+struct merge_offload *
+merge_offload_new(const struct merge_offload_part *parts,
+		  uint32_t part_count, bool reverse, uint32_t run_count)
+{
+	assert(part_count > 0 && part_count <= MERGE_OFFLOAD_PART_MAX);
+	struct merge_offload *offload = malloc(sizeof(*offload));
+	size_t runs_size = sizeof(struct merge_offload_run) * run_count;
+	size_t heap_size = sizeof(struct heap_node *) * run_count;
+	struct merge_offload_run *runs = malloc(runs_size);
+	struct heap_node **harr = malloc(heap_size);
+	if (offload == NULL || runs == NULL || harr == NULL) {
+		free(offload);
+		free(runs);
+		free(harr);
+		diag_set_oom(sizeof(*offload) + runs_size + heap_size,
+			     "malloc", "offload");
+		return NULL;
+	}
+	memcpy(offload->parts, parts,
+	       sizeof(struct merge_offload_part) * part_count);
+	offload->part_count = part_count;
+	offload->max_fieldno = 0;
+	for (uint32_t i = 0; i < part_count; ++i) {
+		if (parts[i].fieldno > offload->max_fieldno)
+			offload->max_fieldno = parts[i].fieldno;
+	}
+	offload->reverse = reverse;
+	/*
+	 * The heap does not grow in a coio thread: it has room
+	 * for all runs.
+	 */
+	merge_offload_heap_create(&offload->heap);
+	offload->heap.harr = harr;
+	offload->heap.capacity = run_count;
+	for (uint32_t i = 0; i < run_count; ++i) {
+		runs[i].pos = NULL;
+		runs[i].sizes = NULL;
+		runs[i].count = 0;
+		runs[i].taken = 0;
+	}
+	offload->runs = runs;
+	offload->run_count = run_count;
+	offload->bsize = 0;
+	return offload;
+}
+
+void
+merge_offload_delete(struct merge_offload *offload)
+{
+	merge_offload_heap_destroy(&offload->heap);
+	free(offload->runs);
+	free(offload);
+}
+
+/**
+ * A size of entries of a run, which are not merged yet.
+ */
+static size_t
+merge_offload_run_bsize(const struct merge_offload_run *run)
+{
+	size_t bsize = 0;
+	for (uint32_t i = 0; i < run->count; ++i)
+		bsize += run->sizes[i];
+	return bsize;
+}
+
+void
+merge_offload_set_run(struct merge_offload *offload, uint32_t idx,
+		      const char *data, const uint32_t *sizes,
+		      uint32_t count)
+{
+	assert(idx < offload->run_count);
+	struct merge_offload_run *run = &offload->runs[idx];
+	offload->bsize -= merge_offload_run_bsize(run);
+	run->pos = data;
+	run->sizes = sizes;
+	run->count = count;
+	run->taken = 0;
+	offload->bsize += merge_offload_run_bsize(run);
+}
+
+uint32_t
+merge_offload_take(struct merge_offload *offload, uint32_t idx,
+		   const char **pos, uint32_t *left)
+{
+	assert(idx < offload->run_count);
+	struct merge_offload_run *run = &offload->runs[idx];
+	uint32_t taken = run->taken;
+	run->taken = 0;
+	*pos = run->pos;
+	*left = run->count;
+	return taken;
+}
+
+size_t
+merge_offload_bsize(const struct merge_offload *offload)
+{
+	return offload->bsize;
+}
+
+/**
+ * Copy @a count next entries of a run to the output.
+ */
+static void
+merge_offload_run_copy(struct merge_offload *offload,
+		       struct merge_offload_run *run, uint32_t count)
+{
+	size_t size = 0;
+	for (uint32_t i = 0; i < count; ++i)
+		size += run->sizes[i];
+	memcpy(offload->out + offload->size, run->pos, size);
+	offload->size += size;
+	offload->count += count;
+	offload->bsize -= size;
+	run->pos += size;
+	run->sizes += count;
+	run->count -= count;
+	run->taken += count;
+}
+
+/**
+ * Merge runs until a limit is reached or a run ends. It runs in
+ * a coio thread, so it does not set a diag.
+ */
+static void
+merge_offload_merge_impl(struct merge_offload *offload)
+{
+	offload->count = 0;
+	offload->size = 0;
+	offload->is_mismatch = false;
+	offload->heap.size = 0;
+	for (uint32_t i = 0; i < offload->run_count; ++i) {
+		struct merge_offload_run *run = &offload->runs[i];
+		if (run->count == 0)
+			continue;
+		if (!merge_offload_run_read_key(offload, run)) {
+			offload->is_mismatch = true;
+			return;
+		}
+		heap_node_create(&run->in_heap);
+		/* The heap has room for all runs. */
+		merge_offload_heap_insert(&offload->heap, run);
+	}
+
+	while (offload->count < offload->limit) {
+		struct merge_offload_run *run =
+			merge_offload_heap_top(&offload->heap);
+		if (run == NULL)
+			break;
+		/* Nothing to merge: copy the rest of the last run. */
+		if (offload->heap.size == 1) {
+			uint32_t count = offload->limit - offload->count;
+			merge_offload_run_copy(offload, run,
+				count < run->count ? count : run->count);
+			break;
+		}
+		merge_offload_run_copy(offload, run, 1);
+		if (run->count == 0)
+			break;
+		if (!merge_offload_run_read_key(offload, run)) {
+			offload->is_mismatch = true;
+			break;
+		}
+		merge_offload_heap_update(&offload->heap, run);
+	}
+}
+
+static ssize_t
+merge_offload_merge_f(va_list ap)
+{
+	struct merge_offload *offload = va_arg(ap, struct merge_offload *);
+	merge_offload_merge_impl(offload);
+	return 0;
+}
+
+ssize_t
+merge_offload_merge(struct merge_offload *offload, char *out, uint32_t limit,
+		    uint32_t *count_ptr, bool *is_mismatch)
+{
+	offload->out = out;
+	offload->limit = limit;
+	offload->count = 0;
+	offload->size = 0;
+	offload->is_mismatch = false;
+	if (limit > 0 && offload->bsize > 0 &&
+	    coio_call(merge_offload_merge_f, offload) == -1) {
+		diag_set_system("Failed to merge in a coio thread");
+		return -1;
+	}
+	*count_ptr = offload->count;
+	*is_mismatch = offload->is_mismatch;
+	return offload->size;
+}
+
+/* }}} */
@@ -0,0 +1,133 @@
+#ifndef MERGER_OFFLOAD_H_INCLUDED
+#define MERGER_OFFLOAD_H_INCLUDED
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/*
+ * An offload merges runs of raw tuples (MsgPack arrays) in a
+ * coio thread, so a heavy merge does not occupy the tx thread.
+ *
+ * A worker thread can't create tuples, call Lua or allocate on
+ * the tx thread's slab cache, so key fields are compared right
+ * in MsgPack and runs are refilled by a caller between merges:
+ * a merge stops when a run ends.
+ */
+
+/* Types of key parts, which may be compared in MsgPack. */
+enum merge_offload_type {
+	MERGE_OFFLOAD_UNSIGNED,
+	MERGE_OFFLOAD_INTEGER,
+	MERGE_OFFLOAD_NUMBER,
+	MERGE_OFFLOAD_STRING,
+	MERGE_OFFLOAD_BOOLEAN,
+};
+
+struct merge_offload_part {
+	/* A zero based field number. */
+	uint32_t fieldno;
+	enum merge_offload_type type;
+	bool is_nullable;
+};
+
+/* A maximum number of key parts. */
+enum { MERGE_OFFLOAD_PART_MAX = 16 };
+
+struct merge_offload;
+
+/**
+ * Create an offload to merge @a run_count runs by a key of
+ * @a parts (strings are compared binary, nil goes first).
+ *
+ * Return NULL at an error and set a diag.
+ */
+struct merge_offload *
+merge_offload_new(const struct merge_offload_part *parts,
+		  uint32_t part_count, bool reverse, uint32_t run_count);
+
+void
+merge_offload_delete(struct merge_offload *offload);
+
+/**
+ * Set entries of a run: @a count MsgPack arrays at @a data with
+ * sizes given by @a sizes. An empty run does not take part in
+ * a merge.
+ */
+void
+merge_offload_set_run(struct merge_offload *offload, uint32_t idx,
+		      const char *data, const uint32_t *sizes,
+		      uint32_t count);
+
+/**
+ * Get a number of entries of a run, which are merged since it
+ * was set or the last call, and a position after them. Return
+ * a number of entries that remain in the run in @a left.
+ */
+uint32_t
+merge_offload_take(struct merge_offload *offload, uint32_t idx,
+		   const char **pos, uint32_t *left);
+
+/**
+ * A size of entries of all runs, which are not merged yet.
+ */
+size_t
+merge_offload_bsize(const struct merge_offload *offload);
+
+/**
+ * Merge runs in a coio thread and write up to @a limit entries
+ * into @a out, which has room for merge_offload_bsize() bytes.
+ * The calling fiber yields meanwhile.
+ *
+ * Stop when a run ends: a caller should set its next entries
+ * or let it out and merge again. Stop when a key of a next entry
+ * does not match types of key parts and set @a is_mismatch: a
+ * caller should merge the rest in another way.
+ *
+ * Set @a count_ptr to a number of written entries and return a
+ * size of them. Return -1 at an error and set a diag.
+ */
+ssize_t
+merge_offload_merge(struct merge_offload *offload, char *out, uint32_t limit,
+		    uint32_t *count_ptr, bool *is_mismatch);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /* MERGER_OFFLOAD_H_INCLUDED */
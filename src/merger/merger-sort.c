@@ -0,0 +1,896 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <module.h>
+
+#include "compat/diag.h"
+
+#include "merger-source.h"
+
+/* {{{ Array source */
+
+/**
+ * A source of tuples from an array. It is used to give an
+ * in-memory sorted batch.
+ */
+struct merge_source_array {
+	struct merge_source base;
+	/* Refcounted tuples. */
+	box_tuple_t **tuples;
+	/* A number of tuples. */
+	uint32_t count;
+	/* An index of a next tuple. */
+	uint32_t next_idx;
+};
+
+/* Virtual methods declarations */
+
+static void
+merge_source_array_destroy(struct merge_source *base);
+static int
+merge_source_array_next(struct merge_source *base, box_tuple_format_t *format,
+			box_tuple_t **out);
+
+/* Non-virtual methods */
+
+/**
+ * Create a new source from an array of refcounted tuples.
+ *
+ * The source takes ownership of the array and the tuples.
+ *
+ * In case of an error it returns NULL and sets a diag.
+ */
+static struct merge_source *
+merge_source_array_new(box_tuple_t **tuples, uint32_t count)
+{
+	static struct merge_source_vtab merge_source_array_vtab = {
+		.destroy = merge_source_array_destroy,
+		.next = merge_source_array_next,
+	};
+
+	struct merge_source_array *source = malloc(
+		sizeof(struct merge_source_array));
+	if (source == NULL) {
+		diag_set_oom(sizeof(struct merge_source_array), "malloc",
+			     "merge_source_array");
+		return NULL;
+	}
+
+	merge_source_create(&source->base, &merge_source_array_vtab);
+	source->tuples = tuples;
+	source->count = count;
+	source->next_idx = 0;
+
+	return &source->base;
+}
+
+/* Virtual methods */
+
+static void
+merge_source_array_destroy(struct merge_source *base)
+{
+	struct merge_source_array *source = container_of(base,
+		struct merge_source_array, base);
+
+	for (uint32_t i = source->next_idx; i < source->count; ++i)
+		box_tuple_unref(source->tuples[i]);
+	free(source->tuples);
+	free(source);
+}
+
+static int
+merge_source_array_next(struct merge_source *base, box_tuple_format_t *format,
+			box_tuple_t **out)
+{
+	struct merge_source_array *source = container_of(base,
+		struct merge_source_array, base);
+
+	if (source->next_idx == source->count) {
+		*out = NULL;
+		return 0;
+	}
+	box_tuple_t *tuple = source->tuples[source->next_idx];
+	if (format != NULL && box_tuple_validate(tuple, format) != 0)
+		return -1;
+	/* Pass the reference to the caller. */
+	++source->next_idx;
+	*out = tuple;
+	return 0;
+}
+
+/* }}} */
+
+/* {{{ External sort */
+
+/* How many tuples are read between yields. */
+enum { MERGE_SORT_YIELD_STEP = 4096 };
+
+/**
+ * A state of an external sort process.
+ */
+struct merge_sort {
+	/* A key_def to compare tuples. */
+	struct key_def *key_def;
+	/* Sort parameters. */
+	const struct merge_sort_opts *opts;
+	/* Refcounted tuples of the current batch. */
+	box_tuple_t **tuples;
+	uint32_t tuple_count;
+	uint32_t tuple_capacity;
+	/* Accounted memory of the current batch. */
+	size_t batch_size;
+	/* Sources of sorted runs. */
+	struct merge_source **runs;
+	/*
+	 * How many times tuples of each run were merged. A run
+	 * of level N + 1 is written when fan_in runs of level N
+	 * are collected, so levels do not grow along the array.
+	 */
+	uint32_t *run_levels;
+	uint32_t run_count;
+	uint32_t run_capacity;
+};
+
+/**
+ * Sort tuples using bottom-up merge sort.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_sort_tuples(box_tuple_t **tuples, uint32_t count,
+		  struct key_def *key_def)
+{
+	if (count < 2)
+		return 0;
+	size_t tmp_size = sizeof(box_tuple_t *) * count;
+	box_tuple_t **tmp = malloc(tmp_size);
+	if (tmp == NULL) {
+		diag_set_oom(tmp_size, "malloc", "sort buffer");
+		return -1;
+	}
+
+	box_tuple_t **src = tuples;
+	box_tuple_t **dst = tmp;
+	for (size_t width = 1; width < count; width *= 2) {
+		for (size_t lo = 0; lo < count; lo += 2 * width) {
+			size_t mid = lo + width < count ? lo + width : count;
+			size_t hi = lo + 2 * width < count ?
+				lo + 2 * width : count;
+			size_t i = lo;
+			size_t j = mid;
+			size_t k = lo;
+			while (i < mid && j < hi) {
+				if (box_tuple_compare(src[j], src[i],
+						      key_def) < 0)
+					dst[k++] = src[j++];
+				else
+					dst[k++] = src[i++];
+			}
+			while (i < mid)
+				dst[k++] = src[i++];
+			while (j < hi)
+				dst[k++] = src[j++];
+		}
+		box_tuple_t **t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != tuples)
+		memcpy(tuples, src, tmp_size);
+	free(tmp);
+	return 0;
+}
+
+/**
+ * Add a source of a sorted run.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_sort_add_run(struct merge_sort *sort, struct merge_source *run,
+		   uint32_t level)
+{
+	if (sort->run_count == sort->run_capacity) {
+		uint32_t capacity = sort->run_capacity > 0 ?
+			sort->run_capacity * 2 : 8;
+		size_t size = sizeof(struct merge_source *) * capacity;
+		struct merge_source **runs = realloc(sort->runs, size);
+		if (runs == NULL) {
+			diag_set_oom(size, "realloc", "sort runs");
+			return -1;
+		}
+		sort->runs = runs;
+		size = sizeof(uint32_t) * capacity;
+		uint32_t *run_levels = realloc(sort->run_levels, size);
+		if (run_levels == NULL) {
+			diag_set_oom(size, "realloc", "sort runs");
+			return -1;
+		}
+		sort->run_levels = run_levels;
+		sort->run_capacity = capacity;
+	}
+	sort->runs[sort->run_count] = run;
+	sort->run_levels[sort->run_count] = level;
+	++sort->run_count;
+	return 0;
+}
+
+/**
+ * Sort the current batch and create a source from it.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+static struct merge_source *
+merge_sort_flush_batch(struct merge_sort *sort)
+{
+	if (merge_sort_tuples(sort->tuples, sort->tuple_count,
+			      sort->key_def) != 0)
+		return NULL;
+	struct merge_source *source = merge_source_array_new(sort->tuples,
+							     sort->tuple_count);
+	if (source == NULL)
+		return NULL;
+	/* The source owns the tuples now. */
+	sort->tuples = NULL;
+	sort->tuple_count = 0;
+	sort->tuple_capacity = 0;
+	sort->batch_size = 0;
+	return source;
+}
+
+static ssize_t
+merge_run_create_f(va_list ap)
+{
+	char *path = va_arg(ap, char *);
+	int *saved_errno = va_arg(ap, int *);
+	int fd = mkstemp(path);
+	*saved_errno = fd < 0 ? errno : 0;
+	if (fd >= 0)
+		close(fd);
+	return 0;
+}
+
+/**
+ * Write tuples of a sorted source to a run file and create a
+ * source of the run. The file is written from a coio thread.
+ *
+ * The function takes the source reference in any case.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+static struct merge_source *
+merge_run_spill(struct merge_source *source, struct key_def *key_def,
+		const char *tmpdir)
+{
+	size_t path_size = strlen(tmpdir) +
+		sizeof("/tuple-merger-sort-XXXXXX");
+	char *path = malloc(path_size);
+	if (path == NULL) {
+		merge_source_unref(source);
+		diag_set_oom(path_size, "malloc", "run path");
+		return NULL;
+	}
+	snprintf(path, path_size, "%s/tuple-merger-sort-XXXXXX", tmpdir);
+	int saved_errno = 0;
+	if (coio_call(merge_run_create_f, path, &saved_errno) == -1 ||
+	    saved_errno != 0) {
+		diag_set_system("Can't create a run file in '%s': %s",
+				tmpdir, strerror(saved_errno));
+		merge_source_unref(source);
+		free(path);
+		return NULL;
+	}
+
+	int rc = merge_source_write_file(source, path, 0, NULL);
+	merge_source_unref(source);
+	struct merge_source *run = NULL;
+	if (rc == 0) {
+		struct merge_source_file_opts file_opts = {
+			.index_path = NULL,
+			.key = NULL,
+			.iterator = ITER_GE,
+		};
+		run = merge_source_file_new(path, key_def, &file_opts);
+	}
+	/* The mapping keeps data of the unlinked file. */
+	unlink(path);
+	free(path);
+	return run;
+}
+
+/**
+ * Merge the last @a count runs into one run file.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_sort_merge_runs(struct merge_sort *sort, uint32_t count)
+{
+	assert(count >= 2 && count <= sort->run_count);
+	uint32_t first = sort->run_count - count;
+	uint32_t level = 0;
+	for (uint32_t i = first; i < sort->run_count; ++i) {
+		if (sort->run_levels[i] > level)
+			level = sort->run_levels[i];
+	}
+	struct merge_source *merger = merger_new(sort->key_def,
+						 &sort->runs[first], count,
+						 false);
+	if (merger == NULL)
+		return -1;
+	/* The merger holds the runs now. */
+	for (uint32_t i = first; i < sort->run_count; ++i)
+		merge_source_unref(sort->runs[i]);
+	sort->run_count = first;
+	struct merge_source *run = merge_run_spill(merger, sort->key_def,
+						   sort->opts->tmpdir);
+	if (run == NULL)
+		return -1;
+	/* There is room: the merged runs were there. */
+	return merge_sort_add_run(sort, run, level + 1);
+}
+
+/**
+ * Sort the current batch and write it to a run file. Merge the
+ * last fan_in runs when they are of the same level.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_sort_spill(struct merge_sort *sort)
+{
+	struct merge_source *batch = merge_sort_flush_batch(sort);
+	if (batch == NULL)
+		return -1;
+	struct merge_source *run = merge_run_spill(batch, sort->key_def,
+						   sort->opts->tmpdir);
+	if (run == NULL)
+		return -1;
+	if (merge_sort_add_run(sort, run, 0) != 0) {
+		merge_source_unref(run);
+		return -1;
+	}
+	uint32_t fan_in = sort->opts->fan_in;
+	while (sort->run_count >= fan_in &&
+	       sort->run_levels[sort->run_count - fan_in] ==
+	       sort->run_levels[sort->run_count - 1]) {
+		if (merge_sort_merge_runs(sort, fan_in) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Yield to let other fibers work while a sort reads its input.
+ *
+ * Return 0 at success. Return -1 and set a diag if the fiber is
+ * cancelled.
+ */
+static int
+merge_sort_yield(void)
+{
+	fiber_sleep(0);
+	if (fiber_is_cancelled()) {
+		diag_set_system("fiber is cancelled");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Add a tuple to the current batch. Spill the batch if it
+ * exceeds the memory limit.
+ *
+ * The function takes the tuple reference in any case.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_sort_add_tuple(struct merge_sort *sort, box_tuple_t *tuple)
+{
+	if (sort->tuple_count == sort->tuple_capacity) {
+		uint32_t capacity = sort->tuple_capacity > 0 ?
+			sort->tuple_capacity * 2 : 1024;
+		size_t size = sizeof(box_tuple_t *) * capacity;
+		box_tuple_t **tuples = realloc(sort->tuples, size);
+		if (tuples == NULL) {
+			box_tuple_unref(tuple);
+			diag_set_oom(size, "realloc", "sort batch");
+			return -1;
+		}
+		sort->tuples = tuples;
+		sort->tuple_capacity = capacity;
+	}
+	sort->tuples[sort->tuple_count++] = tuple;
+	/* Account the tuple and its slots in the sort buffers. */
+	sort->batch_size += box_tuple_bsize(tuple) + 2 * sizeof(box_tuple_t *);
+	if (sort->batch_size >= sort->opts->memory_limit)
+		return merge_sort_spill(sort);
+	return 0;
+}
+
+/**
+ * Free all resources of a sort process.
+ */
+static void
+merge_sort_destroy(struct merge_sort *sort)
+{
+	for (uint32_t i = 0; i < sort->tuple_count; ++i)
+		box_tuple_unref(sort->tuples[i]);
+	free(sort->tuples);
+	for (uint32_t i = 0; i < sort->run_count; ++i)
+		merge_source_unref(sort->runs[i]);
+	free(sort->runs);
+	free(sort->run_levels);
+}
+
+struct merge_source *
+merge_sort(struct merge_source *source, struct key_def *key_def,
+	   const struct merge_sort_opts *opts)
+{
+	/* Acquire tuples in a format that is fast to compare. */
+	box_tuple_format_t *format = box_tuple_format_new(&key_def, 1);
+	if (format == NULL)
+		return NULL;
+
+	struct merge_sort sort = {
+		.key_def = key_def,
+		.opts = opts,
+		.tuples = NULL,
+		.tuple_count = 0,
+		.tuple_capacity = 0,
+		.batch_size = 0,
+		.runs = NULL,
+		.run_levels = NULL,
+		.run_count = 0,
+		.run_capacity = 0,
+	};
+
+	box_tuple_t *tuple;
+	uint64_t count = 0;
+	int rc;
+	while ((rc = merge_source_next(source, format, &tuple)) == 0 &&
+	       tuple != NULL) {
+		if ((rc = merge_sort_add_tuple(&sort, tuple)) != 0)
+			break;
+		if (++count % MERGE_SORT_YIELD_STEP == 0 &&
+		    (rc = merge_sort_yield()) != 0)
+			break;
+	}
+	box_tuple_format_unref(format);
+	if (rc != 0)
+		goto error;
+
+	/* Everything fits into memory: don't merge. */
+	struct merge_source *batch = merge_sort_flush_batch(&sort);
+	if (batch == NULL)
+		goto error;
+	if (sort.run_count == 0) {
+		merge_sort_destroy(&sort);
+		return batch;
+	}
+
+	/*
+	 * Merge runs into files until at most fan_in sources are
+	 * left for the final merge with the last batch.
+	 */
+	while (sort.run_count >= opts->fan_in) {
+		uint32_t count = sort.run_count - opts->fan_in + 2;
+		if (count > opts->fan_in)
+			count = opts->fan_in;
+		if (merge_sort_merge_runs(&sort, count) != 0) {
+			merge_source_unref(batch);
+			goto error;
+		}
+	}
+
+	/* Merge the runs and the last batch. */
+	if (merge_sort_add_run(&sort, batch, 0) != 0) {
+		merge_source_unref(batch);
+		goto error;
+	}
+	struct merge_source *merger = merger_new(key_def, sort.runs,
+						 sort.run_count, false);
+	/* The merger holds references to the runs. */
+	merge_sort_destroy(&sort);
+	return merger;
+
+error:
+	merge_sort_destroy(&sort);
+	return NULL;
+}
+
+/* }}} */
+
+/* {{{ Cascaded merge */
+
+/**
+ * Sources (or runs) of one level of a cascade.
+ */
+struct merge_cascade_level {
+	struct merge_source **sources;
+	/* Bytes of in-memory runs, zero for other sources. */
+	size_t *sizes;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+/**
+ * A merger over many sources, which merges at most fan_in
+ * sources at once.
+ *
+ * Sources are not touched until a first tuple is requested.
+ * Then they are merged by groups of fan_in into intermediate
+ * runs, the runs are merged the same way and so on until at
+ * most fan_in runs remain. The last ones are merged by a usual
+ * merger.
+ *
+ * A run is kept in memory while all in-memory runs fit into
+ * memory_limit. Otherwise the collected part of the run and the
+ * rest of the group are written to files.
+ */
+struct merge_cascade {
+	struct merge_source base;
+	/* A key_def to compare tuples. */
+	struct key_def *key_def;
+	/* A format of tuples of in-memory runs. */
+	box_tuple_format_t *format;
+	bool reverse;
+	uint32_t fan_in;
+	size_t memory_limit;
+	/* A directory for runs. */
+	char *tmpdir;
+	/* Sources of the current level. */
+	struct merge_cascade_level level;
+	/* Bytes of all in-memory runs. */
+	size_t buffered;
+	/* A merger of the last level or NULL if not built yet. */
+	struct merge_source *merger;
+};
+
+/**
+ * Add a source to a level. The level takes the reference.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_cascade_level_add(struct merge_cascade_level *level,
+			struct merge_source *source, size_t size)
+{
+	if (level->count == level->capacity) {
+		uint32_t capacity = level->capacity > 0 ?
+			level->capacity * 2 : 8;
+		struct merge_source **sources = realloc(level->sources,
+			sizeof(struct merge_source *) * capacity);
+		if (sources == NULL) {
+			diag_set_oom(sizeof(struct merge_source *) * capacity,
+				     "realloc", "cascade sources");
+			return -1;
+		}
+		level->sources = sources;
+		size_t *sizes = realloc(level->sizes,
+					sizeof(size_t) * capacity);
+		if (sizes == NULL) {
+			diag_set_oom(sizeof(size_t) * capacity, "realloc",
+				     "cascade sources");
+			return -1;
+		}
+		level->sizes = sizes;
+		level->capacity = capacity;
+	}
+	level->sources[level->count] = source;
+	level->sizes[level->count] = size;
+	++level->count;
+	return 0;
+}
+
+static void
+merge_cascade_level_destroy(struct merge_cascade_level *level)
+{
+	for (uint32_t i = 0; i < level->count; ++i) {
+		if (level->sources[i] != NULL)
+			merge_source_unref(level->sources[i]);
+	}
+	free(level->sources);
+	free(level->sizes);
+	memset(level, 0, sizeof(*level));
+}
+
+/**
+ * Create an in-memory run or write it to a file and add it to
+ * @a next.
+ *
+ * The function takes ownership of the tuples in any case.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_cascade_add_run(struct merge_cascade *cascade,
+		      struct merge_cascade_level *next, box_tuple_t **tuples,
+		      uint32_t count, size_t size, bool spill)
+{
+	struct merge_source *run = merge_source_array_new(tuples, count);
+	if (run == NULL) {
+		for (uint32_t i = 0; i < count; ++i)
+			box_tuple_unref(tuples[i]);
+		free(tuples);
+		return -1;
+	}
+	if (spill) {
+		run = merge_run_spill(run, cascade->key_def, cascade->tmpdir);
+		if (run == NULL)
+			return -1;
+		size = 0;
+	}
+	if (merge_cascade_level_add(next, run, size) != 0) {
+		merge_source_unref(run);
+		return -1;
+	}
+	cascade->buffered += size;
+	return 0;
+}
+
+/**
+ * Merge sources [first, first + count) of the current level into
+ * runs of the next level.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_cascade_merge_group(struct merge_cascade *cascade, uint32_t first,
+			  uint32_t count, struct merge_cascade_level *next)
+{
+	struct merge_cascade_level *level = &cascade->level;
+	if (count == 1) {
+		/* Move the source to the next level as is. */
+		if (merge_cascade_level_add(next, level->sources[first],
+					    level->sizes[first]) != 0)
+			return -1;
+		level->sources[first] = NULL;
+		return 0;
+	}
+
+	struct merge_source *merger = merger_new(cascade->key_def,
+		&level->sources[first], count, cascade->reverse);
+	if (merger == NULL)
+		return -1;
+	/* The merger holds the sources now. */
+	size_t group_size = 0;
+	for (uint32_t i = first; i < first + count; ++i) {
+		merge_source_unref(level->sources[i]);
+		level->sources[i] = NULL;
+		group_size += level->sizes[i];
+	}
+
+	box_tuple_t **tuples = NULL;
+	uint32_t tuple_count = 0;
+	uint32_t capacity = 0;
+	size_t run_size = 0;
+	box_tuple_t *tuple;
+	int rc;
+	while ((rc = merge_source_next(merger, cascade->format,
+				       &tuple)) == 0 && tuple != NULL) {
+		if (tuple_count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 1024;
+			size_t size = sizeof(box_tuple_t *) * capacity;
+			box_tuple_t **new_tuples = realloc(tuples, size);
+			if (new_tuples == NULL) {
+				box_tuple_unref(tuple);
+				diag_set_oom(size, "realloc", "cascade run");
+				rc = -1;
+				break;
+			}
+			tuples = new_tuples;
+		}
+		tuples[tuple_count++] = tuple;
+		run_size += box_tuple_bsize(tuple) + sizeof(box_tuple_t *);
+		if (cascade->buffered + run_size <= cascade->memory_limit)
+			continue;
+		/*
+		 * Write the collected part to a file and stream
+		 * the rest of the group into another one.
+		 */
+		rc = merge_cascade_add_run(cascade, next, tuples,
+					   tuple_count, run_size, true);
+		tuples = NULL;
+		tuple_count = 0;
+		run_size = 0;
+		if (rc != 0)
+			break;
+		merge_source_ref(merger);
+		struct merge_source *rest = merge_run_spill(merger,
+			cascade->key_def, cascade->tmpdir);
+		if (rest == NULL ||
+		    merge_cascade_level_add(next, rest, 0) != 0) {
+			if (rest != NULL)
+				merge_source_unref(rest);
+			rc = -1;
+		}
+		break;
+	}
+	merge_source_unref(merger);
+	/* In-memory runs of the group are freed now. */
+	cascade->buffered -= group_size;
+
+	if (rc != 0) {
+		for (uint32_t i = 0; i < tuple_count; ++i)
+			box_tuple_unref(tuples[i]);
+		free(tuples);
+		return -1;
+	}
+	if (tuple_count == 0) {
+		free(tuples);
+		return 0;
+	}
+	return merge_cascade_add_run(cascade, next, tuples, tuple_count,
+				     run_size, false);
+}
+
+/**
+ * Merge sources level by level until at most fan_in runs remain
+ * and create a merger of them.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merge_cascade_build(struct merge_cascade *cascade)
+{
+	struct merge_cascade_level *level = &cascade->level;
+	while (level->count > cascade->fan_in) {
+		struct merge_cascade_level next;
+		memset(&next, 0, sizeof(next));
+		for (uint32_t i = 0; i < level->count; i += cascade->fan_in) {
+			uint32_t count = level->count - i < cascade->fan_in ?
+				level->count - i : cascade->fan_in;
+			if (merge_cascade_merge_group(cascade, i, count,
+						      &next) != 0) {
+				merge_cascade_level_destroy(&next);
+				return -1;
+			}
+		}
+		merge_cascade_level_destroy(level);
+		*level = next;
+	}
+	cascade->merger = merger_new(cascade->key_def, level->sources,
+				     level->count, cascade->reverse);
+	if (cascade->merger == NULL)
+		return -1;
+	/* The merger holds the runs now. */
+	merge_cascade_level_destroy(level);
+	return 0;
+}
+
+/* Virtual methods */
+
+static void
+merge_cascade_destroy(struct merge_source *base)
+{
+	struct merge_cascade *cascade = container_of(base,
+		struct merge_cascade, base);
+	if (cascade->merger != NULL)
+		merge_source_unref(cascade->merger);
+	merge_cascade_level_destroy(&cascade->level);
+	box_tuple_format_unref(cascade->format);
+	box_key_def_delete(cascade->key_def);
+	free(cascade->tmpdir);
+	free(cascade);
+}
+
+static int
+merge_cascade_next(struct merge_source *base, box_tuple_format_t *format,
+		   box_tuple_t **out)
+{
+	struct merge_cascade *cascade = container_of(base,
+		struct merge_cascade, base);
+	if (cascade->merger == NULL && merge_cascade_build(cascade) != 0)
+		return -1;
+	return merge_source_next(cascade->merger, format, out);
+}
+
+static int
+merge_cascade_copy_raw(struct merge_source *base, box_ibuf_t *ibuf,
+		       uint32_t limit, uint32_t *count_ptr)
+{
+	struct merge_cascade *cascade = container_of(base,
+		struct merge_cascade, base);
+	*count_ptr = 0;
+	if (cascade->merger == NULL && merge_cascade_build(cascade) != 0)
+		return -1;
+	return merge_source_copy_raw(cascade->merger, ibuf, limit,
+				     count_ptr);
+}
+
+/* Non-virtual methods */
+
+struct merge_source *
+merge_cascade_new(struct key_def *key_def, struct merge_source **sources,
+		  uint32_t source_count, bool reverse,
+		  const struct merge_cascade_opts *opts)
+{
+	static struct merge_source_vtab merge_cascade_vtab = {
+		.destroy = merge_cascade_destroy,
+		.next = merge_cascade_next,
+		.copy_raw = merge_cascade_copy_raw,
+	};
+
+	assert(opts->fan_in >= 2);
+	struct merge_cascade *cascade = calloc(1, sizeof(*cascade));
+	if (cascade == NULL) {
+		diag_set_oom(sizeof(*cascade), "calloc", "merge_cascade");
+		return NULL;
+	}
+	merge_source_create(&cascade->base, &merge_cascade_vtab);
+	cascade->reverse = reverse;
+	cascade->fan_in = opts->fan_in;
+	cascade->memory_limit = opts->memory_limit;
+
+	/* The key_def may be collected by LuaJIT GC before use. */
+	cascade->key_def = box_key_def_dup(key_def);
+	if (cascade->key_def == NULL)
+		goto error;
+	cascade->format = box_tuple_format_new(&cascade->key_def, 1);
+	if (cascade->format == NULL)
+		goto error;
+	cascade->tmpdir = strdup(opts->tmpdir);
+	if (cascade->tmpdir == NULL) {
+		diag_set_oom(strlen(opts->tmpdir) + 1, "strdup", "tmpdir");
+		goto error;
+	}
+	for (uint32_t i = 0; i < source_count; ++i) {
+		if (merge_cascade_level_add(&cascade->level, sources[i],
+					    0) != 0)
+			goto error;
+		merge_source_ref(sources[i]);
+	}
+	return &cascade->base;
+
+error:
+	merge_cascade_level_destroy(&cascade->level);
+	if (cascade->format != NULL)
+		box_tuple_format_unref(cascade->format);
+	if (cascade->key_def != NULL)
+		box_key_def_delete(cascade->key_def);
+	free(cascade->tmpdir);
+	free(cascade);
+	return NULL;
+}
+
+/* }}} */
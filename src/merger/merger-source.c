@@ -34,14 +34,19 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <lauxlib.h>
 #include <module.h>
+#include <msgpuck/msgpuck.h>
 
 #include "compat/diag.h"
 #define HEAP_FORWARD_DECLARATION
 #include "compat/heap.h"
 
+#include "merger-collation.h"
+#include "merger-filter.h"
+#include "merger-offload.h"
 #include "merger-source.h"
 
 /* {{{ Merger */
@@ -61,11 +66,20 @@
 struct merger_heap_node {
 	/* A source of tuples. */
 	struct merge_source *source;
+	/* A last fetched (refcounted) tuple to compare. */
+	box_tuple_t *tuple;
 	/*
-	 * A last fetched (refcounted) tuple to compare against
-	 * other nodes.
+	 * A (refcounted) key of the last fetched tuple, which is
+	 * compared instead of the tuple by a keyed merger.
 	 */
-	box_tuple_t *tuple;
+	box_tuple_t *key;
+	/*
+	 * A sort key of the last fetched tuple, which is compared
+	 * when merger->sort_key_def is set.
+	 */
+	char *sort_key;
+	size_t sort_key_size;
+	size_t sort_key_capacity;
 	/* An anchor to make the structure a merger heap node. */
 	struct heap_node in_merger;
 };
@@ -83,6 +97,20 @@ merge_source_less(const heap_t *heap, const struct merger_heap_node *left,
 #undef heap_value_t
 #undef heap_value_attr
 
+/**
+ * A type of all sources of a merger. next() of such sources is
+ * called directly rather than via the vtab (see
+ * merger_heap_node_fetch()).
+ */
+enum merger_source_type {
+	/* Sources of different types: call them via the vtab. */
+	MERGER_SOURCE_ANY,
+	/* Buffer sources. */
+	MERGER_SOURCE_BUFFER,
+	/* Non-keyed mergers. */
+	MERGER_SOURCE_MERGER,
+};
+
 /**
  * Holds a heap, parameters of a merge process and utility fields.
  */
@@ -96,8 +124,20 @@ struct merger {
 	 * first output tuple is acquired.
 	 */
 	bool started;
-	/* A key_def to compare tuples. */
+	/* A type of all sources, which is known at start. */
+	enum merger_source_type source_type;
+	/* A key_def to compare tuples (or keys). */
 	struct key_def *key_def;
+	/*
+	 * Whether sources give keys along with tuples and the
+	 * merger compares the keys.
+	 */
+	bool keyed;
+	/*
+	 * A definition to build sort keys or NULL if tuples are
+	 * compared using the key_def.
+	 */
+	struct merge_sort_key_def *sort_key_def;
 	/* A format to acquire compatible tuples from sources. */
 	box_tuple_format_t *format;
 	/*
@@ -110,8 +150,88 @@ struct merger {
 	struct merger_heap_node *nodes;
 	/* Ascending (false) / descending (true) order. */
 	bool reverse;
+	/*
+	 * A plan the merger is bound from or NULL. The key_def
+	 * and the format are owned by the plan then.
+	 */
+	struct merge_plan *plan;
+	/* A next merger in the plan's pool. */
+	struct merger *next_free;
+	/*
+	 * Zero based field numbers of key parts to encode a
+	 * position (see merger_set_key_fields()) or NULL.
+	 */
+	uint32_t *key_fields;
+	uint32_t key_field_count;
+	/*
+	 * A position to resume a merge from (see
+	 * merger_set_position()): a key or NULL and how many
+	 * tuples equal to the key should be skipped.
+	 */
+	char *after_key;
+	size_t after_key_size;
+	uint32_t after_ties;
+	/* How many tuples equal to after_key are skipped. */
+	uint32_t skipped_ties;
+	/* Whether tuples before the position are skipped. */
+	bool is_positioned;
+	/* Whether merger_track_position() is called. */
+	bool track_position;
+	/*
+	 * The last given tuple (a key for a keyed merger) and
+	 * how many given tuples are equal to it, counting ones
+	 * given before the resumed position.
+	 */
+	box_tuple_t *last;
+	uint32_t last_ties;
+	/*
+	 * A filter of tuples (see merger_set_filter()) or NULL.
+	 * Rejected tuples don't get into the heap.
+	 */
+	struct merge_filter *filter;
+	/*
+	 * Key parts to merge sources in a coio thread (see
+	 * merger_set_offload_parts()) or NULL.
+	 */
+	struct merge_offload_part *offload_parts;
+	uint32_t offload_part_count;
+	/*
+	 * A node, whose tuple is copied by merger_copy_raw(), or
+	 * NULL. The node gets a next tuple from its source on a
+	 * next call.
+	 */
+	struct merger_heap_node *pending;
+};
+
+/**
+ * A prepared merge: parameters and a pool of released mergers
+ * to bind sources to.
+ */
+struct merge_plan {
+	int refs;
+	struct key_def *key_def;
+	box_tuple_format_t *format;
+	bool reverse;
+	bool keyed;
+	/* A capacity of nodes arrays of mergers. */
+	uint32_t max_sources;
+	/*
+	 * Key parts shared by bound mergers (see
+	 * merge_plan_set_key_fields() and others) or NULLs.
+	 */
+	uint32_t *key_fields;
+	uint32_t key_field_count;
+	struct merge_sort_key_def *sort_key_def;
+	struct merge_offload_part *offload_parts;
+	uint32_t offload_part_count;
+	/* Released mergers ready to be bound again. */
+	struct merger *free_list;
+	uint32_t free_count;
 };
 
+/* How many released mergers a plan keeps. */
+enum { MERGE_PLAN_POOL_MAX = 64 };
+
 /* Helpers */
 
 /**
@@ -124,7 +244,18 @@ merge_source_less(const heap_t *heap, const struct merger_heap_node *left,
 	assert(left->tuple != NULL);
 	assert(right->tuple != NULL);
 	struct merger *merger = container_of(heap, struct merger, heap);
-	int cmp = box_tuple_compare(left->tuple, right->tuple, merger->key_def);
+	if (merger->sort_key_def != NULL) {
+		size_t size = left->sort_key_size < right->sort_key_size ?
+			left->sort_key_size : right->sort_key_size;
+		int cmp = memcmp(left->sort_key, right->sort_key, size);
+		if (cmp == 0)
+			cmp = (left->sort_key_size > right->sort_key_size) -
+			      (left->sort_key_size < right->sort_key_size);
+		return merger->reverse ? cmp >= 0 : cmp < 0;
+	}
+	int cmp = merger->keyed ?
+		box_tuple_compare(left->key, right->key, merger->key_def) :
+		box_tuple_compare(left->tuple, right->tuple, merger->key_def);
 	return merger->reverse ? cmp >= 0 : cmp < 0;
 }
 
@@ -138,18 +269,140 @@ merger_heap_node_create(struct merger_heap_node *node,
 	node->source = source;
 	merge_source_ref(node->source);
 	node->tuple = NULL;
+	node->key = NULL;
+	node->sort_key = NULL;
+	node->sort_key_size = 0;
+	node->sort_key_capacity = 0;
 	heap_node_create(&node->in_merger);
 }
 
+/**
+ * Drop a last fetched tuple and its key of a heap node.
+ */
+static void
+merger_heap_node_release(struct merger_heap_node *node)
+{
+	if (node->tuple != NULL)
+		box_tuple_unref(node->tuple);
+	if (node->key != NULL)
+		box_tuple_unref(node->key);
+	node->tuple = NULL;
+	node->key = NULL;
+}
+
 /**
  * Free a merger heap node.
  */
 static void
 merger_heap_node_delete(struct merger_heap_node *node)
 {
+	merger_heap_node_release(node);
 	merge_source_unref(node->source);
-	if (node->tuple != NULL)
-		box_tuple_unref(node->tuple);
+	free(node->sort_key);
+}
+
+/* Declared here to be called directly for nested mergers. */
+static int
+merger_next(struct merge_source *base, box_tuple_format_t *format,
+	    box_tuple_t **out);
+
+/**
+ * Find out whether all sources of a merger have the same type,
+ * which next() may be called directly.
+ */
+static enum merger_source_type
+merger_source_type(struct merger *merger)
+{
+	if (merger->node_count == 0)
+		return MERGER_SOURCE_ANY;
+	const struct merge_source_vtab *vtab = merger->nodes[0].source->vtab;
+	for (uint32_t i = 1; i < merger->node_count; ++i) {
+		if (merger->nodes[i].source->vtab != vtab)
+			return MERGER_SOURCE_ANY;
+	}
+	if (vtab->next == luaL_merge_source_buffer_next)
+		return MERGER_SOURCE_BUFFER;
+	if (!merger->keyed && vtab->next == merger_next)
+		return MERGER_SOURCE_MERGER;
+	return MERGER_SOURCE_ANY;
+}
+
+/**
+ * Get a next tuple (and a key for a keyed merger) of a node's
+ * source. Known sources are called directly, so the merge loop
+ * gets no indirect call per tuple.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static inline int
+merger_heap_node_fetch(struct merger *merger, struct merger_heap_node *node)
+{
+	switch (merger->source_type) {
+	case MERGER_SOURCE_BUFFER:
+		if (merger->keyed)
+			return luaL_merge_source_buffer_next_keyed(
+				node->source, merger->format, &node->key,
+				&node->tuple);
+		return luaL_merge_source_buffer_next(node->source,
+						     merger->format,
+						     &node->tuple);
+	case MERGER_SOURCE_MERGER:
+		return merger_next(node->source, merger->format,
+				   &node->tuple);
+	default:
+		if (merger->keyed)
+			return merge_source_next_keyed(node->source,
+						       merger->format,
+						       &node->key,
+						       &node->tuple);
+		return merge_source_next(node->source, merger->format,
+					 &node->tuple);
+	}
+}
+
+/**
+ * Acquire a next tuple (and a key for a keyed merger) from a
+ * node's source.
+ *
+ * An old node->tuple and node->key are overwritten: a caller is
+ * responsible for them.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merger_heap_node_next(struct merger *merger, struct merger_heap_node *node)
+{
+	int rc;
+	while (true) {
+		rc = merger_heap_node_fetch(merger, node);
+		if (rc != 0) {
+			node->tuple = NULL;
+			node->key = NULL;
+			break;
+		}
+		if (node->tuple == NULL || merger->filter == NULL ||
+		    merge_filter_match(merger->filter, node->tuple))
+			break;
+		merger_heap_node_release(node);
+	}
+	if (rc != 0 || node->tuple == NULL || merger->sort_key_def == NULL)
+		return rc;
+
+	ssize_t size = merge_sort_key_build(merger->sort_key_def,
+		merger->keyed ? node->key : node->tuple, merger->keyed,
+		&node->sort_key, &node->sort_key_capacity);
+	if (size < 0) {
+		/*
+		 * Compare tuples from now on. It gives the same
+		 * order, so the heap remains valid.
+		 */
+		if (merger->plan == NULL)
+			merge_sort_key_def_delete(merger->sort_key_def);
+		merger->sort_key_def = NULL;
+		return 0;
+	}
+	node->sort_key_size = size;
+	return 0;
 }
 
 /**
@@ -163,19 +416,14 @@ merger_heap_node_delete(struct merger_heap_node *node)
 static int
 merger_add_heap_node(struct merger *merger, struct merger_heap_node *node)
 {
-	box_tuple_t *tuple = NULL;
-
 	/* Acquire a next tuple. */
-	struct merge_source *source = node->source;
-	if (merge_source_next(source, merger->format, &tuple) != 0)
+	if (merger_heap_node_next(merger, node) != 0)
 		return -1;
 
 	/* Don't add an empty source to a heap. */
-	if (tuple == NULL)
+	if (node->tuple == NULL)
 		return 0;
 
-	node->tuple = tuple;
-
 	/* Add a node to a heap. */
 	if (merger_heap_insert(&merger->heap, node) != 0) {
 		diag_set_oom(0, "malloc", "merger->heap");
@@ -185,13 +433,91 @@ merger_add_heap_node(struct merger *merger, struct merger_heap_node *node)
 	return 0;
 }
 
+/**
+ * Initialize position related fields of a merger.
+ */
+static void
+merger_position_create(struct merger *merger)
+{
+	merger->after_key = NULL;
+	merger->after_key_size = 0;
+	merger->after_ties = 0;
+	merger->skipped_ties = 0;
+	merger->is_positioned = true;
+	merger->track_position = false;
+	merger->last = NULL;
+	merger->last_ties = 0;
+}
+
+/**
+ * Free position related fields of a merger.
+ */
+static void
+merger_position_destroy(struct merger *merger)
+{
+	free(merger->after_key);
+	if (merger->last != NULL)
+		box_tuple_unref(merger->last);
+	merger_position_create(merger);
+}
+
+/**
+ * Whether a tuple (a key for a keyed merger) goes before the
+ * position set by merger_set_position() and should be skipped.
+ */
+static bool
+merger_position_skip(struct merger *merger, box_tuple_t *item)
+{
+	int cmp = box_tuple_compare_with_key(item, merger->after_key,
+					     merger->key_def);
+	if (merger->reverse)
+		cmp = -cmp;
+	if (cmp < 0)
+		return true;
+	if (cmp == 0 && merger->skipped_ties < merger->after_ties) {
+		++merger->skipped_ties;
+		return true;
+	}
+	merger->is_positioned = true;
+	return false;
+}
+
+/**
+ * Remember a given tuple (a key for a keyed merger) as the last
+ * one and count tuples equal to it.
+ */
+static void
+merger_position_track(struct merger *merger, box_tuple_t *item)
+{
+	bool is_tie;
+	if (merger->last != NULL)
+		is_tie = box_tuple_compare(merger->last, item,
+					   merger->key_def) == 0;
+	else if (merger->after_key != NULL)
+		is_tie = box_tuple_compare_with_key(item, merger->after_key,
+						    merger->key_def) == 0;
+	else
+		is_tie = false;
+	merger->last_ties = is_tie ? merger->last_ties + 1 : 1;
+	box_tuple_ref(item);
+	if (merger->last != NULL)
+		box_tuple_unref(merger->last);
+	merger->last = item;
+}
+
+static void
+merge_plan_release(struct merge_plan *plan, struct merger *merger);
+
 /* Virtual methods declarations */
 
 static void
 merger_delete(struct merge_source *base);
 static int
-merger_next(struct merge_source *base, box_tuple_format_t *format,
-	    box_tuple_t **out);
+merger_next_keyed(struct merge_source *base, box_tuple_format_t *key_format,
+		  box_tuple_t **key, box_tuple_t **out);
+static int
+merger_copy_raw(struct merge_source *base, box_ibuf_t *buf, uint32_t limit,
+		uint32_t *count_ptr);
 
 /* Non-virtual methods */
 
@@ -223,14 +549,34 @@ merger_set_sources(struct merger *merger, struct merge_source **sources,
 }
 
 
-struct merge_source *
-merger_new(struct key_def *key_def, struct merge_source **sources,
-	   uint32_t source_count, bool reverse)
+/**
+ * Create a new merger.
+ *
+ * It is the helper for merger_new() and merger_new_keyed().
+ */
+static struct merge_source *
+merger_new_impl(struct key_def *key_def, struct merge_source **sources,
+		uint32_t source_count, bool reverse, bool keyed)
 {
 	static struct merge_source_vtab merger_vtab = {
 		.destroy = merger_delete,
 		.next = merger_next,
+		.copy_raw = merger_copy_raw,
 	};
+	static struct merge_source_vtab merger_keyed_vtab = {
+		.destroy = merger_delete,
+		.next = merger_next,
+		.next_keyed = merger_next_keyed,
+		.copy_raw = merger_copy_raw,
+	};
+
+	for (uint32_t i = 0; keyed && i < source_count; ++i) {
+		if (sources[i]->vtab->next_keyed == NULL) {
+			diag_set_illegal("A source at index %d does not "
+					 "provide keys", i + 1);
+			return NULL;
+		}
+	}
 
 	struct merger *merger = malloc(sizeof(struct merger));
 	if (merger == NULL) {
@@ -256,14 +602,27 @@ merger_new(struct key_def *key_def, struct merge_source **sources,
 		return NULL;
 	}
 
-	merge_source_create(&merger->base, &merger_vtab);
+	merge_source_create(&merger->base,
+			    keyed ? &merger_keyed_vtab : &merger_vtab);
 	merger->started = false;
+	merger->source_type = MERGER_SOURCE_ANY;
 	merger->key_def = key_def;
+	merger->keyed = keyed;
+	merger->sort_key_def = NULL;
 	merger->format = format;
 	merger_heap_create(&merger->heap);
 	merger->node_count = 0;
 	merger->nodes = NULL;
 	merger->reverse = reverse;
+	merger->plan = NULL;
+	merger->next_free = NULL;
+	merger->key_fields = NULL;
+	merger->key_field_count = 0;
+	merger->filter = NULL;
+	merger->offload_parts = NULL;
+	merger->offload_part_count = 0;
+	merger->pending = NULL;
+	merger_position_create(merger);
 
 	if (merger_set_sources(merger, sources, source_count) != 0) {
 		box_key_def_delete(merger->key_def);
@@ -276,6 +635,244 @@ merger_new(struct key_def *key_def, struct merge_source **sources,
 	return &merger->base;
 }
 
+struct merge_source *
+merger_new(struct key_def *key_def, struct merge_source **sources,
+	   uint32_t source_count, bool reverse)
+{
+	return merger_new_impl(key_def, sources, source_count, reverse,
+			       false);
+}
+
+struct merge_source *
+merger_new_keyed(struct key_def *key_def, struct merge_source **sources,
+		 uint32_t source_count, bool reverse)
+{
+	return merger_new_impl(key_def, sources, source_count, reverse,
+			       true);
+}
+
+bool
+merger_set_sort_keys(struct merge_source *base,
+		     const struct merge_sort_key_part *parts,
+		     uint32_t part_count)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	assert(!merger->started);
+	if (merger->sort_key_def != NULL)
+		merge_sort_key_def_delete(merger->sort_key_def);
+	merger->sort_key_def = merge_sort_key_def_new(parts, part_count);
+	return merger->sort_key_def != NULL;
+}
+
+int
+merger_set_key_fields(struct merge_source *base, const uint32_t *fields,
+		      uint32_t field_count)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	size_t size = sizeof(uint32_t) * field_count;
+	uint32_t *key_fields = malloc(size);
+	if (key_fields == NULL) {
+		diag_set_oom(size, "malloc", "key_fields");
+		return -1;
+	}
+	memcpy(key_fields, fields, size);
+	free(merger->key_fields);
+	merger->key_fields = key_fields;
+	merger->key_field_count = field_count;
+	return 0;
+}
+
+int
+merger_key_fields(struct merge_source *base, const uint32_t **fields,
+		  uint32_t *field_count)
+{
+	if (base->vtab->destroy != merger_delete) {
+		diag_set_illegal("Keys are available for a merger only");
+		return -1;
+	}
+	struct merger *merger = container_of(base, struct merger, base);
+	if (merger->keyed) {
+		*fields = NULL;
+		*field_count = 0;
+		return 0;
+	}
+	if (merger->key_fields == NULL) {
+		diag_set_illegal("Keys are not available: the merger does "
+				 "not know key fields");
+		return -1;
+	}
+	*fields = merger->key_fields;
+	*field_count = merger->key_field_count;
+	return 0;
+}
+
+int
+merger_set_offload_parts(struct merge_source *base,
+			 const struct merge_offload_part *parts,
+			 uint32_t part_count)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	size_t size = sizeof(struct merge_offload_part) * part_count;
+	struct merge_offload_part *offload_parts = malloc(size);
+	if (offload_parts == NULL) {
+		diag_set_oom(size, "malloc", "offload_parts");
+		return -1;
+	}
+	memcpy(offload_parts, parts, size);
+	free(merger->offload_parts);
+	merger->offload_parts = offload_parts;
+	merger->offload_part_count = part_count;
+	return 0;
+}
+
+bool
+merger_offload_info(struct merge_source *base,
+		    const struct merge_offload_part **parts,
+		    uint32_t *part_count, bool *reverse,
+		    uint32_t *source_count)
+{
+	if (base->vtab->destroy != merger_delete)
+		return false;
+	struct merger *merger = container_of(base, struct merger, base);
+	if (merger->started || merger->keyed || merger->filter != NULL ||
+	    !merger->is_positioned || merger->track_position ||
+	    merger->offload_parts == NULL)
+		return false;
+	*parts = merger->offload_parts;
+	*part_count = merger->offload_part_count;
+	*reverse = merger->reverse;
+	*source_count = merger->node_count;
+	return true;
+}
+
+struct merge_source *
+merger_source(struct merge_source *base, uint32_t idx)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	assert(idx < merger->node_count);
+	return merger->nodes[idx].source;
+}
+
+void
+merger_set_filter(struct merge_source *base, struct merge_filter *filter)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	assert(!merger->started);
+	if (merger->filter != NULL)
+		merge_filter_delete(merger->filter);
+	merger->filter = filter;
+}
+
+int
+merger_set_position(struct merge_source *base, const char *key,
+		    const char *key_end, uint32_t ties)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	assert(!merger->started);
+	const char *pos = key;
+	/* An empty key with no ties is the beginning. */
+	if (mp_decode_array(&pos) == 0 && ties == 0)
+		return 0;
+	size_t size = key_end - key;
+	char *after_key = malloc(size);
+	if (after_key == NULL) {
+		diag_set_oom(size, "malloc", "after_key");
+		return -1;
+	}
+	memcpy(after_key, key, size);
+	free(merger->after_key);
+	merger->after_key = after_key;
+	merger->after_key_size = size;
+	merger->after_ties = ties;
+	merger->skipped_ties = 0;
+	merger->is_positioned = false;
+	merger->last_ties = ties;
+	return 0;
+}
+
+int
+merger_track_position(struct merge_source *base)
+{
+	if (base->vtab->destroy != merger_delete) {
+		diag_set_illegal("A cursor is available for a merger only");
+		return -1;
+	}
+	struct merger *merger = container_of(base, struct merger, base);
+	if (merger->track_position)
+		return 0;
+	if (!merger->keyed && merger->key_fields == NULL) {
+		diag_set_illegal("A cursor is not available: the merger "
+				 "does not know key fields");
+		return -1;
+	}
+	if (merger->started) {
+		diag_set_illegal("A cursor should be requested before a "
+				 "merger gives a first tuple");
+		return -1;
+	}
+	merger->track_position = true;
+	return 0;
+}
+
+size_t
+merger_encode_position(struct merge_source *base, char *buf)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	assert(merger->track_position);
+	size_t size = mp_sizeof_array(2);
+	char *pos = buf;
+	if (pos != NULL)
+		pos = mp_encode_array(pos, 2);
+
+	/* The key. */
+	if (merger->last != NULL && merger->keyed) {
+		size_t bsize = box_tuple_bsize(merger->last);
+		if (pos != NULL)
+			pos += box_tuple_to_buf(merger->last, pos, bsize);
+		size += bsize;
+	} else if (merger->last != NULL) {
+		uint32_t count = merger->key_field_count;
+		size += mp_sizeof_array(count);
+		if (pos != NULL)
+			pos = mp_encode_array(pos, count);
+		for (uint32_t i = 0; i < count; ++i) {
+			const char *field = box_tuple_field(merger->last,
+				merger->key_fields[i]);
+			if (field == NULL) {
+				size += mp_sizeof_nil();
+				if (pos != NULL)
+					pos = mp_encode_nil(pos);
+				continue;
+			}
+			const char *field_end = field;
+			mp_next(&field_end);
+			size += field_end - field;
+			if (pos != NULL) {
+				memcpy(pos, field, field_end - field);
+				pos += field_end - field;
+			}
+		}
+	} else if (merger->after_key != NULL) {
+		size += merger->after_key_size;
+		if (pos != NULL) {
+			memcpy(pos, merger->after_key,
+			       merger->after_key_size);
+			pos += merger->after_key_size;
+		}
+	} else {
+		size += mp_sizeof_array(0);
+		if (pos != NULL)
+			pos = mp_encode_array(pos, 0);
+	}
+
+	/* Ties. */
+	size += mp_sizeof_uint(merger->last_ties);
+	if (pos != NULL)
+		pos = mp_encode_uint(pos, merger->last_ties);
+	assert(pos == NULL || (size_t)(pos - buf) == size);
+	return size;
+}
+
 /* Virtual methods */
 
 static void
@@ -283,9 +880,24 @@ merger_delete(struct merge_source *base)
 {
 	struct merger *merger = container_of(base, struct merger, base);
 
+	merger_position_destroy(merger);
+	merger->pending = NULL;
+	if (merger->filter != NULL) {
+		merge_filter_delete(merger->filter);
+		merger->filter = NULL;
+	}
+	if (merger->plan != NULL) {
+		merge_plan_release(merger->plan, merger);
+		return;
+	}
+
+	free(merger->key_fields);
+	free(merger->offload_parts);
 	box_key_def_delete(merger->key_def);
 	box_tuple_format_unref(merger->format);
 	merger_heap_destroy(&merger->heap);
+	if (merger->sort_key_def != NULL)
+		merge_sort_key_def_delete(merger->sort_key_def);
 
 	for (uint32_t i = 0; i < merger->node_count; ++i)
 		merger_heap_node_delete(&merger->nodes[i]);
@@ -296,28 +908,84 @@ merger_delete(struct merge_source *base)
 	free(merger);
 }
 
+/**
+ * Fetch a first tuple for each source and add all heap nodes to
+ * a merger heap when it is not done yet.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
 static int
-merger_next(struct merge_source *base, box_tuple_format_t *format,
-	    box_tuple_t **out)
+merger_start(struct merger *merger)
 {
-	struct merger *merger = container_of(base, struct merger, base);
+	if (merger->started)
+		return 0;
+	merger->source_type = merger_source_type(merger);
+	for (uint32_t i = 0; i < merger->node_count; ++i) {
+		struct merger_heap_node *node = &merger->nodes[i];
+		if (merger_add_heap_node(merger, node) != 0)
+			return -1;
+	}
+	merger->started = true;
+	return 0;
+}
 
-	/*
-	 * Fetch a first tuple for each source and add all heap
-	 * nodes to a merger heap.
-	 */
-	if (!merger->started) {
-		for (uint32_t i = 0; i < merger->node_count; ++i) {
-			struct merger_heap_node *node = &merger->nodes[i];
-			if (merger_add_heap_node(merger, node) != 0)
-				return -1;
-		}
-		merger->started = true;
+/**
+ * Fetch a next tuple of a heap node and update the heap. There
+ * is nothing to reorder when only one source remains.
+ *
+ * The node leaves the heap when its source ends or fails.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merger_heap_node_advance(struct merger *merger, struct merger_heap_node *node)
+{
+	if (merger_heap_node_next(merger, node) != 0) {
+		merger_heap_delete(&merger->heap, node);
+		return -1;
 	}
+	if (node->tuple == NULL)
+		merger_heap_delete(&merger->heap, node);
+	else if (merger->heap.size > 1)
+		merger_heap_update(&merger->heap, node);
+	return 0;
+}
+
+/**
+ * Advance a node, whose tuple is already given, if any (see
+ * merger->pending).
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+merger_advance_pending(struct merger *merger)
+{
+	struct merger_heap_node *node = merger->pending;
+	if (node == NULL)
+		return 0;
+	merger->pending = NULL;
+	merger_heap_node_release(node);
+	return merger_heap_node_advance(merger, node);
+}
+
+/**
+ * Get a next tuple and (for a keyed merger) its key from the
+ * heap.
+ *
+ * It is the helper for merger_next_impl().
+ */
+static int
+merger_next_from_heap(struct merger *merger, box_tuple_format_t *format,
+		      box_tuple_t **key, box_tuple_t **out)
+{
+	if (merger_advance_pending(merger) != 0 ||
+	    merger_start(merger) != 0)
+		return -1;
 
 	/* Get a next tuple. */
 	struct merger_heap_node *node = merger_heap_top(&merger->heap);
 	if (node == NULL) {
+		*key = NULL;
 		*out = NULL;
 		return 0;
 	}
@@ -329,22 +997,368 @@ merger_next(struct merge_source *base, box_tuple_format_t *format,
 		return -1;
 
 	/*
-	 * Note: An old node->tuple pointer will be written to
-	 * *out as refcounted tuple, so we don't unreference it
-	 * here.
+	 * Note: Old node->tuple and node->key pointers will be
+	 * written to *out and *key as refcounted tuples, so we
+	 * don't unreference them here.
 	 */
-	struct merge_source *source = node->source;
-	if (merge_source_next(source, merger->format, &node->tuple) != 0)
+	box_tuple_t *tuple_key = node->key;
+	if (merger_heap_node_advance(merger, node) != 0) {
+		box_tuple_unref(tuple);
+		if (tuple_key != NULL)
+			box_tuple_unref(tuple_key);
 		return -1;
+	}
 
-	/* Update a heap. */
-	if (node->tuple == NULL)
-		merger_heap_delete(&merger->heap, node);
-	else
-		merger_heap_update(&merger->heap, node);
-
+	*key = tuple_key;
 	*out = tuple;
 	return 0;
 }
 
+/**
+ * Get a next tuple and (for a keyed merger) its key.
+ *
+ * Skip tuples before a position to resume from and track the
+ * position of a given tuple when requested.
+ *
+ * It is the helper for merger_next() and merger_next_keyed().
+ */
+static int
+merger_next_impl(struct merger *merger, box_tuple_format_t *format,
+		 box_tuple_t **key, box_tuple_t **out)
+{
+	while (true) {
+		if (merger_next_from_heap(merger, format, key, out) != 0)
+			return -1;
+		if (*out == NULL ||
+		    (merger->is_positioned && !merger->track_position))
+			return 0;
+		box_tuple_t *item = merger->keyed ? *key : *out;
+		if (!merger->is_positioned &&
+		    merger_position_skip(merger, item)) {
+			if (*key != NULL)
+				box_tuple_unref(*key);
+			box_tuple_unref(*out);
+			continue;
+		}
+		if (merger->track_position)
+			merger_position_track(merger, item);
+		return 0;
+	}
+}
+
+static int
+merger_next(struct merge_source *base, box_tuple_format_t *format,
+	    box_tuple_t **out)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	box_tuple_t *key;
+	if (merger_next_impl(merger, format, &key, out) != 0)
+		return -1;
+	if (key != NULL)
+		box_tuple_unref(key);
+	return 0;
+}
+
+static int
+merger_next_keyed(struct merge_source *base, box_tuple_format_t *key_format,
+		  box_tuple_t **key, box_tuple_t **out)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+	if (merger_next_impl(merger, NULL, key, out) != 0)
+		return -1;
+	if (*key != NULL && key_format != NULL &&
+	    key_format != merger->format &&
+	    box_tuple_validate(*key, key_format) != 0) {
+		box_tuple_unref(*key);
+		box_tuple_unref(*out);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * copy_raw() virtual method implementation for a merger.
+ *
+ * When only one source remains, there is nothing to merge: copy
+ * the current tuple and let the source copy the rest.
+ *
+ * @see struct merge_source_vtab
+ */
+static int
+merger_copy_raw(struct merge_source *base, box_ibuf_t *buf, uint32_t limit,
+		uint32_t *count_ptr)
+{
+	struct merger *merger = container_of(base, struct merger, base);
+
+	*count_ptr = 0;
+	if (merger_advance_pending(merger) != 0)
+		return -1;
+	if (!merger->started || merger->heap.size != 1 || limit == 0)
+		return 0;
+	/* Tuples are not seen by the merger when copied. */
+	if (!merger->is_positioned || merger->track_position ||
+	    merger->filter != NULL)
+		return 0;
+
+	/* Copy the current tuple. */
+	struct merger_heap_node *node = merger_heap_top(&merger->heap);
+	size_t bsize = box_tuple_bsize(node->tuple);
+	char **wpos;
+	box_ibuf_write_range(buf, &wpos, NULL);
+	if (box_ibuf_reserve(buf, bsize) == NULL) {
+		diag_set_oom(bsize, "ibuf", "tuples");
+		return -1;
+	}
+	box_tuple_to_buf(node->tuple, *wpos, bsize);
+	*wpos += bsize;
+	/*
+	 * The node fetches a new current tuple on a next call if
+	 * something fails below: copied tuples are given anyway.
+	 */
+	merger_heap_node_release(node);
+	merger->pending = node;
+
+	/* Copy next tuples and fetch a new current one. */
+	uint32_t count = 0;
+	int rc = merge_source_copy_raw(node->source, buf, limit - 1, &count);
+	*count_ptr = count + 1;
+	if (rc != 0)
+		return -1;
+	return merger_advance_pending(merger);
+}
+
+/* }}} */
+
+/* {{{ Merge plan */
+
+struct merge_plan *
+merge_plan_new(struct key_def *key_def, uint32_t max_sources, bool reverse,
+	       bool keyed)
+{
+	struct merge_plan *plan = malloc(sizeof(struct merge_plan));
+	if (plan == NULL) {
+		diag_set_oom(sizeof(struct merge_plan), "malloc",
+			     "merge_plan");
+		return NULL;
+	}
+	plan->key_def = box_key_def_dup(key_def);
+	if (plan->key_def == NULL) {
+		free(plan);
+		return NULL;
+	}
+	plan->format = box_tuple_format_new(&plan->key_def, 1);
+	if (plan->format == NULL) {
+		box_key_def_delete(plan->key_def);
+		free(plan);
+		return NULL;
+	}
+	plan->refs = 1;
+	plan->reverse = reverse;
+	plan->keyed = keyed;
+	plan->max_sources = max_sources;
+	plan->key_fields = NULL;
+	plan->key_field_count = 0;
+	plan->sort_key_def = NULL;
+	plan->offload_parts = NULL;
+	plan->offload_part_count = 0;
+	plan->free_list = NULL;
+	plan->free_count = 0;
+	return plan;
+}
+
+bool
+merge_plan_set_sort_keys(struct merge_plan *plan,
+			 const struct merge_sort_key_part *parts,
+			 uint32_t part_count)
+{
+	if (plan->sort_key_def != NULL)
+		merge_sort_key_def_delete(plan->sort_key_def);
+	plan->sort_key_def = merge_sort_key_def_new(parts, part_count);
+	return plan->sort_key_def != NULL;
+}
+
+int
+merge_plan_set_key_fields(struct merge_plan *plan, const uint32_t *fields,
+			  uint32_t field_count)
+{
+	size_t size = sizeof(uint32_t) * field_count;
+	uint32_t *key_fields = malloc(size);
+	if (key_fields == NULL) {
+		diag_set_oom(size, "malloc", "key_fields");
+		return -1;
+	}
+	memcpy(key_fields, fields, size);
+	free(plan->key_fields);
+	plan->key_fields = key_fields;
+	plan->key_field_count = field_count;
+	return 0;
+}
+
+int
+merge_plan_set_offload_parts(struct merge_plan *plan,
+			     const struct merge_offload_part *parts,
+			     uint32_t part_count)
+{
+	size_t size = sizeof(struct merge_offload_part) * part_count;
+	struct merge_offload_part *offload_parts = malloc(size);
+	if (offload_parts == NULL) {
+		diag_set_oom(size, "malloc", "offload_parts");
+		return -1;
+	}
+	memcpy(offload_parts, parts, size);
+	free(plan->offload_parts);
+	plan->offload_parts = offload_parts;
+	plan->offload_part_count = part_count;
+	return 0;
+}
+
+/**
+ * Free a merger of a plan with all its nodes.
+ */
+static void
+merge_plan_merger_delete(struct merger *merger)
+{
+	for (uint32_t i = 0; i < merger->plan->max_sources; ++i)
+		free(merger->nodes[i].sort_key);
+	merger_heap_destroy(&merger->heap);
+	free(merger->nodes);
+	free(merger);
+}
+
+void
+merge_plan_unref(struct merge_plan *plan)
+{
+	assert(plan->refs > 0);
+	if (--plan->refs > 0)
+		return;
+	while (plan->free_list != NULL) {
+		struct merger *merger = plan->free_list;
+		plan->free_list = merger->next_free;
+		merge_plan_merger_delete(merger);
+	}
+	free(plan->key_fields);
+	free(plan->offload_parts);
+	if (plan->sort_key_def != NULL)
+		merge_sort_key_def_delete(plan->sort_key_def);
+	box_tuple_format_unref(plan->format);
+	box_key_def_delete(plan->key_def);
+	free(plan);
+}
+
+/**
+ * Drop sources and tuples of a merger and put it into the plan's
+ * pool. Nodes and the heap keep their memory.
+ */
+static void
+merge_plan_release(struct merge_plan *plan, struct merger *merger)
+{
+	for (uint32_t i = 0; i < merger->node_count; ++i) {
+		struct merger_heap_node *node = &merger->nodes[i];
+		merger_heap_node_release(node);
+		merge_source_unref(node->source);
+		node->source = NULL;
+	}
+	merger->node_count = 0;
+	merger->heap.size = 0;
+
+	/* The plan owns the merger while it is in the pool. */
+	if (plan->free_count < MERGE_PLAN_POOL_MAX) {
+		merger->next_free = plan->free_list;
+		plan->free_list = merger;
+		++plan->free_count;
+	} else {
+		merge_plan_merger_delete(merger);
+	}
+	merge_plan_unref(plan);
+}
+
+struct merge_source *
+merge_plan_bind(struct merge_plan *plan, struct merge_source **sources,
+		uint32_t source_count)
+{
+	static struct merge_source_vtab merger_vtab = {
+		.destroy = merger_delete,
+		.next = merger_next,
+		.copy_raw = merger_copy_raw,
+	};
+	static struct merge_source_vtab merger_keyed_vtab = {
+		.destroy = merger_delete,
+		.next = merger_next,
+		.next_keyed = merger_next_keyed,
+		.copy_raw = merger_copy_raw,
+	};
+
+	if (source_count > plan->max_sources) {
+		diag_set_illegal("Too many sources: %u, the plan is prepared "
+				 "for %u", source_count, plan->max_sources);
+		return NULL;
+	}
+	for (uint32_t i = 0; plan->keyed && i < source_count; ++i) {
+		if (sources[i]->vtab->next_keyed == NULL) {
+			diag_set_illegal("A source at index %d does not "
+					 "provide keys", i + 1);
+			return NULL;
+		}
+	}
+
+	struct merger *merger = plan->free_list;
+	if (merger != NULL) {
+		plan->free_list = merger->next_free;
+		--plan->free_count;
+	} else {
+		merger = malloc(sizeof(struct merger));
+		size_t nodes_size = sizeof(struct merger_heap_node) *
+			plan->max_sources;
+		struct merger_heap_node *nodes = malloc(nodes_size);
+		if (merger == NULL || nodes == NULL) {
+			free(merger);
+			free(nodes);
+			diag_set_oom(sizeof(struct merger) + nodes_size,
+				     "malloc", "merger");
+			return NULL;
+		}
+		for (uint32_t i = 0; i < plan->max_sources; ++i) {
+			nodes[i].sort_key = NULL;
+			nodes[i].sort_key_size = 0;
+			nodes[i].sort_key_capacity = 0;
+		}
+		merger->nodes = nodes;
+		merger->key_def = plan->key_def;
+		merger->format = plan->format;
+		merger->keyed = plan->keyed;
+		merger->reverse = plan->reverse;
+		merger->node_count = 0;
+		merger->plan = plan;
+		merger_position_create(merger);
+		merger_heap_create(&merger->heap);
+	}
+	merger->next_free = NULL;
+	merger->filter = NULL;
+	merger->pending = NULL;
+	/* Key parts are owned by the plan. */
+	merger->sort_key_def = plan->sort_key_def;
+	merger->key_fields = plan->key_fields;
+	merger->key_field_count = plan->key_field_count;
+	merger->offload_parts = plan->offload_parts;
+	merger->offload_part_count = plan->offload_part_count;
+
+	merge_source_create(&merger->base, plan->keyed ? &merger_keyed_vtab :
+			    &merger_vtab);
+	merger->started = false;
+	merger->source_type = MERGER_SOURCE_ANY;
+	for (uint32_t i = 0; i < source_count; ++i) {
+		struct merger_heap_node *node = &merger->nodes[i];
+		node->source = sources[i];
+		merge_source_ref(node->source);
+		node->tuple = NULL;
+		node->key = NULL;
+		heap_node_create(&node->in_merger);
+	}
+	merger->node_count = source_count;
+	/* The merger holds the plan. */
+	++plan->refs;
+	return &merger->base;
+}
+
 /* }}} */
+
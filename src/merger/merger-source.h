@@ -69,6 +69,44 @@ struct merge_source_vtab {
 	 */
 	int (*next)(struct merge_source *base, box_tuple_format_t *format,
 		    box_tuple_t **out);
+	/**
+	 * Get a next tuple along with its key (both refcounted).
+	 *
+	 * A key is an array of key parts, which is provided by
+	 * a source itself (say, extracted by a storage), so a
+	 * caller may compare keys without looking into tuples.
+	 *
+	 * When key_format is not NULL the resulting key will be
+	 * in a compatible format. The tuple is in the default
+	 * format.
+	 *
+	 * The method is optional: it is NULL when a source does
+	 * not provide keys.
+	 *
+	 * Return 0 when successfully fetched a tuple or NULL (and
+	 * a key or NULL). In case of an error set a diag and
+	 * return -1.
+	 */
+	int (*next_keyed)(struct merge_source *base,
+			  box_tuple_format_t *key_format, box_tuple_t **key,
+			  box_tuple_t **out);
+	/**
+	 * Copy up to @a limit next tuples into @a buf as MsgPack
+	 * arrays without creating tuples and set @a count_ptr to
+	 * a number of copied tuples.
+	 *
+	 * A source may copy less tuples than requested, zero
+	 * including (say, at end of a chunk or when a merger has
+	 * several live sources). A caller should use next() then.
+	 *
+	 * The method is optional.
+	 *
+	 * Return 0 at success. Return -1 at an error and set a
+	 * diag. @a count_ptr is set in the latter case too:
+	 * copied tuples are given anyway.
+	 */
+	int (*copy_raw)(struct merge_source *base, box_ibuf_t *buf,
+			uint32_t limit, uint32_t *count_ptr);
 };
 
 /**
@@ -118,6 +156,35 @@ merge_source_next(struct merge_source *source, box_tuple_format_t *format,
 	return source->vtab->next(source, format, out);
 }
 
+/**
+ * @see merge_source_vtab
+ */
+static inline int
+merge_source_next_keyed(struct merge_source *source,
+			box_tuple_format_t *key_format, box_tuple_t **key,
+			box_tuple_t **out)
+{
+	assert(source->vtab->next_keyed != NULL);
+	return source->vtab->next_keyed(source, key_format, key, out);
+}
+
+/**
+ * @see merge_source_vtab
+ *
+ * Set @a count_ptr to zero if a source does not support copying
+ * of raw tuples.
+ */
+static inline int
+merge_source_copy_raw(struct merge_source *source, box_ibuf_t *buf,
+		      uint32_t limit, uint32_t *count_ptr)
+{
+	if (source->vtab->copy_raw == NULL) {
+		*count_ptr = 0;
+		return 0;
+	}
+	return source->vtab->copy_raw(source, buf, limit, count_ptr);
+}
+
 /**
  * Initialize a base merge source structure.
  */
@@ -130,6 +197,24 @@ merge_source_create(struct merge_source *source, struct merge_source_vtab *vtab)
 
 /* }}} */
 
+/* {{{ Buffer source */
+
+/**
+ * next() and next_keyed() of a buffer source (see merger.c).
+ *
+ * A merger, whose sources are all buffer sources, calls them
+ * directly rather than via the vtab.
+ */
+int
+luaL_merge_source_buffer_next(struct merge_source *base,
+			      box_tuple_format_t *format, box_tuple_t **out);
+int
+luaL_merge_source_buffer_next_keyed(struct merge_source *base,
+				    box_tuple_format_t *key_format,
+				    box_tuple_t **key, box_tuple_t **out);
+
+/* }}} */
+
 /* {{{ Merger */
 
 /**
@@ -141,6 +226,367 @@ struct merge_source *
 merger_new(struct key_def *key_def, struct merge_source **sources,
 	   uint32_t source_count, bool reverse);
 
+/**
+ * Create a new merger that compares keys given by sources (see
+ * merge_source_vtab.next_keyed) instead of tuples.
+ *
+ * @a key_def describes the keys: its parts refer to fields of a
+ * key, not of a tuple.
+ *
+ * All sources should provide keys. The merger provides them
+ * too, so it may be used as a source of another keyed merger.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+struct merge_source *
+merger_new_keyed(struct key_def *key_def, struct merge_source **sources,
+		 uint32_t source_count, bool reverse);
+
+struct merge_sort_key_part;
+
+/**
+ * Let a merger compare binary sort keys instead of tuples (see
+ * merger-collation.h). It pays off for collation aware string
+ * key parts: a sort key is built once per tuple.
+ *
+ * @a parts should describe the same key as the merger's
+ * key_def. Should be called before the merger gives a first
+ * tuple.
+ *
+ * Return true when sort keys are used. Return false when they
+ * are not available: the merger compares tuples then.
+ */
+bool
+merger_set_sort_keys(struct merge_source *merger,
+		     const struct merge_sort_key_part *parts,
+		     uint32_t part_count);
+
+/**
+ * Set zero based field numbers of key parts, which are needed
+ * to encode a position of a merger (see
+ * merger_encode_position()). A keyed merger does not need them.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merger_set_key_fields(struct merge_source *merger, const uint32_t *fields,
+		      uint32_t field_count);
+
+/**
+ * Get field numbers set by merger_set_key_fields(). Set
+ * @a fields to NULL for a keyed merger: it gives keys using
+ * merge_source_next_keyed().
+ *
+ * Return -1 and set a diag when @a source is not a merger or it
+ * does not know key fields.
+ */
+int
+merger_key_fields(struct merge_source *source, const uint32_t **fields,
+		  uint32_t *field_count);
+
+struct merge_offload_part;
+
+/**
+ * Let a merger know its key parts when they may be compared
+ * in MsgPack (see merger-offload.h), so its sources may be
+ * merged in a coio thread.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merger_set_offload_parts(struct merge_source *merger,
+			 const struct merge_offload_part *parts,
+			 uint32_t part_count);
+
+/**
+ * Get parameters to merge sources of a merger in a coio thread:
+ * key parts set by merger_set_offload_parts(), the order and
+ * a number of sources (see merger_source()).
+ *
+ * Sources may be merged this way only before the merger gives
+ * a first tuple. The merger gives the rest of tuples then.
+ *
+ * Return false when @a source is not a merger or it can't be
+ * merged this way: it is keyed, it has a filter, a position to
+ * resume from or tracks a position, or its key parts are not
+ * set.
+ */
+bool
+merger_offload_info(struct merge_source *source,
+		    const struct merge_offload_part **parts,
+		    uint32_t *part_count, bool *reverse,
+		    uint32_t *source_count);
+
+/**
+ * Get a source of a merger by its index.
+ */
+struct merge_source *
+merger_source(struct merge_source *merger, uint32_t idx);
+
+struct merge_filter;
+
+/**
+ * Let a merger give only tuples that satisfy @a filter (see
+ * merger-filter.h). The merger owns the filter then. Rejected
+ * tuples are dropped when they are fetched from sources, so
+ * they are not compared. The merger does not copy raw tuples
+ * (see merge_source_copy_raw()).
+ *
+ * Should be called before the merger gives a first tuple.
+ */
+void
+merger_set_filter(struct merge_source *merger, struct merge_filter *filter);
+
+/**
+ * Resume a merge from a position encoded by
+ * merger_encode_position(): skip tuples, which go before @a key
+ * in the merge order, and first @a ties tuples equal to it.
+ *
+ * @a key is a MsgPack array of key parts. Should be called
+ * before the merger gives a first tuple.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merger_set_position(struct merge_source *merger, const char *key,
+		    const char *key_end, uint32_t ties);
+
+/**
+ * Let a merger track a position of the last given tuple. The
+ * merger does not copy raw tuples (see merge_source_copy_raw())
+ * then.
+ *
+ * Return -1 and set a diag when @a source is not a merger, when
+ * it does not know key fields or it already gave a tuple.
+ */
+int
+merger_track_position(struct merge_source *source);
+
+/**
+ * Encode a position of a merger as a MsgPack array of the last
+ * given key and the number of given tuples equal to it into
+ * @a buf or return its size if @a buf is NULL.
+ *
+ * merger_track_position() should be called before.
+ */
+size_t
+merger_encode_position(struct merge_source *merger, char *buf);
+
+/* }}} */
+
+/* {{{ Merge plan */
+
+/**
+ * A prepared merge: a key_def, a format and a pool of mergers,
+ * which are reused to merge the same shape of sources again and
+ * again.
+ */
+struct merge_plan;
+
+/**
+ * Create a new plan for mergers of up to @a max_sources
+ * sources.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+struct merge_plan *
+merge_plan_new(struct key_def *key_def, uint32_t max_sources, bool reverse,
+	       bool keyed);
+
+/**
+ * Set key fields of mergers bound from a plan like
+ * merger_set_key_fields() does for a merger.
+ *
+ * Should be called before a first merger is bound.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merge_plan_set_key_fields(struct merge_plan *plan, const uint32_t *fields,
+			  uint32_t field_count);
+
+/**
+ * Let mergers bound from a plan compare sort keys like
+ * merger_set_sort_keys() does for a merger. The sort key
+ * definition is built once and shared by the mergers.
+ *
+ * Should be called before a first merger is bound.
+ *
+ * Return true when sort keys are used.
+ */
+bool
+merge_plan_set_sort_keys(struct merge_plan *plan,
+			 const struct merge_sort_key_part *parts,
+			 uint32_t part_count);
+
+/**
+ * Set offload key parts of mergers bound from a plan like
+ * merger_set_offload_parts() does for a merger.
+ *
+ * Should be called before a first merger is bound.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merge_plan_set_offload_parts(struct merge_plan *plan,
+			     const struct merge_offload_part *parts,
+			     uint32_t part_count);
+
+/**
+ * Drop a reference to a plan. Each merger bound from the plan
+ * holds a reference too.
+ */
+void
+merge_plan_unref(struct merge_plan *plan);
+
+/**
+ * Create a merger of given sources.
+ *
+ * A merger released by its last reference returns to the plan
+ * and is reused by a next call, so the nodes array, the heap and
+ * sort key buffers are not allocated again.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+struct merge_source *
+merge_plan_bind(struct merge_plan *plan, struct merge_source **sources,
+		uint32_t source_count);
+
+/* }}} */
+
+/* {{{ File source */
+
+/**
+ * Parameters of a file source.
+ */
+struct merge_source_file_opts {
+	/*
+	 * A path to a sparse index written by
+	 * merge_source_write_file() or NULL.
+	 */
+	const char *index_path;
+	/*
+	 * A key (with MsgPack array header) to position the
+	 * source at or NULL to start from the beginning.
+	 */
+	const char *key;
+	/*
+	 * An iterator type to position the source: ITER_GE or
+	 * ITER_GT for an ascending file, ITER_LE or ITER_LT for a
+	 * descending one.
+	 */
+	int iterator;
+};
+
+/**
+ * Create a new source of tuples stored in a file.
+ *
+ * The file is a sequence of MsgPack arrays (tuples). It is
+ * mapped into memory and tuples are created right from the
+ * mapping.
+ *
+ * @a key_def is used to position the source when opts->key is
+ * set.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+struct merge_source *
+merge_source_file_new(const char *path, struct key_def *key_def,
+		      const struct merge_source_file_opts *opts);
+
+/**
+ * Write all tuples of a source into a file in the format that
+ * merge_source_file_new() accepts.
+ *
+ * When @a index_step is not zero, also write a sparse index
+ * into `<path>.idx`: an offset of each index_step-th tuple.
+ *
+ * Set @a count_ptr (if not NULL) to the number of written
+ * tuples.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+int
+merge_source_write_file(struct merge_source *source, const char *path,
+			uint32_t index_step, uint64_t *count_ptr);
+
+/* }}} */
+
+/* {{{ External sort */
+
+/**
+ * Parameters of an external sort.
+ */
+struct merge_sort_opts {
+	/*
+	 * How many bytes of tuples are sorted in memory before
+	 * they are written to a temporary file (a run).
+	 */
+	size_t memory_limit;
+	/* How many runs are merged at once, at least 2. */
+	uint32_t fan_in;
+	/* A directory for runs. */
+	const char *tmpdir;
+};
+
+/**
+ * Read all tuples from a source and return a new source that
+ * gives them in the order defined by @a key_def.
+ *
+ * Tuples are collected until opts->memory_limit is reached,
+ * sorted and written to a run file. When opts->fan_in runs of
+ * the same level are collected, they are merged into one run of
+ * a next level. The resulting source merges at most fan_in runs
+ * and the last in-memory batch using merger_new().
+ *
+ * Files are written from a coio thread and the fiber yields
+ * while the input is read, so other fibers are not blocked.
+ *
+ * Run files are unlinked right after they are opened, so they
+ * are removed when the resulting source is freed.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+struct merge_source *
+merge_sort(struct merge_source *source, struct key_def *key_def,
+	   const struct merge_sort_opts *opts);
+
+/* }}} */
+
+/* {{{ Cascaded merge */
+
+/**
+ * Parameters of a cascaded merge.
+ */
+struct merge_cascade_opts {
+	/* How many sources are merged at once, at least 2. */
+	uint32_t fan_in;
+	/* How many bytes of intermediate runs are kept in memory. */
+	size_t memory_limit;
+	/* A directory for runs, which do not fit into memory. */
+	const char *tmpdir;
+};
+
+/**
+ * Create a new merger, which merges at most opts->fan_in
+ * sources at once.
+ *
+ * When a first tuple is requested, sources are merged by groups
+ * of fan_in into intermediate runs: a group is read to the end
+ * before a next one is started. Then the runs are merged the
+ * same way until at most fan_in runs remain. So only fan_in
+ * sources hold their current chunks at the same time.
+ *
+ * Intermediate runs are written to unlinked files in
+ * opts->tmpdir when they do not fit into opts->memory_limit.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+struct merge_source *
+merge_cascade_new(struct key_def *key_def, struct merge_source **sources,
+		  uint32_t source_count, bool reverse,
+		  const struct merge_cascade_opts *opts);
+
 /* }}} */
 
 #if defined(__cplusplus)
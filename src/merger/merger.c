@@ -37,6 +37,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <lua.h>             /* lua_*() */
 #include <lauxlib.h>         /* luaL_*() */
@@ -47,7 +48,12 @@
 #include "compat/diag.h"
 #include "compat/utils.h"
 
+#include "merger-collation.h" /* struct merge_sort_key_part */
+#include "merger-compact.h" /* merge_compact_*() */
+#include "merger-filter.h" /* merge_filter_*() */
+#include "merger-offload.h" /* merge_offload_*() */
 #include "merger-source.h" /* merge_source_*, merger_*() */
+#include "tuple_merger.h" /* struct tuple_merger_api */
 #include "version.h"
 
 /**
@@ -65,6 +71,10 @@ enum mp_extension_type {
 static uint32_t CTID_STRUCT_KEY_DEF_REF = 0;
 static uint32_t CTID_STRUCT_TUPLE_KEYDEF_PTR = 0;
 static uint32_t CTID_STRUCT_TUPLE_MERGE_SOURCE_REF = 0;
+static uint32_t CTID_STRUCT_TUPLE_MERGE_PLAN_REF = 0;
+
+/* A reference to `function(key_def) return key_def:totable() end`. */
+static int KEY_DEF_TOTABLE_REF = LUA_NOREF;
 
 /**
  * A type of a function to create a source from a Lua iterator on
@@ -196,6 +206,67 @@ luaT_gettuple(struct lua_State *L, int idx, box_tuple_format_t *format)
 	return tuple;
 }
 
+/**
+ * Encode a key (a Lua table or a tuple) from a Lua stack as
+ * MsgPack.
+ *
+ * Return a buffer that should be freed by a caller and set
+ * @a size_ptr. In case of an error return NULL and set a diag.
+ */
+static char *
+luaT_encode_key(struct lua_State *L, int idx, size_t *size_ptr)
+{
+	box_tuple_t *tuple = luaT_tuple_new(L, idx, box_tuple_format_default());
+	if (tuple == NULL)
+		return NULL;
+	box_tuple_ref(tuple);
+	size_t size = box_tuple_bsize(tuple);
+	char *key = malloc(size);
+	if (key == NULL) {
+		box_tuple_unref(tuple);
+		diag_set_oom(size, "malloc", "key");
+		return NULL;
+	}
+	box_tuple_to_buf(tuple, key, size);
+	box_tuple_unref(tuple);
+	*size_ptr = size;
+	return key;
+}
+
+/**
+ * Get an iterator type from a Lua stack: either a number (say,
+ * box.index.GE) or a string (say, 'GE').
+ *
+ * Return -1 if the value is not an iterator type.
+ */
+static int
+luaT_toiterator(struct lua_State *L, int idx)
+{
+	static const char *names[] = {
+		[ITER_EQ] = "EQ",
+		[ITER_REQ] = "REQ",
+		[ITER_ALL] = "ALL",
+		[ITER_LT] = "LT",
+		[ITER_LE] = "LE",
+		[ITER_GE] = "GE",
+		[ITER_GT] = "GT",
+	};
+	static const int name_count = sizeof(names) / sizeof(names[0]);
+
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		lua_Integer type = lua_tointeger(L, idx);
+		return type >= 0 && type < name_count ? type : -1;
+	}
+	if (lua_type(L, idx) != LUA_TSTRING)
+		return -1;
+	const char *name = lua_tostring(L, idx);
+	for (int type = 0; type < name_count; ++type) {
+		if (strcasecmp(name, names[type]) == 0)
+			return type;
+	}
+	return -1;
+}
+
 /*
  * Buffer for the part of the module written in Lua.
  *
@@ -237,6 +308,239 @@ execute_postload_lua(struct lua_State *L, bool first_load)
 
 /* }}} */
 
+/* {{{ Filters */
+
+/* Limits of a filter expression. */
+enum {
+	MERGE_FILTER_DEPTH_MAX = 32,
+	MERGE_FILTER_FIELDNO_MAX = 65535,
+};
+
+static const struct {
+	const char *name;
+	enum merge_filter_op op;
+} merge_filter_ops[] = {
+	{"and",		MERGE_FILTER_AND},
+	{"or",		MERGE_FILTER_OR},
+	{"==",		MERGE_FILTER_EQ},
+	{"~=",		MERGE_FILTER_NE},
+	{"<",		MERGE_FILTER_LT},
+	{"<=",		MERGE_FILTER_LE},
+	{">",		MERGE_FILTER_GT},
+	{">=",		MERGE_FILTER_GE},
+	{"in",		MERGE_FILTER_IN},
+	{"is_null",	MERGE_FILTER_IS_NULL},
+	{"not_null",	MERGE_FILTER_NOT_NULL},
+};
+
+/**
+ * Get an operation of a filter expression (a table) at @a idx.
+ *
+ * Return -1 when it is unknown.
+ */
+static int
+luaT_merge_filter_op(struct lua_State *L, int idx)
+{
+	lua_rawgeti(L, idx, 1);
+	const char *name = lua_type(L, -1) == LUA_TSTRING ?
+		lua_tostring(L, -1) : "";
+	static const size_t op_count = sizeof(merge_filter_ops) /
+		sizeof(merge_filter_ops[0]);
+	int op = -1;
+	for (size_t i = 0; i < op_count; ++i) {
+		if (strcmp(name, merge_filter_ops[i].name) == 0) {
+			op = merge_filter_ops[i].op;
+			break;
+		}
+	}
+	lua_pop(L, 1);
+	return op;
+}
+
+/**
+ * Convert a Lua value at @a idx into a value to compare fields
+ * with. A string is not copied: it should be held by Lua.
+ *
+ * Return -1 when it is not a number, a string or a boolean.
+ */
+static int
+luaT_merge_filter_value(struct lua_State *L, int idx,
+			struct merge_filter_value *value)
+{
+	memset(value, 0, sizeof(*value));
+	switch (lua_type(L, idx)) {
+	case LUA_TBOOLEAN:
+		value->type = MERGE_FILTER_VALUE_BOOL;
+		value->boolean = lua_toboolean(L, idx);
+		return 0;
+	case LUA_TNUMBER: {
+		double number = lua_tonumber(L, idx);
+		if (number != number)
+			return -1;
+		value->type = MERGE_FILTER_VALUE_NUMBER;
+		value->number = number;
+		value->is_int = number >= -9223372036854775808.0 &&
+			number < 9223372036854775808.0 &&
+			(double)(int64_t)number == number;
+		if (value->is_int)
+			value->integer = (int64_t)number;
+		return 0;
+	}
+	case LUA_TSTRING: {
+		size_t len;
+		value->type = MERGE_FILTER_VALUE_STRING;
+		value->str = lua_tolstring(L, idx, &len);
+		value->len = len;
+		return len <= UINT32_MAX ? 0 : -1;
+	}
+	default:
+		return -1;
+	}
+}
+
+/**
+ * Check a filter expression at @a idx.
+ *
+ * Return 0 when it is well formed, -1 otherwise.
+ */
+static int
+luaT_merge_filter_check(struct lua_State *L, int idx, int depth)
+{
+	if (!lua_istable(L, idx) || depth > MERGE_FILTER_DEPTH_MAX)
+		return -1;
+	int op = luaT_merge_filter_op(L, idx);
+	uint32_t len = lua_objlen(L, idx);
+	if (op < 0)
+		return -1;
+	if (op == MERGE_FILTER_AND || op == MERGE_FILTER_OR) {
+		if (len < 2)
+			return -1;
+		for (uint32_t i = 2; i <= len; ++i) {
+			lua_rawgeti(L, idx, i);
+			int rc = luaT_merge_filter_check(L, lua_gettop(L),
+							 depth + 1);
+			lua_pop(L, 1);
+			if (rc != 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	/* Predicates: {op, fieldno[, value or {value, ...}]}. */
+	lua_rawgeti(L, idx, 2);
+	bool ok = lua_type(L, -1) == LUA_TNUMBER &&
+		lua_tonumber(L, -1) >= 1 &&
+		lua_tonumber(L, -1) <= MERGE_FILTER_FIELDNO_MAX;
+	lua_pop(L, 1);
+	if (!ok)
+		return -1;
+	if (op == MERGE_FILTER_IS_NULL || op == MERGE_FILTER_NOT_NULL)
+		return len == 2 ? 0 : -1;
+	if (len != 3)
+		return -1;
+	lua_rawgeti(L, idx, 3);
+	int values_idx = lua_gettop(L);
+	struct merge_filter_value value;
+	int rc = 0;
+	if (op != MERGE_FILTER_IN) {
+		rc = luaT_merge_filter_value(L, values_idx, &value);
+	} else if (!lua_istable(L, values_idx)) {
+		rc = -1;
+	} else {
+		uint32_t count = lua_objlen(L, values_idx);
+		for (uint32_t i = 0; i < count && rc == 0; ++i) {
+			lua_rawgeti(L, values_idx, i + 1);
+			rc = luaT_merge_filter_value(L, lua_gettop(L),
+						     &value);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return rc;
+}
+
+/**
+ * Append nodes of a filter expression at @a idx, which is
+ * checked by luaT_merge_filter_check().
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+luaT_merge_filter_build(struct lua_State *L, int idx,
+			struct merge_filter *filter)
+{
+	enum merge_filter_op op = luaT_merge_filter_op(L, idx);
+	if (op == MERGE_FILTER_AND || op == MERGE_FILTER_OR) {
+		int node_idx = merge_filter_add(filter, op, 0, NULL, 0);
+		if (node_idx < 0)
+			return -1;
+		uint32_t len = lua_objlen(L, idx);
+		for (uint32_t i = 2; i <= len; ++i) {
+			lua_rawgeti(L, idx, i);
+			int rc = luaT_merge_filter_build(L, lua_gettop(L),
+							 filter);
+			lua_pop(L, 1);
+			if (rc != 0)
+				return -1;
+		}
+		merge_filter_close(filter, node_idx);
+		return 0;
+	}
+
+	lua_rawgeti(L, idx, 2);
+	uint32_t fieldno = lua_tointeger(L, -1) - 1;
+	lua_pop(L, 1);
+	if (op == MERGE_FILTER_IS_NULL || op == MERGE_FILTER_NOT_NULL)
+		return merge_filter_add(filter, op, fieldno, NULL, 0) < 0 ?
+		       -1 : 0;
+
+	/* Strings are held by the expression until they are copied. */
+	lua_rawgeti(L, idx, 3);
+	int values_idx = lua_gettop(L);
+	uint32_t count = op == MERGE_FILTER_IN ? lua_objlen(L, values_idx) : 1;
+	size_t size = sizeof(struct merge_filter_value) * (count + 1);
+	struct merge_filter_value *values = malloc(size);
+	if (values == NULL) {
+		lua_pop(L, 1);
+		diag_set_oom(size, "malloc", "values");
+		return -1;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		if (op != MERGE_FILTER_IN) {
+			luaT_merge_filter_value(L, values_idx, &values[i]);
+			continue;
+		}
+		lua_rawgeti(L, values_idx, i + 1);
+		luaT_merge_filter_value(L, lua_gettop(L), &values[i]);
+		lua_pop(L, 1);
+	}
+	int rc = merge_filter_add(filter, op, fieldno, values, count);
+	free(values);
+	lua_pop(L, 1);
+	return rc < 0 ? -1 : 0;
+}
+
+/**
+ * Compile a filter expression at @a idx, which is checked by
+ * luaT_merge_filter_check().
+ *
+ * Return NULL at an error and set a diag.
+ */
+static struct merge_filter *
+luaT_merge_filter_new(struct lua_State *L, int idx)
+{
+	struct merge_filter *filter = merge_filter_new();
+	if (filter == NULL)
+		return NULL;
+	if (luaT_merge_filter_build(L, idx, filter) != 0) {
+		merge_filter_delete(filter);
+		return NULL;
+	}
+	return filter;
+}
+
+/* }}} */
+
 /* {{{ Create, destroy structures from Lua */
 
 /**
@@ -292,7 +596,13 @@ lbox_merger_new_usage(struct lua_State *L, const char *param_name)
 {
 	static const char *usage = "merger.new(key_def, "
 				   "{source, source, ...}[, {"
-				   "reverse = <boolean> or <nil>}])";
+				   "reverse = <boolean> or <nil>, "
+				   "keyed = <boolean> or <nil>, "
+				   "fan_in = <number> or <nil>, "
+				   "memory_limit = <number> or <nil>, "
+				   "tmpdir = <string> or <nil>, "
+				   "cursor = <string> or <nil>, "
+				   "filter = <table> or <nil>}])";
 	if (param_name == NULL)
 		return luaL_error(L, "Bad params, use: %s", usage);
 	else
@@ -345,6 +655,221 @@ luaT_merger_new_parse_sources(struct lua_State *L, int idx,
 	return sources;
 }
 
+/**
+ * Get a type of a key part to compare it in MsgPack (see
+ * merger-offload.h).
+ *
+ * Return -1 when the part can't be compared this way.
+ */
+static int
+merge_offload_type_by_name(const char *type, const char *collation)
+{
+	if (type == NULL)
+		return -1;
+	if (strcmp(type, "unsigned") == 0)
+		return MERGE_OFFLOAD_UNSIGNED;
+	if (strcmp(type, "integer") == 0)
+		return MERGE_OFFLOAD_INTEGER;
+	if (strcmp(type, "number") == 0)
+		return MERGE_OFFLOAD_NUMBER;
+	if (strcmp(type, "boolean") == 0)
+		return MERGE_OFFLOAD_BOOLEAN;
+	if ((strcmp(type, "string") == 0 || strcmp(type, "str") == 0) &&
+	    collation == NULL)
+		return MERGE_OFFLOAD_STRING;
+	return -1;
+}
+
+enum { MERGE_KEY_PART_MAX = 64 };
+
+/**
+ * Key parts of a key_def, which a merger needs besides the
+ * key_def itself (see luaT_merge_key_parts_get()).
+ */
+struct merge_key_parts {
+	uint32_t part_count;
+	/* Zero based field numbers to encode a position. */
+	uint32_t fields[MERGE_KEY_PART_MAX];
+	/* Whether sort keys pay off: collation aware strings. */
+	bool has_sort_keys;
+	struct merge_sort_key_part sort_parts[MERGE_KEY_PART_MAX];
+	/* Whether parts may be compared in MsgPack. */
+	bool has_offload_parts;
+	struct merge_offload_part offload_parts[MERGE_OFFLOAD_PART_MAX];
+};
+
+/**
+ * Get key parts of a key_def to encode a position of a merger
+ * (see merger_set_key_fields()), compare sort keys (see
+ * merger_set_sort_keys()) when the key_def has collation aware
+ * string parts and merge sources in a coio thread (see
+ * merger_set_offload_parts()) when parts are plain scalars.
+ *
+ * Key parts are not accessible via the module API, so get them
+ * from key_def:totable(). The table is left on the Lua stack: it
+ * holds collation names. A caller should restore the stack.
+ *
+ * Return 0 at success. Return -1 if something goes wrong: a
+ * merger just compares tuples then and a cursor is not
+ * available.
+ */
+static int
+luaT_merge_key_parts_get(struct lua_State *L, int idx,
+			 struct merge_key_parts *key_parts)
+{
+	bool has_collation = false;
+	bool is_string = true;
+	bool is_asc = true;
+	bool is_scalar = true;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, KEY_DEF_TOTABLE_REF);
+	lua_pushvalue(L, idx);
+	if (lua_pcall(L, 1, 1, 0) != 0 || !lua_istable(L, -1))
+		return -1;
+	uint32_t part_count = lua_objlen(L, -1);
+	if (part_count == 0 || part_count > MERGE_KEY_PART_MAX)
+		return -1;
+	int parts_idx = lua_gettop(L);
+	for (uint32_t i = 0; i < part_count; ++i) {
+		lua_rawgeti(L, parts_idx, i + 1);
+		if (!lua_istable(L, -1))
+			return -1;
+		lua_getfield(L, -1, "type");
+		lua_getfield(L, -2, "fieldno");
+		lua_getfield(L, -3, "collation");
+		lua_getfield(L, -4, "path");
+		lua_getfield(L, -5, "is_nullable");
+		lua_getfield(L, -6, "sort_order");
+		if (!lua_isnumber(L, -5) || lua_tointeger(L, -5) < 1 ||
+		    !lua_isnil(L, -3))
+			return -1;
+		const char *type = lua_tostring(L, -6);
+		is_string &= type != NULL && (strcmp(type, "string") == 0 ||
+					      strcmp(type, "str") == 0);
+		uint32_t fieldno = lua_tointeger(L, -5) - 1;
+		key_parts->fields[i] = fieldno;
+		struct merge_sort_key_part *part = &key_parts->sort_parts[i];
+		part->fieldno = fieldno;
+		/* The string is held by the parts table. */
+		part->collation = lua_type(L, -4) == LUA_TSTRING ?
+			lua_tostring(L, -4) : NULL;
+		if (part->collation != NULL &&
+		    (strcmp(part->collation, "binary") == 0 ||
+		     strcmp(part->collation, "none") == 0))
+			part->collation = NULL;
+		has_collation |= part->collation != NULL;
+		/*
+		 * Descending parts are compared by a key_def only:
+		 * sort keys and offloaded comparisons are ascending.
+		 */
+		is_asc &= lua_isnil(L, -1) ||
+			(lua_type(L, -1) == LUA_TSTRING &&
+			 strcmp(lua_tostring(L, -1), "asc") == 0);
+		int offload_type = merge_offload_type_by_name(type,
+			part->collation);
+		is_scalar &= offload_type >= 0 &&
+			i < MERGE_OFFLOAD_PART_MAX && is_asc;
+		if (is_scalar) {
+			struct merge_offload_part *offload_part =
+				&key_parts->offload_parts[i];
+			offload_part->fieldno = fieldno;
+			offload_part->type = offload_type;
+			offload_part->is_nullable = lua_toboolean(L, -2);
+		}
+		lua_settop(L, parts_idx);
+	}
+	key_parts->part_count = part_count;
+	key_parts->has_sort_keys = is_string && has_collation && is_asc;
+	key_parts->has_offload_parts = is_scalar;
+	return 0;
+}
+
+/**
+ * Let a merger know its key parts (see
+ * luaT_merge_key_parts_get()). Do nothing if something goes
+ * wrong.
+ *
+ * It is the helper for lbox_merger_new().
+ */
+static void
+luaT_merger_set_key_parts(struct lua_State *L, int idx,
+			  struct merge_source *merger)
+{
+	struct merge_key_parts key_parts;
+	int top = lua_gettop(L);
+	if (luaT_merge_key_parts_get(L, idx, &key_parts) != 0)
+		goto out;
+	uint32_t part_count = key_parts.part_count;
+	/* A cursor is not available when it fails. */
+	merger_set_key_fields(merger, key_parts.fields, part_count);
+	if (key_parts.has_sort_keys)
+		merger_set_sort_keys(merger, key_parts.sort_parts,
+				     part_count);
+	/* Sources are merged in the tx thread when it fails. */
+	if (key_parts.has_offload_parts)
+		merger_set_offload_parts(merger, key_parts.offload_parts,
+					 part_count);
+out:
+	lua_settop(L, top);
+}
+
+/**
+ * Let mergers bound from a plan know their key parts like
+ * luaT_merger_set_key_parts() does for a merger: key_def is
+ * parsed once when the plan is prepared.
+ *
+ * It is the helper for lbox_merger_prepare().
+ */
+static void
+luaT_merge_plan_set_key_parts(struct lua_State *L, int idx,
+			      struct merge_plan *plan)
+{
+	struct merge_key_parts key_parts;
+	int top = lua_gettop(L);
+	if (luaT_merge_key_parts_get(L, idx, &key_parts) != 0)
+		goto out;
+	uint32_t part_count = key_parts.part_count;
+	merge_plan_set_key_fields(plan, key_parts.fields, part_count);
+	if (key_parts.has_sort_keys)
+		merge_plan_set_sort_keys(plan, key_parts.sort_parts,
+					 part_count);
+	if (key_parts.has_offload_parts)
+		merge_plan_set_offload_parts(plan, key_parts.offload_parts,
+					     part_count);
+out:
+	lua_settop(L, top);
+}
+
+/**
+ * Decode a cursor given by merge_source:select({cursor = true}):
+ * a MsgPack array of a key and a number of ties.
+ *
+ * Return 0 at success, -1 when the cursor is malformed.
+ */
+static int
+merger_decode_cursor(const char *cursor, size_t size, const char **key,
+		     const char **key_end, uint32_t *ties)
+{
+	const char *pos = cursor;
+	const char *end = cursor + size;
+	if (size == 0 || mp_check(&pos, end) != 0 || pos != end)
+		return -1;
+	pos = cursor;
+	if (mp_typeof(*pos) != MP_ARRAY || mp_decode_array(&pos) != 2 ||
+	    mp_typeof(*pos) != MP_ARRAY)
+		return -1;
+	*key = pos;
+	mp_next(&pos);
+	*key_end = pos;
+	if (mp_typeof(*pos) != MP_UINT)
+		return -1;
+	uint64_t value = mp_decode_uint(&pos);
+	if (value > UINT32_MAX)
+		return -1;
+	*ties = value;
+	return 0;
+}
+
 /**
  * Create a new merger and push it to a Lua stack as a merge
  * source.
@@ -369,6 +894,18 @@ lbox_merger_new(struct lua_State *L)
 
 	/* Options. */
 	bool reverse = false;
+	bool keyed = false;
+	const char *tmpdir = getenv("TMPDIR");
+	struct merge_cascade_opts cascade_opts = {
+		.fan_in = 0,
+		.memory_limit = 64 * 1024 * 1024,
+		.tmpdir = tmpdir != NULL ? tmpdir : "/tmp",
+	};
+	const char *cursor = NULL;
+	const char *cursor_key = NULL;
+	const char *cursor_key_end = NULL;
+	uint32_t cursor_ties = 0;
+	int filter_idx = 0;
 
 	/* Parse options. */
 	if (!lua_isnoneornil(L, 3)) {
@@ -382,6 +919,79 @@ lbox_merger_new(struct lua_State *L)
 				return lbox_merger_new_usage(L, "reverse");
 		}
 		lua_pop(L, 1);
+
+		/* Parse keyed. */
+		lua_pushstring(L, "keyed");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isboolean(L, -1))
+				keyed = lua_toboolean(L, -1);
+			else
+				return lbox_merger_new_usage(L, "keyed");
+		}
+		lua_pop(L, 1);
+
+		/* Parse fan_in. */
+		lua_pushstring(L, "fan_in");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 2 &&
+			    lua_tonumber(L, -1) <= UINT32_MAX && !keyed)
+				cascade_opts.fan_in = lua_tonumber(L, -1);
+			else
+				return lbox_merger_new_usage(L, "fan_in");
+		}
+		lua_pop(L, 1);
+
+		/* Parse memory_limit. */
+		lua_pushstring(L, "memory_limit");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0 &&
+			    cascade_opts.fan_in != 0)
+				cascade_opts.memory_limit =
+					lua_tonumber(L, -1);
+			else
+				return lbox_merger_new_usage(L,
+					"memory_limit");
+		}
+		lua_pop(L, 1);
+
+		/* Parse cursor. Keep the string on the stack. */
+		lua_pushstring(L, "cursor");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			size_t size;
+			if (lua_type(L, -1) != LUA_TSTRING ||
+			    cascade_opts.fan_in != 0)
+				return lbox_merger_new_usage(L, "cursor");
+			cursor = lua_tolstring(L, -1, &size);
+			if (merger_decode_cursor(cursor, size, &cursor_key,
+						 &cursor_key_end,
+						 &cursor_ties) != 0)
+				return lbox_merger_new_usage(L, "cursor");
+		}
+
+		/* Parse filter. Keep the table on the stack. */
+		lua_pushstring(L, "filter");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			filter_idx = lua_gettop(L);
+			if (cascade_opts.fan_in != 0 ||
+			    luaT_merge_filter_check(L, filter_idx, 0) != 0)
+				return lbox_merger_new_usage(L, "filter");
+		}
+
+		/* Parse tmpdir. Keep the string on the stack. */
+		lua_pushstring(L, "tmpdir");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_type(L, -1) == LUA_TSTRING &&
+			    cascade_opts.fan_in != 0)
+				cascade_opts.tmpdir = lua_tostring(L, -1);
+			else
+				return lbox_merger_new_usage(L, "tmpdir");
+		}
 	}
 
 	uint32_t source_count = 0;
@@ -390,11 +1000,38 @@ lbox_merger_new(struct lua_State *L)
 	if (sources == NULL)
 		return luaT_error(L);
 
-	struct merge_source *merger = merger_new(key_def, sources, source_count,
-						 reverse);
+	/* Merge many sources by a cascade of mergers. */
+	bool is_cascade = cascade_opts.fan_in != 0 &&
+		source_count > cascade_opts.fan_in;
+	struct merge_source *merger;
+	if (is_cascade)
+		merger = merge_cascade_new(key_def, sources, source_count,
+					   reverse, &cascade_opts);
+	else if (keyed)
+		merger = merger_new_keyed(key_def, sources, source_count,
+					  reverse);
+	else
+		merger = merger_new(key_def, sources, source_count, reverse);
 	free(sources);
 	if (merger == NULL)
 		return luaT_error(L);
+	if (!is_cascade)
+		luaT_merger_set_key_parts(L, 1, merger);
+	if (cursor != NULL &&
+	    merger_set_position(merger, cursor_key, cursor_key_end,
+				cursor_ties) != 0) {
+		merge_source_unref(merger);
+		return luaT_error(L);
+	}
+	if (filter_idx != 0) {
+		struct merge_filter *filter = luaT_merge_filter_new(L,
+			filter_idx);
+		if (filter == NULL) {
+			merge_source_unref(merger);
+			return luaT_error(L);
+		}
+		merger_set_filter(merger, filter);
+	}
 
 	*(struct merge_source **)
 		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_SOURCE_REF) = merger;
@@ -406,47 +1043,235 @@ lbox_merger_new(struct lua_State *L)
 
 /* }}} */
 
-/* {{{ Buffer merge source */
-
-struct merge_source_buffer {
-	struct merge_source base;
-	/*
-	 * A reference to a Lua iterator to fetch a next chunk of
-	 * tuples.
-	 */
-	struct luaL_iterator *fetch_it;
-	/*
-	 * A reference to a buffer storing the current chunk of
-	 * tuples. It is needed to prevent LuaJIT from collecting
-	 * the buffer while the source consider it as the current
-	 * one.
-	 */
-	int ref;
-	/*
-	 * A buffer with a current chunk of tuples.
-	 */
-	box_ibuf_t *buf;
-	/*
-	 * A merger stops before end of a buffer when it is not
-	 * the last merger in the chain.
-	 */
-	size_t remaining_tuple_count;
-};
+/* {{{ Merge plan */
 
-/* Virtual methods declarations */
+/**
+ * Extract a merge plan from the Lua stack.
+ */
+static struct merge_plan *
+luaT_check_merge_plan(struct lua_State *L, int idx)
+{
+	if (!luaL_iscdata(L, idx))
+		return NULL;
+	uint32_t cdata_type;
+	struct merge_plan **plan_ptr = luaL_checkcdata(L, idx, &cdata_type);
+	if (plan_ptr == NULL || cdata_type != CTID_STRUCT_TUPLE_MERGE_PLAN_REF)
+		return NULL;
+	return *plan_ptr;
+}
 
-static void
-luaL_merge_source_buffer_destroy(struct merge_source *base);
+/**
+ * Free a merge plan when its Lua object is collected. Mergers
+ * bound from the plan keep it alive.
+ */
 static int
-luaL_merge_source_buffer_next(struct merge_source *base,
-			      box_tuple_format_t *format,
-			      box_tuple_t **out);
-
-/* Non-virtual methods */
+lbox_merge_plan_gc(struct lua_State *L)
+{
+	struct merge_plan *plan = luaT_check_merge_plan(L, 1);
+	assert(plan != NULL);
+	merge_plan_unref(plan);
+	return 0;
+}
 
 /**
- * Create a new merge source of the buffer type.
- *
+ * Raise a Lua error with merger.prepare() usage info.
+ */
+static int
+lbox_merger_prepare_usage(struct lua_State *L, const char *param_name)
+{
+	static const char *usage = "merger.prepare(key_def, {"
+				   "max_sources = <number>, "
+				   "reverse = <boolean> or <nil>, "
+				   "keyed = <boolean> or <nil>})";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Create a new merge plan and push it onto the Lua stack.
+ *
+ * Expect cdata<struct key_def> and a table of options on a Lua
+ * stack.
+ */
+static int
+lbox_merger_prepare(struct lua_State *L)
+{
+	struct key_def *key_def;
+	bool ok = lua_gettop(L) == 2 &&
+		/* key_def. */
+		(key_def = luaT_check_key_def(L, 1)) != NULL &&
+		/* Opts. */
+		lua_istable(L, 2) == 1;
+	if (!ok)
+		return lbox_merger_prepare_usage(L, NULL);
+
+	/* Parse max_sources. */
+	uint32_t max_sources;
+	lua_pushstring(L, "max_sources");
+	lua_gettable(L, 2);
+	if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0 &&
+	    lua_tonumber(L, -1) <= UINT32_MAX)
+		max_sources = lua_tonumber(L, -1);
+	else
+		return lbox_merger_prepare_usage(L, "max_sources");
+	lua_pop(L, 1);
+
+	/* Parse reverse. */
+	bool reverse = false;
+	lua_pushstring(L, "reverse");
+	lua_gettable(L, 2);
+	if (!lua_isnil(L, -1)) {
+		if (lua_isboolean(L, -1))
+			reverse = lua_toboolean(L, -1);
+		else
+			return lbox_merger_prepare_usage(L, "reverse");
+	}
+	lua_pop(L, 1);
+
+	/* Parse keyed. */
+	bool keyed = false;
+	lua_pushstring(L, "keyed");
+	lua_gettable(L, 2);
+	if (!lua_isnil(L, -1)) {
+		if (lua_isboolean(L, -1))
+			keyed = lua_toboolean(L, -1);
+		else
+			return lbox_merger_prepare_usage(L, "keyed");
+	}
+	lua_pop(L, 1);
+
+	struct merge_plan *plan = merge_plan_new(key_def, max_sources,
+						 reverse, keyed);
+	if (plan == NULL)
+		return luaT_error(L);
+	luaT_merge_plan_set_key_parts(L, 1, plan);
+
+	*(struct merge_plan **)
+		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_PLAN_REF) = plan;
+	lua_pushcfunction(L, lbox_merge_plan_gc);
+	luaL_setcdatagc(L, -2);
+
+	return 1;
+}
+
+/**
+ * Create a merger of sources using a plan and push it onto the
+ * Lua stack.
+ *
+ * Expect a merge plan and a table of sources on a Lua stack.
+ */
+static int
+lbox_merge_plan_bind(struct lua_State *L)
+{
+	struct merge_plan *plan;
+	bool ok = lua_gettop(L) == 2 &&
+		/* Plan. */
+		(plan = luaT_check_merge_plan(L, 1)) != NULL &&
+		/* Sources. */
+		lua_istable(L, 2) == 1;
+	if (!ok)
+		return luaL_error(L, "Usage: plan:bind({source, source, "
+				  "...})");
+
+	uint32_t source_count = 0;
+	struct merge_source **sources = luaT_merger_new_parse_sources(L, 2,
+		&source_count);
+	if (sources == NULL)
+		return luaT_error(L);
+
+	struct merge_source *merger = merge_plan_bind(plan, sources,
+						      source_count);
+	free(sources);
+	if (merger == NULL)
+		return luaT_error(L);
+
+	*(struct merge_source **)
+		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_SOURCE_REF) = merger;
+	lua_pushcfunction(L, lbox_merge_source_gc);
+	luaL_setcdatagc(L, -2);
+
+	return 1;
+}
+
+/* }}} */
+
+/* {{{ Buffer merge source */
+
+struct merge_source_buffer {
+	struct merge_source base;
+	/*
+	 * A reference to a Lua iterator to fetch a next chunk of
+	 * tuples.
+	 */
+	struct luaL_iterator *fetch_it;
+	/*
+	 * A reference to a buffer storing the current chunk of
+	 * tuples. It is needed to prevent LuaJIT from collecting
+	 * the buffer while the source consider it as the current
+	 * one.
+	 */
+	int ref;
+	/*
+	 * A buffer with a current chunk of tuples.
+	 */
+	box_ibuf_t *buf;
+	/*
+	 * A merger stops before end of a buffer when it is not
+	 * the last merger in the chain.
+	 */
+	size_t remaining_tuple_count;
+	/*
+	 * Whether chunks are compact blocks (see
+	 * merger-compact.h) rather than MsgPack arrays of tuples.
+	 */
+	bool is_compact;
+	/* Whether entries are [key, tuple] pairs. */
+	bool is_keyed;
+	/* A decoder of compact blocks. */
+	struct merge_compact_decoder decoder;
+	/* Decoded tuples of the current compact block. */
+	const char *compact_pos;
+	const char *compact_end;
+	/*
+	 * Sizes of entries of the current chunk. The chunk is
+	 * validated in one pass when it is fetched, so next()
+	 * and copy_raw() don't walk MsgPack again.
+	 */
+	uint32_t *entry_sizes;
+	uint32_t entry_capacity;
+	/*
+	 * A number of valid entries of the current chunk (an
+	 * invalid one is reported when it is reached) and an
+	 * index of a next entry.
+	 */
+	uint32_t entry_count;
+	uint32_t entry_idx;
+	/*
+	 * A filter of tuples or NULL. It is evaluated on MsgPack,
+	 * so tuples are not created for rejected entries.
+	 */
+	struct merge_filter *filter;
+	/* Whether the chunks iterator ended. */
+	bool is_ended;
+};
+
+/* Virtual methods declarations */
+
+static void
+luaL_merge_source_buffer_destroy(struct merge_source *base);
+static int
+luaL_merge_source_buffer_copy_raw(struct merge_source *base,
+				  box_ibuf_t *buf, uint32_t limit,
+				  uint32_t *count_ptr);
+
+/* Non-virtual methods */
+
+/**
+ * Create a new merge source of the buffer type.
+ *
  * Reads gen, param, state from the top of a Lua stack.
  *
  * In case of an error it returns NULL and sets a diag.
@@ -457,6 +1282,8 @@ luaL_merge_source_buffer_new(struct lua_State *L)
 	static struct merge_source_vtab merge_source_buffer_vtab = {
 		.destroy = luaL_merge_source_buffer_destroy,
 		.next = luaL_merge_source_buffer_next,
+		.next_keyed = luaL_merge_source_buffer_next_keyed,
+		.copy_raw = luaL_merge_source_buffer_copy_raw,
 	};
 
 	struct merge_source_buffer *source = malloc(
@@ -473,10 +1300,107 @@ luaL_merge_source_buffer_new(struct lua_State *L)
 	source->ref = 0;
 	source->buf = NULL;
 	source->remaining_tuple_count = 0;
+	source->is_compact = false;
+	source->is_keyed = false;
+	merge_compact_decoder_create(&source->decoder);
+	source->compact_pos = NULL;
+	source->compact_end = NULL;
+	source->entry_sizes = NULL;
+	source->entry_capacity = 0;
+	source->entry_count = 0;
+	source->entry_idx = 0;
+	source->filter = NULL;
+	source->is_ended = false;
 
 	return &source->base;
 }
 
+/**
+ * Validate entries of a fetched chunk and save their sizes.
+ *
+ * Stop at a first invalid entry: it is reported when a source
+ * reaches it, like tuples before it are given.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+luaL_merge_source_buffer_index(struct merge_source_buffer *source,
+			       const char *data, const char *data_end)
+{
+	/* Each entry occupies one byte at least. */
+	size_t count = source->remaining_tuple_count;
+	if (count > (size_t)(data_end - data))
+		count = data_end - data;
+	if (count > UINT32_MAX)
+		count = UINT32_MAX;
+	if (count > source->entry_capacity) {
+		uint32_t capacity = source->entry_capacity > 0 ?
+			source->entry_capacity : 64;
+		while (capacity < count)
+			capacity = capacity * 2 > capacity ? capacity * 2 :
+				UINT32_MAX;
+		size_t size = sizeof(uint32_t) * capacity;
+		uint32_t *sizes = realloc(source->entry_sizes, size);
+		if (sizes == NULL) {
+			diag_set_oom(size, "realloc", "entry sizes");
+			return -1;
+		}
+		source->entry_sizes = sizes;
+		source->entry_capacity = capacity;
+	}
+
+	const char *pos = data;
+	uint32_t i = 0;
+	while (i < count && pos < data_end) {
+		const char *end = pos;
+		if (mp_check(&end, data_end) != 0)
+			break;
+		source->entry_sizes[i++] = end - pos;
+		pos = end;
+	}
+	source->entry_count = i;
+	source->entry_idx = 0;
+	return 0;
+}
+
+/**
+ * Decode a compact block (a MsgPack string or binary) from the
+ * current buffer and skip it.
+ *
+ * Return 1 at success and -1 at an error and set a diag.
+ */
+static int
+luaL_merge_source_buffer_decode_compact(struct merge_source_buffer *source)
+{
+	char **rpos;
+	char **wpos;
+	box_ibuf_read_range(source->buf, &rpos, &wpos);
+	const char *pos = *rpos;
+	const char *end = pos;
+	if (ibuf_used(*rpos, *wpos) == 0 ||
+	    (mp_typeof(*pos) != MP_STR && mp_typeof(*pos) != MP_BIN) ||
+	    mp_check(&end, *wpos) != 0) {
+		diag_set_illegal("Invalid merge source %p",
+			 &source->base);
+		return -1;
+	}
+	uint32_t size;
+	const char *block = mp_typeof(*pos) == MP_STR ?
+		mp_decode_str(&pos, &size) : mp_decode_bin(&pos, &size);
+	*rpos = (char *)end;
+
+	uint32_t count;
+	if (merge_compact_decode(&source->decoder, block, block + size,
+				 &source->compact_pos, &source->compact_end,
+				 &count) != 0)
+		return -1;
+	source->remaining_tuple_count = count;
+	if (luaL_merge_source_buffer_index(source, source->compact_pos,
+					   source->compact_end) != 0)
+		return -1;
+	return 1;
+}
+
 /**
  * Helper for `luaL_merge_source_buffer_fetch()`.
  */
@@ -484,6 +1408,17 @@ static int
 luaL_merge_source_buffer_fetch_impl(struct merge_source_buffer *source,
 				    struct lua_State *L)
 {
+	/*
+	 * The current chunk is drained: release it before the
+	 * call, so a gen function may reuse or free it, and the
+	 * chunk is not held while the function waits for a next
+	 * one or after the last one.
+	 */
+	if (source->ref > 0) {
+		luaL_unref(L, LUA_REGISTRYINDEX, source->ref);
+		source->ref = 0;
+		source->buf = NULL;
+	}
 	int nresult = luaL_iterator_next(L, source->fetch_it);
 
 	/* Handle a Lua error in a gen function. */
@@ -502,10 +1437,6 @@ luaL_merge_source_buffer_fetch_impl(struct merge_source_buffer *source,
 	}
 
 	/* Set a new buffer as the current chunk. */
-	if (source->ref > 0) {
-		luaL_unref(L, LUA_REGISTRYINDEX, source->ref);
-		source->ref = 0;
-	}
 	lua_pushvalue(L, -nresult + 1); /* Popped by luaL_ref(). */
 	source->buf = luaT_toibuf(L, -1);
 	if (source->buf == NULL) {
@@ -515,12 +1446,20 @@ luaL_merge_source_buffer_fetch_impl(struct merge_source_buffer *source,
 	source->ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	lua_pop(L, nresult);
 
+	if (source->is_compact)
+		return luaL_merge_source_buffer_decode_compact(source);
+
 	/* Update remaining_tuple_count and skip the header. */
 	if (decode_header(source->buf, &source->remaining_tuple_count) != 0) {
 		diag_set_illegal("Invalid merge source %p",
 			 &source->base);
 		return -1;
 	}
+	char **rpos;
+	char **wpos;
+	box_ibuf_read_range(source->buf, &rpos, &wpos);
+	if (luaL_merge_source_buffer_index(source, *rpos, *wpos) != 0)
+		return -1;
 	return 1;
 }
 
@@ -534,6 +1473,9 @@ luaL_merge_source_buffer_fetch_impl(struct merge_source_buffer *source,
 static int
 luaL_merge_source_buffer_fetch(struct merge_source_buffer *source)
 {
+	/* Don't call an ended iterator again. */
+	if (source->is_ended)
+		return 0;
 	int coro_ref = LUA_REFNIL;
 	int top = -1;
 	struct lua_State *L = luaT_temp_luastate(&coro_ref, &top);
@@ -541,6 +1483,7 @@ luaL_merge_source_buffer_fetch(struct merge_source_buffer *source)
 		return -1;
 	int rc = luaL_merge_source_buffer_fetch_impl(source, L);
 	luaT_release_temp_luastate(L, coro_ref, top);
+	source->is_ended = rc == 0;
 	return rc;
 }
 
@@ -561,23 +1504,28 @@ luaL_merge_source_buffer_destroy(struct merge_source *base)
 	luaL_iterator_delete(source->fetch_it);
 	if (source->ref > 0)
 		luaL_unref(luaT_state(), LUA_REGISTRYINDEX, source->ref);
+	merge_compact_decoder_destroy(&source->decoder);
+	free(source->entry_sizes);
+	if (source->filter != NULL)
+		merge_filter_delete(source->filter);
 
 	free(source);
 }
 
 /**
- * next() virtual method implementation for a buffer source.
+ * Read a next entry from a buffer source: a tuple and, for the
+ * keyed format, its key.
  *
- * @see struct merge_source_vtab
+ * Set @a tuple_beg to NULL when the source ends.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
  */
 static int
-luaL_merge_source_buffer_next(struct merge_source *base,
-			      box_tuple_format_t *format,
-			      box_tuple_t **out)
+luaL_merge_source_buffer_read_entry(struct merge_source_buffer *source,
+				    const char **key_beg, const char **key_end,
+				    const char **tuple_beg,
+				    const char **tuple_end)
 {
-	struct merge_source_buffer *source = container_of(base,
-		struct merge_source_buffer, base);
-
 	/*
 	 * Handle the case when all data were processed: ask a
 	 * next chunk until a non-empty chunk is received or a
@@ -588,101 +1536,712 @@ luaL_merge_source_buffer_next(struct merge_source *base,
 		if (rc < 0)
 			return -1;
 		if (rc == 0) {
-			*out = NULL;
+			*tuple_beg = NULL;
 			return 0;
 		}
 	}
-	char **rpos;
-	char **wpos;
-	box_ibuf_read_range(source->buf, &rpos, &wpos);
-	if (ibuf_used(*rpos, *wpos) == 0) {
-		diag_set_illegal("Unexpected msgpack buffer end");
-		return -1;
+	char **rpos = NULL;
+	char **wpos = NULL;
+	const char *entry_beg;
+	if (source->is_compact) {
+		entry_beg = source->compact_pos;
+	} else {
+		box_ibuf_read_range(source->buf, &rpos, &wpos);
+		entry_beg = *rpos;
 	}
-	const char *tuple_beg = *rpos;
-	const char *tuple_end = tuple_beg;
-	if (mp_check(&tuple_end, *wpos) != 0) {
+	/* The entry is validated by luaL_merge_source_buffer_index(). */
+	if (source->entry_idx == source->entry_count) {
 		diag_set_illegal("Unexpected msgpack buffer end");
 		return -1;
 	}
+	const char *entry_end = entry_beg +
+		source->entry_sizes[source->entry_idx++];
 	--source->remaining_tuple_count;
-	*rpos = (char *)tuple_end;
-	if (format == NULL)
-		format = box_tuple_format_default();
+	if (source->is_compact)
+		source->compact_pos = entry_end;
+	else
+		*rpos = (char *)entry_end;
+
+	/* Split a [key, tuple] entry. */
+	*key_beg = NULL;
+	*key_end = NULL;
+	if (source->is_keyed) {
+		const char *pos = entry_beg;
+		if (mp_typeof(*pos) != MP_ARRAY ||
+		    mp_decode_array(&pos) != 2 ||
+		    mp_typeof(*pos) != MP_ARRAY) {
+			diag_set_illegal("Expected [key, tuple] entry");
+			return -1;
+		}
+		*key_beg = pos;
+		mp_next(&pos);
+		*key_end = pos;
+		entry_beg = pos;
+	}
+
 	/*
 	 * If we encounter an MP_TUPLE, skip the extension header and the tuple
 	 * format identifier.
 	 */
-	if (mp_typeof(*tuple_beg) == MP_EXT) {
+	if (mp_typeof(*entry_beg) == MP_EXT) {
 		int8_t type;
-		mp_decode_extl(&tuple_beg, &type);
+		mp_decode_extl(&entry_beg, &type);
 		if (type != MP_TUPLE) {
 			diag_set_illegal("Unexpected MsgPack extension type "
 					 "(should be MP_TUPLE)");
 			return -1;
 		}
-		assert(mp_typeof(*tuple_beg) == MP_UINT);
+		assert(mp_typeof(*entry_beg) == MP_UINT);
 		/* Skip the tuple format identifier. */
-		mp_decode_uint(&tuple_beg);
+		mp_decode_uint(&entry_beg);
 	}
-	box_tuple_t *tuple = box_tuple_new(format, tuple_beg, tuple_end);
-	if (tuple == NULL)
-		return -1;
-
-	box_tuple_ref(tuple);
-	*out = tuple;
+	*tuple_beg = entry_beg;
+	*tuple_end = entry_end;
 	return 0;
 }
 
-/* Lua functions */
-
 /**
- * Create a new buffer source and push it onto the Lua stack.
+ * Get a next entry, which satisfies a filter of a buffer
+ * source.
+ *
+ * @see luaL_merge_source_buffer_read_entry()
  */
 static int
-lbox_merger_new_buffer_source(struct lua_State *L)
+luaL_merge_source_buffer_next_entry(struct merge_source_buffer *source,
+				    const char **key_beg, const char **key_end,
+				    const char **tuple_beg,
+				    const char **tuple_end)
 {
-	return lbox_merge_source_new(L, "merger.new_buffer_source",
-				     luaL_merge_source_buffer_new);
+	while (true) {
+		if (luaL_merge_source_buffer_read_entry(source, key_beg,
+							key_end, tuple_beg,
+							tuple_end) != 0)
+			return -1;
+		/* box_tuple_new() reports a malformed tuple. */
+		if (*tuple_beg == NULL || source->filter == NULL ||
+		    mp_typeof(**tuple_beg) != MP_ARRAY ||
+		    merge_filter_match_raw(source->filter, *tuple_beg))
+			return 0;
+	}
 }
 
-/* }}} */
-
-/* {{{ Table merge source */
-
-struct merge_source_table {
-	struct merge_source base;
-	/*
-	 * A reference to a Lua iterator to fetch a next chunk of
-	 * tuples.
-	 */
-	struct luaL_iterator *fetch_it;
-	/*
-	 * A reference to a table with a current chunk of tuples.
-	 */
-	int ref;
-	/* An index of current tuples within a current chunk. */
-	int next_idx;
-};
-
-/* Virtual methods declarations */
+/**
+ * next() virtual method implementation for a buffer source.
+ *
+ * @see struct merge_source_vtab
+ */
+int
+luaL_merge_source_buffer_next(struct merge_source *base,
+			      box_tuple_format_t *format,
+			      box_tuple_t **out)
+{
+	struct merge_source_buffer *source = container_of(base,
+		struct merge_source_buffer, base);
 
-static void
-luaL_merge_source_table_destroy(struct merge_source *base);
-static int
-luaL_merge_source_table_next(struct merge_source *base,
-			     box_tuple_format_t *format,
-			     box_tuple_t **out);
+	const char *key_beg, *key_end, *tuple_beg, *tuple_end;
+	if (luaL_merge_source_buffer_next_entry(source, &key_beg, &key_end,
+						&tuple_beg, &tuple_end) != 0)
+		return -1;
+	if (tuple_beg == NULL) {
+		*out = NULL;
+		return 0;
+	}
+	if (format == NULL)
+		format = box_tuple_format_default();
+	box_tuple_t *tuple = box_tuple_new(format, tuple_beg, tuple_end);
+	if (tuple == NULL)
+		return -1;
 
-/* Non-virtual methods */
+	box_tuple_ref(tuple);
+	*out = tuple;
+	return 0;
+}
 
 /**
- * Create a new merge source of the table type.
+ * next_keyed() virtual method implementation for a buffer
+ * source.
  *
- * In case of an error it returns NULL and set a diag.
+ * The tuple is created in the default format, so its fields are
+ * not parsed: only the key is.
+ *
+ * @see struct merge_source_vtab
  */
-static struct merge_source *
-luaL_merge_source_table_new(struct lua_State *L)
+int
+luaL_merge_source_buffer_next_keyed(struct merge_source *base,
+				    box_tuple_format_t *key_format,
+				    box_tuple_t **key, box_tuple_t **out)
+{
+	struct merge_source_buffer *source = container_of(base,
+		struct merge_source_buffer, base);
+
+	if (!source->is_keyed) {
+		diag_set_illegal("A buffer source gives keys only with "
+				 "{format = 'keyed'}");
+		return -1;
+	}
+
+	const char *key_beg, *key_end, *tuple_beg, *tuple_end;
+	if (luaL_merge_source_buffer_next_entry(source, &key_beg, &key_end,
+						&tuple_beg, &tuple_end) != 0)
+		return -1;
+	if (tuple_beg == NULL) {
+		*key = NULL;
+		*out = NULL;
+		return 0;
+	}
+	if (key_format == NULL)
+		key_format = box_tuple_format_default();
+	box_tuple_t *key_tuple = box_tuple_new(key_format, key_beg, key_end);
+	if (key_tuple == NULL)
+		return -1;
+	box_tuple_ref(key_tuple);
+	box_tuple_t *tuple = box_tuple_new(box_tuple_format_default(),
+					   tuple_beg, tuple_end);
+	if (tuple == NULL) {
+		box_tuple_unref(key_tuple);
+		return -1;
+	}
+
+	box_tuple_ref(tuple);
+	*key = key_tuple;
+	*out = tuple;
+	return 0;
+}
+
+/**
+ * Append MsgPack of [@a beg, @a end) to @a buf.
+ *
+ * Return 0 at success. Return -1 at OOM and set a diag.
+ */
+static int
+luaL_merge_source_buffer_copy_run(box_ibuf_t *buf, const char *beg,
+				  const char *end)
+{
+	size_t size = end - beg;
+	if (size == 0)
+		return 0;
+	char **wpos;
+	box_ibuf_write_range(buf, &wpos, NULL);
+	if (box_ibuf_reserve(buf, size) == NULL) {
+		diag_set_oom(size, "ibuf", "tuples");
+		return -1;
+	}
+	memcpy(*wpos, beg, size);
+	*wpos += size;
+	return 0;
+}
+
+/**
+ * copy_raw() virtual method implementation for a buffer source.
+ *
+ * Copy tuples that remain in the current chunk with one
+ * memcpy() (one per a run of accepted tuples when the source
+ * has a filter). Stop at a tuple that needs special handling
+ * (an MP_TUPLE extension) and at a chunk end: next() handles
+ * them.
+ *
+ * @see struct merge_source_vtab
+ */
+static int
+luaL_merge_source_buffer_copy_raw(struct merge_source *base,
+				  box_ibuf_t *buf, uint32_t limit,
+				  uint32_t *count_ptr)
+{
+	struct merge_source_buffer *source = container_of(base,
+		struct merge_source_buffer, base);
+
+	*count_ptr = 0;
+	if (source->is_keyed || source->remaining_tuple_count == 0)
+		return 0;
+
+	char **rpos = NULL;
+	char **wpos = NULL;
+	const char *data_beg;
+	if (source->is_compact) {
+		data_beg = source->compact_pos;
+	} else {
+		box_ibuf_read_range(source->buf, &rpos, &wpos);
+		data_beg = *rpos;
+	}
+
+	/*
+	 * Find tuples to copy using validated entry sizes and
+	 * copy runs of accepted ones.
+	 */
+	const char *pos = data_beg;
+	const char *run_beg = data_beg;
+	uint32_t count = 0;
+	uint32_t consumed = 0;
+	/* Entries before run_beg and accepted tuples among them. */
+	uint32_t done = 0;
+	uint32_t done_count = 0;
+	int rc = 0;
+	uint32_t valid_count = source->entry_count - source->entry_idx;
+	while (count < limit && consumed < source->remaining_tuple_count &&
+	       consumed < valid_count && mp_typeof(*pos) == MP_ARRAY) {
+		const char *next = pos +
+			source->entry_sizes[source->entry_idx + consumed];
+		++consumed;
+		if (source->filter != NULL &&
+		    !merge_filter_match_raw(source->filter, pos)) {
+			rc = luaL_merge_source_buffer_copy_run(buf, run_beg,
+							       pos);
+			if (rc != 0)
+				break;
+			run_beg = next;
+			done = consumed;
+			done_count = count;
+		} else {
+			++count;
+		}
+		pos = next;
+	}
+	if (rc == 0 &&
+	    (rc = luaL_merge_source_buffer_copy_run(buf, run_beg, pos)) == 0) {
+		run_beg = pos;
+		done = consumed;
+		done_count = count;
+	}
+
+	/* Tuples of copied runs are given even at an error. */
+	source->remaining_tuple_count -= done;
+	source->entry_idx += done;
+	if (source->is_compact)
+		source->compact_pos = run_beg;
+	else
+		*rpos = (char *)run_beg;
+	*count_ptr = done_count;
+	return rc;
+}
+
+/**
+ * Give next entries of a buffer source to an offload as a run:
+ * tuples that copy_raw() would copy. Fetch a next chunk when
+ * the current one is over.
+ *
+ * Set @a count_ptr to a number of entries in the run. It is
+ * zero when the source ends or when its next entry needs
+ * special handling (an MP_TUPLE extension or an invalid entry):
+ * next() handles it.
+ *
+ * Return 0 at success. Return -1 at an error and set a diag.
+ */
+static int
+luaL_merge_source_buffer_offload_run(struct merge_source_buffer *source,
+				     struct merge_offload *offload,
+				     uint32_t idx, uint32_t *count_ptr)
+{
+	*count_ptr = 0;
+	merge_offload_set_run(offload, idx, NULL, NULL, 0);
+	while (source->remaining_tuple_count == 0) {
+		int rc = luaL_merge_source_buffer_fetch(source);
+		if (rc <= 0)
+			return rc;
+	}
+
+	const char *data_beg;
+	if (source->is_compact) {
+		data_beg = source->compact_pos;
+	} else {
+		char **rpos;
+		char **wpos;
+		box_ibuf_read_range(source->buf, &rpos, &wpos);
+		data_beg = *rpos;
+	}
+	const char *pos = data_beg;
+	uint32_t count = 0;
+	uint32_t valid_count = source->entry_count - source->entry_idx;
+	while (count < source->remaining_tuple_count &&
+	       count < valid_count && mp_typeof(*pos) == MP_ARRAY) {
+		pos += source->entry_sizes[source->entry_idx + count];
+		++count;
+	}
+	merge_offload_set_run(offload, idx, data_beg,
+			      source->entry_sizes + source->entry_idx, count);
+	*count_ptr = count;
+	return 0;
+}
+
+/**
+ * Skip entries of a buffer source, which are merged by an
+ * offload. Return a number of entries that remain in its run.
+ */
+static uint32_t
+luaL_merge_source_buffer_offload_take(struct merge_source_buffer *source,
+				      struct merge_offload *offload,
+				      uint32_t idx)
+{
+	const char *pos;
+	uint32_t left;
+	uint32_t taken = merge_offload_take(offload, idx, &pos, &left);
+	source->remaining_tuple_count -= taken;
+	source->entry_idx += taken;
+	if (source->is_compact) {
+		source->compact_pos = pos;
+	} else if (taken > 0) {
+		char **rpos;
+		char **wpos;
+		box_ibuf_read_range(source->buf, &rpos, &wpos);
+		*rpos = (char *)pos;
+	}
+	return left;
+}
+
+/**
+ * Merge buffer sources of a merger in a coio thread for
+ * select({buffer = ..., offload = true}) and write up to
+ * @a limit tuples into the buffer.
+ *
+ * A worker thread can't call Lua, so chunks are fetched by the
+ * calling fiber between merges: a merge stops when a chunk of a
+ * source is over.
+ *
+ * It gives a prefix of results when a merge can't go on this
+ * way (say, a source gives an MP_TUPLE extension or a key of a
+ * wrong type): the merger gives the rest as usual, because it
+ * has not started. Nothing is merged when the merger can't be
+ * merged this way (see merger_offload_info()) or some of its
+ * sources is not a buffer source without a filter.
+ *
+ * The array header at @a header_offset holds a number of
+ * written tuples while the fiber yields. Set @a is_end when all
+ * sources end. Set @a is_cancelled when the fiber is cancelled.
+ *
+ * Return 0 at success and set @a count_ptr to a number of
+ * written tuples. Return -1 at an error and set a diag.
+ */
+static int
+merge_source_buffer_offload(struct merge_source *merger, box_ibuf_t *buf,
+			    size_t header_offset, uint32_t limit,
+			    double deadline, uint32_t *count_ptr,
+			    bool *is_end, bool *is_cancelled)
+{
+	*count_ptr = 0;
+	const struct merge_offload_part *parts;
+	uint32_t part_count;
+	bool reverse;
+	uint32_t source_count;
+	if (!merger_offload_info(merger, &parts, &part_count, &reverse,
+				 &source_count) || source_count == 0)
+		return 0;
+	for (uint32_t i = 0; i < source_count; ++i) {
+		struct merge_source *base = merger_source(merger, i);
+		if (base->vtab->destroy != luaL_merge_source_buffer_destroy)
+			return 0;
+		struct merge_source_buffer *source = container_of(base,
+			struct merge_source_buffer, base);
+		if (source->is_keyed || source->filter != NULL)
+			return 0;
+	}
+
+	struct merge_offload *offload = merge_offload_new(parts, part_count,
+							  reverse,
+							  source_count);
+	if (offload == NULL)
+		return -1;
+
+	/*
+	 * Merge while each live source has a run. A source that
+	 * can't give one stops the offload.
+	 */
+	int rc = 0;
+	uint32_t count = 0;
+	bool is_stuck = false;
+	while (true) {
+		for (uint32_t i = 0; i < source_count && !is_stuck; ++i) {
+			struct merge_source_buffer *source = container_of(
+				merger_source(merger, i),
+				struct merge_source_buffer, base);
+			uint32_t left = luaL_merge_source_buffer_offload_take(
+				source, offload, i);
+			if (left > 0 || source->is_ended)
+				continue;
+			rc = luaL_merge_source_buffer_offload_run(source,
+				offload, i, &left);
+			is_stuck = rc != 0 || (left == 0 && !source->is_ended);
+		}
+		if (is_stuck || count == limit)
+			break;
+		size_t bsize = merge_offload_bsize(offload);
+		if (bsize == 0) {
+			*is_end = true;
+			break;
+		}
+		if (deadline != 0 && clock_realtime() >= deadline)
+			break;
+
+		char **rpos;
+		char **wpos;
+		box_ibuf_read_range(buf, &rpos, &wpos);
+		mp_store_u32(*rpos + header_offset + 1, count);
+		if (box_ibuf_reserve(buf, bsize) == NULL) {
+			diag_set_oom(bsize, "ibuf", "tuples");
+			rc = -1;
+			break;
+		}
+		/* The buffer may be reallocated. */
+		box_ibuf_read_range(buf, &rpos, &wpos);
+		uint32_t merged;
+		bool is_mismatch;
+		ssize_t size = merge_offload_merge(offload, *wpos,
+						   limit - count, &merged,
+						   &is_mismatch);
+		if (size < 0) {
+			rc = -1;
+			break;
+		}
+		*wpos += size;
+		count += merged;
+		if ((*is_cancelled = fiber_is_cancelled()))
+			break;
+		/* The merger gives the rest. */
+		is_stuck = is_mismatch;
+	}
+	/* Skip entries of the last merge. */
+	for (uint32_t i = 0; i < source_count; ++i) {
+		struct merge_source_buffer *source = container_of(
+			merger_source(merger, i), struct merge_source_buffer,
+			base);
+		luaL_merge_source_buffer_offload_take(source, offload, i);
+	}
+	merge_offload_delete(offload);
+	*count_ptr = count;
+	return rc;
+}
+
+/* Lua functions */
+
+/**
+ * Raise a Lua error with merger.new_buffer_source() usage info.
+ */
+static int
+lbox_merger_new_buffer_source_usage(struct lua_State *L,
+				    const char *param_name)
+{
+	static const char *usage = "merger.new_buffer_source(gen, param, "
+				   "state[, {format = 'msgpack' or "
+				   "'compact' or 'keyed' or <nil>, "
+				   "filter = <table> or <nil>}])";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Create a new buffer source and push it onto the Lua stack.
+ *
+ * Accept an optional table of options after gen, param, state.
+ */
+static int
+lbox_merger_new_buffer_source(struct lua_State *L)
+{
+	bool is_compact = false;
+	bool is_keyed = false;
+	int filter_ref = LUA_NOREF;
+
+	/* Parse options. */
+	if (lua_gettop(L) == 4) {
+		if (!lua_isnil(L, 4) && !lua_istable(L, 4))
+			return lbox_merger_new_buffer_source_usage(L, NULL);
+		if (lua_istable(L, 4)) {
+			/* Parse format. */
+			lua_pushstring(L, "format");
+			lua_gettable(L, 4);
+			if (!lua_isnil(L, -1)) {
+				const char *format =
+					lua_type(L, -1) == LUA_TSTRING ?
+					lua_tostring(L, -1) : "";
+				if (strcmp(format, "compact") == 0)
+					is_compact = true;
+				else if (strcmp(format, "keyed") == 0)
+					is_keyed = true;
+				else if (strcmp(format, "msgpack") != 0)
+					return lbox_merger_new_buffer_source_usage(
+						L, "format");
+			}
+			lua_pop(L, 1);
+
+			/*
+			 * Parse filter. Hold the table while the
+			 * source is created.
+			 */
+			lua_pushstring(L, "filter");
+			lua_gettable(L, 4);
+			if (!lua_isnil(L, -1)) {
+				if (luaT_merge_filter_check(L, lua_gettop(L),
+							    0) != 0)
+					return lbox_merger_new_buffer_source_usage(
+						L, "filter");
+				filter_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			}
+		}
+		lua_settop(L, 3);
+	}
+
+	int rc = lbox_merge_source_new(L, "merger.new_buffer_source",
+				       luaL_merge_source_buffer_new);
+	struct merge_source_buffer *source = container_of(
+		luaT_check_merge_source(L, -1), struct merge_source_buffer,
+		base);
+	source->is_compact = is_compact;
+	source->is_keyed = is_keyed;
+	if (filter_ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, filter_ref);
+		luaL_unref(L, LUA_REGISTRYINDEX, filter_ref);
+		source->filter = luaT_merge_filter_new(L, lua_gettop(L));
+		if (source->filter == NULL)
+			return luaT_error(L);
+		lua_pop(L, 1);
+	}
+	return rc;
+}
+
+/* }}} */
+
+/* {{{ Compact chunks */
+
+/**
+ * Raise a Lua error with merger.encode_compact() usage info.
+ */
+static int
+lbox_merger_encode_compact_usage(struct lua_State *L, const char *param_name)
+{
+	static const char *usage = "merger.encode_compact({tuple, tuple, "
+				   "...}[, {delta = <boolean> or <nil>, "
+				   "compress = <boolean> or <nil>}])";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Encode tuples into a compact block for a buffer source with
+ * {format = 'compact'} and push it onto the Lua stack as a
+ * string.
+ *
+ * Expect a table of tuples (or tables) and (optionally) a table
+ * of options on a Lua stack.
+ */
+static int
+lbox_merger_encode_compact(struct lua_State *L)
+{
+	int top = lua_gettop(L);
+	bool ok = (top == 1 || top == 2) &&
+		/* Tuples. */
+		lua_istable(L, 1) == 1 &&
+		/* Opts. */
+		(lua_isnoneornil(L, 2) == 1 || lua_istable(L, 2) == 1);
+	if (!ok)
+		return lbox_merger_encode_compact_usage(L, NULL);
+
+	/* Options. */
+	int delta = -1; /* Use when applicable. */
+	bool compress = false;
+
+	/* Parse options. */
+	if (!lua_isnoneornil(L, 2)) {
+		/* Parse delta. */
+		lua_pushstring(L, "delta");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isboolean(L, -1))
+				delta = lua_toboolean(L, -1);
+			else
+				return lbox_merger_encode_compact_usage(L,
+					"delta");
+		}
+		lua_pop(L, 1);
+
+		/* Parse compress. */
+		lua_pushstring(L, "compress");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isboolean(L, -1))
+				compress = lua_toboolean(L, -1);
+			else
+				return lbox_merger_encode_compact_usage(L,
+					"compress");
+		}
+		lua_pop(L, 1);
+	}
+
+	struct merge_compact_encoder encoder;
+	merge_compact_encoder_create(&encoder);
+	uint32_t tuple_count = lua_objlen(L, 1);
+	for (uint32_t i = 0; i < tuple_count; ++i) {
+		lua_rawgeti(L, 1, i + 1);
+		box_tuple_t *tuple = luaT_gettuple(L, -1, NULL);
+		if (tuple == NULL)
+			goto error;
+		box_tuple_ref(tuple);
+		int rc = merge_compact_encoder_add(&encoder, tuple);
+		box_tuple_unref(tuple);
+		if (rc != 0)
+			goto error;
+		lua_pop(L, 1);
+	}
+
+	unsigned flags = 0;
+	if (delta == 1 || (delta == -1 && tuple_count > 0 &&
+			   encoder.is_delta_applicable))
+		flags |= MERGE_COMPACT_DELTA;
+	if (compress)
+		flags |= MERGE_COMPACT_LZ;
+	size_t size;
+	char *block = merge_compact_encoder_finish(&encoder, flags, &size);
+	if (block == NULL)
+		goto error;
+	merge_compact_encoder_destroy(&encoder);
+	lua_pushlstring(L, block, size);
+	free(block);
+	return 1;
+
+error:
+	merge_compact_encoder_destroy(&encoder);
+	return luaT_error(L);
+}
+
+/* }}} */
+
+/* {{{ Table merge source */
+
+struct merge_source_table {
+	struct merge_source base;
+	/*
+	 * A reference to a Lua iterator to fetch a next chunk of
+	 * tuples.
+	 */
+	struct luaL_iterator *fetch_it;
+	/*
+	 * A reference to a table with a current chunk of tuples.
+	 */
+	int ref;
+	/* An index of current tuples within a current chunk. */
+	int next_idx;
+};
+
+/* Virtual methods declarations */
+
+static void
+luaL_merge_source_table_destroy(struct merge_source *base);
+static int
+luaL_merge_source_table_next(struct merge_source *base,
+			     box_tuple_format_t *format,
+			     box_tuple_t **out);
+
+/* Non-virtual methods */
+
+/**
+ * Create a new merge source of the table type.
+ *
+ * In case of an error it returns NULL and set a diag.
+ */
+static struct merge_source *
+luaL_merge_source_table_new(struct lua_State *L)
 {
 	static struct merge_source_vtab merge_source_table_vtab = {
 		.destroy = luaL_merge_source_table_destroy,
@@ -1031,30 +2590,566 @@ lbox_merger_new_tuple_source(struct lua_State *L)
 
 /* }}} */
 
-/* {{{ Merge source Lua methods */
+/* {{{ Index merge source */
 
 /**
- * Iterator gen function to traverse source results.
- *
- * Expected a nil as the first parameter (param) and a
- * merge_source as the second parameter (state) on a Lua stack.
- *
- * Push the original merge_source (as a new state) and a next
- * tuple.
+ * A source of tuples from a box index iterator. Unlike a tuple
+ * source over index:pairs() it does not call Lua per tuple.
  */
+struct merge_source_index {
+	struct merge_source base;
+	box_iterator_t *it;
+};
+
+/* Virtual methods declarations */
+
+static void
+merge_source_index_destroy(struct merge_source *base);
 static int
-lbox_merge_source_gen(struct lua_State *L)
-{
-	struct merge_source *source;
-	bool ok = lua_gettop(L) == 2 && lua_isnil(L, 1) &&
-		(source = luaT_check_merge_source(L, 2)) != NULL;
-	if (!ok)
-		return luaL_error(L, "Bad params, use: lbox_merge_source_gen("
-				  "nil, merge_source)");
+merge_source_index_next(struct merge_source *base, box_tuple_format_t *format,
+			box_tuple_t **out);
+static int
+merge_source_index_copy_raw(struct merge_source *base, box_ibuf_t *buf,
+			    uint32_t limit, uint32_t *count_ptr);
 
-#ifndef NDEBUG
-	int top = lua_gettop(L);
-#endif
+/* Non-virtual methods */
+
+/**
+ * Create a new merge source of the index type.
+ *
+ * @a key is a MsgPack array.
+ *
+ * In case of an error it returns NULL and set a diag.
+ */
+static struct merge_source *
+merge_source_index_new(uint32_t space_id, uint32_t index_id, int iterator,
+		       const char *key, const char *key_end)
+{
+	static struct merge_source_vtab merge_source_index_vtab = {
+		.destroy = merge_source_index_destroy,
+		.next = merge_source_index_next,
+		.copy_raw = merge_source_index_copy_raw,
+	};
+
+	box_iterator_t *it = box_index_iterator(space_id, index_id, iterator,
+						key, key_end);
+	if (it == NULL)
+		return NULL;
+
+	struct merge_source_index *source = malloc(
+		sizeof(struct merge_source_index));
+	if (source == NULL) {
+		box_iterator_free(it);
+		diag_set_oom(sizeof(struct merge_source_index),
+			 "malloc", "merge_source_index");
+		return NULL;
+	}
+
+	merge_source_create(&source->base, &merge_source_index_vtab);
+	source->it = it;
+
+	return &source->base;
+}
+
+/* Virtual methods */
+
+/**
+ * destroy() virtual method implementation for an index source.
+ *
+ * @see struct merge_source_vtab
+ */
+static void
+merge_source_index_destroy(struct merge_source *base)
+{
+	struct merge_source_index *source = container_of(base,
+		struct merge_source_index, base);
+
+	box_iterator_free(source->it);
+	free(source);
+}
+
+/**
+ * next() virtual method implementation for an index source.
+ *
+ * @see struct merge_source_vtab
+ */
+static int
+merge_source_index_next(struct merge_source *base, box_tuple_format_t *format,
+			box_tuple_t **out)
+{
+	struct merge_source_index *source = container_of(base,
+		struct merge_source_index, base);
+
+	box_tuple_t *tuple;
+	if (box_iterator_next(source->it, &tuple) != 0)
+		return -1;
+	if (tuple != NULL && format != NULL &&
+	    box_tuple_validate(tuple, format) != 0)
+		return -1;
+	if (tuple != NULL)
+		box_tuple_ref(tuple);
+	*out = tuple;
+	return 0;
+}
+
+/**
+ * copy_raw() virtual method implementation for an index source.
+ *
+ * @see struct merge_source_vtab
+ */
+static int
+merge_source_index_copy_raw(struct merge_source *base, box_ibuf_t *buf,
+			    uint32_t limit, uint32_t *count_ptr)
+{
+	struct merge_source_index *source = container_of(base,
+		struct merge_source_index, base);
+
+	uint32_t count = 0;
+	box_tuple_t *tuple;
+	while (count < limit) {
+		if (box_iterator_next(source->it, &tuple) != 0)
+			goto error;
+		if (tuple == NULL)
+			break;
+		size_t size = box_tuple_bsize(tuple);
+		char **wpos;
+		box_ibuf_write_range(buf, &wpos, NULL);
+		if (box_ibuf_reserve(buf, size) == NULL) {
+			diag_set_oom(size, "ibuf", "tuple");
+			goto error;
+		}
+		box_tuple_to_buf(tuple, *wpos, size);
+		*wpos += size;
+		++count;
+	}
+	*count_ptr = count;
+	return 0;
+
+error:
+	/* Copied tuples are given anyway. */
+	*count_ptr = count;
+	return -1;
+}
+
+/* Lua functions */
+
+/**
+ * Raise a Lua error with merger.new_index_source() usage info.
+ */
+static int
+lbox_merger_new_index_source_usage(struct lua_State *L,
+				   const char *param_name)
+{
+	static const char *usage = "merger.new_index_source(space_id, "
+				   "index_id[, key[, {"
+				   "iterator = <number> or <string> or "
+				   "<nil>}]])";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Get a space or an index id from a Lua stack: a number or a
+ * name.
+ *
+ * Return BOX_ID_NIL if there is no such space or index.
+ */
+static uint32_t
+luaT_toid(struct lua_State *L, int idx, uint32_t space_id)
+{
+	if (lua_type(L, idx) == LUA_TNUMBER)
+		return lua_tointeger(L, idx);
+	size_t len;
+	const char *name = lua_tolstring(L, idx, &len);
+	if (space_id == BOX_ID_NIL)
+		return box_space_id_by_name(name, len);
+	return box_index_id_by_name(space_id, name, len);
+}
+
+/**
+ * Create a new index source and push it onto the Lua stack.
+ *
+ * Expect a space id, an index id, (optionally) a key and
+ * (optionally) a table of options on a Lua stack.
+ */
+static int
+lbox_merger_new_index_source(struct lua_State *L)
+{
+	int top = lua_gettop(L);
+	bool ok = top >= 2 && top <= 4 &&
+		/* Space. */
+		(lua_type(L, 1) == LUA_TNUMBER ||
+		 lua_type(L, 1) == LUA_TSTRING) &&
+		/* Index. */
+		(lua_type(L, 2) == LUA_TNUMBER ||
+		 lua_type(L, 2) == LUA_TSTRING) &&
+		/* Opts. */
+		(lua_isnoneornil(L, 4) == 1 || lua_istable(L, 4) == 1);
+	if (!ok)
+		return lbox_merger_new_index_source_usage(L, NULL);
+
+	uint32_t space_id = luaT_toid(L, 1, BOX_ID_NIL);
+	if (space_id == BOX_ID_NIL)
+		return lbox_merger_new_index_source_usage(L, "space_id");
+	uint32_t index_id = luaT_toid(L, 2, space_id);
+	if (index_id == BOX_ID_NIL)
+		return lbox_merger_new_index_source_usage(L, "index_id");
+
+	/* Parse options. */
+	int iterator = ITER_EQ;
+	if (!lua_isnoneornil(L, 4)) {
+		/* Parse iterator. */
+		lua_pushstring(L, "iterator");
+		lua_gettable(L, 4);
+		if (!lua_isnil(L, -1)) {
+			iterator = luaT_toiterator(L, -1);
+			if (iterator < 0)
+				return lbox_merger_new_index_source_usage(L,
+					"iterator");
+		}
+		lua_pop(L, 1);
+	}
+
+	/* Encode a key: nil, a scalar, a table or a tuple. */
+	static const char empty_key[] = {'\x90'};
+	char *key = NULL;
+	size_t key_size = sizeof(empty_key);
+	if (!lua_isnoneornil(L, 3)) {
+		if (!lua_istable(L, 3) && luaT_istuple(L, 3) == NULL) {
+			/* Wrap a scalar into a table. */
+			lua_createtable(L, 1, 0);
+			lua_pushvalue(L, 3);
+			lua_rawseti(L, -2, 1);
+			lua_replace(L, 3);
+		}
+		key = luaT_encode_key(L, 3, &key_size);
+		if (key == NULL)
+			return luaT_error(L);
+	}
+	const char *key_beg = key != NULL ? key : empty_key;
+
+	struct merge_source *source = merge_source_index_new(space_id,
+		index_id, iterator, key_beg, key_beg + key_size);
+	free(key);
+	if (source == NULL)
+		return luaT_error(L);
+
+	*(struct merge_source **)
+		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_SOURCE_REF) = source;
+	lua_pushcfunction(L, lbox_merge_source_gc);
+	luaL_setcdatagc(L, -2);
+
+	return 1;
+}
+
+/* }}} */
+
+/* {{{ File merge source */
+
+/**
+ * Raise a Lua error with merger.new_file_source() usage info.
+ */
+static int
+lbox_merger_new_file_source_usage(struct lua_State *L, const char *param_name)
+{
+	static const char *usage = "merger.new_file_source(path, key_def[, {"
+				   "index = <string> or <boolean> or <nil>, "
+				   "key = <table> or <tuple> or <nil>, "
+				   "iterator = <string> or <number> or <nil>}])";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Create a new file source and push it onto the Lua stack.
+ *
+ * Expect a path, cdata<struct key_def> and (optionally) a table
+ * of options on a Lua stack.
+ */
+static int
+lbox_merger_new_file_source(struct lua_State *L)
+{
+	struct key_def *key_def;
+	int top = lua_gettop(L);
+	bool ok = (top == 2 || top == 3) &&
+		/* Path. */
+		lua_type(L, 1) == LUA_TSTRING &&
+		/* key_def. */
+		(key_def = luaT_check_key_def(L, 2)) != NULL &&
+		/* Opts. */
+		(lua_isnoneornil(L, 3) == 1 || lua_istable(L, 3) == 1);
+	if (!ok)
+		return lbox_merger_new_file_source_usage(L, NULL);
+
+	const char *path = lua_tostring(L, 1);
+	struct merge_source_file_opts opts = {
+		.index_path = NULL,
+		.key = NULL,
+		.iterator = ITER_GE,
+	};
+	/* A default name of an index file. */
+	lua_pushfstring(L, "%s.idx", path);
+	int default_index_idx = lua_gettop(L);
+
+	/* Parse options. */
+	if (!lua_isnoneornil(L, 3)) {
+		/* Parse index. */
+		lua_pushstring(L, "index");
+		lua_gettable(L, 3);
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			opts.index_path = lua_tostring(L, -1);
+			/* Keep the string on the stack. */
+			lua_replace(L, default_index_idx);
+		} else if (lua_isboolean(L, -1)) {
+			if (lua_toboolean(L, -1))
+				opts.index_path = lua_tostring(L,
+					default_index_idx);
+			lua_pop(L, 1);
+		} else if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+		} else {
+			return lbox_merger_new_file_source_usage(L, "index");
+		}
+
+		/* Parse iterator. */
+		lua_pushstring(L, "iterator");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			opts.iterator = luaT_toiterator(L, -1);
+			if (opts.iterator != ITER_GE &&
+			    opts.iterator != ITER_GT &&
+			    opts.iterator != ITER_LE &&
+			    opts.iterator != ITER_LT)
+				return lbox_merger_new_file_source_usage(L,
+					"iterator");
+		}
+		lua_pop(L, 1);
+
+		/* Parse key. */
+		lua_pushstring(L, "key");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (!lua_istable(L, -1) && luaT_istuple(L, -1) == NULL)
+				return lbox_merger_new_file_source_usage(L,
+					"key");
+			size_t key_size;
+			opts.key = luaT_encode_key(L, -1, &key_size);
+			if (opts.key == NULL)
+				return luaT_error(L);
+		}
+		lua_pop(L, 1);
+	}
+
+	struct merge_source *source = merge_source_file_new(path, key_def,
+							    &opts);
+	free((char *)opts.key);
+	if (source == NULL)
+		return luaT_error(L);
+
+	*(struct merge_source **)
+		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_SOURCE_REF) = source;
+	lua_pushcfunction(L, lbox_merge_source_gc);
+	luaL_setcdatagc(L, -2);
+
+	return 1;
+}
+
+/**
+ * Raise a Lua error with merger.write_file() usage info.
+ */
+static int
+lbox_merger_write_file_usage(struct lua_State *L, const char *param_name)
+{
+	static const char *usage = "merger.write_file(path, source[, {"
+				   "index_step = <number> or <nil>}])";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Write all tuples of a source into a file that can be read
+ * using merger.new_file_source().
+ *
+ * Expect a path, a merge source and (optionally) a table of
+ * options on a Lua stack.
+ *
+ * Return the number of written tuples.
+ */
+static int
+lbox_merger_write_file(struct lua_State *L)
+{
+	struct merge_source *source;
+	int top = lua_gettop(L);
+	bool ok = (top == 2 || top == 3) &&
+		/* Path. */
+		lua_type(L, 1) == LUA_TSTRING &&
+		/* Merge source. */
+		(source = luaT_check_merge_source(L, 2)) != NULL &&
+		/* Opts. */
+		(lua_isnoneornil(L, 3) == 1 || lua_istable(L, 3) == 1);
+	if (!ok)
+		return lbox_merger_write_file_usage(L, NULL);
+
+	uint32_t index_step = 0;
+
+	/* Parse options. */
+	if (!lua_isnoneornil(L, 3)) {
+		/* Parse index_step. */
+		lua_pushstring(L, "index_step");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0)
+				index_step = lua_tointeger(L, -1);
+			else
+				return lbox_merger_write_file_usage(L,
+					"index_step");
+		}
+		lua_pop(L, 1);
+	}
+
+	uint64_t count;
+	if (merge_source_write_file(source, lua_tostring(L, 1), index_step,
+				    &count) != 0)
+		return luaT_error(L);
+	lua_pushnumber(L, count);
+	return 1;
+}
+
+/* }}} */
+
+/* {{{ External sort */
+
+/**
+ * Raise a Lua error with merger.sort() usage info.
+ */
+static int
+lbox_merger_sort_usage(struct lua_State *L, const char *param_name)
+{
+	static const char *usage = "merger.sort(source, key_def[, {"
+				   "memory_limit = <number> or <nil>, "
+				   "fan_in = <number> or <nil>, "
+				   "tmpdir = <string> or <nil>}])";
+	if (param_name == NULL)
+		return luaL_error(L, "Bad params, use: %s", usage);
+	else
+		return luaL_error(L, "Bad param \"%s\", use: %s", param_name,
+				  usage);
+}
+
+/**
+ * Sort tuples of a source and push a new source with sorted
+ * tuples onto the Lua stack.
+ *
+ * Expect a merge source, cdata<struct key_def> and (optionally)
+ * a table of options on a Lua stack.
+ */
+static int
+lbox_merger_sort(struct lua_State *L)
+{
+	struct merge_source *source;
+	struct key_def *key_def;
+	int top = lua_gettop(L);
+	bool ok = (top == 2 || top == 3) &&
+		/* Merge source. */
+		(source = luaT_check_merge_source(L, 1)) != NULL &&
+		/* key_def. */
+		(key_def = luaT_check_key_def(L, 2)) != NULL &&
+		/* Opts. */
+		(lua_isnoneornil(L, 3) == 1 || lua_istable(L, 3) == 1);
+	if (!ok)
+		return lbox_merger_sort_usage(L, NULL);
+
+	const char *tmpdir = getenv("TMPDIR");
+	struct merge_sort_opts opts = {
+		.memory_limit = 64 * 1024 * 1024,
+		.fan_in = 16,
+		.tmpdir = tmpdir != NULL ? tmpdir : "/tmp",
+	};
+
+	/* Parse options. */
+	if (!lua_isnoneornil(L, 3)) {
+		/* Parse memory_limit. */
+		lua_pushstring(L, "memory_limit");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tonumber(L, -1) > 0)
+				opts.memory_limit = lua_tonumber(L, -1);
+			else
+				return lbox_merger_sort_usage(L,
+					"memory_limit");
+		}
+		lua_pop(L, 1);
+
+		/* Parse fan_in. */
+		lua_pushstring(L, "fan_in");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 2 &&
+			    lua_tonumber(L, -1) <= UINT32_MAX)
+				opts.fan_in = lua_tonumber(L, -1);
+			else
+				return lbox_merger_sort_usage(L, "fan_in");
+		}
+		lua_pop(L, 1);
+
+		/* Parse tmpdir. Keep the string on the stack. */
+		lua_pushstring(L, "tmpdir");
+		lua_gettable(L, 3);
+		if (!lua_isnil(L, -1)) {
+			if (lua_type(L, -1) == LUA_TSTRING)
+				opts.tmpdir = lua_tostring(L, -1);
+			else
+				return lbox_merger_sort_usage(L, "tmpdir");
+		}
+	}
+
+	struct merge_source *sorted = merge_sort(source, key_def, &opts);
+	if (sorted == NULL)
+		return luaT_error(L);
+
+	*(struct merge_source **)
+		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_SOURCE_REF) = sorted;
+	lua_pushcfunction(L, lbox_merge_source_gc);
+	luaL_setcdatagc(L, -2);
+
+	return 1;
+}
+
+/* }}} */
+
+/* {{{ Merge source Lua methods */
+
+/**
+ * Iterator gen function to traverse source results.
+ *
+ * Expected a nil as the first parameter (param) and a
+ * merge_source as the second parameter (state) on a Lua stack.
+ *
+ * Push the original merge_source (as a new state) and a next
+ * tuple.
+ */
+static int
+lbox_merge_source_gen(struct lua_State *L)
+{
+	struct merge_source *source;
+	bool ok = lua_gettop(L) == 2 && lua_isnil(L, 1) &&
+		(source = luaT_check_merge_source(L, 2)) != NULL;
+	if (!ok)
+		return luaL_error(L, "Bad params, use: lbox_merge_source_gen("
+				  "nil, merge_source)");
+
+#ifndef NDEBUG
+	int top = lua_gettop(L);
+#endif
 
 	box_tuple_t *tuple;
 	if (merge_source_next(source, NULL, &tuple) != 0)
@@ -1122,71 +3217,804 @@ lbox_merge_source_ipairs(struct lua_State *L)
 	lua_insert(L, -2); /* Swap merge_source and wrap. */
 	/* Stack: wrap, merge_source. */
 
-	lua_pushcfunction(L, lbox_merge_source_gen);
-	lua_insert(L, -2); /* Swap merge_source and gen. */
-	/* Stack: wrap, gen, merge_source. */
+	lua_pushcfunction(L, lbox_merge_source_gen);
+	lua_insert(L, -2); /* Swap merge_source and gen. */
+	/* Stack: wrap, gen, merge_source. */
+
+	/*
+	 * Push nil as an iterator param, because all needed state
+	 * is in a merge source.
+	 */
+	lua_pushnil(L);
+	/* Stack: wrap, gen, merge_source, nil. */
+
+	lua_insert(L, -2); /* Swap merge_source and nil. */
+	/* Stack: wrap, gen, nil, merge_source. */
+
+	/* Call fun.wrap(gen, nil, merge_source). */
+	lua_call(L, 3, 3);
+	return 3;
+}
+
+/**
+ * Iterator gen function to traverse source results by batches.
+ *
+ * Expected a table as the first parameter (param) and a
+ * merge_source as the second parameter (state) on a Lua stack
+ * and a batch size as an upvalue.
+ *
+ * Fill the table with up to the batch size next tuples, clear
+ * the rest of a previous batch and push the original
+ * merge_source (as a new state) and the table. Push nils when
+ * the source ends.
+ */
+static int
+lbox_merge_source_batch_gen(struct lua_State *L)
+{
+	struct merge_source *source;
+	bool ok = lua_gettop(L) == 2 && lua_istable(L, 1) &&
+		(source = luaT_check_merge_source(L, 2)) != NULL;
+	if (!ok)
+		return luaL_error(L, "Bad params, use: "
+				  "lbox_merge_source_batch_gen(<table>, "
+				  "merge_source)");
+	uint32_t batch_size = lua_tointeger(L, lua_upvalueindex(1));
+
+	uint32_t count = 0;
+	while (count < batch_size) {
+		box_tuple_t *tuple;
+		if (merge_source_next(source, NULL, &tuple) != 0)
+			return luaT_error(L);
+		if (tuple == NULL)
+			break;
+		/* luaT_pushtuple() references the tuple. */
+		luaT_pushtuple(L, tuple);
+		box_tuple_unref(tuple);
+		lua_rawseti(L, 1, ++count);
+	}
+	for (uint32_t i = lua_objlen(L, 1); i > count; --i) {
+		lua_pushnil(L);
+		lua_rawseti(L, 1, i);
+	}
+
+	if (count == 0) {
+		lua_pushnil(L);
+		lua_pushnil(L);
+		return 2;
+	}
+	/* Return merge_source and the table. */
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 1);
+	return 2;
+}
+
+/**
+ * Iterate over merge source results from Lua by batches of up to
+ * a given number of tuples.
+ *
+ * Push three values to the Lua stack:
+ *
+ * 1. gen (lbox_merge_source_batch_gen wrapped by fun.wrap());
+ * 2. param (a table, which is reused for all batches);
+ * 3. state (merge_source).
+ */
+static int
+lbox_merge_source_batches(struct lua_State *L)
+{
+	struct merge_source *source;
+	bool ok = lua_gettop(L) == 2 &&
+		(source = luaT_check_merge_source(L, 1)) != NULL &&
+		lua_type(L, 2) == LUA_TNUMBER &&
+		lua_tonumber(L, 2) >= 1 && lua_tonumber(L, 2) <= UINT32_MAX;
+	if (!ok)
+		return luaL_error(L, "Usage: merge_source:batches(<number>)");
+	uint32_t batch_size = lua_tonumber(L, 2);
+
+	luaL_loadstring(L, "return require('fun').wrap");
+	lua_call(L, 0, 1);
+	lua_pushinteger(L, batch_size);
+	lua_pushcclosure(L, lbox_merge_source_batch_gen, 1);
+	lua_createtable(L, batch_size < 1024 ? batch_size : 1024, 0);
+	lua_pushvalue(L, 1);
+	/* Stack: merge_source, n, wrap, gen, table, merge_source. */
+
+	/* Call fun.wrap(gen, table, merge_source). */
+	lua_call(L, 3, 3);
+	return 3;
+}
+
+enum { MERGE_PARTITION_PART_MAX = 64 };
+
+/**
+ * An output buffer of a partitioned select().
+ */
+struct merge_source_partition {
+	box_ibuf_t *buffer;
+	/* An offset of the array header from the buffer's rpos. */
+	size_t header_offset;
+	/* A number of tuples written into the buffer. */
+	uint32_t count;
+};
+
+/**
+ * Fields to give instead of whole tuples.
+ */
+struct merge_source_projection {
+	uint32_t field_count;
+	/* The maximal requested field number. */
+	uint32_t max_fieldno;
+	/*
+	 * Scratch arrays: requested fields of a current tuple and
+	 * all its fields up to max_fieldno.
+	 */
+	const char **values;
+	const char **by_fieldno;
+	/* Zero based field numbers. */
+	uint32_t *fields;
+};
+
+/**
+ * Options of merge_source:select().
+ */
+struct merge_source_select_opts {
+	/* A buffer to write results or NULL to create a table. */
+	box_ibuf_t *buffer;
+	/*
+	 * Buffers to split results into or NULL. A tuple goes to
+	 * a partition chosen by a hash of partition_fields.
+	 */
+	struct merge_source_partition *partitions;
+	uint32_t partition_count;
+	/* Zero based field numbers to hash. */
+	uint32_t partition_fields[MERGE_PARTITION_PART_MAX];
+	uint32_t partition_field_count;
+	/* A maximum number of tuples. */
+	uint32_t limit;
+	/* Yield after each yield_every tuples (if not zero). */
+	uint32_t yield_every;
+	/*
+	 * Stop when clock_realtime() reaches the deadline (if not
+	 * zero) and give a partial result.
+	 */
+	double deadline;
+	/* Whether to return a cursor to resume a merge from. */
+	bool cursor;
+	/* Fields to give or NULL to give whole tuples. */
+	struct merge_source_projection *projection;
+	/* Whether to give keys of a keyed merger. */
+	bool keys;
+	/*
+	 * Whether to merge buffer sources of a merger in a coio
+	 * thread (see merge_source_buffer_offload()).
+	 */
+	bool offload;
+};
+
+/* How many tuples are given between checks of a deadline. */
+enum { MERGE_SELECT_DEADLINE_STEP = 64 };
+
+/**
+ * Yield to let other fibers work during a long select().
+ *
+ * Return true if the fiber is cancelled.
+ */
+static bool
+merge_source_select_yield(void)
+{
+	if (fiber_is_cancelled())
+		return true;
+	fiber_sleep(0);
+	return fiber_is_cancelled();
+}
+
+/**
+ * Get a number of tuples to give before a next yield.
+ */
+static inline uint32_t
+merge_source_select_next_yield(const struct merge_source_select_opts *opts,
+			       uint32_t result_len)
+{
+	if (opts->yield_every == 0 ||
+	    opts->yield_every > UINT32_MAX - result_len)
+		return UINT32_MAX;
+	return result_len + opts->yield_every;
+}
+
+/**
+ * Get a number of tuples to give before a next check of a
+ * deadline.
+ */
+static inline uint32_t
+merge_source_select_next_check(const struct merge_source_select_opts *opts,
+			       uint32_t result_len)
+{
+	if (opts->deadline == 0 ||
+	    MERGE_SELECT_DEADLINE_STEP > UINT32_MAX - result_len)
+		return UINT32_MAX;
+	return result_len + MERGE_SELECT_DEADLINE_STEP;
+}
+
+/**
+ * Whether a select() should stop, because its deadline is
+ * reached.
+ */
+static inline bool
+merge_source_select_is_late(const struct merge_source_select_opts *opts)
+{
+	return opts->deadline != 0 && clock_realtime() >= opts->deadline;
+}
+
+/**
+ * A buffer to build projected tuples and to hold raw tuples
+ * while they are projected. It is freed after a select, when it
+ * has grown above MERGE_PROJECTION_BUF_KEEP bytes (a select that
+ * raises an error leaves it to the next one).
+ */
+static char *merge_projection_buf = NULL;
+static size_t merge_projection_buf_capacity = 0;
+
+enum { MERGE_PROJECTION_BUF_KEEP = 64 * 1024 };
+
+/**
+ * Ensure merge_projection_buf is at least @a size bytes.
+ *
+ * Return NULL and set a diag at OOM.
+ */
+static char *
+merge_projection_buf_reserve(size_t size)
+{
+	if (size <= merge_projection_buf_capacity)
+		return merge_projection_buf;
+	size_t capacity = merge_projection_buf_capacity * 2;
+	if (capacity < size)
+		capacity = size;
+	char *buf = realloc(merge_projection_buf, capacity);
+	if (buf == NULL) {
+		diag_set_oom(capacity, "realloc", "projection buffer");
+		return NULL;
+	}
+	merge_projection_buf = buf;
+	merge_projection_buf_capacity = capacity;
+	return buf;
+}
+
+/**
+ * Free merge_projection_buf if a large run of tuples has grown
+ * it, so it does not hold the memory till the next select.
+ */
+static void
+merge_projection_buf_shrink(void)
+{
+	if (merge_projection_buf_capacity <= MERGE_PROJECTION_BUF_KEEP)
+		return;
+	free(merge_projection_buf);
+	merge_projection_buf = NULL;
+	merge_projection_buf_capacity = 0;
+}
+
+/**
+ * Find requested fields of a tuple, which is given as MsgPack,
+ * and advance @a data past it.
+ */
+static void
+merge_projection_find_raw(struct merge_source_projection *projection,
+			  const char **data)
+{
+	uint32_t field_count = mp_decode_array(data);
+	uint32_t i = 0;
+	for (; i < field_count && i <= projection->max_fieldno; ++i) {
+		projection->by_fieldno[i] = *data;
+		mp_next(data);
+	}
+	for (uint32_t j = i; j <= projection->max_fieldno; ++j)
+		projection->by_fieldno[j] = NULL;
+	for (; i < field_count; ++i)
+		mp_next(data);
+	for (uint32_t k = 0; k < projection->field_count; ++k)
+		projection->values[k] =
+			projection->by_fieldno[projection->fields[k]];
+}
+
+/**
+ * Find requested fields of a tuple.
+ */
+static void
+merge_projection_find(struct merge_source_projection *projection,
+		      box_tuple_t *tuple)
+{
+	for (uint32_t k = 0; k < projection->field_count; ++k)
+		projection->values[k] = box_tuple_field(tuple,
+			projection->fields[k]);
+}
+
+/**
+ * Encode found fields as a MsgPack array into @a buf or return
+ * its size if @a buf is NULL. A missing field is encoded as nil.
+ */
+static size_t
+merge_projection_encode(const struct merge_source_projection *projection,
+			char *buf)
+{
+	size_t size = mp_sizeof_array(projection->field_count);
+	if (buf != NULL)
+		buf = mp_encode_array(buf, projection->field_count);
+	for (uint32_t k = 0; k < projection->field_count; ++k) {
+		const char *field = projection->values[k];
+		size_t field_size = mp_sizeof_nil();
+		if (field != NULL) {
+			const char *field_end = field;
+			mp_next(&field_end);
+			field_size = field_end - field;
+		}
+		size += field_size;
+		if (buf == NULL)
+			continue;
+		if (field != NULL)
+			memcpy(buf, field, field_size);
+		else
+			mp_encode_nil(buf);
+		buf += field_size;
+	}
+	return size;
+}
+
+/**
+ * Write found fields into an ibuf.
+ *
+ * Return 0 at success. Return -1 at OOM and set a diag.
+ */
+static int
+merge_projection_write(const struct merge_source_projection *projection,
+		       box_ibuf_t *buf)
+{
+	size_t size = merge_projection_encode(projection, NULL);
+	char **wpos;
+	box_ibuf_write_range(buf, &wpos, NULL);
+	if (box_ibuf_reserve(buf, size) == NULL) {
+		diag_set_oom(size, "ibuf", "tuples");
+		return -1;
+	}
+	*wpos += merge_projection_encode(projection, *wpos);
+	return 0;
+}
+
+/**
+ * Project @a count raw tuples, which are written into an ibuf
+ * starting from @a offset (from rpos). Tuples are moved aside
+ * and requested fields are written in their place, so they are
+ * not created as tuples.
+ *
+ * Memory for the result is reserved before the tuples are moved,
+ * so either all of them are projected or the ibuf is left
+ * untouched.
+ *
+ * Return 0 at success. Return -1 at OOM and set a diag.
+ */
+static int
+merge_projection_rewrite_raw(struct merge_source_projection *projection,
+			     box_ibuf_t *buf, size_t offset, uint32_t count)
+{
+	char **rpos;
+	char **wpos;
+	box_ibuf_read_range(buf, &rpos, &wpos);
+	size_t size = *wpos - (*rpos + offset);
+	const char *data = *rpos + offset;
+	size_t projected_size = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		merge_projection_find_raw(projection, &data);
+		projected_size += merge_projection_encode(projection, NULL);
+	}
+	/*
+	 * The tuples end at wpos, so the space reserved after
+	 * them is there for the result once they are moved aside.
+	 */
+	if (box_ibuf_reserve(buf, projected_size) == NULL) {
+		diag_set_oom(projected_size, "ibuf", "tuples");
+		return -1;
+	}
+	data = merge_projection_buf_reserve(size);
+	if (data == NULL)
+		return -1;
+	memcpy(merge_projection_buf, *rpos + offset, size);
+	*wpos = *rpos + offset;
+	for (uint32_t i = 0; i < count; ++i) {
+		merge_projection_find_raw(projection, &data);
+		*wpos += merge_projection_encode(projection, *wpos);
+	}
+	return 0;
+}
+
+/**
+ * Get a next tuple to give: a key for select({keys = true}) or
+ * a tuple otherwise.
+ */
+static int
+merge_source_select_next(struct merge_source *source,
+			 const struct merge_source_select_opts *opts,
+			 box_tuple_t **out)
+{
+	if (!opts->keys)
+		return merge_source_next(source, NULL, out);
+	box_tuple_t *tuple;
+	if (merge_source_next_keyed(source, NULL, out, &tuple) != 0)
+		return -1;
+	if (tuple != NULL)
+		box_tuple_unref(tuple);
+	return 0;
+}
+
+/**
+ * Write a tuple (or its requested fields) into an ibuf.
+ *
+ * Return 0 at success. Return -1 at OOM and set a diag.
+ */
+static int
+merge_source_select_write(const struct merge_source_select_opts *opts,
+			  box_ibuf_t *buf, box_tuple_t *tuple)
+{
+	if (opts->projection != NULL) {
+		merge_projection_find(opts->projection, tuple);
+		return merge_projection_write(opts->projection, buf);
+	}
+	uint32_t bsize = box_tuple_bsize(tuple);
+	char **wpos;
+	box_ibuf_write_range(buf, &wpos, NULL);
+	if (box_ibuf_reserve(buf, bsize) == NULL) {
+		diag_set_oom(bsize, "ibuf", "tuples");
+		return -1;
+	}
+	box_tuple_to_buf(tuple, *wpos, bsize);
+	*wpos += bsize;
+	return 0;
+}
+
+/**
+ * Write source results into ibuf.
+ *
+ * The array header always holds a number of written tuples when
+ * the function yields or raises an error, so the buffer is
+ * consistent.
+ *
+ * It is the helper for lbox_merge_source_select().
+ */
+static int
+encode_result_buffer(struct lua_State *L, struct merge_source *source,
+		     const struct merge_source_select_opts *opts,
+		     bool *is_end)
+{
+	box_ibuf_t *output_buffer = opts->buffer;
+	uint32_t limit = opts->limit;
+	uint32_t result_len = 0;
+	char **rpos;
+	char **wpos;
+	box_ibuf_read_range(output_buffer, &rpos, &wpos);
+
+	/*
+	 * Reserve maximum size for the array around resulting
+	 * tuples to set it later. Save its offset: the buffer
+	 * may be reallocated.
+	 */
+	size_t header_offset = *wpos - *rpos;
+	encode_header(output_buffer, UINT32_MAX);
+
+	/* Merge raw tuples in a coio thread when it is possible. */
+	int rc = 0;
+	bool is_cancelled = false;
+	if (opts->offload && opts->projection == NULL && !opts->keys)
+		rc = merge_source_buffer_offload(source, output_buffer,
+						 header_offset, limit,
+						 opts->deadline, &result_len,
+						 is_end, &is_cancelled);
+
+	/*
+	 * Fetch, merge and copy tuples to the buffer. Let a
+	 * source copy raw tuples when it is able to, say, when
+	 * only one source of a merger remains.
+	 */
+	box_tuple_t *tuple;
+	uint32_t next_yield = merge_source_select_next_yield(opts,
+							     result_len);
+	uint32_t next_check = opts->deadline != 0 ? result_len : UINT32_MAX;
+	while (rc == 0 && !is_cancelled && !*is_end && result_len < limit) {
+		if (result_len == next_yield) {
+			mp_store_u32(*rpos + header_offset + 1, result_len);
+			if ((is_cancelled = merge_source_select_yield()))
+				break;
+			next_yield = merge_source_select_next_yield(opts,
+				result_len);
+		}
+		if (result_len == next_check) {
+			if (merge_source_select_is_late(opts))
+				break;
+			next_check = merge_source_select_next_check(opts,
+				result_len);
+		}
+
+		uint32_t count = 0;
+		uint32_t batch = limit;
+		if (batch > next_yield)
+			batch = next_yield;
+		if (batch > next_check)
+			batch = next_check;
+		batch -= result_len;
+		size_t offset = *wpos - *rpos;
+		if (!opts->keys)
+			rc = merge_source_copy_raw(source, output_buffer,
+						   batch, &count);
+		/*
+		 * Tuples copied before an error are given too.
+		 * When they cannot be projected, they are dropped
+		 * from the buffer along with the error.
+		 */
+		if (count > 0 && opts->projection != NULL &&
+		    merge_projection_rewrite_raw(opts->projection,
+						 output_buffer, offset,
+						 count) != 0) {
+			*wpos = *rpos + offset;
+			rc = -1;
+			count = 0;
+		}
+		result_len += count;
+		if (rc != 0)
+			break;
+		if (count > 0)
+			continue;
+
+		rc = merge_source_select_next(source, opts, &tuple);
+		if (rc == 0 && tuple == NULL)
+			*is_end = true;
+		if (rc != 0 || tuple == NULL)
+			break;
+		rc = merge_source_select_write(opts, output_buffer, tuple);
+		/* The received tuple is not needed anymore */
+		box_tuple_unref(tuple);
+		if (rc != 0)
+			break;
+		++result_len;
+	}
+
+	/* Write the real array size. */
+	mp_store_u32(*rpos + header_offset + 1, result_len);
+
+	if (rc != 0)
+		return luaT_error(L);
+	if (is_cancelled)
+		return luaL_error(L, "fiber is cancelled");
+
+	return 0;
+}
+
+/**
+ * Add @a size bytes to a FNV-1a hash.
+ */
+static inline uint32_t
+merge_partition_hash_bytes(uint32_t hash, const void *data, size_t size)
+{
+	const unsigned char *pos = data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= pos[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/**
+ * Add a 64-bit value to a hash as little-endian bytes, so the
+ * hash does not depend on the host byte order.
+ */
+static inline uint32_t
+merge_partition_hash_u64(uint32_t hash, uint64_t value)
+{
+	for (int i = 0; i < 8; ++i) {
+		hash ^= (uint8_t)(value >> (8 * i));
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/**
+ * Add a number to a hash: an integral value as a sign and a
+ * magnitude, any other one as IEEE 754 double bits.
+ */
+static uint32_t
+merge_partition_hash_number(uint32_t hash, bool is_neg, uint64_t magnitude)
+{
+	/* A tag, which is never a first byte of hashed MsgPack. */
+	uint8_t tag = 'n';
+	hash = merge_partition_hash_bytes(hash, &tag, 1);
+	tag = is_neg && magnitude != 0;
+	hash = merge_partition_hash_bytes(hash, &tag, 1);
+	return merge_partition_hash_u64(hash, magnitude);
+}
+
+static uint32_t
+merge_partition_hash_double(uint32_t hash, double value)
+{
+	/* 2^64: integral values below it are hashed as integers. */
+	const double max = 18446744073709551616.0;
+	double abs = value < 0 ? -value : value;
+	if (abs < max && (double)(uint64_t)abs == abs)
+		return merge_partition_hash_number(hash, value < 0,
+						   (uint64_t)abs);
+	uint8_t tag = 'd';
+	hash = merge_partition_hash_bytes(hash, &tag, 1);
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return merge_partition_hash_u64(hash, bits);
+}
 
-	/*
-	 * Push nil as an iterator param, because all needed state
-	 * is in a merge source.
-	 */
-	lua_pushnil(L);
-	/* Stack: wrap, gen, merge_source, nil. */
+/**
+ * Add a MsgPack field to a hash.
+ *
+ * Values, which are equal for a key_def without a collation,
+ * give the same hash on any host: numbers are hashed by value
+ * whatever their MsgPack type and width are (1 and 1.0 are the
+ * same), strings are hashed by their contents. Other values are
+ * hashed by their MsgPack bytes.
+ */
+static uint32_t
+merge_partition_hash_field(uint32_t hash, const char *field)
+{
+	if (field == NULL) {
+		/* A missing field is hashed as nil. */
+		uint8_t nil = 0xc0;
+		return merge_partition_hash_bytes(hash, &nil, 1);
+	}
+	switch (mp_typeof(*field)) {
+	case MP_UINT:
+		return merge_partition_hash_number(hash, false,
+						   mp_decode_uint(&field));
+	case MP_INT: {
+		int64_t value = mp_decode_int(&field);
+		uint64_t magnitude = value < 0 ?
+			0 - (uint64_t)value : (uint64_t)value;
+		return merge_partition_hash_number(hash, value < 0,
+						   magnitude);
+	}
+	case MP_FLOAT:
+		return merge_partition_hash_double(hash,
+						   mp_decode_float(&field));
+	case MP_DOUBLE:
+		return merge_partition_hash_double(hash,
+						   mp_decode_double(&field));
+	case MP_STR: {
+		uint8_t tag = 's';
+		hash = merge_partition_hash_bytes(hash, &tag, 1);
+		uint32_t len;
+		const char *str = mp_decode_str(&field, &len);
+		return merge_partition_hash_bytes(hash, str, len);
+	}
+	default: {
+		const char *end = field;
+		mp_next(&end);
+		return merge_partition_hash_bytes(hash, field, end - field);
+	}
+	}
+}
 
-	lua_insert(L, -2); /* Swap merge_source and nil. */
-	/* Stack: wrap, gen, nil, merge_source. */
+/**
+ * Choose a partition for a tuple.
+ */
+static uint32_t
+merge_partition_of(const struct merge_source_select_opts *opts,
+		   box_tuple_t *tuple)
+{
+	uint32_t hash = 2166136261;
+	for (uint32_t i = 0; i < opts->partition_field_count; ++i) {
+		const char *field = box_tuple_field(tuple,
+			opts->partition_fields[i]);
+		hash = merge_partition_hash_field(hash, field);
+	}
+	return hash % opts->partition_count;
+}
 
-	/* Call fun.wrap(gen, nil, merge_source). */
-	lua_call(L, 3, 3);
-	return 3;
+/**
+ * Write array headers of all partitions.
+ */
+static void
+merge_partitions_store_counts(const struct merge_source_select_opts *opts)
+{
+	for (uint32_t i = 0; i < opts->partition_count; ++i) {
+		struct merge_source_partition *partition = &opts->partitions[i];
+		char **rpos;
+		box_ibuf_read_range(partition->buffer, &rpos, NULL);
+		mp_store_u32(*rpos + partition->header_offset + 1,
+			     partition->count);
+	}
 }
 
 /**
- * Write source results into ibuf.
+ * Split source results into several ibufs by a hash of
+ * partition fields.
+ *
+ * Each buffer receives an array of its tuples. Headers always
+ * hold numbers of written tuples when the function yields or
+ * raises an error, like in encode_result_buffer().
  *
  * It is the helper for lbox_merge_source_select().
  */
 static int
-encode_result_buffer(struct lua_State *L, struct merge_source *source,
-		     box_ibuf_t *output_buffer, uint32_t limit)
+encode_result_partitions(struct lua_State *L, struct merge_source *source,
+			 const struct merge_source_select_opts *opts,
+			 bool *is_end)
 {
-	uint32_t result_len = 0;
-	uint32_t result_len_offset = 4;
-	char **wpos;
-	box_ibuf_write_range(output_buffer, &wpos, NULL);
-
-	/*
-	 * Reserve maximum size for the array around resulting
-	 * tuples to set it later.
-	 */
-	encode_header(output_buffer, UINT32_MAX);
+	for (uint32_t i = 0; i < opts->partition_count; ++i) {
+		struct merge_source_partition *partition = &opts->partitions[i];
+		char **rpos;
+		char **wpos;
+		box_ibuf_read_range(partition->buffer, &rpos, &wpos);
+		partition->header_offset = *wpos - *rpos;
+		partition->count = 0;
+		encode_header(partition->buffer, UINT32_MAX);
+	}
 
-	/* Fetch, merge and copy tuples to the buffer. */
+	uint32_t limit = opts->limit;
+	uint32_t result_len = 0;
 	box_tuple_t *tuple;
 	int rc = 0;
-	while (result_len < limit && (rc =
-	       merge_source_next(source, NULL, &tuple)) == 0 &&
-	       tuple != NULL) {
-		uint32_t bsize = box_tuple_bsize(tuple);
-		box_ibuf_reserve(output_buffer, bsize);
-		box_tuple_to_buf(tuple, *wpos, bsize);
-		*wpos += bsize;
-		result_len_offset += bsize;
-		++result_len;
+	bool is_cancelled = false;
+	uint32_t next_yield = merge_source_select_next_yield(opts, 0);
+	uint32_t next_check = opts->deadline != 0 ? 0 : UINT32_MAX;
+	while (result_len < limit) {
+		if (result_len == next_yield) {
+			merge_partitions_store_counts(opts);
+			if ((is_cancelled = merge_source_select_yield()))
+				break;
+			next_yield = merge_source_select_next_yield(opts,
+				result_len);
+		}
+		if (result_len == next_check) {
+			if (merge_source_select_is_late(opts))
+				break;
+			next_check = merge_source_select_next_check(opts,
+				result_len);
+		}
 
+		rc = merge_source_select_next(source, opts, &tuple);
+		if (rc == 0 && tuple == NULL)
+			*is_end = true;
+		if (rc != 0 || tuple == NULL)
+			break;
+		struct merge_source_partition *partition =
+			&opts->partitions[merge_partition_of(opts, tuple)];
+		rc = merge_source_select_write(opts, partition->buffer, tuple);
 		/* The received tuple is not needed anymore */
 		box_tuple_unref(tuple);
+		if (rc != 0)
+			break;
+		++partition->count;
+		++result_len;
 	}
 
+	/* Write the real array sizes. */
+	merge_partitions_store_counts(opts);
+
 	if (rc != 0)
 		return luaT_error(L);
-
-	/* Write the real array size. */
-	mp_store_u32(*wpos - result_len_offset, result_len);
+	if (is_cancelled)
+		return luaL_error(L, "fiber is cancelled");
 
 	return 0;
 }
 
+/**
+ * Create a tuple of requested fields of a tuple.
+ *
+ * Return NULL and set a diag in case of an error.
+ */
+static box_tuple_t *
+merge_projection_tuple(struct merge_source_projection *projection,
+		       box_tuple_t *tuple)
+{
+	merge_projection_find(projection, tuple);
+	size_t size = merge_projection_encode(projection, NULL);
+	char *buf = merge_projection_buf_reserve(size);
+	if (buf == NULL)
+		return NULL;
+	merge_projection_encode(projection, buf);
+	return box_tuple_new(box_tuple_format_default(), buf, buf + size);
+}
+
 /**
  * Write source results into a new Lua table.
  *
@@ -1194,8 +4022,11 @@ encode_result_buffer(struct lua_State *L, struct merge_source *source,
  */
 static int
 create_result_table(struct lua_State *L, struct merge_source *source,
-		    uint32_t limit)
+		    const struct merge_source_select_opts *opts,
+		    bool *is_end)
 {
+	uint32_t limit = opts->limit;
+
 	/* Create result table. */
 	lua_newtable(L);
 
@@ -1204,9 +4035,37 @@ create_result_table(struct lua_State *L, struct merge_source *source,
 	/* Fetch, merge and save tuples to the table. */
 	box_tuple_t *tuple;
 	int rc = 0;
-	while (cur - 1 < limit && (rc =
-	       merge_source_next(source, NULL, &tuple)) == 0 &&
-	       tuple != NULL) {
+	uint32_t next_yield = merge_source_select_next_yield(opts, 0);
+	uint32_t next_check = opts->deadline != 0 ? 0 : UINT32_MAX;
+	while (cur - 1 < limit) {
+		if (cur - 1 == next_yield) {
+			if (merge_source_select_yield())
+				return luaL_error(L, "fiber is cancelled");
+			next_yield = merge_source_select_next_yield(opts,
+				cur - 1);
+		}
+		if (cur - 1 == next_check) {
+			if (merge_source_select_is_late(opts))
+				break;
+			next_check = merge_source_select_next_check(opts,
+				cur - 1);
+		}
+		rc = merge_source_select_next(source, opts, &tuple);
+		if (rc == 0 && tuple == NULL)
+			*is_end = true;
+		if (rc != 0 || tuple == NULL)
+			break;
+		if (opts->projection != NULL) {
+			box_tuple_t *projected = merge_projection_tuple(
+				opts->projection, tuple);
+			box_tuple_unref(tuple);
+			if (projected == NULL) {
+				rc = -1;
+				break;
+			}
+			tuple = projected;
+			box_tuple_ref(tuple);
+		}
 		luaT_pushtuple(L, tuple);
 		lua_rawseti(L, -2, cur);
 		++cur;
@@ -1232,7 +4091,17 @@ lbox_merge_source_select_usage(struct lua_State *L, const char *param_name)
 {
 	static const char *usage = "merge_source:select([{"
 				   "buffer = <cdata<struct ibuf>> or <nil>, "
-				   "limit = <number> or <nil>}])";
+				   "buffers = {<cdata<struct ibuf>>, ...} or "
+				   "<nil>, "
+				   "partition_by = <cdata<struct key_def>> or "
+				   "<nil>, "
+				   "limit = <number> or <nil>, "
+				   "yield_every = <number> or <nil>, "
+				   "deadline = <number> or <nil>, "
+				   "cursor = <boolean> or <nil>, "
+				   "fields = {<number>, ...} or <nil>, "
+				   "key_only = <boolean> or <nil>, "
+				   "offload = <boolean> or <nil>}])";
 	if (param_name == NULL)
 		return luaL_error(L, "Bad params, use: %s", usage);
 	else
@@ -1240,16 +4109,220 @@ lbox_merge_source_select_usage(struct lua_State *L, const char *param_name)
 				  usage);
 }
 
+/**
+ * Parse select({buffers = ...}).
+ *
+ * Allocate partitions as a userdata, which is left on the Lua
+ * stack, so it is freed by GC when an error is raised.
+ *
+ * Return 0 at success, -1 at a bad parameter.
+ */
+static int
+luaT_merge_source_parse_buffers(struct lua_State *L, int idx,
+				struct merge_source_select_opts *opts)
+{
+	if (!lua_istable(L, idx))
+		return -1;
+	uint32_t count = lua_objlen(L, idx);
+	if (count == 0)
+		return -1;
+	struct merge_source_partition *partitions = lua_newuserdata(L,
+		sizeof(struct merge_source_partition) * count);
+	for (uint32_t i = 0; i < count; ++i) {
+		lua_rawgeti(L, idx, i + 1);
+		partitions[i].buffer = luaT_toibuf(L, -1);
+		lua_pop(L, 1);
+		if (partitions[i].buffer == NULL)
+			return -1;
+		/* Array headers would overwrite each other. */
+		for (uint32_t j = 0; j < i; ++j) {
+			if (partitions[j].buffer == partitions[i].buffer)
+				return -1;
+		}
+	}
+	opts->partitions = partitions;
+	opts->partition_count = count;
+	return 0;
+}
+
+/**
+ * Parse select({partition_by = key_def}): get field numbers of
+ * key parts from key_def:totable(), because key parts are not
+ * accessible via the module API.
+ *
+ * Return 0 at success, -1 at a bad parameter.
+ */
+static int
+luaT_merge_source_parse_partition_by(struct lua_State *L, int idx,
+				     struct merge_source_select_opts *opts)
+{
+	if (luaT_check_key_def(L, idx) == NULL)
+		return -1;
+	int top = lua_gettop(L);
+	int rc = -1;
+	if (luaL_loadstring(L, "return (...):totable()") != 0)
+		goto out;
+	lua_pushvalue(L, idx);
+	if (lua_pcall(L, 1, 1, 0) != 0 || !lua_istable(L, -1))
+		goto out;
+	uint32_t part_count = lua_objlen(L, -1);
+	if (part_count == 0 || part_count > MERGE_PARTITION_PART_MAX)
+		goto out;
+	for (uint32_t i = 0; i < part_count; ++i) {
+		lua_rawgeti(L, -1, i + 1);
+		if (!lua_istable(L, -1))
+			goto out;
+		lua_getfield(L, -1, "fieldno");
+		lua_getfield(L, -2, "path");
+		/* JSON paths are not supported. */
+		if (!lua_isnumber(L, -2) || lua_tointeger(L, -2) < 1 ||
+		    !lua_isnil(L, -1))
+			goto out;
+		opts->partition_fields[i] = lua_tointeger(L, -2) - 1;
+		/*
+		 * Strings equal by a collation are not hashed to
+		 * the same partition.
+		 */
+		lua_getfield(L, -3, "collation");
+		const char *collation = lua_type(L, -1) == LUA_TSTRING ?
+			lua_tostring(L, -1) : NULL;
+		if (collation != NULL && strcmp(collation, "binary") != 0 &&
+		    strcmp(collation, "none") != 0)
+			goto out;
+		lua_pop(L, 4);
+	}
+	opts->partition_field_count = part_count;
+	rc = 0;
+out:
+	lua_settop(L, top);
+	return rc;
+}
+
+/**
+ * Allocate a projection of @a field_count fields as a userdata,
+ * which is left on the Lua stack, so it is freed by GC when an
+ * error is raised. Fields should be set by a caller and
+ * max_fieldno updated.
+ */
+static struct merge_source_projection *
+luaT_merge_projection_new(struct lua_State *L, uint32_t field_count,
+			  uint32_t max_fieldno)
+{
+	size_t size = sizeof(struct merge_source_projection) +
+		sizeof(const char *) * field_count +
+		sizeof(const char *) * ((size_t)max_fieldno + 1) +
+		sizeof(uint32_t) * field_count;
+	struct merge_source_projection *projection =
+		lua_newuserdata(L, size);
+	projection->field_count = field_count;
+	projection->max_fieldno = max_fieldno;
+	projection->values = (const char **)(projection + 1);
+	projection->by_fieldno = projection->values + field_count;
+	projection->fields = (uint32_t *)
+		(projection->by_fieldno + max_fieldno + 1);
+	return projection;
+}
+
+/**
+ * Parse select({fields = {...}}): one based field numbers.
+ *
+ * Return 0 at success, -1 at a bad parameter.
+ */
+static int
+luaT_merge_source_parse_fields(struct lua_State *L, int idx,
+			       struct merge_source_select_opts *opts)
+{
+	/* Field numbers are limited to keep the scratch small. */
+	enum { FIELDNO_MAX = 65535 };
+	if (!lua_istable(L, idx))
+		return -1;
+	uint32_t count = lua_objlen(L, idx);
+	if (count == 0)
+		return -1;
+	uint32_t max_fieldno = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		lua_rawgeti(L, idx, i + 1);
+		bool ok = lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 1 &&
+			lua_tonumber(L, -1) <= FIELDNO_MAX;
+		uint32_t fieldno = ok ? lua_tointeger(L, -1) - 1 : 0;
+		lua_pop(L, 1);
+		if (!ok)
+			return -1;
+		if (fieldno > max_fieldno)
+			max_fieldno = fieldno;
+	}
+	opts->projection = luaT_merge_projection_new(L, count, max_fieldno);
+	for (uint32_t i = 0; i < count; ++i) {
+		lua_rawgeti(L, idx, i + 1);
+		opts->projection->fields[i] = lua_tointeger(L, -1) - 1;
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+/**
+ * Set up select({key_only = true}): give fields of key parts of
+ * a merger or keys of a keyed merger.
+ *
+ * Return 0 at success. Return -1 and set a diag when a source
+ * is not a merger or its key fields are unknown.
+ */
+static int
+luaT_merge_source_set_key_only(struct lua_State *L,
+			       struct merge_source *source,
+			       struct merge_source_select_opts *opts)
+{
+	const uint32_t *fields;
+	uint32_t field_count;
+	if (merger_key_fields(source, &fields, &field_count) != 0)
+		return -1;
+	if (fields == NULL) {
+		opts->keys = true;
+		return 0;
+	}
+	uint32_t max_fieldno = 0;
+	for (uint32_t i = 0; i < field_count; ++i) {
+		if (fields[i] > max_fieldno)
+			max_fieldno = fields[i];
+	}
+	opts->projection = luaT_merge_projection_new(L, field_count,
+						     max_fieldno);
+	memcpy(opts->projection->fields, fields,
+	       sizeof(uint32_t) * field_count);
+	return 0;
+}
+
+/**
+ * Push a cursor of a merger onto a Lua stack: a MsgPack string
+ * to pass to merger.new({cursor = <...>}) or nil when the merger
+ * is exhausted.
+ */
+static void
+luaT_push_merge_cursor(struct lua_State *L, struct merge_source *source,
+		       bool is_end)
+{
+	if (is_end) {
+		lua_pushnil(L);
+		return;
+	}
+	size_t size = merger_encode_position(source, NULL);
+	char *buf = lua_newuserdata(L, size);
+	merger_encode_position(source, buf);
+	lua_pushlstring(L, buf, size);
+	lua_remove(L, -2);
+}
+
 /**
  * Pull results of a merge source to a Lua stack.
  *
- * Write results into a buffer or a Lua table depending on
- * options.
+ * Write results into a buffer, into partition buffers or into
+ * a Lua table depending on options.
  *
  * Expected a merge source and options (optional) on a Lua stack.
  *
  * Return a Lua table or nothing when a 'buffer' option is
- * provided.
+ * provided. When a 'cursor' option is set, also return a cursor
+ * to get a next page.
  */
 static int
 lbox_merge_source_select(struct lua_State *L)
@@ -1264,8 +4337,20 @@ lbox_merge_source_select(struct lua_State *L)
 	if (!ok)
 		return lbox_merge_source_select_usage(L, NULL);
 
-	uint32_t limit = UINT32_MAX;
-	box_ibuf_t *output_buffer = NULL;
+	struct merge_source_select_opts opts = {
+		.buffer = NULL,
+		.partitions = NULL,
+		.partition_count = 0,
+		.partition_field_count = 0,
+		.limit = UINT32_MAX,
+		.yield_every = 0,
+		.deadline = 0,
+		.cursor = false,
+		.projection = NULL,
+		.keys = false,
+		.offload = false,
+	};
+	bool key_only = false;
 
 	/* Parse options. */
 	if (!lua_isnoneornil(L, 2)) {
@@ -1273,31 +4358,251 @@ lbox_merge_source_select(struct lua_State *L)
 		lua_pushstring(L, "buffer");
 		lua_gettable(L, 2);
 		if (!lua_isnil(L, -1)) {
-			if ((output_buffer = luaT_toibuf(L, -1)) == NULL)
+			if ((opts.buffer = luaT_toibuf(L, -1)) == NULL)
 				return lbox_merge_source_select_usage(L,
 					"buffer");
 		}
 		lua_pop(L, 1);
 
+		/*
+		 * Parse buffers. The partitions userdata stays on
+		 * the stack until the end of the call.
+		 */
+		lua_pushstring(L, "buffers");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (opts.buffer != NULL ||
+			    luaT_merge_source_parse_buffers(L, lua_gettop(L),
+							    &opts) != 0)
+				return lbox_merge_source_select_usage(L,
+					"buffers");
+		}
+
+		/* Parse partition_by. */
+		lua_pushstring(L, "partition_by");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (opts.partitions == NULL ||
+			    luaT_merge_source_parse_partition_by(L,
+					lua_gettop(L), &opts) != 0)
+				return lbox_merge_source_select_usage(L,
+					"partition_by");
+		} else if (opts.partitions != NULL) {
+			return lbox_merge_source_select_usage(L,
+				"partition_by");
+		}
+		lua_pop(L, 1);
+
 		/* Parse limit. */
 		lua_pushstring(L, "limit");
 		lua_gettable(L, 2);
 		if (!lua_isnil(L, -1)) {
 			if (lua_isnumber(L, -1))
-				limit = lua_tointeger(L, -1);
+				opts.limit = lua_tointeger(L, -1);
 			else
 				return lbox_merge_source_select_usage(L,
 					"limit");
 		}
 		lua_pop(L, 1);
+
+		/* Parse yield_every. */
+		lua_pushstring(L, "yield_every");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0)
+				opts.yield_every = lua_tointeger(L, -1);
+			else
+				return lbox_merge_source_select_usage(L,
+					"yield_every");
+		}
+		lua_pop(L, 1);
+
+		/* Parse deadline. */
+		lua_pushstring(L, "deadline");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isnumber(L, -1) && lua_tonumber(L, -1) > 0)
+				opts.deadline = lua_tonumber(L, -1);
+			else
+				return lbox_merge_source_select_usage(L,
+					"deadline");
+		}
+		lua_pop(L, 1);
+
+		/* Parse cursor. */
+		lua_pushstring(L, "cursor");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isboolean(L, -1))
+				opts.cursor = lua_toboolean(L, -1);
+			else
+				return lbox_merge_source_select_usage(L,
+					"cursor");
+		}
+		lua_pop(L, 1);
+
+		/*
+		 * Parse fields. The projection userdata stays on
+		 * the stack until the end of the call.
+		 */
+		lua_pushstring(L, "fields");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (luaT_merge_source_parse_fields(L, lua_gettop(L),
+							   &opts) != 0)
+				return lbox_merge_source_select_usage(L,
+					"fields");
+		}
+
+		/* Parse key_only. */
+		lua_pushstring(L, "key_only");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isboolean(L, -1) && opts.projection == NULL)
+				key_only = lua_toboolean(L, -1);
+			else
+				return lbox_merge_source_select_usage(L,
+					"key_only");
+		}
+		lua_pop(L, 1);
+
+		/* Parse offload. */
+		lua_pushstring(L, "offload");
+		lua_gettable(L, 2);
+		if (!lua_isnil(L, -1)) {
+			if (lua_isboolean(L, -1) && opts.buffer != NULL)
+				opts.offload = lua_toboolean(L, -1);
+			else
+				return lbox_merge_source_select_usage(L,
+					"offload");
+		}
+		lua_pop(L, 1);
 	}
 
-	if (output_buffer == NULL)
-		return create_result_table(L, source, limit);
+	if (key_only && luaT_merge_source_set_key_only(L, source, &opts) != 0)
+		return luaT_error(L);
+
+	if (opts.cursor && merger_track_position(source) != 0)
+		return luaT_error(L);
+
+	bool is_end = false;
+	int count;
+	if (opts.partitions != NULL)
+		count = encode_result_partitions(L, source, &opts, &is_end);
+	else if (opts.buffer == NULL)
+		count = create_result_table(L, source, &opts, &is_end);
 	else
-		return encode_result_buffer(L, source, output_buffer, limit);
+		count = encode_result_buffer(L, source, &opts, &is_end);
+	merge_projection_buf_shrink();
+	if (!opts.cursor)
+		return count;
+	luaT_push_merge_cursor(L, source, is_end);
+	return count + 1;
+}
+
+/* }}} */
+
+/* {{{ Public C API */
+
+/**
+ * A source, which is implemented by another module (see
+ * tuple_merger.h).
+ *
+ * struct tuple_merge_source is never defined: it is struct
+ * merge_source for users of the public API.
+ */
+struct merge_source_native {
+	struct merge_source base;
+	const struct tuple_merge_source_vtab *vtab;
+	void *ctx;
+};
+
+static void
+merge_source_native_destroy(struct merge_source *base)
+{
+	struct merge_source_native *source = container_of(base,
+		struct merge_source_native, base);
+	source->vtab->destroy(source->ctx);
+	free(source);
+}
+
+static int
+merge_source_native_next(struct merge_source *base, box_tuple_format_t *format,
+			 box_tuple_t **out)
+{
+	struct merge_source_native *source = container_of(base,
+		struct merge_source_native, base);
+	return source->vtab->next(source->ctx, format, out);
+}
+
+static struct tuple_merge_source *
+api_source_new(const struct tuple_merge_source_vtab *vtab, void *ctx)
+{
+	static struct merge_source_vtab merge_source_native_vtab = {
+		.destroy = merge_source_native_destroy,
+		.next = merge_source_native_next,
+	};
+
+	struct merge_source_native *source = malloc(
+		sizeof(struct merge_source_native));
+	if (source == NULL) {
+		diag_set_oom(sizeof(struct merge_source_native), "malloc",
+			     "merge_source_native");
+		return NULL;
+	}
+	merge_source_create(&source->base, &merge_source_native_vtab);
+	source->vtab = vtab;
+	source->ctx = ctx;
+	return (struct tuple_merge_source *) &source->base;
+}
+
+static void
+api_source_ref(struct tuple_merge_source *source)
+{
+	merge_source_ref((struct merge_source *) source);
+}
+
+static void
+api_source_unref(struct tuple_merge_source *source)
+{
+	merge_source_unref((struct merge_source *) source);
+}
+
+static int
+api_source_next(struct tuple_merge_source *source, box_tuple_format_t *format,
+		box_tuple_t **out)
+{
+	return merge_source_next((struct merge_source *) source, format, out);
+}
+
+static void
+api_luaT_push_source(struct lua_State *L, struct tuple_merge_source *source)
+{
+	*(struct merge_source **)
+		luaL_pushcdata(L, CTID_STRUCT_TUPLE_MERGE_SOURCE_REF) =
+		(struct merge_source *) source;
+	lua_pushcfunction(L, lbox_merge_source_gc);
+	luaL_setcdatagc(L, -2);
+}
+
+static struct tuple_merge_source *
+api_luaT_check_source(struct lua_State *L, int idx)
+{
+	if (!luaL_iscdata(L, idx))
+		return NULL;
+	return (struct tuple_merge_source *) luaT_check_merge_source(L, idx);
 }
 
+static const struct tuple_merger_api merger_api = {
+	.version = TUPLE_MERGER_API_VERSION,
+	.source_new = api_source_new,
+	.source_ref = api_source_ref,
+	.source_unref = api_source_unref,
+	.source_next = api_source_next,
+	.luaT_push_source = api_luaT_push_source,
+	.luaT_check_source = api_luaT_check_source,
+};
+
 /* }}} */
 
 /**
@@ -1320,12 +4625,22 @@ luaopen_tuple_merger(struct lua_State *L)
 	CTID_STRUCT_TUPLE_MERGE_SOURCE_REF =
 		luaL_ctypeid(L, "struct tuple_merge_source&");
 
+	luaL_cdef(L, "struct tuple_merge_plan;");
+	CTID_STRUCT_TUPLE_MERGE_PLAN_REF =
+		luaL_ctypeid(L, "struct tuple_merge_plan&");
+
 	/* Create the module table. */
 	static const struct luaL_Reg meta[] = {
 		{"new_buffer_source", lbox_merger_new_buffer_source},
+		{"encode_compact", lbox_merger_encode_compact},
 		{"new_table_source", lbox_merger_new_table_source},
 		{"new_tuple_source", lbox_merger_new_tuple_source},
+		{"new_index_source", lbox_merger_new_index_source},
+		{"new_file_source", lbox_merger_new_file_source},
+		{"write_file", lbox_merger_write_file},
+		{"sort", lbox_merger_sort},
 		{"new", lbox_merger_new},
+		{"prepare", lbox_merger_prepare},
 		{NULL, NULL}
 	};
 	size_t len = sizeof(meta) / sizeof(meta[0]);
@@ -1336,14 +4651,29 @@ luaopen_tuple_merger(struct lua_State *L)
 	lua_pushstring(L, TUPLE_MERGER_VERSION);
 	lua_setfield(L, -2, "_VERSION");
 
-	/* Add internal.{select,ipairs}(). */
+	/* Add the C API (see tuple_merger.h). */
+	lua_pushlightuserdata(L, (void *) &merger_api);
+	lua_setfield(L, -2, "c_api");
+
+	/* Add internal.{select,ipairs,batches,bind}(). */
 	lua_newtable(L); /* merger.internal */
 	lua_pushcfunction(L, lbox_merge_source_select);
 	lua_setfield(L, -2, "select");
 	lua_pushcfunction(L, lbox_merge_source_ipairs);
 	lua_setfield(L, -2, "ipairs");
+	lua_pushcfunction(L, lbox_merge_source_batches);
+	lua_setfield(L, -2, "batches");
+	lua_pushcfunction(L, lbox_merge_plan_bind);
+	lua_setfield(L, -2, "bind");
 	lua_setfield(L, -2, "internal");
 
+	/* Compile key_def:totable() call once for all mergers. */
+	if (KEY_DEF_TOTABLE_REF == LUA_NOREF) {
+		if (luaL_loadstring(L, "return (...):totable()") != 0)
+			return lua_error(L);
+		KEY_DEF_TOTABLE_REF = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
 	/* Execute Lua part of the module. */
 	execute_postload_lua(L, first_load);
 	first_load = false;
@@ -0,0 +1,182 @@
+#ifndef TUPLE_MERGER_H_INCLUDED
+#define TUPLE_MERGER_H_INCLUDED
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Public C API of the tuple.merger module.
+ *
+ * The module is loaded by `require('tuple.merger')` and its
+ * symbols are not visible to other modules, so the API is a
+ * table of functions. Get it using tuple_merger_api_get():
+ *
+ *  | const struct tuple_merger_api *api =
+ *  |         tuple_merger_api_get(L, TUPLE_MERGER_API_VERSION);
+ *  | if (api == NULL)
+ *  |         return luaL_error(L, "tuple.merger is not available");
+ *  |
+ *  | struct tuple_merge_source *source = api->source_new(&vtab, ctx);
+ *  | if (source == NULL)
+ *  |         return luaT_error(L);
+ *  | api->luaT_push_source(L, source);
+ *
+ * The pushed source may be passed to merger.new() and used with
+ * all other merge source methods.
+ *
+ * The API is versioned: new functions are added to the end of
+ * struct tuple_merger_api and increase TUPLE_MERGER_API_VERSION.
+ * Existing functions and struct tuple_merge_source_vtab never
+ * change within the same major version of the module.
+ *
+ * The header has no link time dependencies: copy it into a
+ * module that uses the API.
+ */
+
+#include <stdint.h>
+
+#include <lua.h>
+#include <module.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+#define TUPLE_MERGER_API_VERSION 1
+
+/**
+ * A merge source: cdata<struct tuple_merge_source &> in Lua.
+ */
+struct tuple_merge_source;
+
+/**
+ * Callbacks of a source created by tuple_merger_api.source_new().
+ */
+struct tuple_merge_source_vtab {
+	/**
+	 * Free the source context. Called when the last reference
+	 * to the source is dropped.
+	 */
+	void (*destroy)(void *ctx);
+	/**
+	 * Get a next tuple (refcounted) or NULL at the end.
+	 *
+	 * Tuples should be given in the order of a key_def of a
+	 * merger the source is used in.
+	 *
+	 * When @a format is not NULL, the tuple should be in a
+	 * compatible format (see box_tuple_validate()).
+	 *
+	 * Return 0 when successfully fetched a tuple or NULL. In
+	 * case of an error set a diag (see box_error_set()) and
+	 * return -1.
+	 */
+	int (*next)(void *ctx, box_tuple_format_t *format,
+		    box_tuple_t **out);
+};
+
+/**
+ * Functions of the API.
+ */
+struct tuple_merger_api {
+	/* TUPLE_MERGER_API_VERSION of the loaded module. */
+	uint32_t version;
+	/**
+	 * Create a new source with given callbacks and a
+	 * context. The vtab should outlive the source.
+	 *
+	 * The source has one reference. The context is owned by
+	 * the source after a successful call.
+	 *
+	 * Return NULL and set a diag in case of an error.
+	 */
+	struct tuple_merge_source *
+	(*source_new)(const struct tuple_merge_source_vtab *vtab, void *ctx);
+	/** Increment a source reference counter. */
+	void
+	(*source_ref)(struct tuple_merge_source *source);
+	/**
+	 * Decrement a source reference counter and free the
+	 * source when it reaches zero.
+	 */
+	void
+	(*source_unref)(struct tuple_merge_source *source);
+	/**
+	 * Get a next tuple (refcounted) from any source, say, a
+	 * merger. See tuple_merge_source_vtab.next.
+	 */
+	int
+	(*source_next)(struct tuple_merge_source *source,
+		       box_tuple_format_t *format, box_tuple_t **out);
+	/**
+	 * Push a source onto a Lua stack. The Lua object takes
+	 * the reference of the caller.
+	 */
+	void
+	(*luaT_push_source)(struct lua_State *L,
+			    struct tuple_merge_source *source);
+	/**
+	 * Get a source from a Lua stack without taking a
+	 * reference. Return NULL if the value is not a source.
+	 */
+	struct tuple_merge_source *
+	(*luaT_check_source)(struct lua_State *L, int idx);
+};
+
+/**
+ * Load the module and get its API.
+ *
+ * Return NULL when the module can't be loaded or its API is
+ * older than @a min_version.
+ */
+static inline const struct tuple_merger_api *
+tuple_merger_api_get(struct lua_State *L, uint32_t min_version)
+{
+	const struct tuple_merger_api *api = NULL;
+	int top = lua_gettop(L);
+	lua_getglobal(L, "require");
+	lua_pushstring(L, "tuple.merger");
+	if (lua_pcall(L, 1, 1, 0) == 0 && lua_istable(L, -1)) {
+		lua_getfield(L, -1, "c_api");
+		if (lua_islightuserdata(L, -1))
+			api = (const struct tuple_merger_api *)
+				lua_touserdata(L, -1);
+	}
+	lua_settop(L, top);
+	if (api != NULL && api->version < min_version)
+		return NULL;
+	return api;
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /* TUPLE_MERGER_H_INCLUDED */
@@ -7,26 +7,31 @@
 --
 -- It is executed at each module reload with two arguments:
 -- a module itself and first_load flag that should prevent
--- `ffi.metatype` call for `struct tuple_merge_source`
--- more than one time.
+-- `ffi.metatype` call for `struct tuple_merge_source` and
+-- `struct tuple_merge_plan` more than one time.
 --
 
 local merger, first_load = ...
 
 local ffi = require('ffi')
 local fun = require('fun')
+local fiber = require('fiber')
+local buffer = require('buffer')
+local msgpack = require('msgpack')
 
 local ibuf_t = ffi.typeof('struct ibuf')
 local merge_source_t = ffi.typeof('struct tuple_merge_source')
+local merge_plan_t = ffi.typeof('struct tuple_merge_plan')
 
 -- Create a source from one buffer.
-merger.new_source_frombuffer = function(buf)
+merger.new_source_frombuffer = function(buf, opts)
     local func_name = 'merger.new_source_frombuffer'
     if type(buf) ~= 'cdata' or not ffi.istype(ibuf_t, buf) then
         error(('Usage: %s(<cdata<struct ibuf>>)'):format(func_name), 0)
     end
 
-    return merger.new_buffer_source(fun.iter({buf}))
+    local gen, param, state = fun.iter({buf})
+    return merger.new_buffer_source(gen, param, state, opts)
 end
 
 -- Create a source from one table.
@@ -39,6 +44,256 @@ merger.new_source_fromtable = function(tbl)
     return merger.new_table_source(fun.iter({tbl}))
 end
 
+-- {{{ map_merge
+
+local MAP_MERGE_PIPELINE_DEPTH = 2
+local MAP_MERGE_TIMEOUT = 60
+
+-- The end of a stream of chunks.
+local MAP_MERGE_END = {}
+
+-- Skip an array around call results and decode the cursor, leave
+-- tuples in the buffer.
+--
+-- A C function (see select_chunked() in merger-chunked.c) returns
+-- one [cursor, tuples] tuple instead of two values.
+local function map_merge_decode_cursor(buf)
+    local len
+    len, buf.rpos = msgpack.decode_array_header(buf.rpos, buf:size())
+    if len == 1 then
+        len, buf.rpos = msgpack.decode_array_header(buf.rpos, buf:size())
+    end
+    if len ~= 2 then
+        error(('Expected <cursor>, <tuples>, got %d return values'):format(
+            len), 0)
+    end
+    local cursor
+    cursor, buf.rpos = msgpack.decode(buf.rpos, buf:size())
+    return cursor
+end
+
+-- Create a quota to share between map_merge() calls (see
+-- opts.read_ahead_limit), say, one per process.
+merger.new_read_ahead_quota = function(limit)
+    if type(limit) ~= 'number' or limit < 0 then
+        error('Usage: merger.new_read_ahead_quota(<number>)', 0)
+    end
+    -- Bytes of fetched and not yet merged chunks of map_merge()
+    -- calls sharing the quota.
+    return {limit = limit, used = 0, cond = fiber.cond()}
+end
+
+-- Whether a fetcher should not read ahead: merges sharing its
+-- quota hold more than the limit in fetched chunks. A chunk that
+-- the merger waits for is always fetched.
+local function map_merge_is_over_quota(ctx)
+    local quota = ctx.quota
+    return quota ~= nil and quota.used >= quota.limit and
+        ctx.ready:count() > 0 and not ctx.ready:is_closed()
+end
+
+-- Account a fetched chunk in a memory quota.
+local function map_merge_quota_acquire(ctx, buf)
+    if ctx.quota ~= nil then
+        ctx.sizes[buf] = buf:size()
+        ctx.quota.used = ctx.quota.used + buf:size()
+    end
+end
+
+-- Release a chunk consumed by the merger and let fetchers read
+-- ahead if the merge fits its memory limit again.
+local function map_merge_quota_release(ctx, buf)
+    if ctx.quota ~= nil and ctx.sizes[buf] ~= nil then
+        ctx.quota.used = ctx.quota.used - ctx.sizes[buf]
+        ctx.sizes[buf] = nil
+        ctx.quota.cond:broadcast()
+    end
+end
+
+-- Fetch chunks from a replicaset until the last one, each one
+-- into a free buffer.
+--
+-- A next request depends on a cursor from a previous response,
+-- so there is one request in flight, but the fiber runs ahead of
+-- the merger by up to pipeline_depth chunks (while the merge
+-- fits its memory limit).
+local function map_merge_fetcher(ctx)
+    local cursor
+    while true do
+        local buf = ctx.free:get(ctx.timeout)
+        if buf == nil then
+            break
+        end
+        while map_merge_is_over_quota(ctx) do
+            ctx.quota.cond:wait(ctx.timeout)
+        end
+        ctx.opts.cursor = cursor
+        local ok, res, err = pcall(function()
+            local future = ctx.replicaset:callro(ctx.func, ctx.args,
+                {is_async = true, buffer = buf, skip_header = true})
+            local res, err = future:wait_result(ctx.timeout)
+            if res == nil then
+                return nil, err
+            end
+            return map_merge_decode_cursor(buf)
+        end)
+        if not ok or res == nil then
+            ctx.ready:put({err = ok and err or res}, 0)
+            break
+        end
+        cursor = res
+        map_merge_quota_acquire(ctx, buf)
+        if not ctx.ready:put(buf, ctx.timeout) then
+            map_merge_quota_release(ctx, buf)
+            break
+        end
+        if cursor.is_end then
+            ctx.ready:put(MAP_MERGE_END, ctx.timeout)
+            break
+        end
+    end
+end
+
+-- A gen function of a buffer source: give a next fetched buffer
+-- and return a previous one into the pool. The previous buffer is
+-- consumed, so its memory is freed at once.
+local function map_merge_fetch(param, state)
+    local ctx = param.ctx
+    if state.buf ~= nil then
+        map_merge_quota_release(ctx, state.buf)
+        state.buf:recycle()
+        ctx.free:put(state.buf, 0)
+        state.buf = nil
+    end
+    local item = ctx.ready:get(ctx.timeout)
+    if item == nil then
+        error('Timed out while waiting for a chunk', 0)
+    end
+    if item == MAP_MERGE_END then
+        return
+    end
+    if type(item) == 'table' then
+        error(item.err, 0)
+    end
+    return {buf = item}, item
+end
+
+-- Call func on each replicaset and merge results.
+--
+-- func is called with args, where the last argument is a table
+-- of options (it is added when args does not end with a table).
+-- func should return a cursor and tuples: the cursor is passed
+-- back as opts.cursor to get a next chunk, {is_end = true} means
+-- the last chunk.
+--
+-- When opts.cursor is given, func gets a key to start from in
+-- opts.after of a first call.
+--
+-- When opts.read_ahead_limit is given, fetchers don't read ahead
+-- while fetched and not yet merged chunks of all replicasets
+-- take more bytes. It is either a number of bytes for this call
+-- or a quota from merger.new_read_ahead_quota() shared with other
+-- calls. Only read-ahead of map_merge() is bounded: a merger does
+-- not account chunks of other buffer sources.
+merger.map_merge = function(router, func, args, key_def, opts)
+    local func_name = 'merger.map_merge'
+    local opts = opts or {}
+    if type(router) ~= 'table' or type(func) ~= 'string' or
+            type(args) ~= 'table' or type(opts) ~= 'table' then
+        error(('Usage: %s(router, func, args, key_def[, {' ..
+               'pipeline_depth = <number> or <nil>, ' ..
+               'timeout = <number> or <nil>, ' ..
+               'format = <string> or <nil>, ' ..
+               'reverse = <boolean> or <nil>, ' ..
+               'cursor = <string> or <nil>, ' ..
+               'read_ahead_limit = <number> or <quota> or <nil>}])'):format(
+               func_name), 0)
+    end
+    local pipeline_depth = opts.pipeline_depth or MAP_MERGE_PIPELINE_DEPTH
+    local timeout = opts.timeout or MAP_MERGE_TIMEOUT
+    local quota = opts.read_ahead_limit
+    if type(quota) == 'number' then
+        quota = merger.new_read_ahead_quota(quota)
+    elseif quota ~= nil and (type(quota) ~= 'table' or
+            type(quota.limit) ~= 'number' or quota.cond == nil) then
+        error('Bad read_ahead_limit: expected a number or a quota', 0)
+    end
+
+    -- A cursor from merge_source:select({cursor = true}) is
+    -- [key, ties]: storages start from the key and the merger
+    -- skips the rest.
+    local after
+    if opts.cursor ~= nil then
+        local ok, position = pcall(msgpack.decode, opts.cursor)
+        if not ok or type(position) ~= 'table' then
+            error('Bad cursor', 0)
+        end
+        after = position[1]
+    end
+
+    local sources = {}
+    for _, replicaset in pairs(router:routeall()) do
+        -- Each replicaset gets its own copy of options to
+        -- set a cursor.
+        local args = table.copy(args)
+        local call_opts
+        if type(args[#args]) == 'table' then
+            call_opts = table.copy(args[#args])
+            args[#args] = call_opts
+        else
+            call_opts = {}
+            table.insert(args, call_opts)
+        end
+        call_opts.after = after
+
+        local ctx = {
+            replicaset = replicaset,
+            func = func,
+            args = args,
+            opts = call_opts,
+            timeout = timeout,
+            free = fiber.channel(pipeline_depth),
+            ready = fiber.channel(pipeline_depth + 1),
+            quota = quota,
+            -- Accounted sizes of fetched buffers.
+            sizes = {},
+        }
+        for _ = 1, pipeline_depth do
+            ctx.free:put(buffer.ibuf())
+        end
+        fiber.create(map_merge_fetcher, ctx)
+
+        -- Stop the fetcher when the source is collected: the
+        -- fetcher holds ctx, but not param.
+        local param = {
+            ctx = ctx,
+            gc = ffi.gc(ffi.new('char[1]'), function()
+                ctx.free:close()
+                ctx.ready:close()
+                -- Give chunks that are not merged back to a
+                -- shared quota.
+                for buf in pairs(ctx.sizes) do
+                    map_merge_quota_release(ctx, buf)
+                end
+                if quota ~= nil then
+                    quota.cond:broadcast()
+                end
+            end),
+        }
+        local source = merger.new_buffer_source(map_merge_fetch, param, {},
+            {format = opts.format})
+        table.insert(sources, source)
+    end
+
+    return merger.new(key_def, sources, {
+        reverse = opts.reverse,
+        keyed = opts.format == 'keyed',
+        cursor = opts.cursor,
+    })
+end
+
+-- }}} map_merge
+
 if not first_load then
     return
 end
@@ -47,6 +302,7 @@ local methods = {
     ['select'] = merger.internal.select,
     ['pairs']  = merger.internal.ipairs,
     ['ipairs']  = merger.internal.ipairs,
+    ['batches'] = merger.internal.batches,
 }
 
 ffi.metatype(merge_source_t, {
@@ -57,3 +313,9 @@ ffi.metatype(merge_source_t, {
     __pairs = merger.internal.ipairs,
     __ipairs = merger.internal.ipairs,
 })
+
+ffi.metatype(merge_plan_t, {
+    __index = {
+        bind = merger.internal.bind,
+    },
+})
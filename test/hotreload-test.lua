@@ -12,11 +12,19 @@ local key_def_lib = require('tuple.keydef')
 local function test_module_methods_presence(test, tuple_merger)
     local methods = {
         'new_buffer_source',
+        'encode_compact',
         'new_table_source',
         'new',
+        'prepare',
         'new_source_fromtable',
         'new_source_frombuffer',
         'new_tuple_source',
+        'new_index_source',
+        'new_file_source',
+        'write_file',
+        'sort',
+        'map_merge',
+        'c_api',
     }
     test:plan(#methods)
 
@@ -33,6 +41,7 @@ local function test_instance_methods_presence(test, tuple_merger_instance)
     local methods = {
         'select',
         'pairs',
+        'batches',
     }
     test:plan(#methods)
 
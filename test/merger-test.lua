@@ -10,6 +10,7 @@ local fiber = require('fiber')
 local utf8 = require('utf8')
 local ffi = require('ffi')
 local fun = require('fun')
+local fio = require('fio')
 
 -- A chunk size for table and buffer sources. A chunk size for
 -- tuple source is always 1.
@@ -18,7 +19,13 @@ local FETCH_BLOCK_SIZE = 10
 local function merger_new_usage(param)
     local msg = 'merger.new(key_def, ' ..
         '{source, source, ...}[, {' ..
-        'reverse = <boolean> or <nil>}])'
+        'reverse = <boolean> or <nil>, ' ..
+        'keyed = <boolean> or <nil>, ' ..
+        'fan_in = <number> or <nil>, ' ..
+        'memory_limit = <number> or <nil>, ' ..
+        'tmpdir = <string> or <nil>, ' ..
+        'cursor = <string> or <nil>, ' ..
+        'filter = <table> or <nil>}])'
     if not param then
         return ('Bad params, use: %s'):format(msg)
     else
@@ -29,7 +36,15 @@ end
 local function merger_select_usage(param)
     local msg = 'merge_source:select([{' ..
                 'buffer = <cdata<struct ibuf>> or <nil>, ' ..
-                'limit = <number> or <nil>}])'
+                'buffers = {<cdata<struct ibuf>>, ...} or <nil>, ' ..
+                'partition_by = <cdata<struct key_def>> or <nil>, ' ..
+                'limit = <number> or <nil>, ' ..
+                'yield_every = <number> or <nil>, ' ..
+                'deadline = <number> or <nil>, ' ..
+                'cursor = <boolean> or <nil>, ' ..
+                'fields = {<number>, ...} or <nil>, ' ..
+                'key_only = <boolean> or <nil>, ' ..
+                'offload = <boolean> or <nil>}])'
     if not param then
         return ('Bad params, use: %s'):format(msg)
     else
@@ -124,6 +139,48 @@ local bad_merger_new_calls = {
         opts = {reverse = 1},
         exp_err = merger_new_usage('reverse'),
     },
+    {
+        'Bad opts.fan_in',
+        sources = {},
+        opts = {fan_in = 1},
+        exp_err = merger_new_usage('fan_in'),
+    },
+    {
+        'opts.fan_in with opts.keyed',
+        sources = {},
+        opts = {fan_in = 2, keyed = true},
+        exp_err = merger_new_usage('fan_in'),
+    },
+    {
+        'opts.memory_limit without opts.fan_in',
+        sources = {},
+        opts = {memory_limit = 1000},
+        exp_err = merger_new_usage('memory_limit'),
+    },
+    {
+        'opts.tmpdir without opts.fan_in',
+        sources = {},
+        opts = {tmpdir = '/tmp'},
+        exp_err = merger_new_usage('tmpdir'),
+    },
+    {
+        'Bad opts.cursor (not a cursor)',
+        sources = {},
+        opts = {cursor = 'hello'},
+        exp_err = merger_new_usage('cursor'),
+    },
+    {
+        'Bad opts.filter (unknown operation)',
+        sources = {},
+        opts = {filter = {'like', 1, 'a%'}},
+        exp_err = merger_new_usage('filter'),
+    },
+    {
+        'opts.filter with opts.fan_in',
+        sources = {},
+        opts = {fan_in = 2, filter = {'is_null', 1}},
+        exp_err = merger_new_usage('filter'),
+    },
 }
 
 local bad_merger_select_calls = {
@@ -169,7 +226,57 @@ local bad_merger_select_calls = {
         sources = {},
         opts = {limit = 'hello'},
         exp_err = merger_select_usage('limit'),
-    }
+    },
+    {
+        'Bad opts.buffers (with opts.buffer)',
+        sources = {},
+        opts = {buffer = buffer.ibuf(), buffers = {buffer.ibuf()}},
+        exp_err = merger_select_usage('buffers'),
+    },
+    {
+        'Bad opts.buffers (the same buffer twice)',
+        sources = {},
+        opts = (function()
+            local buf = buffer.ibuf()
+            return {buffers = {buf, buf}}
+        end)(),
+        exp_err = merger_select_usage('buffers'),
+    },
+    {
+        'Bad opts.fields (zero field number)',
+        sources = {},
+        opts = {fields = {1, 0}},
+        exp_err = merger_select_usage('fields'),
+    },
+    {
+        'Bad opts.key_only (with opts.fields)',
+        sources = {},
+        opts = {fields = {1}, key_only = true},
+        exp_err = merger_select_usage('key_only'),
+    },
+    {
+        'Bad opts.offload (without opts.buffer)',
+        sources = {},
+        opts = {offload = true},
+        exp_err = merger_select_usage('offload'),
+    },
+    {
+        'Bad opts.partition_by (missed)',
+        sources = {},
+        opts = {buffers = {buffer.ibuf()}},
+        exp_err = merger_select_usage('partition_by'),
+    },
+    {
+        'Bad opts.partition_by (a collation)',
+        sources = {},
+        opts = {
+            buffers = {buffer.ibuf()},
+            partition_by = key_def_lib.new({{
+                fieldno = 1, type = 'string', collation = 'unicode_ci',
+            }}),
+        },
+        exp_err = merger_select_usage('partition_by'),
+    },
 }
 
 local schemas = {
@@ -530,7 +637,7 @@ end
 
 local test = tap.test('merger')
 test:plan(#bad_source_new_calls + #bad_chunks + #bad_merger_new_calls +
-    #bad_merger_select_calls + 8 + #schemas * 48)
+    #bad_merger_select_calls + 28 + #schemas * 48)
 
 -- For collations.
 box.cfg{}
@@ -698,6 +805,372 @@ test:test('use limit', function(test)
     test:is_deeply(res[1], data[1], 'tuple content')
 end)
 
+test:test('collation aware key parts', function(test)
+    test:plan(4)
+
+    local words = {'apple', 'Apple', 'APPLE', 'Äpfel', 'banana', 'Banana',
+                   'ёлка', 'Ёлка', 'елка', 'zebra', '', 'a\0b', 'a'}
+
+    local function check(key_def, name)
+        local sources = {}
+        local count = 0
+        for i = 1, 3 do
+            local tuples = {}
+            for j, word in ipairs(words) do
+                if j % 3 == i - 1 or j % 2 == 0 then
+                    local name = j % 5 == 0 and box.NULL or
+                        words[#words - j + 1]
+                    table.insert(tuples, box.tuple.new({word, name}))
+                end
+            end
+            table.sort(tuples, function(a, b)
+                return key_def:compare(a, b) < 0
+            end)
+            count = count + #tuples
+            sources[i] = merger.new_source_fromtable(tuples)
+        end
+
+        local res = merger.new(key_def, sources):select()
+        test:is(#res, count, ('all tuples are merged (%s)'):format(name))
+        local is_sorted = true
+        for i = 2, #res do
+            if key_def:compare(res[i - 1], res[i]) > 0 then
+                is_sorted = false
+            end
+        end
+        test:ok(is_sorted, ('tuples are sorted (%s)'):format(name))
+    end
+
+    check(key_def_lib.new({
+        {fieldno = 2, type = 'string', collation = 'unicode_ci',
+         is_nullable = true},
+        {fieldno = 1, type = 'string', collation = 'unicode'},
+    }), 'asc')
+
+    -- Sort keys are ascending, so they are not used here.
+    local ok, key_def = pcall(key_def_lib.new, {
+        {fieldno = 2, type = 'string', collation = 'unicode_ci',
+         is_nullable = true, sort_order = 'desc'},
+        {fieldno = 1, type = 'string', collation = 'unicode'},
+    })
+    if ok then
+        check(key_def, 'desc')
+    else
+        test:skip('sort_order is not supported by key_def')
+        test:skip('sort_order is not supported by key_def')
+    end
+end)
+
+test:test('drain the last source', function(test)
+    test:plan(4)
+
+    -- The first source ends soon, the second one gives the rest
+    -- of tuples in several chunks.
+    local data = {}
+    for i = 1, 100 do
+        data[i] = {('%03d'):format(i)}
+    end
+    local function new_sources()
+        local chunks = {{}, {}, {}}
+        for i = 1, 100 do
+            local chunk = i <= 5 and chunks[1] or
+                i <= 50 and chunks[2] or chunks[3]
+            table.insert(chunk, data[i])
+        end
+        local bufs = {}
+        for i, chunk in ipairs(chunks) do
+            bufs[i] = buffer.ibuf()
+            msgpackffi.internal.encode_r(bufs[i], chunk, 0)
+        end
+        return {
+            merger.new_source_fromtable({data[1], data[3]}),
+            merger.new_buffer_source(fun.iter(bufs)),
+        }
+    end
+
+    local exp = table.copy(data)
+    table.insert(exp, 1, data[1])
+    table.insert(exp, 4, data[3])
+
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, new_sources()):select({buffer = output_buffer})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, exp, 'buffer output')
+
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, new_sources()):select({buffer = output_buffer,
+                                               limit = 70})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, {unpack(exp, 1, 70)}, 'buffer output with limit')
+
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, {merger.new(key_def, new_sources())}):select({
+        buffer = output_buffer})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, exp, 'cascade mergers')
+
+    local res = merger.new(key_def, new_sources()):select()
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, exp, 'table output')
+end)
+
+test:test('yield_every', function(test)
+    test:plan(5)
+
+    local data = {}
+    for i = 1, 100 do
+        data[i] = {('%03d'):format(i)}
+    end
+
+    -- Count how many times a concurrent fiber is scheduled.
+    local function count_yields(func)
+        local yields = 0
+        local f = fiber.new(function()
+            while true do
+                yields = yields + 1
+                fiber.yield()
+            end
+        end)
+        fiber.yield()
+        yields = 0
+        func()
+        f:cancel()
+        return yields
+    end
+
+    local res
+    local yields = count_yields(function()
+        local source = merger.new_source_fromtable(data)
+        res = merger.new(key_def, {source}):select({yield_every = 10})
+    end)
+    test:is(#res, 100, 'table output')
+    test:ok(yields >= 9, 'yields with table output')
+
+    local output_buffer = buffer.ibuf()
+    local yields = count_yields(function()
+        local source = merger.new_source_fromtable(data)
+        merger.new(key_def, {source}):select({buffer = output_buffer,
+                                              yield_every = 10})
+    end)
+    test:ok(yields >= 9, 'yields with buffer output')
+
+    -- Cancel a fiber, which writes results into a buffer.
+    local output_buffer = buffer.ibuf()
+    local f = fiber.new(function()
+        local source = merger.new_source_fromtable(data)
+        merger.new(key_def, {source}):select({buffer = output_buffer,
+                                              yield_every = 10})
+    end)
+    f:set_joinable(true)
+    fiber.yield()
+    f:cancel()
+    local ok, err = f:join()
+    test:ok(not ok and tostring(err):match('fiber is cancelled'),
+        'select is cancelled')
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, {unpack(data, 1, #res)},
+        'buffer is consistent after cancellation')
+end)
+
+test:test('partitioned select', function(test)
+    test:plan(4)
+
+    local data = {}
+    for i = 1, 100 do
+        data[i] = {('%03d'):format(i), i % 7}
+    end
+    local partition_by = key_def_lib.new({{fieldno = 2, type = 'unsigned'}})
+
+    local buffers = {buffer.ibuf(), buffer.ibuf(), buffer.ibuf()}
+    local source = merger.new_source_fromtable(data)
+    merger.new(key_def, {source}):select({buffers = buffers,
+                                          partition_by = partition_by})
+    local parts = fun.iter(buffers):map(function(buf)
+        return msgpackffi.decode(buf.rpos)
+    end):totable()
+
+    local total = 0
+    local placed = {}
+    local ok = true
+    for i, part in ipairs(parts) do
+        total = total + #part
+        for j, tuple in ipairs(part) do
+            -- Equal partition fields go to the same buffer.
+            local p = placed[tuple[2]]
+            ok = ok and (p == nil or p == i)
+            placed[tuple[2]] = i
+            -- Each partition keeps the merge order.
+            ok = ok and (j == 1 or part[j - 1][1] < tuple[1])
+        end
+    end
+    test:is(total, #data, 'all tuples are written')
+    test:ok(ok, 'partitions are consistent and sorted')
+
+    local buffers = {buffer.ibuf(), buffer.ibuf()}
+    local source = merger.new_source_fromtable(data)
+    merger.new(key_def, {source}):select({buffers = buffers,
+                                          partition_by = partition_by,
+                                          limit = 10})
+    local total = 0
+    for _, buf in ipairs(buffers) do
+        total = total + #msgpackffi.decode(buf.rpos)
+    end
+    test:is(total, 10, 'limit is applied to all partitions')
+
+    -- Equal numbers go to the same buffer whether they are
+    -- encoded as integers or as doubles.
+    local data = {}
+    for i = 1, 20 do
+        data[2 * i - 1] = {('%03d'):format(2 * i - 1), i}
+        data[2 * i] = {('%03d'):format(2 * i), ffi.new('double', i)}
+    end
+    local partition_by = key_def_lib.new({{fieldno = 2, type = 'number'}})
+    local buffers = {buffer.ibuf(), buffer.ibuf(), buffer.ibuf()}
+    local source = merger.new_source_fromtable(data)
+    merger.new(key_def, {source}):select({buffers = buffers,
+                                          partition_by = partition_by})
+    local placed = {}
+    local ok = true
+    for i, buf in ipairs(buffers) do
+        for _, tuple in ipairs(msgpackffi.decode(buf.rpos)) do
+            local value = tonumber(tuple[2])
+            ok = ok and (placed[value] == nil or placed[value] == i)
+            placed[value] = i
+        end
+    end
+    test:ok(ok, 'integers and doubles are hashed by value')
+end)
+
+test:test('cursor', function(test)
+    test:plan(5)
+
+    -- Non-unique keys: a page may end among equal tuples.
+    local data = {}
+    for i = 1, 30 do
+        data[i] = {('%03d'):format(math.floor(i / 4)), i}
+    end
+    local function new_sources()
+        local a, b = {}, {}
+        for i, tuple in ipairs(data) do
+            table.insert(i % 2 == 0 and a or b, tuple)
+        end
+        return {merger.new_source_fromtable(a),
+                merger.new_source_fromtable(b)}
+    end
+    local exp = merger.new(key_def, new_sources()):select()
+    exp = fun.iter(exp):map(box.tuple.totable):totable()
+
+    -- Each page is read by a new merger of new sources.
+    local res = {}
+    local cursor
+    local pages = 0
+    repeat
+        local m = merger.new(key_def, new_sources(), {cursor = cursor})
+        local page
+        page, cursor = m:select({limit = 7, cursor = true})
+        for _, tuple in ipairs(page) do
+            table.insert(res, tuple:totable())
+        end
+        pages = pages + 1
+    until cursor == nil
+    test:is_deeply(res, exp, 'pages give all tuples')
+    test:is(pages, 5, 'the last page gives no cursor')
+
+    -- A buffer output gives a cursor only.
+    local output_buffer = buffer.ibuf()
+    local m = merger.new(key_def, new_sources())
+    local cursor = m:select({buffer = output_buffer, limit = 10,
+                             cursor = true})
+    local m = merger.new(key_def, new_sources(), {cursor = cursor})
+    local rest = m:select()
+    test:is(#msgpackffi.decode(output_buffer.rpos) + #rest, #data,
+        'resume after a buffer output')
+
+    -- A passed deadline gives an empty page and a cursor.
+    local m = merger.new(key_def, new_sources())
+    local page, cursor = m:select({deadline = fiber.time() - 1,
+                                   cursor = true})
+    local m = merger.new(key_def, new_sources(), {cursor = cursor})
+    test:is_deeply({#page, #m:select()}, {0, #data},
+        'stop at a deadline')
+
+    local ok, err = pcall(function()
+        local source = merger.new_source_fromtable(data)
+        return source:select({cursor = true})
+    end)
+    test:is_deeply({ok, tostring(err)},
+        {false, 'A cursor is available for a merger only'},
+        'a cursor of a source')
+end)
+
+test:test('projection', function(test)
+    test:plan(5)
+
+    local data = {}
+    for i = 1, 50 do
+        data[i] = {('%03d'):format(i), i, 'x', i * 2}
+    end
+    -- The table source ends soon, so the buffer source copies
+    -- the rest of tuples as raw MsgPack.
+    local function new_sources()
+        local buf = buffer.ibuf()
+        msgpackffi.internal.encode_r(buf, {unpack(data, 2)}, 0)
+        return {
+            merger.new_source_fromtable({data[1]}),
+            merger.new_buffer_source(fun.iter({buf})),
+        }
+    end
+    local function project(fields)
+        return fun.iter(data):map(function(tuple)
+            local res = {}
+            for i, fieldno in ipairs(fields) do
+                res[i] = tuple[fieldno] == nil and box.NULL or
+                    tuple[fieldno]
+            end
+            return res
+        end):totable()
+    end
+
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, new_sources()):select({buffer = output_buffer,
+                                               fields = {4, 1}})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, project({4, 1}), 'buffer output')
+
+    local res = merger.new(key_def, new_sources()):select({fields = {2, 6}})
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, project({2, 6}), 'table output, a missing field')
+
+    local buffers = {buffer.ibuf(), buffer.ibuf()}
+    merger.new(key_def, new_sources()):select({
+        buffers = buffers,
+        partition_by = key_def_lib.new({{fieldno = 2, type = 'unsigned'}}),
+        fields = {1},
+    })
+    local res = {}
+    for _, buf in ipairs(buffers) do
+        for _, tuple in ipairs(msgpackffi.decode(buf.rpos)) do
+            table.insert(res, tuple)
+        end
+    end
+    table.sort(res, function(a, b) return a[1] < b[1] end)
+    test:is_deeply(res, project({1}), 'partitioned output')
+
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, new_sources()):select({buffer = output_buffer,
+                                               key_only = true})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, project({1}), 'key only')
+
+    local ok, err = pcall(function()
+        local source = merger.new_source_fromtable(data)
+        return source:select({key_only = true})
+    end)
+    test:is_deeply({ok, tostring(err)},
+        {false, 'Keys are available for a merger only'},
+        'key only of a source')
+end)
+
 test:test('cascade mergers', function(test)
     test:plan(2)
 
@@ -724,6 +1197,130 @@ test:test('cascade mergers', function(test)
     test:is_deeply(res, data, 'different key_defs')
 end)
 
+test:test('file source', function(test)
+    test:plan(8)
+
+    local tmpdir = fio.tempdir()
+    local path = fio.pathjoin(tmpdir, 'tuples.bin')
+    local data = {}
+    for i = 1, 100 do
+        data[i] = {('%03d'):format(i)}
+    end
+
+    local source = merger.new_source_fromtable(data)
+    local count = merger.write_file(path, source, {index_step = 8})
+    test:is(count, #data, 'write tuples')
+    test:ok(fio.path.exists(path .. '.idx'), 'write an index')
+
+    local source = merger.new_file_source(path, key_def)
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'read tuples')
+
+    local source = merger.new_file_source(path, key_def, {
+        index = true,
+        key = {'050'},
+    })
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, fun.iter(data):drop(49):totable(),
+        'position using an index')
+
+    local source = merger.new_file_source(path, key_def, {
+        key = {'050'},
+        iterator = 'GT',
+    })
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, fun.iter(data):drop(50):totable(),
+        'position without an index')
+
+    local m = merger.new(key_def, {
+        merger.new_file_source(path, key_def),
+        merger.new_file_source(path, key_def, {index = true, key = {'091'}}),
+    })
+    test:is(#m:select(), #data + 10, 'merge file sources')
+
+    -- An index with offsets in the middle of tuples is not used.
+    local index_path = path .. '.idx'
+    local f = fio.open(index_path, {'O_RDONLY'})
+    local index = msgpackffi.decode(f:read())
+    f:close()
+    for i, offset in ipairs(index[6]) do
+        index[6][i] = offset + 1
+    end
+    local f = fio.open(index_path, {'O_WRONLY', 'O_TRUNC'})
+    f:write(msgpackffi.encode(index))
+    f:close()
+    local source = merger.new_file_source(path, key_def, {
+        index = true,
+        key = {'050'},
+    })
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, fun.iter(data):drop(49):totable(),
+        'an index with bad offsets is ignored')
+
+    -- An index of a rewritten file is not used.
+    local data = fun.iter(data):map(function(t) return {t[1], 'x'} end)
+        :totable()
+    merger.write_file(path, merger.new_source_fromtable(data))
+    local source = merger.new_file_source(path, key_def, {
+        index = true,
+        key = {'050'},
+    })
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, fun.iter(data):drop(49):totable(),
+        'a stale index is ignored')
+
+    fio.rmtree(tmpdir)
+end)
+
+test:test('external sort', function(test)
+    test:plan(5)
+
+    local data = {}
+    for i = 1, 1000 do
+        data[i] = {('%04d'):format((i * 7919) % 1000)}
+    end
+    local exp = table.copy(data)
+    table.sort(exp, function(a, b) return a[1] < b[1] end)
+
+    local source = merger.sort(merger.new_source_fromtable(data), key_def)
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, exp, 'sort in memory')
+
+    local tmpdir = fio.tempdir()
+    local source = merger.sort(merger.new_source_fromtable(data), key_def, {
+        memory_limit = 4096,
+        tmpdir = tmpdir,
+    })
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, exp, 'sort using runs')
+
+    local source = merger.sort(merger.new_source_fromtable(data), key_def, {
+        memory_limit = 512,
+        fan_in = 2,
+        tmpdir = tmpdir,
+    })
+    local res = source:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, exp, 'sort merging runs by fan_in')
+    test:is_deeply(fio.listdir(tmpdir), {}, 'runs are unlinked')
+    fio.rmtree(tmpdir)
+
+    -- Other fibers work while a sort reads its input.
+    local many = {}
+    for i = 1, 10000 do
+        many[i] = {('%05d'):format((i * 7919) % 10000)}
+    end
+    local ticks = 0
+    local ticker = fiber.new(function()
+        while true do
+            ticks = ticks + 1
+            fiber.yield()
+        end
+    end)
+    merger.sort(merger.new_source_fromtable(many), key_def)
+    ticker:cancel()
+    test:ok(ticks > 0, 'sort yields')
+end)
+
 -- Merging cases.
 for _, input_type in ipairs({'buffer', 'table', 'tuple'}) do
     for _, output_type in ipairs({'buffer', 'table', 'tuple'}) do
@@ -745,6 +1342,780 @@ for _, input_type in ipairs({'buffer', 'table', 'tuple'}) do
     end
 end
 
+test:test('compact chunks', function(test)
+    test:plan(7)
+
+    local key_def = key_def_lib.new({{
+        fieldno = 1,
+        type = 'unsigned',
+    }})
+
+    local tuples = {}
+    for i = 1, 100 do
+        tuples[i] = {i * 3, ('key_%04d'):format(i), 'payload'}
+    end
+
+    -- Put a MsgPack string with a block into a buffer.
+    local function block_buffer(block)
+        local data = msgpackffi.encode(block)
+        local buf = buffer.ibuf()
+        ffi.copy(buf:alloc(#data), data, #data)
+        return buf
+    end
+
+    local cases = {
+        {'default', {}},
+        {'no delta', {delta = false}},
+        {'compress', {compress = true}},
+        {'delta, compress', {delta = true, compress = true}},
+    }
+    for _, case in ipairs(cases) do
+        local case_name, opts = unpack(case)
+        local buf_1 = block_buffer(merger.encode_compact(
+            {unpack(tuples, 1, 50)}, opts))
+        local buf_2 = block_buffer(merger.encode_compact(
+            {unpack(tuples, 51, 100)}, opts))
+        local gen, param, state = fun.iter({buf_1, buf_2})
+        local source = merger.new_buffer_source(gen, param, state,
+            {format = 'compact'})
+        local res = merger.new(key_def, {source}):select()
+        res = fun.iter(res):map(box.tuple.totable):totable()
+        test:is_deeply(res, tuples, ('decode (%s)'):format(case_name))
+    end
+
+    local ok, err = pcall(merger.encode_compact, {{'a'}}, {delta = true})
+    test:ok(not ok and tostring(err):match('unsigned'),
+        'delta encoding of a string field')
+
+    local gen, param, state = fun.iter({})
+    local ok, err = pcall(merger.new_buffer_source, gen, param, state,
+        {format = 'foo'})
+    test:ok(not ok and tostring(err):match('Bad param "format"'),
+        'bad format')
+
+    local source = merger.new_source_frombuffer(block_buffer('foo'),
+        {format = 'compact'})
+    local ok, err = pcall(source.select, source)
+    test:is(not ok and tostring(err), 'Invalid compact block',
+        'invalid block')
+end)
+
+test:test('filter', function(test)
+    test:plan(5)
+
+    local data = {}
+    for i = 1, 50 do
+        data[i] = {('%03d'):format(i), i, i % 3 == 0 and box.NULL or 'x',
+                   i * 2}
+    end
+    local function new_buffer_source(tuples, opts)
+        local buf = buffer.ibuf()
+        msgpackffi.internal.encode_r(buf, tuples, 0)
+        local gen, param, state = fun.iter({buf})
+        return merger.new_buffer_source(gen, param, state, opts)
+    end
+    local function expected(pred)
+        return fun.iter(data):filter(pred):totable()
+    end
+
+    -- The only source copies accepted tuples as raw MsgPack.
+    local source = new_buffer_source(data, {
+        filter = {'and', {'>', 2, 10}, {'<=', 2, 20}},
+    })
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, {source}):select({buffer = output_buffer})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, expected(function(t) return t[2] > 10 and
+        t[2] <= 20 end), 'buffer source, raw copy')
+
+    local function new_sources()
+        return {
+            merger.new_source_fromtable({unpack(data, 1, 25)}),
+            new_buffer_source({unpack(data, 26)}),
+        }
+    end
+    local function select(filter)
+        local res = merger.new(key_def, new_sources(),
+                               {filter = filter}):select()
+        return fun.iter(res):map(box.tuple.totable):totable()
+    end
+
+    test:is_deeply(select({'or', {'in', 2, {1, 5, 40}}, {'is_null', 3}}),
+        expected(function(t) return t[2] == 1 or t[2] == 5 or
+            t[2] == 40 or t[3] == nil end), 'merger, or / in / is_null')
+    test:is_deeply(select({'==', 3, 'x'}),
+        expected(function(t) return t[3] == 'x' end), 'nil is not equal')
+    test:is_deeply(select({'and', {'<', 4, 10.5}, {'~=', 1, 5}}),
+        expected(function(t) return t[4] < 10.5 end),
+        'a float value, other types are not equal')
+
+    local ok, err = pcall(new_buffer_source, data, {filter = {'==', 0, 1}})
+    test:ok(not ok and err:match('Bad param "filter"') ~= nil,
+            'bad filter of a buffer source')
+end)
+
+test:test('offload', function(test)
+    test:plan(4)
+
+    local key_def = key_def_lib.new({
+        {fieldno = 2, type = 'unsigned'},
+        {fieldno = 1, type = 'string', is_nullable = true},
+    })
+    local data = {}
+    for i = 1, 300 do
+        data[i] = {i % 2 == 0 and ('%03d'):format(i) or box.NULL,
+                   math.floor(i / 3), 'x'}
+    end
+    -- Each source gives its tuples by several chunks.
+    local function new_sources(data)
+        local sources = {}
+        for i = 1, 3 do
+            local bufs = {}
+            local chunk = {}
+            for j = i, #data, 3 do
+                table.insert(chunk, data[j])
+                if #chunk == 7 then
+                    table.insert(bufs, buffer.ibuf())
+                    msgpackffi.internal.encode_r(bufs[#bufs], chunk, 0)
+                    chunk = {}
+                end
+            end
+            table.insert(bufs, buffer.ibuf())
+            msgpackffi.internal.encode_r(bufs[#bufs], chunk, 0)
+            sources[i] = merger.new_buffer_source(fun.iter(bufs))
+        end
+        return sources
+    end
+    local function select(data, opts)
+        local m = merger.new(key_def, new_sources(data))
+        local output_buffer = buffer.ibuf()
+        local res = {}
+        repeat
+            local count = #res
+            m:select(fun.chain({buffer = output_buffer}, opts):tomap())
+            for _, tuple in ipairs(msgpackffi.decode(output_buffer.rpos)) do
+                table.insert(res, tuple)
+            end
+            output_buffer:recycle()
+        until #res == count
+        return fun.iter(res):map(function(t) return {t[1], t[2]} end)
+            :totable()
+    end
+
+    local exp = select(data, {})
+    test:is(#exp, #data, 'all tuples are merged')
+    test:is_deeply(select(data, {offload = true}), exp, 'offload')
+    test:is_deeply(select(data, {offload = true, limit = 40}), exp,
+                   'offload by pages')
+
+    -- A key of a wrong type is reported as usual.
+    data[150][2] = 'bad'
+    local ok_1, err_1 = pcall(select, data, {})
+    local ok_2, err_2 = pcall(select, data, {offload = true})
+    test:is_deeply({ok_2, tostring(err_2)}, {ok_1, tostring(err_1)},
+                   'a wrong key type')
+end)
+
+test:test('nested mergers into a buffer', function(test)
+    test:plan(4)
+
+    -- Tuples held by a table, tuples created from Lua tables
+    -- and a nested merger.
+    local function new_merger(opts)
+        local inner = merger.new(key_def, {
+            merger.new_source_fromtable({box.tuple.new({'a'}),
+                box.tuple.new({'c'}), box.tuple.new({'e'})}),
+            merger.new_source_fromtable({{'b'}, {'d'}}),
+        })
+        return merger.new(key_def, {
+            inner,
+            merger.new_source_fromtable({{'a'}, {'f'}}),
+        }, opts)
+    end
+    local exp = {{'a'}, {'a'}, {'b'}, {'c'}, {'d'}, {'e'}, {'f'}}
+
+    local output_buffer = buffer.ibuf()
+    new_merger():select({buffer = output_buffer})
+    test:is_deeply(msgpackffi.decode(output_buffer.rpos), exp,
+                   'buffer output')
+
+    -- Buffer and table outputs of the same merger.
+    local m = new_merger()
+    output_buffer:recycle()
+    m:select({buffer = output_buffer, limit = 3})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    for _, tuple in ipairs(m:select({limit = 2})) do
+        table.insert(res, tuple:totable())
+    end
+    output_buffer:recycle()
+    m:select({buffer = output_buffer})
+    for _, tuple in ipairs(msgpackffi.decode(output_buffer.rpos)) do
+        table.insert(res, tuple)
+    end
+    test:is_deeply(res, exp, 'mixed outputs')
+
+    -- A position is tracked for tuples copied into a buffer.
+    local m = new_merger()
+    output_buffer:recycle()
+    local cursor = m:select({buffer = output_buffer, limit = 2,
+                             cursor = true})
+    local rest = new_merger({cursor = cursor}):select()
+    test:is_deeply(fun.iter(rest):map(box.tuple.totable):totable(),
+                   {unpack(exp, 3)}, 'cursor')
+
+    -- A source of tuples created from Lua tables is shared by
+    -- two mergers, which keep its tuples in their heaps.
+    local shared = merger.new_source_fromtable({{'b'}, {'d'}, {'f'}})
+    local m1 = merger.new(key_def, {
+        shared, merger.new_source_fromtable({{'a'}, {'z'}}),
+    })
+    local m2 = merger.new(key_def, {
+        shared, merger.new_source_fromtable({{'a'}, {'z'}}),
+    })
+    local function take(m, res, limit)
+        output_buffer:recycle()
+        m:select({buffer = output_buffer, limit = limit})
+        for _, tuple in ipairs(msgpackffi.decode(output_buffer.rpos)) do
+            table.insert(res, tuple)
+        end
+        collectgarbage()
+    end
+    local res1 = {}
+    local res2 = {}
+    take(m1, res1, 1)
+    take(m2, res2, 1)
+    take(m1, res1, 1)
+    take(m2, res2, 1)
+    take(m1, res1)
+    take(m2, res2)
+    test:is_deeply({res1, res2}, {
+        {{'a'}, {'b'}, {'f'}, {'z'}},
+        {{'a'}, {'d'}, {'z'}},
+    }, 'a source shared by two mergers')
+end)
+
+test:test('batches', function(test)
+    test:plan(4)
+
+    local data = {}
+    for i = 1, 25 do
+        data[i] = {('%03d'):format(i)}
+    end
+    local function new_merger()
+        return merger.new(key_def, {
+            merger.new_source_fromtable({unpack(data, 1, 10)}),
+            merger.new_source_fromtable({unpack(data, 11)}),
+        })
+    end
+
+    local res = {}
+    local sizes = {}
+    local batches = {}
+    for _, batch in new_merger():batches(7) do
+        table.insert(sizes, #batch)
+        batches[batch] = true
+        for _, tuple in ipairs(batch) do
+            table.insert(res, tuple:totable())
+        end
+    end
+    test:is_deeply(res, data, 'batches give all tuples')
+    test:is_deeply(sizes, {7, 7, 7, 4}, 'batch sizes')
+    test:is(fun.iter(batches):length(), 1, 'a batch table is reused')
+
+    local ok, err = pcall(new_merger().batches, new_merger(), 0)
+    test:is_deeply({ok, tostring(err)},
+                   {false, 'Usage: merge_source:batches(<number>)'},
+                   'bad batch size')
+end)
+
+test:test('keyed entries', function(test)
+    test:plan(5)
+
+    -- Tuples are ordered by the second field, keys are extracted
+    -- by a storage.
+    local tuple_key_def = key_def_lib.new({{
+        fieldno = 2,
+        type = 'string',
+    }})
+    local key_def = key_def_lib.new({{
+        fieldno = 1,
+        type = 'string',
+    }})
+
+    local tuples = {}
+    for i = 1, 40 do
+        tuples[i] = {i, ('key_%04d'):format(i), {nested = i}}
+    end
+
+    local function keyed_buffer(from, to, step)
+        local entries = {}
+        for i = from, to, step do
+            table.insert(entries, {tuple_key_def:extract_key(tuples[i]),
+                                   tuples[i]})
+        end
+        local data = msgpackffi.encode(entries)
+        local buf = buffer.ibuf()
+        ffi.copy(buf:alloc(#data), data, #data)
+        return buf
+    end
+
+    local function keyed_source(from)
+        local gen, param, state = fun.iter({keyed_buffer(from, 40, 2)})
+        return merger.new_buffer_source(gen, param, state,
+            {format = 'keyed'})
+    end
+
+    local m = merger.new(key_def, {keyed_source(1), keyed_source(2)},
+        {keyed = true})
+    local res = m:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, tuples, 'merge by keys')
+
+    -- Cascade keyed mergers.
+    local m = merger.new(key_def, {
+        merger.new(key_def, {keyed_source(1)}, {keyed = true}),
+        merger.new(key_def, {keyed_source(2)}, {keyed = true}),
+    }, {keyed = true})
+    local res = m:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, tuples, 'cascade keyed mergers')
+
+    -- A keyed source in a regular merger gives tuples.
+    local m = merger.new(tuple_key_def, {keyed_source(1), keyed_source(2)})
+    local res = m:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, tuples, 'keyed source in a regular merger')
+
+    local ok, err = pcall(merger.new, key_def,
+        {merger.new_source_fromtable({})}, {keyed = true})
+    test:is(not ok and tostring(err),
+        'A source at index 1 does not provide keys', 'source without keys')
+
+    local ok, err = pcall(merger.new, key_def, {}, {keyed = 1})
+    test:is(not ok and err, merger_new_usage('keyed'), 'bad keyed')
+end)
+
+test:test('prepared merge', function(test)
+    test:plan(8)
+
+    local data = {}
+    for i = 1, 30 do
+        data[i] = {('%03d'):format(i)}
+    end
+    local function new_sources(count)
+        local chunks = {}
+        for j = 1, count do
+            chunks[j] = {}
+        end
+        for i, tuple in ipairs(data) do
+            table.insert(chunks[i % count + 1], tuple)
+        end
+        return fun.iter(chunks):map(merger.new_source_fromtable):totable()
+    end
+
+    local plan = merger.prepare(key_def, {max_sources = 4})
+    local res = plan:bind(new_sources(3)):pairs():map(
+        box.tuple.totable):totable()
+    test:is_deeply(res, data, 'first bind')
+
+    -- Release a merger in the middle of a merge.
+    local m = plan:bind(new_sources(4))
+    m:pairs():take(5):totable()
+    m = nil -- luacheck: no unused
+    collectgarbage()
+    collectgarbage()
+
+    local res = plan:bind(new_sources(4)):select()
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'reused merger')
+
+    -- Several mergers of the same plan at once.
+    local m1 = plan:bind(new_sources(2))
+    local m2 = plan:bind(new_sources(1))
+    test:is_deeply(m1:pairs():map(box.tuple.totable):totable(), data,
+        'first of concurrent mergers')
+    test:is_deeply(m2:pairs():map(box.tuple.totable):totable(), data,
+        'second of concurrent mergers')
+
+    local ok, err = pcall(plan.bind, plan, new_sources(5))
+    test:is(not ok and tostring(err), 'Too many sources: 5, the plan is ' ..
+        'prepared for 4', 'too many sources')
+
+    -- A merger keeps its plan alive.
+    local m = merger.prepare(key_def, {max_sources = 2, reverse = true}):bind(
+        fun.iter(new_sources(2)):map(function(source)
+            local tuples = source:select()
+            local rev = {}
+            for j = #tuples, 1, -1 do
+                table.insert(rev, tuples[j])
+            end
+            return merger.new_source_fromtable(rev)
+        end):totable())
+    collectgarbage()
+    collectgarbage()
+    local exp = {}
+    for i = #data, 1, -1 do
+        table.insert(exp, data[i])
+    end
+    test:is_deeply(m:pairs():map(box.tuple.totable):totable(), exp,
+        'reverse plan')
+
+    -- Key parts are known to bound mergers.
+    local page, cursor = plan:bind(new_sources(3)):select({limit = 10,
+                                                           cursor = true})
+    local res = fun.iter(page):map(box.tuple.totable):totable()
+    local rest = merger.new(key_def, new_sources(3), {cursor = cursor})
+    rest:pairs():map(box.tuple.totable):each(function(tuple)
+        table.insert(res, tuple)
+    end)
+    test:is_deeply(res, data, 'cursor of a bound merger')
+
+    local key_def_ci = key_def_lib.new({{
+        fieldno = 1, type = 'string', collation = 'unicode_ci',
+    }})
+    local plan_ci = merger.prepare(key_def_ci, {max_sources = 2})
+    local m = plan_ci:bind({
+        merger.new_source_fromtable({{'a'}, {'C'}, {'e'}}),
+        merger.new_source_fromtable({{'B'}, {'d'}}),
+    })
+    local res, cursor = m:select({limit = 3, cursor = true})
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply({res, cursor ~= nil}, {{{'a'}, {'B'}, {'C'}}, true},
+        'collation aware plan')
+end)
+
+test:test('index source', function(test)
+    test:plan(5)
+
+    local s1 = box.schema.space.create('merger_index_source_1')
+    s1:create_index('pk', {parts = {{1, 'string'}}})
+    local s2 = box.schema.space.create('merger_index_source_2')
+    s2:create_index('pk', {parts = {{1, 'string'}}})
+    local data = {}
+    for i = 1, 100 do
+        data[i] = {('%03d'):format(i)}
+        local space = i % 3 == 0 and s1 or s2
+        space:insert(data[i])
+    end
+
+    local res = merger.new(key_def, {
+        merger.new_index_source(s1.id, 0),
+        merger.new_index_source(s2.name, 'pk'),
+    }):pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'merge two spaces')
+
+    local res = merger.new(key_def, {
+        merger.new_index_source(s1.id, 0, '050', {iterator = 'GT'}),
+        merger.new_index_source(s2.id, 0, {'050'}, {iterator = 'GT'}),
+    }):select({limit = 10})
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, {unpack(data, 51, 60)}, 'key and iterator')
+
+    local exp = {}
+    for i = 20, 1, -1 do
+        table.insert(exp, data[i])
+    end
+    local res = merger.new(key_def, {
+        merger.new_index_source(s1.id, 0, {'020'}, {iterator = box.index.LE}),
+        merger.new_index_source(s2.id, 0, {'020'}, {iterator = box.index.LE}),
+    }, {reverse = true}):pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, exp, 'reverse')
+
+    -- The last source is copied without creating tuples.
+    local output_buffer = buffer.ibuf()
+    merger.new(key_def, {
+        merger.new_index_source(s1.id, 0, {'099'}, {iterator = 'GE'}),
+        merger.new_index_source(s2.id, 0),
+    }):select({buffer = output_buffer})
+    local res = msgpackffi.decode(output_buffer.rpos)
+    test:is_deeply(res, fun.iter(data):filter(function(t)
+        return tonumber(t[1]) % 3 ~= 0 or tonumber(t[1]) >= 99
+    end):totable(), 'buffer output')
+
+    local ok = pcall(merger.new_index_source, 'merger_no_such_space', 0)
+    test:ok(not ok, 'no such space')
+
+    s1:drop()
+    s2:drop()
+end)
+
+test:test('cascaded merge', function(test)
+    test:plan(5)
+
+    -- Many sources of few tuples each.
+    local data = {}
+    for i = 1, 300 do
+        data[i] = {('%03d'):format(i)}
+    end
+    local function new_sources()
+        local chunks = {}
+        for i = 1, 300 do
+            local j = (i * 7) % 50 + 1
+            chunks[j] = chunks[j] or {}
+            table.insert(chunks[j], data[i])
+        end
+        local sources = {}
+        for j = 1, 50 do
+            local buf = buffer.ibuf()
+            msgpackffi.internal.encode_r(buf, chunks[j], 0)
+            sources[j] = merger.new_buffer_source(fun.iter({buf}))
+        end
+        return sources
+    end
+
+    local res = merger.new(key_def, new_sources(), {fan_in = 4}):select()
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'in-memory runs')
+
+    -- A source is live from its first read until its end.
+    local live = 0
+    local max_live = 0
+    local sources = {}
+    for i = 1, 50 do
+        local tuples = {}
+        for j = i, 300, 50 do
+            table.insert(tuples, data[j])
+        end
+        sources[i] = merger.new_tuple_source(function(_, pos)
+            if pos == 1 then
+                live = live + 1
+                max_live = math.max(max_live, live)
+            end
+            if tuples[pos] == nil then
+                live = live - 1
+                return
+            end
+            return pos + 1, tuples[pos]
+        end, nil, 1)
+    end
+    local res = merger.new(key_def, sources, {fan_in = 4}):select({
+        limit = 10,
+    })
+    test:ok(#res == 10 and max_live <= 4,
+        ('at most fan_in sources are live (%d)'):format(max_live))
+
+    local res = merger.new(key_def, new_sources(), {
+        fan_in = 3,
+        memory_limit = 1000,
+    }):select()
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'partially spilled runs')
+
+    local res = merger.new(key_def, new_sources(), {
+        fan_in = 2,
+        memory_limit = 0,
+    }):pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'spilled runs')
+
+    local exp = {}
+    for i = #data, 1, -1 do
+        table.insert(exp, data[i])
+    end
+    local sources = {}
+    for i, source in ipairs(new_sources()) do
+        local tuples = source:select()
+        local rev = {}
+        for j = #tuples, 1, -1 do
+            table.insert(rev, tuples[j])
+        end
+        sources[i] = merger.new_source_fromtable(rev)
+    end
+    local res = merger.new(key_def, sources, {
+        fan_in = 4,
+        memory_limit = 500,
+        reverse = true,
+    }):select()
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, exp, 'reverse')
+end)
+
+test:test('map_merge', function(test)
+    test:plan(9)
+
+    -- A replicaset, which gives tuples by chunks of a given
+    -- size using a cursor.
+    local function mock_replicaset(tuples, chunk_size, calls)
+        return {
+            callro = function(_, func, args, opts)
+                table.insert(calls, {func = func, args = args})
+                local cursor = args[#args].cursor
+                local pos = cursor ~= nil and cursor.pos or 1
+                if tuples == nil then
+                    return {
+                        wait_result = function()
+                            return nil, 'storage error'
+                        end,
+                    }
+                end
+                local chunk = {unpack(tuples, pos, pos + chunk_size - 1)}
+                local next_cursor = {is_end = true}
+                if pos + chunk_size <= #tuples then
+                    next_cursor = {is_end = false, pos = pos + chunk_size}
+                end
+                msgpackffi.internal.encode_r(opts.buffer,
+                    {next_cursor, chunk}, 0)
+                return {wait_result = function() return true end}
+            end,
+        }
+    end
+
+    local data = {}
+    for i = 1, 50 do
+        data[i] = {('%03d'):format(i)}
+    end
+    local odd = fun.iter(data):enumerate():filter(function(i)
+        return i % 2 == 1 end):map(function(_, t) return t end):totable()
+    local even = fun.iter(data):enumerate():filter(function(i)
+        return i % 2 == 0 end):map(function(_, t) return t end):totable()
+
+    local calls = {}
+    local router = {
+        routeall = function()
+            return {
+                rs_1 = mock_replicaset(odd, 4, calls),
+                rs_2 = mock_replicaset(even, 3, calls),
+            }
+        end,
+    }
+    local m = merger.map_merge(router, 'select_chunked', {'s', {limit = 10}},
+        key_def, {pipeline_depth = 3})
+    local res = m:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'merge results')
+    test:is(#calls, math.ceil(25 / 4) + math.ceil(25 / 3), 'call count')
+    test:is(calls[1].args[2].limit, 10, 'options are passed')
+
+    -- A memory limit defers read-ahead: each fetcher fetches a
+    -- first chunk and waits for the merger.
+    local calls = {}
+    local router = {
+        routeall = function()
+            return {
+                rs_1 = mock_replicaset(odd, 4, calls),
+                rs_2 = mock_replicaset(even, 3, calls),
+            }
+        end,
+    }
+    local m = merger.map_merge(router, 'select_chunked', {'s', {limit = 10}},
+        key_def, {pipeline_depth = 3, read_ahead_limit = 1})
+    fiber.yield()
+    test:is(#calls, 2, 'read_ahead_limit: read-ahead is deferred')
+    local res = m:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, data, 'read_ahead_limit: merge results')
+
+    -- A quota shared by two merges defers read-ahead of both.
+    local calls = {}
+    local router = {
+        routeall = function()
+            return {
+                rs_1 = mock_replicaset(odd, 4, calls),
+                rs_2 = mock_replicaset(even, 3, calls),
+            }
+        end,
+    }
+    local quota = merger.new_read_ahead_quota(1)
+    local m1 = merger.map_merge(router, 'select_chunked', {'s'}, key_def,
+        {pipeline_depth = 3, read_ahead_limit = quota})
+    local m2 = merger.map_merge(router, 'select_chunked', {'s'}, key_def,
+        {pipeline_depth = 3, read_ahead_limit = quota})
+    fiber.yield()
+    test:is(#calls, 4, 'shared quota: read-ahead is deferred')
+    local res1 = m1:pairs():map(box.tuple.totable):totable()
+    local res2 = m2:pairs():map(box.tuple.totable):totable()
+    test:is_deeply({res1, res2}, {data, data}, 'shared quota: merge results')
+    test:is(quota.used, 0, 'shared quota: merged chunks are released')
+
+    local router = {
+        routeall = function()
+            return {rs_1 = mock_replicaset(nil, 1, {})}
+        end,
+    }
+    local m = merger.map_merge(router, 'select_chunked', {}, key_def)
+    local ok, err = pcall(m.select, m)
+    test:is(not ok and tostring(err), 'storage error', 'storage error')
+end)
+
+test:test('select_chunked', function(test)
+    test:plan(8)
+
+    -- C functions are called locally via box.func only.
+    if box.func == nil then
+        for _ = 1, 8 do
+            test:skip('box.func is not available')
+        end
+        return
+    end
+
+    local s = box.schema.space.create('merger_select_chunked')
+    s:create_index('pk', {parts = {{1, 'unsigned'}}})
+    for i = 1, 100 do
+        s:insert({i, ('%03d'):format(i)})
+    end
+    box.schema.func.create('tuple.merger.select_chunked', {language = 'C'})
+    local func = box.func['tuple.merger.select_chunked']
+
+    -- Returns a cursor and tuples (or entries, or a block).
+    local function call(key, opts)
+        local res = func:call({'merger_select_chunked', 'pk',
+                               key == nil and box.NULL or key, opts})
+        return unpack(res:totable())
+    end
+    local function ids(tuples)
+        return fun.iter(tuples):map(function(t) return t[1] end):totable()
+    end
+
+    -- A chunk size doubles while a router asks quickly.
+    local cursor, tuples = call(nil, {chunk_size = 2})
+    local sizes = {#tuples}
+    for _ = 1, 3 do
+        cursor, tuples = call(nil, {cursor = cursor})
+        table.insert(sizes, #tuples)
+    end
+    test:is_deeply({sizes, ids(tuples)[1], cursor.chunk_size},
+                   {{2, 4, 8, 16}, 15, 32}, 'chunk size grows')
+
+    -- A slow router keeps the chunk size. A delay of a cursor
+    -- sent by another instance is not measured.
+    cursor.sent_at = cursor.sent_at - 1
+    local slow_cursor = call(nil, {cursor = cursor})
+    test:is(slow_cursor.chunk_size, 32, 'slow consumer')
+    cursor.sent_by = 1
+    local other_cursor = call(nil, {cursor = cursor})
+    test:is(other_cursor.chunk_size, 64, 'cursor of another instance')
+
+    -- A limit is passed within a cursor.
+    local cursor, tuples = call(nil, {limit = 3, chunk_size = 2})
+    local last_cursor, last_tuples = call(nil, {cursor = cursor})
+    test:is_deeply({ids(tuples), cursor.limit, ids(last_tuples),
+                    last_cursor.is_end}, {{1, 2}, 1, {3}, true}, 'limit')
+
+    local ok, err = pcall(call, nil, {cursor = last_cursor})
+    test:is(not ok and tostring(err),
+            'select_chunked: the cursor is at the end', 'cursor at the end')
+
+    -- A merge is resumed from a key given in opts.after.
+    local _, tuples = call(nil, {after = {51}, limit = 3})
+    test:is_deeply(ids(tuples), {51, 52, 53}, 'after')
+
+    local _, entries = call({10}, {iterator = 'GE', limit = 2,
+                                   format = 'keyed'})
+    test:is_deeply(entries, {{{10}, {10, '010'}}, {{11}, {11, '011'}}},
+                   'keyed format')
+
+    local _, block = call(nil, {limit = 3, format = 'compact'})
+    local data = msgpackffi.encode(block)
+    local buf = buffer.ibuf()
+    ffi.copy(buf:alloc(#data), data, #data)
+    local gen, param, state = fun.iter({buf})
+    local source = merger.new_buffer_source(gen, param, state,
+                                            {format = 'compact'})
+    local res = merger.new(key_def_lib.new({{fieldno = 1,
+                                             type = 'unsigned'}}),
+                           {source}):select()
+    res = fun.iter(res):map(box.tuple.totable):totable()
+    test:is_deeply(res, {{1, '001'}, {2, '002'}, {3, '003'}},
+                   'compact format')
+
+    box.schema.func.drop('tuple.merger.select_chunked')
+    s:drop()
+end)
+
 -- The module must not assign the 'tuple' global.
 --
 -- IOW, luaL_register() must have NULL as the second parameter.
@@ -766,4 +2137,110 @@ test:test('no sources', function(test)
     test:is_deeply(res, {})
 end)
 
+test:test('C API', function(test)
+    test:plan(7)
+
+    -- Declarations of tuple_merger.h. Some of them may be known
+    -- to ffi already.
+    local decls = {
+        'struct tuple_merge_source;',
+        'struct lua_State;',
+        [[struct tuple_merge_source_vtab {
+            void (*destroy)(void *ctx);
+            int (*next)(void *ctx, void *format, struct tuple **out);
+        };]],
+        [[struct tuple_merger_api {
+            uint32_t version;
+            struct tuple_merge_source *(*source_new)(
+                const struct tuple_merge_source_vtab *vtab, void *ctx);
+            void (*source_ref)(struct tuple_merge_source *source);
+            void (*source_unref)(struct tuple_merge_source *source);
+            int (*source_next)(struct tuple_merge_source *source,
+                               void *format, struct tuple **out);
+            void (*luaT_push_source)(struct lua_State *L,
+                                     struct tuple_merge_source *source);
+            struct tuple_merge_source *(*luaT_check_source)(
+                struct lua_State *L, int idx);
+        };]],
+        'struct lua_State *luaT_state(void);',
+        'void lua_setfield(struct lua_State *L, int idx, const char *k);',
+        'int box_tuple_ref(struct tuple *tuple);',
+        'void box_tuple_unref(struct tuple *tuple);',
+        'const char *box_tuple_field(const struct tuple *tuple, uint32_t i);',
+    }
+    for _, decl in ipairs(decls) do
+        pcall(ffi.cdef, decl)
+    end
+    local LUA_GLOBALSINDEX = -10002
+
+    local api = ffi.cast('const struct tuple_merger_api *', merger.c_api)
+    test:ok(api.version >= 1, 'API version')
+
+    -- A source of given tuples, which counts destroy() calls.
+    local destroyed = 0
+    local function new_source(tuples)
+        local pos = 0
+        local vtab = ffi.new('struct tuple_merge_source_vtab')
+        local callbacks = {}
+        callbacks.next = ffi.cast('int (*)(void *, void *, struct tuple **)',
+            function(_, _, out)
+                pos = pos + 1
+                if tuples[pos] == nil then
+                    out[0] = nil
+                    return 0
+                end
+                local tuple = box.tuple.new(tuples[pos])
+                ffi.C.box_tuple_ref(tuple)
+                out[0] = tuple
+                return 0
+            end)
+        callbacks.destroy = ffi.cast('void (*)(void *)', function()
+            destroyed = destroyed + 1
+        end)
+        vtab.next = callbacks.next
+        vtab.destroy = callbacks.destroy
+        local source = api.source_new(vtab, nil)
+        -- Keep the vtab and the callbacks alive with the test.
+        table.insert(callbacks, vtab)
+        return source, callbacks
+    end
+
+    -- Read a source directly.
+    local source, _ = new_source({{'a'}, {'b'}})
+    local out = ffi.new('struct tuple *[1]')
+    local res = {}
+    while api.source_next(source, nil, out) == 0 and out[0] ~= nil do
+        local field = ffi.C.box_tuple_field(out[0], 0)
+        local value = msgpackffi.decode(field)
+        table.insert(res, {value})
+        ffi.C.box_tuple_unref(out[0])
+    end
+    test:is_deeply(res, {{'a'}, {'b'}}, 'source_next()')
+    api.source_unref(source)
+    test:is(destroyed, 1, 'source_unref() destroys a source')
+
+    -- Push a source to Lua and merge it.
+    local source, _ = new_source({{'a'}, {'c'}, {'e'}})
+    local L = ffi.C.luaT_state()
+    api.luaT_push_source(L, source)
+    test:ok(api.luaT_check_source(L, -1) == source, 'luaT_check_source()')
+    ffi.C.lua_setfield(L, LUA_GLOBALSINDEX, 'merger_test_c_source')
+    local lua_source = rawget(_G, 'merger_test_c_source')
+    rawset(_G, 'merger_test_c_source', nil)
+    local m = merger.new(key_def, {
+        lua_source,
+        merger.new_source_fromtable({{'b'}, {'d'}}),
+    })
+    local res = m:pairs():map(box.tuple.totable):totable()
+    test:is_deeply(res, {{'a'}, {'b'}, {'c'}, {'d'}, {'e'}},
+        'merge a C source')
+    test:is(destroyed, 1, 'a source is alive while it is used')
+
+    lua_source = nil -- luacheck: no unused
+    m = nil -- luacheck: no unused
+    collectgarbage()
+    collectgarbage()
+    test:is(destroyed, 2, 'a collected source is destroyed')
+end)
+
 os.exit(test:check() and 0 or 1)